@@ -30,7 +30,9 @@ typedef void (*raop_log_callback_t)(void *cls, int level, const char *msg);
 struct raop_callbacks_s {
 	void* cls;
 
-	/* Compulsory callback functions */
+	/* Compulsory callback functions, bits is the size of the output
+	 * samples: 16, 24 (also for 20-bit streams) or 32. Audio_process
+	 * may be left out if audio_process_timed is given */
 	void* (*audio_init)(void *cls, int bits, int channels, int samplerate);
 	void  (*audio_process)(void *cls, void *session, const void *buffer, int buflen);
 	void  (*audio_destroy)(void *cls, void *session);
@@ -42,14 +44,83 @@ struct raop_callbacks_s {
 	void  (*audio_set_coverart)(void *cls, void *session, const void *buffer, int buflen);
 	void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header);
 	void  (*audio_set_progress)(void *cls, void *session, unsigned int start, unsigned int curr, unsigned int end);
+
+	/* Optional callback lending the output buffer of the next frame, the
+	 * frame is decoded directly into it and passed to audio_process. Return
+	 * a buffer of at least buflen bytes or NULL to use an internal buffer */
+	void* (*audio_get_buffer)(void *cls, void *session, int buflen);
+
+	/* Optional callback used instead of audio_process, pts is the time of
+	 * raop_get_time when the first sample should be heard, or 0 if it is
+	 * not known yet because the sender has not synchronized */
+	void  (*audio_process_timed)(void *cls, void *session, const void *buffer, int buflen, unsigned long long pts);
 };
 typedef struct raop_callbacks_s raop_callbacks_t;
 
+/* Streaming statistics of one audio session */
+struct raop_session_stats_s {
+	/* Address of the sender as a string */
+	char remote[48];
+
+	unsigned int packets_received;
+	unsigned int packets_out_of_order;
+	unsigned int packets_duplicate;
+	unsigned int packets_late;
+
+	unsigned int resends_requested;
+	unsigned int resends_recovered;
+	unsigned int resends_expired;
+
+	unsigned int frames_decoded;
+	unsigned int frames_lost;
+	unsigned int frames_concealed;
+
+	/* Packets in the jitter buffer and its length in frames */
+	unsigned int buffer_depth;
+	unsigned int buffer_length;
+
+	/* Interarrival jitter, and total time spent decrypting and decoding */
+	unsigned int jitter_usec;
+	unsigned int decrypt_usec;
+	unsigned int decode_usec;
+
+	/* Sender clock estimated from the timing channel: its offset from
+	 * our clock, drift, and the round trip of the sample used */
+	int clock_synchronized;
+	long long clock_offset_usec;
+	double clock_drift_ppm;
+	unsigned int clock_delay_usec;
+};
+typedef struct raop_session_stats_s raop_session_stats_t;
+
+/* Stages of the audio path measured by the latency histograms: from the
+ * receive call returning until the packet is in the jitter buffer, the
+ * time it waits there, decryption, decoding, and the audio callback */
+#define RAOP_LATENCY_RECEIVE         0
+#define RAOP_LATENCY_BUFFER_WAIT     1
+#define RAOP_LATENCY_DECRYPT         2
+#define RAOP_LATENCY_DECODE          3
+#define RAOP_LATENCY_CALLBACK        4
+#define RAOP_LATENCY_STAGES          5
+
+/* Log-bucketed histogram of nanoseconds, every power of two is split in
+ * 16 buckets so values are kept within 1/16 of their magnitude */
+#define RAOP_HISTOGRAM_BUCKETS       464
+
+struct raop_histogram_s {
+	unsigned int count;
+	unsigned int buckets[RAOP_HISTOGRAM_BUCKETS];
+};
+typedef struct raop_histogram_s raop_histogram_t;
+
 RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int *error);
 RAOP_API raop_t *raop_init_from_keyfile(int max_clients, raop_callbacks_t *callbacks, const char *keyfile, int *error);
 
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
 RAOP_API void raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls);
+RAOP_API void raop_set_buffer_length(raop_t *raop, int min_length, int max_length);
+RAOP_API void raop_set_drift_compensation(raop_t *raop, int enabled);
+RAOP_API void raop_set_loss_concealment(raop_t *raop, int enabled);
 
 RAOP_API int raop_start(raop_t *raop, unsigned short *port, const char *hwaddr, int hwaddrlen, const char *password);
 RAOP_API int raop_is_running(raop_t *raop);
@@ -57,6 +128,19 @@ RAOP_API void raop_stop(raop_t *raop);
 
 RAOP_API void raop_destroy(raop_t *raop);
 
+/* Fills the statistics of up to max_sessions active audio sessions and
+ * returns the number filled, may be called from any thread */
+RAOP_API int raop_get_session_stats(raop_t *raop, raop_session_stats_t *stats, int max_sessions);
+
+/* Fills the latency histogram of a stage over all sessions since start */
+RAOP_API void raop_get_latency_histogram(raop_t *raop, int stage, raop_histogram_t *hist);
+
+/* Value in nanoseconds below which the given percent of the values fall */
+RAOP_API unsigned long long raop_histogram_get_percentile(const raop_histogram_t *hist, double percentile);
+
+/* Monotonic time in microseconds, the clock of presentation times */
+RAOP_API unsigned long long raop_get_time(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -74,6 +74,10 @@ audio_flush_prototype =         CFUNCTYPE(None, c_void_p, c_void_p)
 audio_set_volume_prototype =    CFUNCTYPE(None, c_void_p, c_void_p, c_float)
 audio_set_metadata_prototype =  CFUNCTYPE(None, c_void_p, c_void_p, c_void_p, c_int)
 audio_set_coverart_prototype =  CFUNCTYPE(None, c_void_p, c_void_p, c_void_p, c_int)
+audio_remote_control_id_prototype = CFUNCTYPE(None, c_void_p, c_char_p, c_char_p)
+audio_set_progress_prototype =  CFUNCTYPE(None, c_void_p, c_void_p, c_uint, c_uint, c_uint)
+audio_get_buffer_prototype =    CFUNCTYPE(c_void_p, c_void_p, c_void_p, c_int)
+audio_process_timed_prototype = CFUNCTYPE(None, c_void_p, c_void_p, c_void_p, c_int, c_ulonglong)
 
 class RaopNativeCallbacks(Structure):
 	_fields_ = [("cls",                 py_object),
@@ -83,7 +87,11 @@ class RaopNativeCallbacks(Structure):
 	            ("audio_flush",         audio_flush_prototype),
 	            ("audio_set_volume",    audio_set_volume_prototype),
 	            ("audio_set_metadata",  audio_set_metadata_prototype),
-	            ("audio_set_coverart",  audio_set_coverart_prototype)]
+	            ("audio_set_coverart",  audio_set_coverart_prototype),
+	            ("audio_remote_control_id", audio_remote_control_id_prototype),
+	            ("audio_set_progress",  audio_set_progress_prototype),
+	            ("audio_get_buffer",    audio_get_buffer_prototype),
+	            ("audio_process_timed", audio_process_timed_prototype)]
 
 def InitShairplay(libshairplay):
 	# Initialize dnssd related functions
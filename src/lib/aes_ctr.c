@@ -42,28 +42,64 @@ AES_ctr_set_key(AES_CTR_CTX *ctx, const uint8_t *key, const uint8_t *nonce, AES_
 	ctx->available = 0;
 }
 
+/* XOR the message with the keystream a word at a time */
+static void
+ctr128_xor(uint8_t *out, const uint8_t *msg, const uint8_t *keystream, int length)
+{
+	uint64_t a, b;
+	int i = 0;
+
+	for (; i+8 <= length; i += 8) {
+		memcpy(&a, msg+i, 8);
+		memcpy(&b, keystream+i, 8);
+		a ^= b;
+		memcpy(out+i, &a, 8);
+	}
+	for (; i < length; i++) {
+		out[i] = msg[i] ^ keystream[i];
+	}
+}
+
 void
 AES_ctr_encrypt(AES_CTR_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
 {
-	unsigned char block[16];
-	int msgidx, i;
+	uint8_t counters[AES_CTR_BATCH*AES_BLOCKSIZE];
+	uint8_t keystream[AES_CTR_BATCH*AES_BLOCKSIZE];
+	int msgidx, blocks, i;
 
 	assert(ctx);
 	assert(msg);
 	assert(out);
 
+	/* Use up the keystream left over from the previous call */
 	msgidx = 0;
-	while (msgidx < length) {
-		if (ctx->available == 0) {
-			/* Generate a new block into state if we have no bytes */
-			memset(ctx->aes_ctx.iv, 0, AES_IV_SIZE);
-			AES_cbc_encrypt(&ctx->aes_ctx, ctx->counter, ctx->state, AES_BLOCKSIZE);
-			ctx->available = AES_BLOCKSIZE;
-			ctr128_inc(ctx->counter);
+	if (ctx->available > 0) {
+		int count = ctx->available < length ? ctx->available : length;
+		ctr128_xor(out, msg, &ctx->state[AES_BLOCKSIZE-ctx->available], count);
+		ctx->available -= count;
+		msgidx += count;
+	}
+
+	/* Generate keystream for full blocks in batches */
+	while (length-msgidx >= AES_BLOCKSIZE) {
+		blocks = (length-msgidx) / AES_BLOCKSIZE;
+		if (blocks > AES_CTR_BATCH) {
+			blocks = AES_CTR_BATCH;
 		}
-		for (i=0; i<ctx->available && msgidx<length; i++, msgidx++) {
-			out[msgidx] = msg[msgidx] ^ ctx->state[AES_BLOCKSIZE-ctx->available+i];
+		for (i=0; i<blocks; i++) {
+			memcpy(&counters[i*AES_BLOCKSIZE], ctx->counter, AES_BLOCKSIZE);
+			ctr128_inc(ctx->counter);
 		}
-		ctx->available -= i;
+		AES_ecb_encrypt(&ctx->aes_ctx, counters, keystream, blocks*AES_BLOCKSIZE);
+		ctr128_xor(&out[msgidx], &msg[msgidx], keystream, blocks*AES_BLOCKSIZE);
+		msgidx += blocks*AES_BLOCKSIZE;
+	}
+
+	/* Keep the rest of the last block for the next call */
+	if (msgidx < length) {
+		AES_ecb_encrypt(&ctx->aes_ctx, ctx->counter, ctx->state, AES_BLOCKSIZE);
+		ctr128_inc(ctx->counter);
+		ctr128_xor(&out[msgidx], &msg[msgidx], ctx->state, length-msgidx);
+		ctx->available = AES_BLOCKSIZE-(length-msgidx);
 	}
 }
@@ -18,6 +18,9 @@
 #include <stdint.h>
 #include "crypto/crypto.h"
 
+/* Number of keystream blocks generated at once */
+#define AES_CTR_BATCH 8
+
 typedef struct aes_ctr_key_st {
 	AES_CTX aes_ctx;
 	uint8_t counter[AES_BLOCKSIZE];
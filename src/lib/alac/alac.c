@@ -42,6 +42,17 @@ static const int host_bigendian = 0;
 
 #include "alac.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define ALAC_HAVE_SSE2
+    #define ALAC_HAVE_AVX2
+    #include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+    #define ALAC_HAVE_NEON
+    #include <arm_neon.h>
+#endif
+
 #define _Swap32(v) do { \
                    v = (((v) & 0x000000FF) << 0x18) | \
                        (((v) & 0x0000FF00) << 0x08) | \
@@ -135,84 +146,65 @@ void alac_set_info(alac_file *alac, char *inputbuffer)
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits)
-{
-    uint32_t result;
-    int new_accumulator;
-
-    result = (alac->input_buffer[0] << 16) |
-             (alac->input_buffer[1] << 8) |
-             (alac->input_buffer[2]);
-
-    /* shift left by the number of bits we've already read,
-     * so that the top 'n' bits of the 24 bits we read will
-     * be the return bits */
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result & 0x00ffffff;
-
-    /* and then only want the top 'n' bits from that, where
-     * n is 'bits' */
-    result = result >> (24 - bits);
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + bits);
-
-    /* increase the buffer pointer if we've read over n bytes. */
-    alac->input_buffer += (new_accumulator >> 3);
-
-    /* and the remainder goes back into the bit accumulator */
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-
-    return result;
-}
+/* The reader keeps up to 64 bits of the input in a cache, with the next
+ * bit to read in the most significant position. Reads past the end of
+ * the input return zero bits.
+ */
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits)
+static void refill(alac_file *alac)
 {
-    int32_t result = 0;
-
-    if (bits > 16)
+    if (alac->input_end - alac->input_buffer >= 8)
     {
-        bits -= 16;
-        result = readbits_16(alac, 16) << bits;
+        const unsigned char *p = alac->input_buffer;
+        uint64_t word = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                        ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                        ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                        ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+
+        /* take as many whole bytes as fit, the bits of a partial byte
+         * are loaded again unchanged on the next refill */
+        alac->input_cache |= word >> alac->input_cache_bits;
+        alac->input_buffer += (63 - alac->input_cache_bits) >> 3;
+        alac->input_cache_bits |= 56;
+    }
+    else
+    {
+        while (alac->input_cache_bits <= 56)
+        {
+            uint64_t byte = 0;
+            if (alac->input_buffer < alac->input_end)
+                byte = *alac->input_buffer++;
+            alac->input_cache |= byte << (56 - alac->input_cache_bits);
+            alac->input_cache_bits += 8;
+        }
     }
-
-    result |= readbits_16(alac, bits);
-
-    return result;
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac)
+/* returns the next 1 to 32 bits, the cache must hold at least that many */
+static uint32_t peekbits(alac_file *alac, int bits)
 {
-    int result;
-    int new_accumulator;
-
-    result = alac->input_buffer[0];
-
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result >> 7 & 1;
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + 1);
-
-    alac->input_buffer += (new_accumulator / 8);
-
-    alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+    return (uint32_t)(alac->input_cache >> (64 - bits));
+}
 
-    return result;
+static void skipbits(alac_file *alac, int bits)
+{
+    alac->input_cache <<= bits;
+    alac->input_cache_bits -= bits;
 }
 
-static void unreadbits(alac_file *alac, int bits)
+/* supports reading 0 to 32 bits, in big endian format */
+static uint32_t readbits(alac_file *alac, int bits)
 {
-    int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
+    uint32_t result;
 
-    alac->input_buffer += (new_accumulator >> 3);
+    if (!bits)
+        return 0;
+    if (alac->input_cache_bits < bits)
+        refill(alac);
 
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-    if (alac->input_buffer_bitaccumulator < 0)
-        alac->input_buffer_bitaccumulator *= -1;
+    result = peekbits(alac, bits);
+    skipbits(alac, bits);
+    return result;
 }
 
 /* various implementations of count_leading_zero:
@@ -313,19 +305,23 @@ static int32_t entropy_decode_value(alac_file* alac,
                              int k,
                              int rice_kmodifier_mask)
 {
-    int32_t x = 0; // decoded value
+    int32_t x; // decoded value
+
+    /* the prefix and the k extra bits always fit in a refilled cache */
+    if (alac->input_cache_bits < RICE_THRESHOLD + 1 + k)
+        refill(alac);
 
     // read x, number of 1s before 0 represent the rice value.
-    while (x <= RICE_THRESHOLD && readbit(alac))
-    {
-        x++;
-    }
+    // the extra bit stops the count at RICE_THRESHOLD + 1.
+    x = count_leading_zeros(~peekbits(alac, 32) |
+                            (1 << (31 - RICE_THRESHOLD - 1)));
 
     if (x > RICE_THRESHOLD)
     {
         // read the number from the bit stream (raw value)
         int32_t value;
 
+        skipbits(alac, RICE_THRESHOLD + 1);
         value = readbits(alac, readSampleSize);
 
         // mask value
@@ -335,17 +331,22 @@ static int32_t entropy_decode_value(alac_file* alac,
     }
     else
     {
+        skipbits(alac, x + 1);
+
         if (k != 1)
         {
-            int extraBits = readbits(alac, k);
+            int extraBits = peekbits(alac, k);
 
             // x = x * (2^k - 1)
             x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
             if (extraBits > 1)
+            {
                 x += extraBits - 1;
+                skipbits(alac, k);
+            }
             else
-                unreadbits(alac, 1);
+                skipbits(alac, k - 1);
         }
     }
 
@@ -429,13 +430,252 @@ static void entropy_rice_decode(alac_file* alac,
                                 ((v > 0) ? (1) : \
                                            (0)))
 
+typedef void (*fir_adapt_func)(int32_t *error_buffer,
+                               int32_t *buffer_out,
+                               int output_size,
+                               int readsamplesize,
+                               int16_t *predictor_coef_table,
+                               int predictor_coef_num,
+                               int predictor_quantitization);
+
+/* general case */
+static void fir_adapt_generic(int32_t *error_buffer,
+                              int32_t *buffer_out,
+                              int output_size,
+                              int readsamplesize,
+                              int16_t *predictor_coef_table,
+                              int predictor_coef_num,
+                              int predictor_quantitization)
+{
+    int i;
+
+    for (i = predictor_coef_num + 1;
+         i < output_size;
+         i++)
+    {
+        int j;
+        int sum = 0;
+        int outval;
+        int error_val = error_buffer[i];
+
+        for (j = 0; j < predictor_coef_num; j++)
+        {
+            sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
+                   predictor_coef_table[j];
+        }
+
+        outval = (1 << (predictor_quantitization-1)) + sum;
+        outval = outval >> predictor_quantitization;
+        outval = outval + buffer_out[0] + error_val;
+        outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+        buffer_out[predictor_coef_num+1] = outval;
+
+        if (error_val > 0)
+        {
+            int predictor_num = predictor_coef_num - 1;
+
+            while (predictor_num >= 0 && error_val > 0)
+            {
+                int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+                int sign = SIGN_ONLY(val);
+
+                predictor_coef_table[predictor_num] -= sign;
+
+                val *= sign; /* absolute value */
+
+                error_val -= ((val >> predictor_quantitization) *
+                              (predictor_coef_num - predictor_num));
+
+                predictor_num--;
+            }
+        }
+        else if (error_val < 0)
+        {
+            int predictor_num = predictor_coef_num - 1;
+
+            while (predictor_num >= 0 && error_val < 0)
+            {
+                int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
+                int sign = - SIGN_ONLY(val);
+
+                predictor_coef_table[predictor_num] -= sign;
+
+                val *= sign; /* neg value */
+
+                error_val -= ((val >> predictor_quantitization) *
+                              (predictor_coef_num - predictor_num));
+
+                predictor_num--;
+            }
+        }
+
+        buffer_out++;
+    }
+}
+
+/* 4 and 8 are very common cases (the only ones i've seen), these are
+ * unrolled with the coefficients kept in locals. the adaptation is the
+ * same as in the general case, with the sign of the error folded into
+ * the sign of each step instead of two separate loops.
+ */
+#define FIR_SUM_TAP(n, j) \
+    sum += (buffer_out[(n) - (j)] - buffer_out[0]) * coef ## j
+
+#define FIR_ADAPT_TAP(n, j) \
+    if (SIGN_ONLY(error_val) == error_sign) \
+    { \
+        int val = buffer_out[0] - buffer_out[(n) - (j)]; \
+        int sign = error_sign * SIGN_ONLY(val); \
+        coef ## j -= sign; \
+        val *= sign; \
+        error_val -= ((val >> predictor_quantitization) * ((n) - (j))); \
+    }
+
+#define FIR_PREDICT(n) \
+    outval = (1 << (predictor_quantitization-1)) + sum; \
+    outval = outval >> predictor_quantitization; \
+    outval = outval + buffer_out[0] + error_val; \
+    outval = SIGN_EXTENDED32(outval, readsamplesize); \
+    buffer_out[(n)+1] = outval; \
+    error_sign = SIGN_ONLY(error_val)
+
+static void fir_adapt_4(int32_t *error_buffer,
+                        int32_t *buffer_out,
+                        int output_size,
+                        int readsamplesize,
+                        int16_t *predictor_coef_table,
+                        int predictor_coef_num,
+                        int predictor_quantitization)
+{
+    int16_t coef0 = predictor_coef_table[0];
+    int16_t coef1 = predictor_coef_table[1];
+    int16_t coef2 = predictor_coef_table[2];
+    int16_t coef3 = predictor_coef_table[3];
+    int i;
+
+    /* always 4, the parameter only matches fir_adapt_func */
+    (void)predictor_coef_num;
+
+    for (i = 4 + 1; i < output_size; i++)
+    {
+        int sum = 0;
+        int outval;
+        int error_val = error_buffer[i];
+        int error_sign;
+
+        FIR_SUM_TAP(4, 0);
+        FIR_SUM_TAP(4, 1);
+        FIR_SUM_TAP(4, 2);
+        FIR_SUM_TAP(4, 3);
+        FIR_PREDICT(4);
+
+        if (error_sign)
+        {
+            FIR_ADAPT_TAP(4, 3);
+            FIR_ADAPT_TAP(4, 2);
+            FIR_ADAPT_TAP(4, 1);
+            FIR_ADAPT_TAP(4, 0);
+        }
+
+        buffer_out++;
+    }
+
+    predictor_coef_table[0] = coef0;
+    predictor_coef_table[1] = coef1;
+    predictor_coef_table[2] = coef2;
+    predictor_coef_table[3] = coef3;
+}
+
+static void fir_adapt_8(int32_t *error_buffer,
+                        int32_t *buffer_out,
+                        int output_size,
+                        int readsamplesize,
+                        int16_t *predictor_coef_table,
+                        int predictor_coef_num,
+                        int predictor_quantitization)
+{
+    int16_t coef0 = predictor_coef_table[0];
+    int16_t coef1 = predictor_coef_table[1];
+    int16_t coef2 = predictor_coef_table[2];
+    int16_t coef3 = predictor_coef_table[3];
+    int16_t coef4 = predictor_coef_table[4];
+    int16_t coef5 = predictor_coef_table[5];
+    int16_t coef6 = predictor_coef_table[6];
+    int16_t coef7 = predictor_coef_table[7];
+    int i;
+
+    /* always 8, the parameter only matches fir_adapt_func */
+    (void)predictor_coef_num;
+
+    for (i = 8 + 1; i < output_size; i++)
+    {
+        int sum = 0;
+        int outval;
+        int error_val = error_buffer[i];
+        int error_sign;
+
+        FIR_SUM_TAP(8, 0);
+        FIR_SUM_TAP(8, 1);
+        FIR_SUM_TAP(8, 2);
+        FIR_SUM_TAP(8, 3);
+        FIR_SUM_TAP(8, 4);
+        FIR_SUM_TAP(8, 5);
+        FIR_SUM_TAP(8, 6);
+        FIR_SUM_TAP(8, 7);
+        FIR_PREDICT(8);
+
+        if (error_sign)
+        {
+            FIR_ADAPT_TAP(8, 7);
+            FIR_ADAPT_TAP(8, 6);
+            FIR_ADAPT_TAP(8, 5);
+            FIR_ADAPT_TAP(8, 4);
+            FIR_ADAPT_TAP(8, 3);
+            FIR_ADAPT_TAP(8, 2);
+            FIR_ADAPT_TAP(8, 1);
+            FIR_ADAPT_TAP(8, 0);
+        }
+
+        buffer_out++;
+    }
+
+    predictor_coef_table[0] = coef0;
+    predictor_coef_table[1] = coef1;
+    predictor_coef_table[2] = coef2;
+    predictor_coef_table[3] = coef3;
+    predictor_coef_table[4] = coef4;
+    predictor_coef_table[5] = coef5;
+    predictor_coef_table[6] = coef6;
+    predictor_coef_table[7] = coef7;
+}
+
+#undef FIR_SUM_TAP
+#undef FIR_ADAPT_TAP
+#undef FIR_PREDICT
+
+/* picks the fir loop for the number of coefficients in a frame header */
+static fir_adapt_func select_fir_adapt(int predictor_coef_num)
+{
+    switch (predictor_coef_num)
+    {
+    case 4:
+        return fir_adapt_4;
+    case 8:
+        return fir_adapt_8;
+    default:
+        return fir_adapt_generic;
+    }
+}
+
 static void predictor_decompress_fir_adapt(int32_t *error_buffer,
                                            int32_t *buffer_out,
                                            int output_size,
                                            int readsamplesize,
                                            int16_t *predictor_coef_table,
                                            int predictor_coef_num,
-                                           int predictor_quantitization)
+                                           int predictor_quantitization,
+                                           fir_adapt_func fir_adapt)
 {
     int i;
 
@@ -482,94 +722,15 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
         }
     }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
-     */
-    if (predictor_coef_num == 4)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-
-    if (predictor_coef_table == 8)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-#endif
-
-
-    /* general case */
     if (predictor_coef_num > 0)
     {
-        for (i = predictor_coef_num + 1;
-             i < output_size;
-             i++)
-        {
-            int j;
-            int sum = 0;
-            int outval;
-            int error_val = error_buffer[i];
-
-            for (j = 0; j < predictor_coef_num; j++)
-            {
-                sum += (buffer_out[predictor_coef_num-j] - buffer_out[0]) *
-                       predictor_coef_table[j];
-            }
-
-            outval = (1 << (predictor_quantitization-1)) + sum;
-            outval = outval >> predictor_quantitization;
-            outval = outval + buffer_out[0] + error_val;
-            outval = SIGN_EXTENDED32(outval, readsamplesize);
-
-            buffer_out[predictor_coef_num+1] = outval;
-
-            if (error_val > 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
-
-                while (predictor_num >= 0 && error_val > 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = SIGN_ONLY(val);
-
-                    predictor_coef_table[predictor_num] -= sign;
-
-                    val *= sign; /* absolute value */
-
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
-
-                    predictor_num--;
-                }
-            }
-            else if (error_val < 0)
-            {
-                int predictor_num = predictor_coef_num - 1;
-
-                while (predictor_num >= 0 && error_val < 0)
-                {
-                    int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-                    int sign = - SIGN_ONLY(val);
-
-                    predictor_coef_table[predictor_num] -= sign;
-
-                    val *= sign; /* neg value */
-
-                    error_val -= ((val >> predictor_quantitization) *
-                                  (predictor_coef_num - predictor_num));
-
-                    predictor_num--;
-                }
-            }
-
-            buffer_out++;
-        }
+        fir_adapt(error_buffer, buffer_out, output_size, readsamplesize,
+                  predictor_coef_table, predictor_coef_num,
+                  predictor_quantitization);
     }
 }
 
-static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
+static void deinterlace_16_c(int32_t *buffer_a, int32_t *buffer_b,
                     int16_t *buffer_out,
                     int numchannels, int numsamples,
                     uint8_t interlacing_shift,
@@ -628,7 +789,7 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
     }
 }
 
-static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
+static void deinterlace_24_c(int32_t *buffer_a, int32_t *buffer_b,
                     int uncompressed_bytes,
                     int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
                     void *buffer_out,
@@ -706,421 +867,1113 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
 
 }
 
-void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
-                       void *outbuffer, int *outputsize)
+/* 20-bit samples are output left justified in 24 bits */
+static void deinterlace_20_c(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
 {
-    int channels;
-    int32_t outputsamples = alac->setinfo_max_samples_per_frame;
-
-    /* setup the stream */
-    alac->input_buffer = inbuffer;
-    alac->input_buffer_bitaccumulator = 0;
-
-    channels = readbits(alac, 3);
-
-    *outputsize = outputsamples * alac->bytespersample;
+    int i;
 
-    switch(channels)
-    {
-    case 0: /* 1 channel */
+    for (i = 0; i < numsamples; i++)
     {
-        int hassize;
-        int isnotcompressed;
-        int readsamplesize;
-
-        int uncompressed_bytes;
-        int ricemodifier;
-
-        /* 2^result = something to do with output waiting.
-         * perhaps matters if we read > 1 frame in a pass?
-         */
-        readbits(alac, 4);
-
-        readbits(alac, 12); /* unknown, skip 12 bits */
-
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
-
-        uncompressed_bytes = readbits(alac, 2); /* number of bytes in the (compressed) stream that are not compressed */
+        int32_t left, right;
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+        if (interlacing_leftweight)
+        { /* weighted interlacing */
+            int32_t midright = buffer_a[i];
+            int32_t difference = buffer_b[i];
 
-        if (hassize)
+            right = midright - ((difference * interlacing_leftweight) >> interlacing_shift);
+            left = right + difference;
+        }
+        else
         {
-            /* now read the number of samples,
-             * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
-            *outputsize = outputsamples * alac->bytespersample;
+            left = buffer_a[i];
+            right = buffer_b[i];
         }
 
-        readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8);
+        if (uncompressed_bytes)
+        {
+            uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+            left <<= (uncompressed_bytes * 8);
+            right <<= (uncompressed_bytes * 8);
 
-        if (!isnotcompressed)
-        { /* so it is compressed */
-            int16_t predictor_coef_table[32];
-            int predictor_coef_num;
-            int prediction_type;
-            int prediction_quantitization;
-            int i;
+            left |= uncompressed_bytes_buffer_a[i] & mask;
+            right |= uncompressed_bytes_buffer_b[i] & mask;
+        }
 
-            /* skip 16 bits, not sure what they are. seem to be used in
-             * two channel case */
-            readbits(alac, 8);
-            readbits(alac, 8);
+        left <<= 4;
+        right <<= 4;
 
-            prediction_type = readbits(alac, 4);
-            prediction_quantitization = readbits(alac, 4);
+        ((uint8_t*)buffer_out)[i * numchannels * 3] = (left) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 3 + 1] = (left >> 8) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 3 + 2] = (left >> 16) & 0xFF;
 
-            ricemodifier = readbits(alac, 3);
-            predictor_coef_num = readbits(alac, 5);
+        ((uint8_t*)buffer_out)[i * numchannels * 3 + 3] = (right) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 3 + 4] = (right >> 8) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 3 + 5] = (right >> 16) & 0xFF;
+    }
+}
 
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num; i++)
-            {
-                predictor_coef_table[i] = (int16_t)readbits(alac, 16);
-            }
+static void deinterlace_32_c(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    int i;
 
-            if (uncompressed_bytes)
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
-                }
-            }
+    for (i = 0; i < numsamples; i++)
+    {
+        int32_t left, right;
 
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
-                                               alac->outputsamples_buffer_a,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table,
-                                               predictor_coef_num,
-                                               prediction_quantitization);
-            }
-            else
-            {
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type);
-                /* i think the only other prediction type (or perhaps this is just a
-                 * boolean?) runs adaptive fir twice.. like:
-                 * predictor_decompress_fir_adapt(predictor_error, tempout, ...)
-                 * predictor_decompress_fir_adapt(predictor_error, outputsamples ...)
-                 * little strange..
-                 */
-            }
+        if (interlacing_leftweight)
+        { /* weighted interlacing */
+            int32_t midright = buffer_a[i];
+            int32_t difference = buffer_b[i];
 
+            right = midright - ((difference * interlacing_leftweight) >> interlacing_shift);
+            left = right + difference;
         }
         else
-        { /* not compressed, easy case */
-            if (alac->setinfo_sample_size <= 16)
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits = readbits(alac, alac->setinfo_sample_size);
-
-                    audiobits = SIGN_EXTENDED32(audiobits, alac->setinfo_sample_size);
-
-                    alac->outputsamples_buffer_a[i] = audiobits;
-                }
-            }
-            else
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits;
-
-                    audiobits = readbits(alac, 16);
-                    /* special case of sign extension..
-                     * as we'll be ORing the low 16bits into this */
-                    audiobits = audiobits << (alac->setinfo_sample_size - 16);
-                    audiobits |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits = SignExtend24(audiobits);
-
-                    alac->outputsamples_buffer_a[i] = audiobits;
-                }
-            }
-            uncompressed_bytes = 0; // always 0 for uncompressed
-        }
-
-        switch(alac->setinfo_sample_size)
         {
-        case 16:
-        {
-            int i;
-            for (i = 0; i < outputsamples; i++)
-            {
-                int16_t sample = alac->outputsamples_buffer_a[i];
-                if (host_bigendian)
-                    _Swap16(sample);
-                ((int16_t*)outbuffer)[i * alac->numchannels] = sample;
-            }
-            break;
+            left = buffer_a[i];
+            right = buffer_b[i];
         }
-        case 24:
+
+        if (uncompressed_bytes)
         {
-            int i;
-            for (i = 0; i < outputsamples; i++)
-            {
-                int32_t sample = alac->outputsamples_buffer_a[i];
-
-                if (uncompressed_bytes)
-                {
-                    uint32_t mask;
-                    sample = sample << (uncompressed_bytes * 8);
-                    mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
-                    sample |= alac->uncompressed_bytes_buffer_a[i] & mask;
-                }
-
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3] = (sample) & 0xFF;
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 1] = (sample >> 8) & 0xFF;
-                ((uint8_t*)outbuffer)[i * alac->numchannels * 3 + 2] = (sample >> 16) & 0xFF;
-            }
-            break;
-        }
-        case 20:
-        case 32:
-            fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->setinfo_sample_size);
-            break;
-        default:
-            break;
-        }
-        break;
-    }
-    case 1: /* 2 channels */
-    {
-        int hassize;
-        int isnotcompressed;
-        int readsamplesize;
+            uint32_t mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+            left <<= (uncompressed_bytes * 8);
+            right <<= (uncompressed_bytes * 8);
 
-        int uncompressed_bytes;
+            left |= uncompressed_bytes_buffer_a[i] & mask;
+            right |= uncompressed_bytes_buffer_b[i] & mask;
+        }
 
-        uint8_t interlacing_shift;
-        uint8_t interlacing_leftweight;
+        ((uint8_t*)buffer_out)[i * numchannels * 4] = (left) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 1] = (left >> 8) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 2] = (left >> 16) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 3] = (left >> 24) & 0xFF;
 
-        /* 2^result = something to do with output waiting.
-         * perhaps matters if we read > 1 frame in a pass?
-         */
-        readbits(alac, 4);
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 4] = (right) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 5] = (right >> 8) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 6] = (right >> 16) & 0xFF;
+        ((uint8_t*)buffer_out)[i * numchannels * 4 + 7] = (right >> 24) & 0xFF;
+    }
+}
 
-        readbits(alac, 12); /* unknown, skip 12 bits */
+/* SIMD versions of the deinterlacing for stereo output. They handle as
+ * many whole vectors as they can and leave the rest to the C versions,
+ * which also handle any other channel count.
+ */
 
-        hassize = readbits(alac, 1); /* the output sample size is stored soon */
+#ifdef ALAC_HAVE_SSE2
+#define SSE2_TARGET __attribute__((target("sse2")))
 
-        uncompressed_bytes = readbits(alac, 2); /* the number of bytes in the (compressed) stream that are not compressed */
+/* SSE2 has no 32-bit low multiply, build it from two 32x32->64 ones */
+SSE2_TARGET
+static __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+
+SSE2_TARGET
+static void mix_sse2(int32_t *buffer_a, int32_t *buffer_b, int i,
+                     uint8_t interlacing_shift, uint8_t interlacing_leftweight,
+                     __m128i *left, __m128i *right)
+{
+    __m128i midright = _mm_loadu_si128((const __m128i *)(buffer_a + i));
+    __m128i difference = _mm_loadu_si128((const __m128i *)(buffer_b + i));
+
+    if (interlacing_leftweight)
+    {
+        __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+        __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
 
-        isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+        *right = _mm_sub_epi32(midright,
+                 _mm_sra_epi32(mullo_epi32_sse2(difference, weight), shift));
+        *left = _mm_add_epi32(*right, difference);
+    }
+    else
+    {
+        *left = midright;
+        *right = difference;
+    }
+}
 
-        if (hassize)
+SSE2_TARGET
+static void deinterlace_16_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    int i = 0;
+
+    if (numchannels == 2)
+    {
+        const __m128i lowmask = _mm_set1_epi32(0xFFFF);
+
+        for (; i + 4 <= numsamples; i += 4)
         {
-            /* now read the number of samples,
-             * as a 32bit integer */
-            outputsamples = readbits(alac, 32);
-            *outputsize = outputsamples * alac->bytespersample;
-        }
+            __m128i left, right;
 
-        readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8) + 1;
+            mix_sse2(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
 
-        if (!isnotcompressed)
-        { /* compressed */
-            int16_t predictor_coef_table_a[32];
-            int predictor_coef_num_a;
-            int prediction_type_a;
-            int prediction_quantitization_a;
-            int ricemodifier_a;
+            /* one little endian left/right pair per 32-bit lane */
+            _mm_storeu_si128((__m128i *)(buffer_out + i * 2),
+                             _mm_or_si128(_mm_and_si128(left, lowmask),
+                                          _mm_slli_epi32(right, 16)));
+        }
+    }
 
-            int16_t predictor_coef_table_b[32];
-            int predictor_coef_num_b;
-            int prediction_type_b;
-            int prediction_quantitization_b;
-            int ricemodifier_b;
+    deinterlace_16_c(buffer_a + i, buffer_b + i, buffer_out + i * numchannels,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
 
-            int i;
+SSE2_TARGET
+static void deinterlace_24_sse2(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    uint8_t *out = buffer_out;
+    int i = 0;
 
-            interlacing_shift = readbits(alac, 8);
-            interlacing_leftweight = readbits(alac, 8);
+    if (numchannels == 2)
+    {
+        const __m128i mask = _mm_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+        const __m128i ubshift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
 
-            /******** channel 1 ***********/
-            prediction_type_a = readbits(alac, 4);
-            prediction_quantitization_a = readbits(alac, 4);
+        for (; i + 4 <= numsamples; i += 4)
+        {
+            uint32_t pairs[8];
+            __m128i left, right;
+            int j;
 
-            ricemodifier_a = readbits(alac, 3);
-            predictor_coef_num_a = readbits(alac, 5);
+            mix_sse2(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
 
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num_a; i++)
+            if (uncompressed_bytes)
             {
-                predictor_coef_table_a[i] = (int16_t)readbits(alac, 16);
+                left = _mm_or_si128(_mm_sll_epi32(left, ubshift), _mm_and_si128(mask,
+                       _mm_loadu_si128((const __m128i *)(uncompressed_bytes_buffer_a + i))));
+                right = _mm_or_si128(_mm_sll_epi32(right, ubshift), _mm_and_si128(mask,
+                        _mm_loadu_si128((const __m128i *)(uncompressed_bytes_buffer_b + i))));
             }
 
-            /******** channel 2 *********/
-            prediction_type_b = readbits(alac, 4);
-            prediction_quantitization_b = readbits(alac, 4);
+            _mm_storeu_si128((__m128i *)pairs, _mm_unpacklo_epi32(left, right));
+            _mm_storeu_si128((__m128i *)(pairs + 4), _mm_unpackhi_epi32(left, right));
 
-            ricemodifier_b = readbits(alac, 3);
-            predictor_coef_num_b = readbits(alac, 5);
-
-            /* read the predictor table */
-            for (i = 0; i < predictor_coef_num_b; i++)
+            /* pack each left/right pair into 6 bytes */
+            for (j = 0; j < 4; j++)
             {
-                predictor_coef_table_b[i] = (int16_t)readbits(alac, 16);
+                uint64_t packed = (uint64_t)(pairs[j * 2] & 0xFFFFFF) |
+                                  ((uint64_t)(pairs[j * 2 + 1] & 0xFFFFFF) << 24);
+                uint8_t *dst = out + (i + j) * 6;
+
+                dst[0] = packed;
+                dst[1] = packed >> 8;
+                dst[2] = packed >> 16;
+                dst[3] = packed >> 24;
+                dst[4] = packed >> 32;
+                dst[5] = packed >> 40;
             }
+        }
+    }
+
+    deinterlace_24_c(buffer_a + i, buffer_b + i, uncompressed_bytes,
+                     uncompressed_bytes_buffer_a + i, uncompressed_bytes_buffer_b + i,
+                     out + i * numchannels * 3, numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+#endif
+
+#ifdef ALAC_HAVE_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET
+static void mix_avx2(int32_t *buffer_a, int32_t *buffer_b, int i,
+                     uint8_t interlacing_shift, uint8_t interlacing_leftweight,
+                     __m256i *left, __m256i *right)
+{
+    __m256i midright = _mm256_loadu_si256((const __m256i *)(buffer_a + i));
+    __m256i difference = _mm256_loadu_si256((const __m256i *)(buffer_b + i));
+
+    if (interlacing_leftweight)
+    {
+        __m256i weight = _mm256_set1_epi32(interlacing_leftweight);
+        __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+
+        *right = _mm256_sub_epi32(midright,
+                 _mm256_sra_epi32(_mm256_mullo_epi32(difference, weight), shift));
+        *left = _mm256_add_epi32(*right, difference);
+    }
+    else
+    {
+        *left = midright;
+        *right = difference;
+    }
+}
+
+AVX2_TARGET
+static void deinterlace_16_avx2(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    int i = 0;
+
+    if (numchannels == 2)
+    {
+        const __m256i lowmask = _mm256_set1_epi32(0xFFFF);
+
+        for (; i + 8 <= numsamples; i += 8)
+        {
+            __m256i left, right;
+
+            mix_avx2(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
+
+            /* one little endian left/right pair per 32-bit lane */
+            _mm256_storeu_si256((__m256i *)(buffer_out + i * 2),
+                                _mm256_or_si256(_mm256_and_si256(left, lowmask),
+                                                _mm256_slli_epi32(right, 16)));
+        }
+    }
+
+    deinterlace_16_c(buffer_a + i, buffer_b + i, buffer_out + i * numchannels,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+
+AVX2_TARGET
+static void store_24_avx2(uint8_t *out, __m128i pairs)
+{
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                       -1, -1, -1, -1);
+    __m128i packed = _mm_shuffle_epi8(pairs, pack);
+    int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+
+    /* write exactly 12 bytes so the end of the buffer is never touched */
+    _mm_storel_epi64((__m128i *)out, packed);
+    memcpy(out + 8, &last, 4);
+}
+
+AVX2_TARGET
+static void deinterlace_24_avx2(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    uint8_t *out = buffer_out;
+    int i = 0;
+
+    if (numchannels == 2)
+    {
+        const __m256i mask = _mm256_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+        const __m128i ubshift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+
+        for (; i + 8 <= numsamples; i += 8)
+        {
+            __m256i left, right, lo, hi;
+
+            mix_avx2(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
 
-            /*********************/
             if (uncompressed_bytes)
-            { /* see mono case */
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
-                    alac->uncompressed_bytes_buffer_b[i] = readbits(alac, uncompressed_bytes * 8);
-                }
+            {
+                left = _mm256_or_si256(_mm256_sll_epi32(left, ubshift), _mm256_and_si256(mask,
+                       _mm256_loadu_si256((const __m256i *)(uncompressed_bytes_buffer_a + i))));
+                right = _mm256_or_si256(_mm256_sll_epi32(right, ubshift), _mm256_and_si256(mask,
+                        _mm256_loadu_si256((const __m256i *)(uncompressed_bytes_buffer_b + i))));
             }
 
-            /* channel 1 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_a,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier_a * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type_a == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_a,
-                                               alac->outputsamples_buffer_a,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table_a,
-                                               predictor_coef_num_a,
-                                               prediction_quantitization_a);
-            }
-            else
-            { /* see mono case */
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_a);
-            }
+            /* the unpacks work within 128-bit lanes: lo holds pairs 0,1
+             * and 4,5, hi holds pairs 2,3 and 6,7 */
+            lo = _mm256_unpacklo_epi32(left, right);
+            hi = _mm256_unpackhi_epi32(left, right);
+            store_24_avx2(out + i * 6, _mm256_castsi256_si128(lo));
+            store_24_avx2(out + i * 6 + 12, _mm256_castsi256_si128(hi));
+            store_24_avx2(out + i * 6 + 24, _mm256_extracti128_si256(lo, 1));
+            store_24_avx2(out + i * 6 + 36, _mm256_extracti128_si256(hi, 1));
+        }
+    }
 
-            /* channel 2 */
-            entropy_rice_decode(alac,
-                                alac->predicterror_buffer_b,
-                                outputsamples,
-                                readsamplesize,
-                                alac->setinfo_rice_initialhistory,
-                                alac->setinfo_rice_kmodifier,
-                                ricemodifier_b * alac->setinfo_rice_historymult / 4,
-                                (1 << alac->setinfo_rice_kmodifier) - 1);
-
-            if (prediction_type_b == 0)
-            { /* adaptive fir */
-                predictor_decompress_fir_adapt(alac->predicterror_buffer_b,
-                                               alac->outputsamples_buffer_b,
-                                               outputsamples,
-                                               readsamplesize,
-                                               predictor_coef_table_b,
-                                               predictor_coef_num_b,
-                                               prediction_quantitization_b);
-            }
-            else
+    deinterlace_24_c(buffer_a + i, buffer_b + i, uncompressed_bytes,
+                     uncompressed_bytes_buffer_a + i, uncompressed_bytes_buffer_b + i,
+                     out + i * numchannels * 3, numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+#endif
+
+#ifdef ALAC_HAVE_NEON
+static void mix_neon(int32_t *buffer_a, int32_t *buffer_b, int i,
+                     uint8_t interlacing_shift, uint8_t interlacing_leftweight,
+                     int32x4_t *left, int32x4_t *right)
+{
+    int32x4_t midright = vld1q_s32(buffer_a + i);
+    int32x4_t difference = vld1q_s32(buffer_b + i);
+
+    if (interlacing_leftweight)
+    {
+        int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+        int32x4_t shift = vdupq_n_s32(-(int32_t)interlacing_shift);
+
+        *right = vsubq_s32(midright, vshlq_s32(vmulq_s32(difference, weight), shift));
+        *left = vaddq_s32(*right, difference);
+    }
+    else
+    {
+        *left = midright;
+        *right = difference;
+    }
+}
+
+static void deinterlace_16_neon(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    int i = 0;
+
+    if (numchannels == 2)
+    {
+        for (; i + 4 <= numsamples; i += 4)
+        {
+            int32x4_t left, right;
+            int16x4x2_t pairs;
+
+            mix_neon(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
+
+            pairs.val[0] = vmovn_s32(left);
+            pairs.val[1] = vmovn_s32(right);
+            vst2_s16(buffer_out + i * 2, pairs);
+        }
+    }
+
+    deinterlace_16_c(buffer_a + i, buffer_b + i, buffer_out + i * numchannels,
+                     numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+
+static void store_24_neon(uint8_t *out, int32x4_t pairs)
+{
+    static const uint8_t pack[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                                      255, 255, 255, 255 };
+    uint8x16_t packed = vqtbl1q_u8(vreinterpretq_u8_s32(pairs), vld1q_u8(pack));
+    uint32_t last = vgetq_lane_u32(vreinterpretq_u32_u8(packed), 2);
+
+    /* write exactly 12 bytes so the end of the buffer is never touched */
+    vst1_u8(out, vget_low_u8(packed));
+    memcpy(out + 8, &last, 4);
+}
+
+static void deinterlace_24_neon(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    uint8_t *out = buffer_out;
+    int i = 0;
+
+    if (numchannels == 2)
+    {
+        const int32x4_t mask = vdupq_n_s32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+        const int32x4_t ubshift = vdupq_n_s32(uncompressed_bytes * 8);
+
+        for (; i + 4 <= numsamples; i += 4)
+        {
+            int32x4_t left, right;
+
+            mix_neon(buffer_a, buffer_b, i, interlacing_shift,
+                     interlacing_leftweight, &left, &right);
+
+            if (uncompressed_bytes)
             {
-                fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_b);
+                left = vorrq_s32(vshlq_s32(left, ubshift),
+                                 vandq_s32(mask, vld1q_s32(uncompressed_bytes_buffer_a + i)));
+                right = vorrq_s32(vshlq_s32(right, ubshift),
+                                  vandq_s32(mask, vld1q_s32(uncompressed_bytes_buffer_b + i)));
             }
+
+            store_24_neon(out + i * 6, vzip1q_s32(left, right));
+            store_24_neon(out + i * 6 + 12, vzip2q_s32(left, right));
         }
-        else
-        { /* not compressed, easy case */
-            if (alac->setinfo_sample_size <= 16)
-            {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits_a, audiobits_b;
+    }
 
-                    audiobits_a = readbits(alac, alac->setinfo_sample_size);
-                    audiobits_b = readbits(alac, alac->setinfo_sample_size);
+    deinterlace_24_c(buffer_a + i, buffer_b + i, uncompressed_bytes,
+                     uncompressed_bytes_buffer_a + i, uncompressed_bytes_buffer_b + i,
+                     out + i * numchannels * 3, numchannels, numsamples - i,
+                     interlacing_shift, interlacing_leftweight);
+}
+#endif
 
-                    audiobits_a = SIGN_EXTENDED32(audiobits_a, alac->setinfo_sample_size);
-                    audiobits_b = SIGN_EXTENDED32(audiobits_b, alac->setinfo_sample_size);
+/* kernel selection */
+
+typedef void (*deinterlace_16_func)(int32_t *buffer_a, int32_t *buffer_b,
+                                    int16_t *buffer_out,
+                                    int numchannels, int numsamples,
+                                    uint8_t interlacing_shift,
+                                    uint8_t interlacing_leftweight);
+typedef void (*deinterlace_24_func)(int32_t *buffer_a, int32_t *buffer_b,
+                                    int uncompressed_bytes,
+                                    int32_t *uncompressed_bytes_buffer_a,
+                                    int32_t *uncompressed_bytes_buffer_b,
+                                    void *buffer_out,
+                                    int numchannels, int numsamples,
+                                    uint8_t interlacing_shift,
+                                    uint8_t interlacing_leftweight);
+
+typedef struct
+{
+    const char *name;
+    deinterlace_16_func deinterlace_16;
+    deinterlace_24_func deinterlace_24;
+} alac_kernel;
 
-                    alac->outputsamples_buffer_a[i] = audiobits_a;
-                    alac->outputsamples_buffer_b[i] = audiobits_b;
-                }
-            }
-            else
+static const alac_kernel alac_kernels[] =
+{
+#ifdef ALAC_HAVE_AVX2
+    { "avx2", deinterlace_16_avx2, deinterlace_24_avx2 },
+#endif
+#ifdef ALAC_HAVE_SSE2
+    { "sse2", deinterlace_16_sse2, deinterlace_24_sse2 },
+#endif
+#ifdef ALAC_HAVE_NEON
+    { "neon", deinterlace_16_neon, deinterlace_24_neon },
+#endif
+    { "c", deinterlace_16_c, deinterlace_24_c },
+};
+
+#define ALAC_NUM_KERNELS (sizeof(alac_kernels) / sizeof(alac_kernels[0]))
+
+/* the kernel is detected on first use, concurrent first calls may both
+ * run the detection but they always store the same pointer */
+static const alac_kernel *alac_kernel_current;
+
+static int alac_kernel_supported(const alac_kernel *kernel)
+{
+#if defined(ALAC_HAVE_AVX2) || defined(ALAC_HAVE_SSE2)
+    __builtin_cpu_init();
+#endif
+#ifdef ALAC_HAVE_AVX2
+    if (kernel->deinterlace_16 == deinterlace_16_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef ALAC_HAVE_SSE2
+    if (kernel->deinterlace_16 == deinterlace_16_sse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static const alac_kernel *alac_get_kernel(void)
+{
+    const alac_kernel *kernel = alac_kernel_current;
+    unsigned int i;
+
+    if (!kernel)
+    {
+        for (i = 0; i < ALAC_NUM_KERNELS; i++)
+        {
+            if (alac_kernel_supported(&alac_kernels[i]))
             {
-                int i;
-                for (i = 0; i < outputsamples; i++)
-                {
-                    int32_t audiobits_a, audiobits_b;
-
-                    audiobits_a = readbits(alac, 16);
-                    audiobits_a = audiobits_a << (alac->setinfo_sample_size - 16);
-                    audiobits_a |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits_a = SignExtend24(audiobits_a);
-
-                    audiobits_b = readbits(alac, 16);
-                    audiobits_b = audiobits_b << (alac->setinfo_sample_size - 16);
-                    audiobits_b |= readbits(alac, alac->setinfo_sample_size - 16);
-                    audiobits_b = SignExtend24(audiobits_b);
-
-                    alac->outputsamples_buffer_a[i] = audiobits_a;
-                    alac->outputsamples_buffer_b[i] = audiobits_b;
-                }
+                kernel = &alac_kernels[i];
+                break;
             }
-            uncompressed_bytes = 0; // always 0 for uncompressed
-            interlacing_shift = 0;
-            interlacing_leftweight = 0;
+        }
+        alac_kernel_current = kernel;
+    }
+    return kernel;
+}
+
+int alac_set_kernel(const char *name)
+{
+    unsigned int i;
+
+    if (!name || !strcmp(name, "auto"))
+    {
+        alac_kernel_current = NULL;
+        alac_get_kernel();
+        return 0;
+    }
+    for (i = 0; i < ALAC_NUM_KERNELS; i++)
+    {
+        if (!strcmp(alac_kernels[i].name, name) &&
+            alac_kernel_supported(&alac_kernels[i]))
+        {
+            alac_kernel_current = &alac_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *alac_get_kernel_name(void)
+{
+    return alac_get_kernel()->name;
+}
+
+static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
+                    int16_t *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    alac_get_kernel()->deinterlace_16(buffer_a, buffer_b, buffer_out,
+                                      numchannels, numsamples,
+                                      interlacing_shift, interlacing_leftweight);
+}
+
+static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
+                    int uncompressed_bytes,
+                    int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                    void *buffer_out,
+                    int numchannels, int numsamples,
+                    uint8_t interlacing_shift,
+                    uint8_t interlacing_leftweight)
+{
+    alac_get_kernel()->deinterlace_24(buffer_a, buffer_b, uncompressed_bytes,
+                                      uncompressed_bytes_buffer_a,
+                                      uncompressed_bytes_buffer_b,
+                                      buffer_out, numchannels, numsamples,
+                                      interlacing_shift, interlacing_leftweight);
+}
+
+/* element types in a frame, channels are output in the order of
+ * their elements */
+#define ID_SCE 0 /* single channel element */
+#define ID_CPE 1 /* channel pair element */
+#define ID_CCE 2 /* coupling channel element */
+#define ID_LFE 3 /* lfe channel element, coded as a single channel */
+#define ID_DSE 4 /* data stream element */
+#define ID_PCE 5 /* program config element */
+#define ID_FIL 6 /* fill element */
+#define ID_END 7 /* end of frame */
+
+static void skipbits_long(alac_file *alac, int bits)
+{
+    while (bits > 32)
+    {
+        readbits(alac, 32);
+        bits -= 32;
+    }
+    readbits(alac, bits);
+}
+
+static void skip_data_stream(alac_file *alac)
+{
+    int aligned;
+    int count;
+
+    readbits(alac, 4); /* element instance tag */
+    aligned = readbits(alac, 1);
+    count = readbits(alac, 8);
+    if (count == 255)
+        count += readbits(alac, 8);
+    if (aligned) /* the input pointer is always on a byte boundary */
+        readbits(alac, alac->input_cache_bits & 7);
+    skipbits_long(alac, count * 8);
+}
+
+static void skip_fill(alac_file *alac)
+{
+    int count;
+
+    count = readbits(alac, 4);
+    if (count == 15)
+        count += readbits(alac, 8) - 1;
+    skipbits_long(alac, count * 8);
+}
+
+/* entropy decodes one channel and runs the predictor over it */
+static void decompress_channel(alac_file *alac,
+                               int32_t *predicterror_buffer,
+                               int32_t *outputsamples_buffer,
+                               int outputsamples,
+                               int readsamplesize,
+                               int ricemodifier,
+                               int prediction_type,
+                               int prediction_quantitization,
+                               int16_t *predictor_coef_table,
+                               int predictor_coef_num,
+                               fir_adapt_func fir_adapt)
+{
+    entropy_rice_decode(alac,
+                        predicterror_buffer,
+                        outputsamples,
+                        readsamplesize,
+                        alac->setinfo_rice_initialhistory,
+                        alac->setinfo_rice_kmodifier,
+                        ricemodifier * alac->setinfo_rice_historymult / 4,
+                        (1 << alac->setinfo_rice_kmodifier) - 1);
+
+    if (prediction_type != 0)
+    { /* the error is first order coded on top of the adaptive fir,
+       * that is undone in place before running the fir */
+        predictor_decompress_fir_adapt(predicterror_buffer,
+                                       predicterror_buffer,
+                                       outputsamples,
+                                       readsamplesize,
+                                       NULL, 0x1f, 0, NULL);
+    }
+
+    /* adaptive fir */
+    predictor_decompress_fir_adapt(predicterror_buffer,
+                                   outputsamples_buffer,
+                                   outputsamples,
+                                   readsamplesize,
+                                   predictor_coef_table,
+                                   predictor_coef_num,
+                                   prediction_quantitization,
+                                   fir_adapt);
+}
+
+/* writes one channel to its position in the interleaved output */
+static void output_single(alac_file *alac, int32_t *buffer_a,
+                          int uncompressed_bytes,
+                          int32_t *uncompressed_bytes_buffer_a,
+                          void *outbuffer, int numsamples)
+{
+    int numchannels = alac->numchannels;
+    int i;
+
+    for (i = 0; i < numsamples; i++)
+    {
+        int32_t sample = buffer_a[i];
+
+        if (uncompressed_bytes)
+        {
+            uint32_t mask;
+            sample = sample << (uncompressed_bytes * 8);
+            mask = ~(0xFFFFFFFF << (uncompressed_bytes * 8));
+            sample |= uncompressed_bytes_buffer_a[i] & mask;
         }
 
         switch(alac->setinfo_sample_size)
         {
         case 16:
         {
-            deinterlace_16(alac->outputsamples_buffer_a,
-                           alac->outputsamples_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
-                           outputsamples,
-                           interlacing_shift,
-                           interlacing_leftweight);
+            int16_t sample16 = sample;
+            if (host_bigendian)
+                _Swap16(sample16);
+            ((int16_t*)outbuffer)[i * numchannels] = sample16;
             break;
         }
+        case 20:
+            sample <<= 4;
+            /* fall through */
         case 24:
+            ((uint8_t*)outbuffer)[i * numchannels * 3] = (sample) & 0xFF;
+            ((uint8_t*)outbuffer)[i * numchannels * 3 + 1] = (sample >> 8) & 0xFF;
+            ((uint8_t*)outbuffer)[i * numchannels * 3 + 2] = (sample >> 16) & 0xFF;
+            break;
+        case 32:
+            ((uint8_t*)outbuffer)[i * numchannels * 4] = (sample) & 0xFF;
+            ((uint8_t*)outbuffer)[i * numchannels * 4 + 1] = (sample >> 8) & 0xFF;
+            ((uint8_t*)outbuffer)[i * numchannels * 4 + 2] = (sample >> 16) & 0xFF;
+            ((uint8_t*)outbuffer)[i * numchannels * 4 + 3] = (sample >> 24) & 0xFF;
+            break;
+        }
+    }
+}
+
+/* reads the number of samples in the element, if it is stored there */
+static int read_element_samples(alac_file *alac, int hassize, int32_t *outputsamples)
+{
+    if (hassize)
+    {
+        /* now read the number of samples,
+         * as a 32bit integer */
+        uint32_t samples = readbits(alac, 32);
+        if (samples > alac->setinfo_max_samples_per_frame)
+            return -1;
+        *outputsamples = samples;
+    }
+    return 0;
+}
+
+/* single channel and lfe elements */
+static int decode_element_single(alac_file *alac, void *outbuffer,
+                                 int32_t *outputsamples)
+{
+    int hassize;
+    int isnotcompressed;
+    int readsamplesize;
+
+    int uncompressed_bytes;
+    int ricemodifier;
+
+    /* element instance tag */
+    readbits(alac, 4);
+
+    readbits(alac, 12); /* unknown, skip 12 bits */
+
+    hassize = readbits(alac, 1); /* the output sample size is stored soon */
+
+    uncompressed_bytes = readbits(alac, 2); /* number of bytes in the (compressed) stream that are not compressed */
+
+    isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+
+    if (read_element_samples(alac, hassize, outputsamples) < 0)
+        return -1;
+
+    readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8);
+
+    if (!isnotcompressed)
+    { /* so it is compressed */
+        int16_t predictor_coef_table[32];
+        int predictor_coef_num;
+        fir_adapt_func fir_adapt;
+        int prediction_type;
+        int prediction_quantitization;
+        int i;
+
+        /* skip 16 bits, not sure what they are. seem to be used in
+         * two channel case */
+        readbits(alac, 8);
+        readbits(alac, 8);
+
+        prediction_type = readbits(alac, 4);
+        prediction_quantitization = readbits(alac, 4);
+
+        ricemodifier = readbits(alac, 3);
+        predictor_coef_num = readbits(alac, 5);
+        fir_adapt = select_fir_adapt(predictor_coef_num);
+
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num; i++)
+        {
+            predictor_coef_table[i] = (int16_t)readbits(alac, 16);
+        }
+
+        if (uncompressed_bytes)
         {
-            deinterlace_24(alac->outputsamples_buffer_a,
+            int i;
+            for (i = 0; i < *outputsamples; i++)
+            {
+                alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
+            }
+        }
+
+        decompress_channel(alac,
+                           alac->predicterror_buffer_a,
+                           alac->outputsamples_buffer_a,
+                           *outputsamples,
+                           readsamplesize,
+                           ricemodifier,
+                           prediction_type,
+                           prediction_quantitization,
+                           predictor_coef_table,
+                           predictor_coef_num,
+                           fir_adapt);
+    }
+    else
+    { /* not compressed, easy case */
+        int i;
+        for (i = 0; i < *outputsamples; i++)
+        {
+            int32_t audiobits = readbits(alac, alac->setinfo_sample_size);
+
+            audiobits = SIGN_EXTENDED32(audiobits, alac->setinfo_sample_size);
+
+            alac->outputsamples_buffer_a[i] = audiobits;
+        }
+        uncompressed_bytes = 0; // always 0 for uncompressed
+    }
+
+    output_single(alac, alac->outputsamples_buffer_a,
+                  uncompressed_bytes, alac->uncompressed_bytes_buffer_a,
+                  outbuffer, *outputsamples);
+    return 0;
+}
+
+/* channel pair elements */
+static int decode_element_pair(alac_file *alac, void *outbuffer,
+                               int32_t *outputsamples)
+{
+    int hassize;
+    int isnotcompressed;
+    int readsamplesize;
+
+    int uncompressed_bytes;
+
+    uint8_t interlacing_shift;
+    uint8_t interlacing_leftweight;
+
+    /* element instance tag */
+    readbits(alac, 4);
+
+    readbits(alac, 12); /* unknown, skip 12 bits */
+
+    hassize = readbits(alac, 1); /* the output sample size is stored soon */
+
+    uncompressed_bytes = readbits(alac, 2); /* the number of bytes in the (compressed) stream that are not compressed */
+
+    isnotcompressed = readbits(alac, 1); /* whether the frame is compressed */
+
+    if (read_element_samples(alac, hassize, outputsamples) < 0)
+        return -1;
+
+    readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8) + 1;
+    if (readsamplesize > 32)
+        return -1;
+
+    if (!isnotcompressed)
+    { /* compressed */
+        int16_t predictor_coef_table_a[32];
+        int predictor_coef_num_a;
+        fir_adapt_func fir_adapt_a;
+        int prediction_type_a;
+        int prediction_quantitization_a;
+        int ricemodifier_a;
+
+        int16_t predictor_coef_table_b[32];
+        int predictor_coef_num_b;
+        fir_adapt_func fir_adapt_b;
+        int prediction_type_b;
+        int prediction_quantitization_b;
+        int ricemodifier_b;
+
+        int i;
+
+        interlacing_shift = readbits(alac, 8);
+        interlacing_leftweight = readbits(alac, 8);
+
+        /******** channel 1 ***********/
+        prediction_type_a = readbits(alac, 4);
+        prediction_quantitization_a = readbits(alac, 4);
+
+        ricemodifier_a = readbits(alac, 3);
+        predictor_coef_num_a = readbits(alac, 5);
+        fir_adapt_a = select_fir_adapt(predictor_coef_num_a);
+
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num_a; i++)
+        {
+            predictor_coef_table_a[i] = (int16_t)readbits(alac, 16);
+        }
+
+        /******** channel 2 *********/
+        prediction_type_b = readbits(alac, 4);
+        prediction_quantitization_b = readbits(alac, 4);
+
+        ricemodifier_b = readbits(alac, 3);
+        predictor_coef_num_b = readbits(alac, 5);
+        fir_adapt_b = select_fir_adapt(predictor_coef_num_b);
+
+        /* read the predictor table */
+        for (i = 0; i < predictor_coef_num_b; i++)
+        {
+            predictor_coef_table_b[i] = (int16_t)readbits(alac, 16);
+        }
+
+        /*********************/
+        if (uncompressed_bytes)
+        { /* see mono case */
+            int i;
+            for (i = 0; i < *outputsamples; i++)
+            {
+                alac->uncompressed_bytes_buffer_a[i] = readbits(alac, uncompressed_bytes * 8);
+                alac->uncompressed_bytes_buffer_b[i] = readbits(alac, uncompressed_bytes * 8);
+            }
+        }
+
+        /* channel 1 */
+        decompress_channel(alac,
+                           alac->predicterror_buffer_a,
+                           alac->outputsamples_buffer_a,
+                           *outputsamples,
+                           readsamplesize,
+                           ricemodifier_a,
+                           prediction_type_a,
+                           prediction_quantitization_a,
+                           predictor_coef_table_a,
+                           predictor_coef_num_a,
+                           fir_adapt_a);
+
+        /* channel 2 */
+        decompress_channel(alac,
+                           alac->predicterror_buffer_b,
                            alac->outputsamples_buffer_b,
-                           uncompressed_bytes,
-                           alac->uncompressed_bytes_buffer_a,
-                           alac->uncompressed_bytes_buffer_b,
-                           (int16_t*)outbuffer,
-                           alac->numchannels,
-                           outputsamples,
-                           interlacing_shift,
-                           interlacing_leftweight);
-            break;
+                           *outputsamples,
+                           readsamplesize,
+                           ricemodifier_b,
+                           prediction_type_b,
+                           prediction_quantitization_b,
+                           predictor_coef_table_b,
+                           predictor_coef_num_b,
+                           fir_adapt_b);
+    }
+    else
+    { /* not compressed, easy case */
+        int i;
+        for (i = 0; i < *outputsamples; i++)
+        {
+            int32_t audiobits_a, audiobits_b;
+
+            audiobits_a = readbits(alac, alac->setinfo_sample_size);
+            audiobits_b = readbits(alac, alac->setinfo_sample_size);
+
+            audiobits_a = SIGN_EXTENDED32(audiobits_a, alac->setinfo_sample_size);
+            audiobits_b = SIGN_EXTENDED32(audiobits_b, alac->setinfo_sample_size);
+
+            alac->outputsamples_buffer_a[i] = audiobits_a;
+            alac->outputsamples_buffer_b[i] = audiobits_b;
         }
-        case 20:
-        case 32:
-            fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->setinfo_sample_size);
+        uncompressed_bytes = 0; // always 0 for uncompressed
+        interlacing_shift = 0;
+        interlacing_leftweight = 0;
+    }
+
+    switch(alac->setinfo_sample_size)
+    {
+    case 16:
+        deinterlace_16(alac->outputsamples_buffer_a,
+                       alac->outputsamples_buffer_b,
+                       (int16_t*)outbuffer,
+                       alac->numchannels,
+                       *outputsamples,
+                       interlacing_shift,
+                       interlacing_leftweight);
+        break;
+    case 20:
+        deinterlace_20_c(alac->outputsamples_buffer_a,
+                         alac->outputsamples_buffer_b,
+                         uncompressed_bytes,
+                         alac->uncompressed_bytes_buffer_a,
+                         alac->uncompressed_bytes_buffer_b,
+                         outbuffer,
+                         alac->numchannels,
+                         *outputsamples,
+                         interlacing_shift,
+                         interlacing_leftweight);
+        break;
+    case 24:
+        deinterlace_24(alac->outputsamples_buffer_a,
+                       alac->outputsamples_buffer_b,
+                       uncompressed_bytes,
+                       alac->uncompressed_bytes_buffer_a,
+                       alac->uncompressed_bytes_buffer_b,
+                       outbuffer,
+                       alac->numchannels,
+                       *outputsamples,
+                       interlacing_shift,
+                       interlacing_leftweight);
+        break;
+    case 32:
+        deinterlace_32_c(alac->outputsamples_buffer_a,
+                         alac->outputsamples_buffer_b,
+                         uncompressed_bytes,
+                         alac->uncompressed_bytes_buffer_a,
+                         alac->uncompressed_bytes_buffer_b,
+                         outbuffer,
+                         alac->numchannels,
+                         *outputsamples,
+                         interlacing_shift,
+                         interlacing_leftweight);
+        break;
+    }
+    return 0;
+}
+
+void alac_decode_frame(alac_file *alac,
+                       unsigned char *inbuffer, int inputsize,
+                       void *outbuffer, int *outputsize)
+{
+    int32_t outputsamples = alac->setinfo_max_samples_per_frame;
+    int samplebytes = alac->bytespersample / alac->numchannels;
+    int channel = 0;
+
+    /* setup the stream */
+    alac->input_buffer = inbuffer;
+    alac->input_end = inbuffer + inputsize;
+    alac->input_cache = 0;
+    alac->input_cache_bits = 0;
+
+    switch(alac->setinfo_sample_size)
+    {
+    case 16:
+    case 20:
+    case 24:
+    case 32:
+        break;
+    default:
+        fprintf(stderr, "FIXME: unimplemented sample size %i\n", alac->setinfo_sample_size);
+        *outputsize = 0;
+        return;
+    }
+
+    /* elements follow each other until the end tag, a stereo frame
+     * is just a single channel pair */
+    while (channel < alac->numchannels)
+    {
+        unsigned char *channelbuffer = (unsigned char *)outbuffer + channel * samplebytes;
+        int element = readbits(alac, 3);
+        int ret = 0;
+
+        switch(element)
+        {
+        case ID_SCE:
+        case ID_LFE:
+            ret = decode_element_single(alac, channelbuffer, &outputsamples);
+            channel += 1;
+            break;
+        case ID_CPE:
+            if (channel + 2 > alac->numchannels)
+                ret = -1;
+            else
+                ret = decode_element_pair(alac, channelbuffer, &outputsamples);
+            channel += 2;
+            break;
+        case ID_DSE:
+            skip_data_stream(alac);
+            break;
+        case ID_FIL:
+            skip_fill(alac);
+            break;
+        case ID_END:
+            channel = alac->numchannels;
             break;
         default:
+            fprintf(stderr, "FIXME: unhandled element type: %i\n", element);
+            ret = -1;
             break;
         }
 
-        break;
-    }
+        if (ret < 0)
+        {
+            *outputsize = 0;
+            return;
+        }
     }
+
+    *outputsize = outputsamples * alac->bytespersample;
 }
 
 alac_file *alac_create(int samplesize, int numchannels)
@@ -1131,7 +1984,8 @@ alac_file *alac_create(int samplesize, int numchannels)
 
     newfile->samplesize = samplesize;
     newfile->numchannels = numchannels;
-    newfile->bytespersample = (samplesize / 8) * numchannels;
+    /* 20-bit samples are output in 24 bits */
+    newfile->bytespersample = ((samplesize + 7) / 8) * numchannels;
 
     return newfile;
 }
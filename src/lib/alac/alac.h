@@ -7,17 +7,23 @@ typedef struct alac_file alac_file;
 
 alac_file *alac_create(int samplesize, int numchannels);
 void alac_decode_frame(alac_file *alac,
-                       unsigned char *inbuffer,
+                       unsigned char *inbuffer, int inputsize,
                        void *outbuffer, int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void alac_allocate_buffers(alac_file *alac);
 void alac_free(alac_file *alac);
 
+/* select the deinterlacing kernel by name ("c", "sse2", "avx2", "neon"),
+ * NULL or "auto" picks the fastest one the cpu supports */
+int alac_set_kernel(const char *name);
+const char *alac_get_kernel_name(void);
+
 struct alac_file
 {
     unsigned char *input_buffer;
-    int input_buffer_bitaccumulator; /* used so we can do arbitary
-                                        bit reads */
+    unsigned char *input_end;
+    uint64_t input_cache; /* next bits of the input, msb first */
+    int input_cache_bits; /* number of valid bits in input_cache */
 
     int samplesize;
     int numchannels;
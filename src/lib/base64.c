@@ -76,6 +76,9 @@ base64_init(const char *charlist, int use_padding, int skip_spaces)
 	base64->use_padding = use_padding;
 	base64->skip_spaces = skip_spaces;
 
+	/* Filled here so decoding never writes to a shared instance */
+	initialize_charmap(base64);
+
 	return base64;
 }
 
@@ -32,12 +32,35 @@
  * AES implementation - this is a small code version. There are much faster
  * versions around but they are much larger in size (i.e. they use large 
  * submix tables).
+ *
+ * The CBC functions dispatch at runtime to the fastest backend the CPU
+ * supports: AES-NI on x86, the ARMv8 crypto extensions on AArch64 or a
+ * table driven implementation. The small version is kept as the
+ * reference. All backends use the same key schedule in AES_CTX.
  */
 
 #include <string.h>
 #include "os_port.h"
 #include "crypto.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_HAVE_AESNI
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON) && \
+    (defined(__linux__) || defined(__APPLE__))
+#define AES_HAVE_ARMV8
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#endif
+
 /* all commented out in skeleton mode */
 #ifndef CONFIG_SSL_SKELETON_MODE
 
@@ -161,6 +184,160 @@ static const unsigned char Rcon[30]=
 	0xb3,0x7d,0xfa,0xef,0xc5,0x91,
 };
 
+/*
+ * Encryption round table, SubBytes and MixColumns combined for one
+ * column. The other three tables are byte rotations of this one.
+ */
+static const uint32_t aes_te0[256] =
+{
+    0xc66363a5, 0xf87c7c84, 0xee777799, 0xf67b7b8d,
+    0xfff2f20d, 0xd66b6bbd, 0xde6f6fb1, 0x91c5c554,
+    0x60303050, 0x02010103, 0xce6767a9, 0x562b2b7d,
+    0xe7fefe19, 0xb5d7d762, 0x4dababe6, 0xec76769a,
+    0x8fcaca45, 0x1f82829d, 0x89c9c940, 0xfa7d7d87,
+    0xeffafa15, 0xb25959eb, 0x8e4747c9, 0xfbf0f00b,
+    0x41adadec, 0xb3d4d467, 0x5fa2a2fd, 0x45afafea,
+    0x239c9cbf, 0x53a4a4f7, 0xe4727296, 0x9bc0c05b,
+    0x75b7b7c2, 0xe1fdfd1c, 0x3d9393ae, 0x4c26266a,
+    0x6c36365a, 0x7e3f3f41, 0xf5f7f702, 0x83cccc4f,
+    0x6834345c, 0x51a5a5f4, 0xd1e5e534, 0xf9f1f108,
+    0xe2717193, 0xabd8d873, 0x62313153, 0x2a15153f,
+    0x0804040c, 0x95c7c752, 0x46232365, 0x9dc3c35e,
+    0x30181828, 0x379696a1, 0x0a05050f, 0x2f9a9ab5,
+    0x0e070709, 0x24121236, 0x1b80809b, 0xdfe2e23d,
+    0xcdebeb26, 0x4e272769, 0x7fb2b2cd, 0xea75759f,
+    0x1209091b, 0x1d83839e, 0x582c2c74, 0x341a1a2e,
+    0x361b1b2d, 0xdc6e6eb2, 0xb45a5aee, 0x5ba0a0fb,
+    0xa45252f6, 0x763b3b4d, 0xb7d6d661, 0x7db3b3ce,
+    0x5229297b, 0xdde3e33e, 0x5e2f2f71, 0x13848497,
+    0xa65353f5, 0xb9d1d168, 0x00000000, 0xc1eded2c,
+    0x40202060, 0xe3fcfc1f, 0x79b1b1c8, 0xb65b5bed,
+    0xd46a6abe, 0x8dcbcb46, 0x67bebed9, 0x7239394b,
+    0x944a4ade, 0x984c4cd4, 0xb05858e8, 0x85cfcf4a,
+    0xbbd0d06b, 0xc5efef2a, 0x4faaaae5, 0xedfbfb16,
+    0x864343c5, 0x9a4d4dd7, 0x66333355, 0x11858594,
+    0x8a4545cf, 0xe9f9f910, 0x04020206, 0xfe7f7f81,
+    0xa05050f0, 0x783c3c44, 0x259f9fba, 0x4ba8a8e3,
+    0xa25151f3, 0x5da3a3fe, 0x804040c0, 0x058f8f8a,
+    0x3f9292ad, 0x219d9dbc, 0x70383848, 0xf1f5f504,
+    0x63bcbcdf, 0x77b6b6c1, 0xafdada75, 0x42212163,
+    0x20101030, 0xe5ffff1a, 0xfdf3f30e, 0xbfd2d26d,
+    0x81cdcd4c, 0x180c0c14, 0x26131335, 0xc3ecec2f,
+    0xbe5f5fe1, 0x359797a2, 0x884444cc, 0x2e171739,
+    0x93c4c457, 0x55a7a7f2, 0xfc7e7e82, 0x7a3d3d47,
+    0xc86464ac, 0xba5d5de7, 0x3219192b, 0xe6737395,
+    0xc06060a0, 0x19818198, 0x9e4f4fd1, 0xa3dcdc7f,
+    0x44222266, 0x542a2a7e, 0x3b9090ab, 0x0b888883,
+    0x8c4646ca, 0xc7eeee29, 0x6bb8b8d3, 0x2814143c,
+    0xa7dede79, 0xbc5e5ee2, 0x160b0b1d, 0xaddbdb76,
+    0xdbe0e03b, 0x64323256, 0x743a3a4e, 0x140a0a1e,
+    0x924949db, 0x0c06060a, 0x4824246c, 0xb85c5ce4,
+    0x9fc2c25d, 0xbdd3d36e, 0x43acacef, 0xc46262a6,
+    0x399191a8, 0x319595a4, 0xd3e4e437, 0xf279798b,
+    0xd5e7e732, 0x8bc8c843, 0x6e373759, 0xda6d6db7,
+    0x018d8d8c, 0xb1d5d564, 0x9c4e4ed2, 0x49a9a9e0,
+    0xd86c6cb4, 0xac5656fa, 0xf3f4f407, 0xcfeaea25,
+    0xca6565af, 0xf47a7a8e, 0x47aeaee9, 0x10080818,
+    0x6fbabad5, 0xf0787888, 0x4a25256f, 0x5c2e2e72,
+    0x381c1c24, 0x57a6a6f1, 0x73b4b4c7, 0x97c6c651,
+    0xcbe8e823, 0xa1dddd7c, 0xe874749c, 0x3e1f1f21,
+    0x964b4bdd, 0x61bdbddc, 0x0d8b8b86, 0x0f8a8a85,
+    0xe0707090, 0x7c3e3e42, 0x71b5b5c4, 0xcc6666aa,
+    0x904848d8, 0x06030305, 0xf7f6f601, 0x1c0e0e12,
+    0xc26161a3, 0x6a35355f, 0xae5757f9, 0x69b9b9d0,
+    0x17868691, 0x99c1c158, 0x3a1d1d27, 0x279e9eb9,
+    0xd9e1e138, 0xebf8f813, 0x2b9898b3, 0x22111133,
+    0xd26969bb, 0xa9d9d970, 0x078e8e89, 0x339494a7,
+    0x2d9b9bb6, 0x3c1e1e22, 0x15878792, 0xc9e9e920,
+    0x87cece49, 0xaa5555ff, 0x50282878, 0xa5dfdf7a,
+    0x038c8c8f, 0x59a1a1f8, 0x09898980, 0x1a0d0d17,
+    0x65bfbfda, 0xd7e6e631, 0x844242c6, 0xd06868b8,
+    0x824141c3, 0x299999b0, 0x5a2d2d77, 0x1e0f0f11,
+    0x7bb0b0cb, 0xa85454fc, 0x6dbbbbd6, 0x2c16163a,
+};
+
+/*
+ * Decryption round table, InvSubBytes and InvMixColumns combined for one
+ * column. The other three tables are byte rotations of this one.
+ */
+static const uint32_t aes_td0[256] =
+{
+    0x51f4a750, 0x7e416553, 0x1a17a4c3, 0x3a275e96,
+    0x3bab6bcb, 0x1f9d45f1, 0xacfa58ab, 0x4be30393,
+    0x2030fa55, 0xad766df6, 0x88cc7691, 0xf5024c25,
+    0x4fe5d7fc, 0xc52acbd7, 0x26354480, 0xb562a38f,
+    0xdeb15a49, 0x25ba1b67, 0x45ea0e98, 0x5dfec0e1,
+    0xc32f7502, 0x814cf012, 0x8d4697a3, 0x6bd3f9c6,
+    0x038f5fe7, 0x15929c95, 0xbf6d7aeb, 0x955259da,
+    0xd4be832d, 0x587421d3, 0x49e06929, 0x8ec9c844,
+    0x75c2896a, 0xf48e7978, 0x99583e6b, 0x27b971dd,
+    0xbee14fb6, 0xf088ad17, 0xc920ac66, 0x7dce3ab4,
+    0x63df4a18, 0xe51a3182, 0x97513360, 0x62537f45,
+    0xb16477e0, 0xbb6bae84, 0xfe81a01c, 0xf9082b94,
+    0x70486858, 0x8f45fd19, 0x94de6c87, 0x527bf8b7,
+    0xab73d323, 0x724b02e2, 0xe31f8f57, 0x6655ab2a,
+    0xb2eb2807, 0x2fb5c203, 0x86c57b9a, 0xd33708a5,
+    0x302887f2, 0x23bfa5b2, 0x02036aba, 0xed16825c,
+    0x8acf1c2b, 0xa779b492, 0xf307f2f0, 0x4e69e2a1,
+    0x65daf4cd, 0x0605bed5, 0xd134621f, 0xc4a6fe8a,
+    0x342e539d, 0xa2f355a0, 0x058ae132, 0xa4f6eb75,
+    0x0b83ec39, 0x4060efaa, 0x5e719f06, 0xbd6e1051,
+    0x3e218af9, 0x96dd063d, 0xdd3e05ae, 0x4de6bd46,
+    0x91548db5, 0x71c45d05, 0x0406d46f, 0x605015ff,
+    0x1998fb24, 0xd6bde997, 0x894043cc, 0x67d99e77,
+    0xb0e842bd, 0x07898b88, 0xe7195b38, 0x79c8eedb,
+    0xa17c0a47, 0x7c420fe9, 0xf8841ec9, 0x00000000,
+    0x09808683, 0x322bed48, 0x1e1170ac, 0x6c5a724e,
+    0xfd0efffb, 0x0f853856, 0x3daed51e, 0x362d3927,
+    0x0a0fd964, 0x685ca621, 0x9b5b54d1, 0x24362e3a,
+    0x0c0a67b1, 0x9357e70f, 0xb4ee96d2, 0x1b9b919e,
+    0x80c0c54f, 0x61dc20a2, 0x5a774b69, 0x1c121a16,
+    0xe293ba0a, 0xc0a02ae5, 0x3c22e043, 0x121b171d,
+    0x0e090d0b, 0xf28bc7ad, 0x2db6a8b9, 0x141ea9c8,
+    0x57f11985, 0xaf75074c, 0xee99ddbb, 0xa37f60fd,
+    0xf701269f, 0x5c72f5bc, 0x44663bc5, 0x5bfb7e34,
+    0x8b432976, 0xcb23c6dc, 0xb6edfc68, 0xb8e4f163,
+    0xd731dcca, 0x42638510, 0x13972240, 0x84c61120,
+    0x854a247d, 0xd2bb3df8, 0xaef93211, 0xc729a16d,
+    0x1d9e2f4b, 0xdcb230f3, 0x0d8652ec, 0x77c1e3d0,
+    0x2bb3166c, 0xa970b999, 0x119448fa, 0x47e96422,
+    0xa8fc8cc4, 0xa0f03f1a, 0x567d2cd8, 0x223390ef,
+    0x87494ec7, 0xd938d1c1, 0x8ccaa2fe, 0x98d40b36,
+    0xa6f581cf, 0xa57ade28, 0xdab78e26, 0x3fadbfa4,
+    0x2c3a9de4, 0x5078920d, 0x6a5fcc9b, 0x547e4662,
+    0xf68d13c2, 0x90d8b8e8, 0x2e39f75e, 0x82c3aff5,
+    0x9f5d80be, 0x69d0937c, 0x6fd52da9, 0xcf2512b3,
+    0xc8ac993b, 0x10187da7, 0xe89c636e, 0xdb3bbb7b,
+    0xcd267809, 0x6e5918f4, 0xec9ab701, 0x834f9aa8,
+    0xe6956e65, 0xaaffe67e, 0x21bccf08, 0xef15e8e6,
+    0xbae79bd9, 0x4a6f36ce, 0xea9f09d4, 0x29b07cd6,
+    0x31a4b2af, 0x2a3f2331, 0xc6a59430, 0x35a266c0,
+    0x744ebc37, 0xfc82caa6, 0xe090d0b0, 0x33a7d815,
+    0xf104984a, 0x41ecdaf7, 0x7fcd500e, 0x1791f62f,
+    0x764dd68d, 0x43efb04d, 0xccaa4d54, 0xe49604df,
+    0x9ed1b5e3, 0x4c6a881b, 0xc12c1fb8, 0x4665517f,
+    0x9d5eea04, 0x018c355d, 0xfa877473, 0xfb0b412e,
+    0xb3671d5a, 0x92dbd252, 0xe9105633, 0x6dd64713,
+    0x9ad7618c, 0x37a10c7a, 0x59f8148e, 0xeb133c89,
+    0xcea927ee, 0xb761c935, 0xe11ce5ed, 0x7a47b13c,
+    0x9cd2df59, 0x55f2733f, 0x1814ce79, 0x73c737bf,
+    0x53f7cdea, 0x5ffdaa5b, 0xdf3d6f14, 0x7844db86,
+    0xcaaff381, 0xb968c43e, 0x3824342c, 0xc2a3405f,
+    0x161dc372, 0xbce2250c, 0x283c498b, 0xff0d9541,
+    0x39a80171, 0x080cb3de, 0xd8b4e49c, 0x6456c190,
+    0x7bcb8461, 0xd532b670, 0x486c5c74, 0xd0b85742,
+};
+
+typedef struct
+{
+    const char *name;
+    void (*cbc_encrypt)(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
+    void (*cbc_decrypt)(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
+    void (*ecb_encrypt)(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
+} aes_backend_t;
+
+static const aes_backend_t *aes_backend;
+
 /* ----- static functions ----- */
 static void AES_encrypt(const AES_CTX *ctx, uint32_t *data);
 static void AES_decrypt(const AES_CTX *ctx, uint32_t *data);
@@ -269,7 +446,7 @@ void AES_convert_key(AES_CTX *ctx)
 /**
  * Encrypt a byte sequence (with a block size 16) using the AES cipher.
  */
-void AES_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+static void aes_small_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
 {
     int i;
     uint32_t tin[4], tout[4], iv[4];
@@ -308,7 +485,7 @@ void AES_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
 /**
  * Decrypt a byte sequence (with a block size 16) using the AES cipher.
  */
-void AES_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+static void aes_small_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
 {
     int i;
     uint32_t tin[4], xor[4], tout[4], data[4], iv[4];
@@ -454,4 +631,553 @@ static void AES_decrypt(const AES_CTX *ctx, uint32_t *data)
     }
 }
 
+/**
+ * Encrypt independent blocks (with a block size 16) using the AES cipher.
+ */
+static void aes_small_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    int i;
+    uint32_t data[4];
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        memcpy(data, msg, AES_BLOCKSIZE);
+        for (i = 0; i < 4; i++)
+            data[i] = ntohl(data[i]);
+
+        AES_encrypt(ctx, data);
+
+        for (i = 0; i < 4; i++)
+            data[i] = htonl(data[i]);
+        memcpy(out, data, AES_BLOCKSIZE);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+}
+
+static const aes_backend_t aes_small_backend =
+{
+    "small", aes_small_cbc_encrypt, aes_small_cbc_decrypt, aes_small_ecb_encrypt
+};
+
+/* ----- table driven backend ----- */
+
+#define GET_U32(p) (((uint32_t)(p)[0]<<24)|((uint32_t)(p)[1]<<16)| \
+                    ((uint32_t)(p)[2]<< 8)|((uint32_t)(p)[3]    ))
+#define PUT_U32(p,v) ((p)[0]=(uint8_t)((v)>>24),(p)[1]=(uint8_t)((v)>>16), \
+                      (p)[2]=(uint8_t)((v)>> 8),(p)[3]=(uint8_t)((v)    ))
+
+#define TE(a,b,c,d) (aes_te0[(a)>>24]^rot1(aes_te0[((b)>>16)&0xff])^ \
+                     rot2(aes_te0[((c)>>8)&0xff])^rot3(aes_te0[(d)&0xff]))
+#define TD(a,b,c,d) (aes_td0[(a)>>24]^rot1(aes_td0[((b)>>16)&0xff])^ \
+                     rot2(aes_td0[((c)>>8)&0xff])^rot3(aes_td0[(d)&0xff]))
+#define SE(a,b,c,d) (((uint32_t)aes_sbox[(a)>>24]<<24)^ \
+                     ((uint32_t)aes_sbox[((b)>>16)&0xff]<<16)^ \
+                     ((uint32_t)aes_sbox[((c)>>8)&0xff]<<8)^ \
+                     ((uint32_t)aes_sbox[(d)&0xff]))
+#define SD(a,b,c,d) (((uint32_t)aes_isbox[(a)>>24]<<24)^ \
+                     ((uint32_t)aes_isbox[((b)>>16)&0xff]<<16)^ \
+                     ((uint32_t)aes_isbox[((c)>>8)&0xff]<<8)^ \
+                     ((uint32_t)aes_isbox[(d)&0xff]))
+
+static void aes_table_encrypt(const AES_CTX *ctx, uint32_t *data)
+{
+    const uint32_t *k = ctx->ks;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = data[0]^k[0];
+    s1 = data[1]^k[1];
+    s2 = data[2]^k[2];
+    s3 = data[3]^k[3];
+
+    for (r = 1; r < ctx->rounds; r++)
+    {
+        k += 4;
+        t0 = TE(s0,s1,s2,s3)^k[0];
+        t1 = TE(s1,s2,s3,s0)^k[1];
+        t2 = TE(s2,s3,s0,s1)^k[2];
+        t3 = TE(s3,s0,s1,s2)^k[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    k += 4;
+    data[0] = SE(s0,s1,s2,s3)^k[0];
+    data[1] = SE(s1,s2,s3,s0)^k[1];
+    data[2] = SE(s2,s3,s0,s1)^k[2];
+    data[3] = SE(s3,s0,s1,s2)^k[3];
+}
+
+static void aes_table_decrypt(const AES_CTX *ctx, uint32_t *data)
+{
+    const uint32_t *k = ctx->ks + ctx->rounds*4;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = data[0]^k[0];
+    s1 = data[1]^k[1];
+    s2 = data[2]^k[2];
+    s3 = data[3]^k[3];
+
+    for (r = 1; r < ctx->rounds; r++)
+    {
+        k -= 4;
+        t0 = TD(s0,s3,s2,s1)^k[0];
+        t1 = TD(s1,s0,s3,s2)^k[1];
+        t2 = TD(s2,s1,s0,s3)^k[2];
+        t3 = TD(s3,s2,s1,s0)^k[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    k -= 4;
+    data[0] = SD(s0,s3,s2,s1)^k[0];
+    data[1] = SD(s1,s0,s3,s2)^k[1];
+    data[2] = SD(s2,s1,s0,s3)^k[2];
+    data[3] = SD(s3,s2,s1,s0)^k[3];
+}
+
+static void aes_table_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint32_t data[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        data[i] = GET_U32(ctx->iv+4*i);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        for (i = 0; i < 4; i++)
+            data[i] ^= GET_U32(msg+4*i);
+
+        aes_table_encrypt(ctx, data);
+
+        for (i = 0; i < 4; i++)
+            PUT_U32(out+4*i, data[i]);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    for (i = 0; i < 4; i++)
+        PUT_U32(ctx->iv+4*i, data[i]);
+}
+
+static void aes_table_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint32_t xor[4], tin[4], data[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        xor[i] = GET_U32(ctx->iv+4*i);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        for (i = 0; i < 4; i++)
+            data[i] = tin[i] = GET_U32(msg+4*i);
+
+        aes_table_decrypt(ctx, data);
+
+        for (i = 0; i < 4; i++)
+        {
+            PUT_U32(out+4*i, data[i]^xor[i]);
+            xor[i] = tin[i];
+        }
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    for (i = 0; i < 4; i++)
+        PUT_U32(ctx->iv+4*i, xor[i]);
+}
+
+static void aes_table_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint32_t data[4];
+    int i;
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        for (i = 0; i < 4; i++)
+            data[i] = GET_U32(msg+4*i);
+
+        aes_table_encrypt(ctx, data);
+
+        for (i = 0; i < 4; i++)
+            PUT_U32(out+4*i, data[i]);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+}
+
+static const aes_backend_t aes_table_backend =
+{
+    "table", aes_table_cbc_encrypt, aes_table_cbc_decrypt, aes_table_ecb_encrypt
+};
+
+/* ----- AES-NI backend ----- */
+
+#ifdef AES_HAVE_AESNI
+#define AESNI_TARGET __attribute__((target("aes,ssse3")))
+
+/* The key schedule words are stored in host order, swap them to bytes */
+AESNI_TARGET
+static void aesni_load_keys(const AES_CTX *ctx, __m128i *keys)
+{
+    const __m128i bswap = _mm_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+    int i;
+
+    for (i = 0; i <= ctx->rounds; i++)
+        keys[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(ctx->ks+4*i)), bswap);
+}
+
+AESNI_TARGET
+static void aesni_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    __m128i keys[AES_MAXROUNDS+1];
+    __m128i state;
+    int rounds = ctx->rounds;
+    int i;
+
+    aesni_load_keys(ctx, keys);
+    state = _mm_loadu_si128((const __m128i *)ctx->iv);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        state = _mm_xor_si128(state, _mm_loadu_si128((const __m128i *)msg));
+        state = _mm_xor_si128(state, keys[0]);
+        for (i = 1; i < rounds; i++)
+            state = _mm_aesenc_si128(state, keys[i]);
+        state = _mm_aesenclast_si128(state, keys[rounds]);
+        _mm_storeu_si128((__m128i *)out, state);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    _mm_storeu_si128((__m128i *)ctx->iv, state);
+}
+
+AESNI_TARGET
+static void aesni_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    __m128i keys[AES_MAXROUNDS+1];
+    __m128i prev, b0, b1, b2, b3, c0, c1, c2, c3;
+    int rounds = ctx->rounds;
+    int blocks = length/AES_BLOCKSIZE;
+    int i;
+
+    aesni_load_keys(ctx, keys);
+    prev = _mm_loadu_si128((const __m128i *)ctx->iv);
+
+    /* Blocks are independent when decrypting, keep four in flight */
+    for (; blocks >= 4; blocks -= 4)
+    {
+        c0 = _mm_loadu_si128((const __m128i *)msg);
+        c1 = _mm_loadu_si128((const __m128i *)(msg+16));
+        c2 = _mm_loadu_si128((const __m128i *)(msg+32));
+        c3 = _mm_loadu_si128((const __m128i *)(msg+48));
+        b0 = _mm_xor_si128(c0, keys[rounds]);
+        b1 = _mm_xor_si128(c1, keys[rounds]);
+        b2 = _mm_xor_si128(c2, keys[rounds]);
+        b3 = _mm_xor_si128(c3, keys[rounds]);
+        for (i = rounds-1; i > 0; i--)
+        {
+            b0 = _mm_aesdec_si128(b0, keys[i]);
+            b1 = _mm_aesdec_si128(b1, keys[i]);
+            b2 = _mm_aesdec_si128(b2, keys[i]);
+            b3 = _mm_aesdec_si128(b3, keys[i]);
+        }
+        b0 = _mm_aesdeclast_si128(b0, keys[0]);
+        b1 = _mm_aesdeclast_si128(b1, keys[0]);
+        b2 = _mm_aesdeclast_si128(b2, keys[0]);
+        b3 = _mm_aesdeclast_si128(b3, keys[0]);
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+        _mm_storeu_si128((__m128i *)(out+16), _mm_xor_si128(b1, c0));
+        _mm_storeu_si128((__m128i *)(out+32), _mm_xor_si128(b2, c1));
+        _mm_storeu_si128((__m128i *)(out+48), _mm_xor_si128(b3, c2));
+        prev = c3;
+        msg += 4*AES_BLOCKSIZE;
+        out += 4*AES_BLOCKSIZE;
+    }
+
+    for (; blocks > 0; blocks--)
+    {
+        c0 = _mm_loadu_si128((const __m128i *)msg);
+        b0 = _mm_xor_si128(c0, keys[rounds]);
+        for (i = rounds-1; i > 0; i--)
+            b0 = _mm_aesdec_si128(b0, keys[i]);
+        b0 = _mm_aesdeclast_si128(b0, keys[0]);
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+        prev = c0;
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    _mm_storeu_si128((__m128i *)ctx->iv, prev);
+}
+
+AESNI_TARGET
+static void aesni_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    __m128i keys[AES_MAXROUNDS+1];
+    __m128i b0, b1, b2, b3;
+    int rounds = ctx->rounds;
+    int blocks = length/AES_BLOCKSIZE;
+    int i;
+
+    aesni_load_keys(ctx, keys);
+
+    for (; blocks >= 4; blocks -= 4)
+    {
+        b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)msg), keys[0]);
+        b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(msg+16)), keys[0]);
+        b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(msg+32)), keys[0]);
+        b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(msg+48)), keys[0]);
+        for (i = 1; i < rounds; i++)
+        {
+            b0 = _mm_aesenc_si128(b0, keys[i]);
+            b1 = _mm_aesenc_si128(b1, keys[i]);
+            b2 = _mm_aesenc_si128(b2, keys[i]);
+            b3 = _mm_aesenc_si128(b3, keys[i]);
+        }
+        _mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(b0, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(out+16), _mm_aesenclast_si128(b1, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(out+32), _mm_aesenclast_si128(b2, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(out+48), _mm_aesenclast_si128(b3, keys[rounds]));
+        msg += 4*AES_BLOCKSIZE;
+        out += 4*AES_BLOCKSIZE;
+    }
+
+    for (; blocks > 0; blocks--)
+    {
+        b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)msg), keys[0]);
+        for (i = 1; i < rounds; i++)
+            b0 = _mm_aesenc_si128(b0, keys[i]);
+        _mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(b0, keys[rounds]));
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+}
+
+static const aes_backend_t aes_aesni_backend =
+{
+    "aesni", aesni_cbc_encrypt, aesni_cbc_decrypt, aesni_ecb_encrypt
+};
+
+static int aesni_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+}
+#endif
+
+/* ----- ARMv8 crypto extensions backend ----- */
+
+#ifdef AES_HAVE_ARMV8
+#ifdef __clang__
+#define ARMV8_TARGET __attribute__((target("aes")))
+#else
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+/* The key schedule words are stored in host order, swap them to bytes */
+ARMV8_TARGET
+static void armv8_load_keys(const AES_CTX *ctx, uint8x16_t *keys)
+{
+    int i;
+
+    for (i = 0; i <= ctx->rounds; i++)
+        keys[i] = vrev32q_u8(vld1q_u8((const uint8_t *)(ctx->ks+4*i)));
+}
+
+ARMV8_TARGET
+static void armv8_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint8x16_t keys[AES_MAXROUNDS+1];
+    uint8x16_t state;
+    int rounds = ctx->rounds;
+    int i;
+
+    armv8_load_keys(ctx, keys);
+    state = vld1q_u8(ctx->iv);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        state = veorq_u8(state, vld1q_u8(msg));
+        for (i = 0; i < rounds-1; i++)
+            state = vaesmcq_u8(vaeseq_u8(state, keys[i]));
+        state = veorq_u8(vaeseq_u8(state, keys[rounds-1]), keys[rounds]);
+        vst1q_u8(out, state);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    vst1q_u8(ctx->iv, state);
+}
+
+ARMV8_TARGET
+static void armv8_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint8x16_t keys[AES_MAXROUNDS+1];
+    uint8x16_t prev, block, cipher;
+    int rounds = ctx->rounds;
+    int i;
+
+    armv8_load_keys(ctx, keys);
+    prev = vld1q_u8(ctx->iv);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        cipher = block = vld1q_u8(msg);
+        for (i = rounds; i > 1; i--)
+            block = vaesimcq_u8(vaesdq_u8(block, keys[i]));
+        block = veorq_u8(vaesdq_u8(block, keys[1]), keys[0]);
+        vst1q_u8(out, veorq_u8(block, prev));
+        prev = cipher;
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+
+    vst1q_u8(ctx->iv, prev);
+}
+
+ARMV8_TARGET
+static void armv8_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    uint8x16_t keys[AES_MAXROUNDS+1];
+    uint8x16_t state;
+    int rounds = ctx->rounds;
+    int i;
+
+    armv8_load_keys(ctx, keys);
+
+    for (length -= AES_BLOCKSIZE; length >= 0; length -= AES_BLOCKSIZE)
+    {
+        state = vld1q_u8(msg);
+        for (i = 0; i < rounds-1; i++)
+            state = vaesmcq_u8(vaeseq_u8(state, keys[i]));
+        state = veorq_u8(vaeseq_u8(state, keys[rounds-1]), keys[rounds]);
+        vst1q_u8(out, state);
+        msg += AES_BLOCKSIZE;
+        out += AES_BLOCKSIZE;
+    }
+}
+
+static const aes_backend_t aes_armv8_backend =
+{
+    "armv8", armv8_cbc_encrypt, armv8_cbc_decrypt, armv8_ecb_encrypt
+};
+
+static int armv8_supported(void)
+{
+#ifdef __APPLE__
+    return 1;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#endif
+}
+#endif
+
+/* ----- backend selection ----- */
+
+static const aes_backend_t *aes_find_backend(AES_BACKEND backend)
+{
+    switch (backend)
+    {
+        case AES_BACKEND_AUTO:
+#ifdef AES_HAVE_AESNI
+            if (aesni_supported())
+                return &aes_aesni_backend;
+#endif
+#ifdef AES_HAVE_ARMV8
+            if (armv8_supported())
+                return &aes_armv8_backend;
+#endif
+            return &aes_table_backend;
+
+        case AES_BACKEND_SMALL:
+            return &aes_small_backend;
+
+        case AES_BACKEND_TABLE:
+            return &aes_table_backend;
+
+#ifdef AES_HAVE_AESNI
+        case AES_BACKEND_AESNI:
+            return aesni_supported() ? &aes_aesni_backend : NULL;
+#endif
+
+#ifdef AES_HAVE_ARMV8
+        case AES_BACKEND_ARMV8:
+            return armv8_supported() ? &aes_armv8_backend : NULL;
+#endif
+
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * The backend is detected on first use. Concurrent first calls may both
+ * run the detection, but they always store the same pointer.
+ */
+static const aes_backend_t *aes_get_backend(void)
+{
+    const aes_backend_t *backend = aes_backend;
+
+    if (backend == NULL)
+    {
+        backend = aes_find_backend(AES_BACKEND_AUTO);
+        aes_backend = backend;
+    }
+
+    return backend;
+}
+
+/**
+ * Select the backend used by the CBC functions. Returns -1 if the backend
+ * is not supported by this build or CPU.
+ */
+int AES_set_backend(AES_BACKEND backend)
+{
+    const aes_backend_t *found = aes_find_backend(backend);
+
+    if (found == NULL)
+        return -1;
+
+    aes_backend = found;
+    return 0;
+}
+
+/**
+ * Return the name of the backend used by the CBC functions.
+ */
+const char *AES_get_backend_name(void)
+{
+    return aes_get_backend()->name;
+}
+
+/**
+ * Encrypt a byte sequence (with a block size 16) using the AES cipher.
+ */
+void AES_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    aes_get_backend()->cbc_encrypt(ctx, msg, out, length);
+}
+
+/**
+ * Decrypt a byte sequence (with a block size 16) using the AES cipher.
+ */
+void AES_cbc_decrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    aes_get_backend()->cbc_decrypt(ctx, msg, out, length);
+}
+
+/**
+ * Encrypt independent blocks (with a block size 16) using the AES cipher,
+ * the IV is not used. Useful for generating CTR mode keystream.
+ */
+void AES_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+    aes_get_backend()->ecb_encrypt(ctx, msg, out, length);
+}
+
 #endif
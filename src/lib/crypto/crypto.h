@@ -72,12 +72,24 @@ typedef enum
     AES_MODE_256
 } AES_MODE;
 
+typedef enum
+{
+    AES_BACKEND_AUTO,
+    AES_BACKEND_SMALL,
+    AES_BACKEND_TABLE,
+    AES_BACKEND_AESNI,
+    AES_BACKEND_ARMV8
+} AES_BACKEND;
+
 void AES_set_key(AES_CTX *ctx, const uint8_t *key, 
         const uint8_t *iv, AES_MODE mode);
 void AES_cbc_encrypt(AES_CTX *ctx, const uint8_t *msg, 
         uint8_t *out, int length);
 void AES_cbc_decrypt(AES_CTX *ks, const uint8_t *in, uint8_t *out, int length);
+void AES_ecb_encrypt(AES_CTX *ctx, const uint8_t *msg, uint8_t *out, int length);
 void AES_convert_key(AES_CTX *ctx);
+int AES_set_backend(AES_BACKEND backend);
+const char *AES_get_backend_name(void);
 
 /**************************************************************************
  * RC4 declarations 
@@ -19,69 +19,147 @@
 #include "http_request.h"
 #include "http_parser.h"
 
+/* Arenas larger than this are freed when the request is reset */
+#define HTTP_REQUEST_ARENA_KEEP 65536
+
+/* Slots of the header index, requests with more than half of this many
+ * headers are searched linearly */
+#define HTTP_REQUEST_INDEX_LEN 64
+
+enum {
+	HTTP_REQUEST_NONE,
+	HTTP_REQUEST_URL,
+	HTTP_REQUEST_FIELD,
+	HTTP_REQUEST_VALUE,
+	HTTP_REQUEST_BODY
+};
+
+/* Offsets of the null terminated strings in the arena, -1 if missing */
+typedef struct {
+	int field;
+	int value;
+	unsigned int hash;
+} http_header_t;
+
 struct http_request_s {
 	http_parser parser;
 	http_parser_settings parser_settings;
 
+	/* The URL, headers and body are appended to the arena as they are
+	 * parsed, the callback that got the last data decides where the
+	 * next data goes */
+	char *arena;
+	size_t arena_size;
+	size_t arena_len;
+	int last_cb;
+
 	const char *method;
-	char *url;
+	int url;
 
-	char **headers;
+	http_header_t *headers;
 	int headers_size;
-	int headers_index;
+	int headers_count;
+
+	/* Header numbers plus one by hash of the field, 0 for empty slots */
+	unsigned char index[HTTP_REQUEST_INDEX_LEN];
+	int indexed;
 
-	char *data;
+	int data;
 	int datalen;
 
 	int complete;
 };
 
 static int
-on_url(http_parser *parser, const char *at, size_t length)
+http_request_tolower(int c)
 {
-	http_request_t *request = parser->data;
-	int urllen = request->url ? strlen(request->url) : 0;
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
 
-	request->url = realloc(request->url, urllen+length+1);
-	assert(request->url);
+/* FNV-1a hash of the lowercase name */
+static unsigned int
+http_request_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
 
-	request->url[urllen] = '\0';
-	strncat(request->url, at, length);
-	return 0;
+	while (*name) {
+		hash ^= (unsigned char)http_request_tolower(*name++);
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
 static int
-on_header_field(http_parser *parser, const char *at, size_t length)
+http_request_casecmp(const char *s1, const char *s2)
 {
-	http_request_t *request = parser->data;
+	while (*s1 && http_request_tolower(*s1) == http_request_tolower(*s2)) {
+		s1++;
+		s2++;
+	}
+	return http_request_tolower(*s1) - http_request_tolower(*s2);
+}
 
-	/* Check if our index is a value */
-	if (request->headers_index%2 == 1) {
-		request->headers_index++;
+static void
+http_request_append(http_request_t *request, const char *at, size_t length)
+{
+	if (request->arena_len+length > request->arena_size) {
+		size_t size = request->arena_size ? request->arena_size : 1024;
+
+		while (size < request->arena_len+length) {
+			size *= 2;
+		}
+		request->arena = realloc(request->arena, size);
+		assert(request->arena);
+		request->arena_size = size;
 	}
+	memcpy(request->arena+request->arena_len, at, length);
+	request->arena_len += length;
+}
 
-	/* Allocate space for new field-value pair */
-	if (request->headers_index == request->headers_size) {
-		request->headers_size += 2;
-		request->headers = realloc(request->headers,
-		                           request->headers_size*sizeof(char*));
-		assert(request->headers);
-		request->headers[request->headers_index] = NULL;
-		request->headers[request->headers_index+1] = NULL;
+/* Terminates the string of the previous callback if this one is new */
+static int
+http_request_switch(http_request_t *request, int cb)
+{
+	if (request->last_cb == cb) {
+		return 0;
+	}
+	if (request->last_cb != HTTP_REQUEST_NONE && request->last_cb != HTTP_REQUEST_BODY) {
+		http_request_append(request, "", 1);
 	}
+	request->last_cb = cb;
+	return 1;
+}
+
+static int
+on_url(http_parser *parser, const char *at, size_t length)
+{
+	http_request_t *request = parser->data;
 
-	/* Allocate space in the current header string */
-	if (request->headers[request->headers_index] == NULL) {
-		request->headers[request->headers_index] = calloc(1, length+1);
-	} else {
-		request->headers[request->headers_index] = realloc(
-			request->headers[request->headers_index],
-			strlen(request->headers[request->headers_index])+length+1
-		);
+	if (http_request_switch(request, HTTP_REQUEST_URL)) {
+		request->url = request->arena_len;
 	}
-	assert(request->headers[request->headers_index]);
+	http_request_append(request, at, length);
+	return 0;
+}
 
-	strncat(request->headers[request->headers_index], at, length);
+static int
+on_header_field(http_parser *parser, const char *at, size_t length)
+{
+	http_request_t *request = parser->data;
+
+	if (http_request_switch(request, HTTP_REQUEST_FIELD)) {
+		/* Allocate space for new field-value pair */
+		if (request->headers_count == request->headers_size) {
+			request->headers_size = request->headers_size ? request->headers_size*2 : 16;
+			request->headers = realloc(request->headers,
+			                           request->headers_size*sizeof(http_header_t));
+			assert(request->headers);
+		}
+		request->headers[request->headers_count].field = request->arena_len;
+		request->headers[request->headers_count].value = -1;
+		request->headers_count++;
+	}
+	http_request_append(request, at, length);
 	return 0;
 }
 
@@ -90,23 +168,19 @@ on_header_value(http_parser *parser, const char *at, size_t length)
 {
 	http_request_t *request = parser->data;
 
-	/* Check if our index is a field */
-	if (request->headers_index%2 == 0) {
-		request->headers_index++;
+	if (http_request_switch(request, HTTP_REQUEST_VALUE) && request->headers_count) {
+		request->headers[request->headers_count-1].value = request->arena_len;
 	}
+	http_request_append(request, at, length);
+	return 0;
+}
 
-	/* Allocate space in the current header string */
-	if (request->headers[request->headers_index] == NULL) {
-		request->headers[request->headers_index] = calloc(1, length+1);
-	} else {
-		request->headers[request->headers_index] = realloc(
-			request->headers[request->headers_index],
-			strlen(request->headers[request->headers_index])+length+1
-		);
-	}
-	assert(request->headers[request->headers_index]);
+static int
+on_headers_complete(http_parser *parser)
+{
+	http_request_t *request = parser->data;
 
-	strncat(request->headers[request->headers_index], at, length);
+	http_request_switch(request, HTTP_REQUEST_NONE);
 	return 0;
 }
 
@@ -115,19 +189,51 @@ on_body(http_parser *parser, const char *at, size_t length)
 {
 	http_request_t *request = parser->data;
 
-	request->data = realloc(request->data, request->datalen+length);
-	assert(request->data);
-
-	memcpy(request->data+request->datalen, at, length);
+	if (http_request_switch(request, HTTP_REQUEST_BODY)) {
+		request->data = request->arena_len;
+	}
+	http_request_append(request, at, length);
 	request->datalen += length;
 	return 0;
 }
 
+/* Hashes the header fields, the first of duplicate fields is found */
+static void
+http_request_build_index(http_request_t *request)
+{
+	int i;
+
+	memset(request->index, 0, sizeof(request->index));
+	request->indexed = (request->headers_count <= HTTP_REQUEST_INDEX_LEN/2);
+	for (i=0; i<request->headers_count; i++) {
+		http_header_t *header = &request->headers[i];
+		const char *field = request->arena + header->field;
+		unsigned int slot;
+
+		header->hash = http_request_hash(field);
+		if (!request->indexed) {
+			continue;
+		}
+		for (slot = header->hash; request->index[slot % HTTP_REQUEST_INDEX_LEN]; slot++) {
+			http_header_t *other = &request->headers[request->index[slot % HTTP_REQUEST_INDEX_LEN]-1];
+
+			if (other->hash == header->hash && !http_request_casecmp(request->arena + other->field, field)) {
+				break;
+			}
+		}
+		if (!request->index[slot % HTTP_REQUEST_INDEX_LEN]) {
+			request->index[slot % HTTP_REQUEST_INDEX_LEN] = i+1;
+		}
+	}
+}
+
 static int
 on_message_complete(http_parser *parser)
 {
 	http_request_t *request = parser->data;
 
+	http_request_switch(request, HTTP_REQUEST_NONE);
+	http_request_build_index(request);
 	request->method = http_method_str(request->parser.method);
 	request->complete = 1;
 	return 0;
@@ -142,30 +248,49 @@ http_request_init(void)
 	if (!request) {
 		return NULL;
 	}
-	http_parser_init(&request->parser, HTTP_REQUEST);
-	request->parser.data = request;
-
 	request->parser_settings.on_url = &on_url;
 	request->parser_settings.on_header_field = &on_header_field;
 	request->parser_settings.on_header_value = &on_header_value;
+	request->parser_settings.on_headers_complete = &on_headers_complete;
 	request->parser_settings.on_body = &on_body;
 	request->parser_settings.on_message_complete = &on_message_complete;
+	http_request_reset(request);
 
 	return request;
 }
 
 void
-http_request_destroy(http_request_t *request)
+http_request_reset(http_request_t *request)
 {
-	int i;
+	assert(request);
 
+	http_parser_init(&request->parser, HTTP_REQUEST);
+	request->parser.data = request;
+
+	/* Keep the storage unless a large body grew it */
+	if (request->arena_size > HTTP_REQUEST_ARENA_KEEP) {
+		free(request->arena);
+		request->arena = NULL;
+		request->arena_size = 0;
+	}
+	request->arena_len = 0;
+	request->last_cb = HTTP_REQUEST_NONE;
+
+	request->method = NULL;
+	request->url = -1;
+	request->headers_count = 0;
+	request->indexed = 0;
+	request->data = -1;
+	request->datalen = 0;
+	request->complete = 0;
+}
+
+void
+http_request_destroy(http_request_t *request)
+{
 	if (request) {
-		free(request->url);
-		for (i=0; i<request->headers_size; i++) {
-			free(request->headers[i]);
-		}
+		free(request->arena);
 		free(request->headers);
-		free(request->data);
 		free(request);
 	}
 }
@@ -222,19 +347,33 @@ const char *
 http_request_get_url(http_request_t *request)
 {
 	assert(request);
-	return request->url;
+	return (request->url != -1) ? request->arena + request->url : NULL;
 }
 
 const char *
 http_request_get_header(http_request_t *request, const char *name)
 {
+	http_header_t *header;
+	unsigned int hash, slot;
 	int i;
 
 	assert(request);
-
-	for (i=0; i<request->headers_size; i+=2) {
-		if (!strcmp(request->headers[i], name)) {
-			return request->headers[i+1];
+	assert(name);
+
+	hash = http_request_hash(name);
+	if (request->indexed) {
+		for (slot = hash; request->index[slot % HTTP_REQUEST_INDEX_LEN]; slot++) {
+			header = &request->headers[request->index[slot % HTTP_REQUEST_INDEX_LEN]-1];
+			if (header->hash == hash && !http_request_casecmp(request->arena + header->field, name)) {
+				return (header->value != -1) ? request->arena + header->value : "";
+			}
+		}
+		return NULL;
+	}
+	for (i=0; i<request->headers_count; i++) {
+		header = &request->headers[i];
+		if (!http_request_casecmp(request->arena + header->field, name)) {
+			return (header->value != -1) ? request->arena + header->value : "";
 		}
 	}
 	return NULL;
@@ -248,5 +387,5 @@ http_request_get_data(http_request_t *request, int *datalen)
 	if (datalen) {
 		*datalen = request->datalen;
 	}
-	return request->data;
+	return (request->data != -1) ? request->arena + request->data : NULL;
 }
@@ -20,6 +20,9 @@ typedef struct http_request_s http_request_t;
 
 http_request_t *http_request_init(void);
 
+/* Clears the request for parsing the next one, keeping its storage */
+void http_request_reset(http_request_t *request);
+
 int http_request_add_data(http_request_t *request, const char *data, int datalen);
 int http_request_is_complete(http_request_t *request);
 int http_request_has_error(http_request_t *request);
@@ -28,6 +31,9 @@ const char *http_request_get_error_name(http_request_t *request);
 const char *http_request_get_error_description(http_request_t *request);
 const char *http_request_get_method(http_request_t *request);
 const char *http_request_get_url(http_request_t *request);
+
+/* Header names are compared case-insensitively, looked up from a hash
+ * index once the request is complete */
 const char *http_request_get_header(http_request_t *request, const char *name);
 const char *http_request_get_data(http_request_t *request, int *datalen);
 
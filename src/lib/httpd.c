@@ -12,23 +12,64 @@
  *  Lesser General Public License for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#else
+# define USE_EPOLL 0
+#endif
 
 #include "httpd.h"
 #include "netutils.h"
 #include "http_request.h"
+#include "raop_ntp.h"
 #include "compat.h"
 #include "logger.h"
 
+/* Idle connections are tracked on a wheel of one second slots */
+#define HTTPD_WHEEL_LEN 64
+
+/* Epoll event data, connections are numbered after the fixed fds */
+#define HTTPD_EPOLL_WAKEUP 0
+#define HTTPD_EPOLL_SERVER4 1
+#define HTTPD_EPOLL_SERVER6 2
+#define HTTPD_EPOLL_CONNECTION 3
+
 struct http_connection_s {
 	int connected;
 
 	int socket_fd;
 	void *user_data;
 	http_request_t *request;
+
+	/* Request handled earlier, reset and reused with its storage */
+	http_request_t *free_request;
+
+	/* Links in the free list while unused, in a wheel slot while
+	 * connected and tracked for idleness, -1 terminates the lists */
+	int next;
+	int prev;
+	int wheel_slot;
+
+	/* Monotonic seconds of the last activity and of the wheel check */
+	unsigned int last_active;
+	unsigned int expiry;
+
+	/* Set while the request is handled by a worker, the connection is
+	 * not read until the response is sent so requests stay in order */
+	int busy;
+	http_response_t *response;
+	int work_next;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -40,6 +81,14 @@ struct httpd_s {
 	int open_connections;
 	http_connection_t *connections;
 
+	/* First unused connection slot, -1 if all are in use */
+	int free_connection;
+
+	/* Idle connections are closed after this many seconds, 0 disables */
+	unsigned int idle_timeout;
+	unsigned int wheel_time;
+	int wheel[HTTPD_WHEEL_LEN];
+
 	/* These variables only edited mutex locked */
 	int running;
 	int joined;
@@ -49,12 +98,41 @@ struct httpd_s {
 	/* Server fds for accepting connections */
 	int server_fd4;
 	int server_fd6;
+
+	/* Wakes up the thread when it should stop */
+	int wakeup_rfd;
+	int wakeup_wfd;
+
+	/* Epoll instance of the thread, -1 when select is used */
+	int epfd;
+	int accepting;
+
+	/* Worker threads handling complete requests, with queues of pending
+	 * and handled connections linked by work_next. Without any started
+	 * workers the requests are handled in the HTTP thread */
+	int workers;
+	int started_workers;
+	thread_handle_t *worker_threads;
+	mutex_handle_t work_mutex;
+	cond_handle_t work_cond;
+	int work_stopping;
+	int work_head;
+	int work_tail;
+	int done_head;
+	int done_tail;
 };
 
+static unsigned int
+httpd_get_time()
+{
+	return (unsigned int)(raop_ntp_get_monotonic_time() >> 32);
+}
+
 httpd_t *
 httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections)
 {
 	httpd_t *httpd;
+	int i;
 
 	assert(logger);
 	assert(callbacks);
@@ -72,6 +150,26 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections)
 		free(httpd);
 		return NULL;
 	}
+	if (netutils_init_wakeup(&httpd->wakeup_rfd, &httpd->wakeup_wfd) < 0) {
+		free(httpd->connections);
+		free(httpd);
+		return NULL;
+	}
+
+	/* Chain all connection slots into the free list */
+	for (i=0; i<max_connections; i++) {
+		httpd->connections[i].next = (i+1 < max_connections) ? i+1 : -1;
+		httpd->connections[i].wheel_slot = -1;
+	}
+	httpd->free_connection = 0;
+	for (i=0; i<HTTPD_WHEEL_LEN; i++) {
+		httpd->wheel[i] = -1;
+	}
+	httpd->epfd = -1;
+	httpd->work_head = httpd->work_tail = -1;
+	httpd->done_head = httpd->done_tail = -1;
+	MUTEX_CREATE(httpd->work_mutex);
+	COND_CREATE(httpd->work_cond);
 
 	/* Use the logger provided */
 	httpd->logger = logger;
@@ -92,27 +190,125 @@ httpd_destroy(httpd_t *httpd)
 	if (httpd) {
 		httpd_stop(httpd);
 
+		netutils_close_wakeup(httpd->wakeup_rfd, httpd->wakeup_wfd);
+		COND_DESTROY(httpd->work_cond);
+		MUTEX_DESTROY(httpd->work_mutex);
 		free(httpd->connections);
 		free(httpd);
 	}
 }
 
+void
+httpd_set_idle_timeout(httpd_t *httpd, int seconds)
+{
+	assert(httpd);
+
+	MUTEX_LOCK(httpd->run_mutex);
+	if (!httpd->running && httpd->joined) {
+		httpd->idle_timeout = (seconds > 0) ? seconds : 0;
+	}
+	MUTEX_UNLOCK(httpd->run_mutex);
+}
+
+void
+httpd_set_workers(httpd_t *httpd, int workers)
+{
+	assert(httpd);
+
+	MUTEX_LOCK(httpd->run_mutex);
+	if (!httpd->running && httpd->joined) {
+		httpd->workers = (workers > 0) ? workers : 0;
+	}
+	MUTEX_UNLOCK(httpd->run_mutex);
+}
+
+static void
+httpd_wheel_insert(httpd_t *httpd, int index, unsigned int expiry)
+{
+	http_connection_t *connection = &httpd->connections[index];
+	int slot = expiry % HTTPD_WHEEL_LEN;
+
+	connection->expiry = expiry;
+	connection->wheel_slot = slot;
+	connection->prev = -1;
+	connection->next = httpd->wheel[slot];
+	if (connection->next != -1) {
+		httpd->connections[connection->next].prev = index;
+	}
+	httpd->wheel[slot] = index;
+}
+
+static void
+httpd_wheel_remove(httpd_t *httpd, int index)
+{
+	http_connection_t *connection = &httpd->connections[index];
+
+	if (connection->wheel_slot == -1) {
+		return;
+	}
+	if (connection->prev != -1) {
+		httpd->connections[connection->prev].next = connection->next;
+	} else {
+		httpd->wheel[connection->wheel_slot] = connection->next;
+	}
+	if (connection->next != -1) {
+		httpd->connections[connection->next].prev = connection->prev;
+	}
+	connection->wheel_slot = -1;
+}
+
+/* Pauses or resumes accepting, the server fds are not watched when full */
+static void
+httpd_set_accepting(httpd_t *httpd, int accepting)
+{
+#if USE_EPOLL
+	struct epoll_event event;
+
+	if (httpd->epfd == -1 || httpd->accepting == accepting) {
+		return;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = accepting ? EPOLLIN : 0;
+	if (httpd->server_fd4 != -1) {
+		event.data.u32 = HTTPD_EPOLL_SERVER4;
+		epoll_ctl(httpd->epfd, EPOLL_CTL_MOD, httpd->server_fd4, &event);
+	}
+	if (httpd->server_fd6 != -1) {
+		event.data.u32 = HTTPD_EPOLL_SERVER6;
+		epoll_ctl(httpd->epfd, EPOLL_CTL_MOD, httpd->server_fd6, &event);
+	}
+#endif
+	httpd->accepting = accepting;
+}
+
 static int
 httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len, unsigned char *remote, int remote_len)
 {
+	http_connection_t *connection;
 	void *user_data;
 	int i;
 
-	for (i=0; i<httpd->max_connections; i++) {
-		if (!httpd->connections[i].connected) {
-			break;
-		}
-	}
-	if (i == httpd->max_connections) {
-		/* This code should never be reached, we do not select server_fds when full */
+	i = httpd->free_connection;
+	if (i == -1) {
+		/* This code should never be reached, we do not accept when full */
 		logger_log(httpd->logger, LOGGER_INFO, "Max connections reached");
 		return -1;
 	}
+	connection = &httpd->connections[i];
+
+#if USE_EPOLL
+	if (httpd->epfd != -1) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.u32 = HTTPD_EPOLL_CONNECTION + i;
+		if (epoll_ctl(httpd->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			logger_log(httpd->logger, LOGGER_ERR, "Error adding socket %d to epoll %d", fd, errno);
+			return -1;
+		}
+	}
+#endif
 
 	user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, local, local_len, remote, remote_len);
 	if (!user_data) {
@@ -120,13 +316,20 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
 		return -1;
 	}
 
+	httpd->free_connection = connection->next;
 	httpd->open_connections++;
-	httpd->connections[i].socket_fd = fd;
-	httpd->connections[i].connected = 1;
-	httpd->connections[i].user_data = user_data;
+	connection->socket_fd = fd;
+	connection->connected = 1;
+	connection->user_data = user_data;
+	if (httpd->idle_timeout) {
+		connection->last_active = httpd_get_time();
+		httpd_wheel_insert(httpd, i, connection->last_active + httpd->idle_timeout);
+	}
+	if (httpd->free_connection == -1) {
+		httpd_set_accepting(httpd, 0);
+	}
 	return 0;
 }
-
 static int
 httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
 {
@@ -170,30 +373,488 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
 static void
 httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
 {
+	int index = connection - httpd->connections;
+
 	if (connection->request) {
 		http_request_destroy(connection->request);
 		connection->request = NULL;
 	}
+	if (connection->free_request) {
+		http_request_destroy(connection->free_request);
+		connection->free_request = NULL;
+	}
+	if (connection->response) {
+		http_response_destroy(connection->response);
+		connection->response = NULL;
+	}
+	connection->busy = 0;
 	httpd->callbacks.conn_destroy(connection->user_data);
 	shutdown(connection->socket_fd, SHUT_WR);
 	closesocket(connection->socket_fd);
 	connection->connected = 0;
 	httpd->open_connections--;
+
+	/* Return the slot to the free list */
+	httpd_wheel_remove(httpd, index);
+	connection->next = httpd->free_connection;
+	httpd->free_connection = index;
+	httpd_set_accepting(httpd, 1);
+}
+
+/* Sends the response to a handled request and deallocates both, returns
+ * -1 if the connection was removed */
+static int
+httpd_send_response(httpd_t *httpd, http_connection_t *connection, http_response_t *response)
+{
+	http_request_reset(connection->request);
+	connection->free_request = connection->request;
+	connection->request = NULL;
+
+	if (response) {
+		const char *data;
+		int datalen;
+		int written;
+		int ret;
+
+		/* Get response data and datalen */
+		data = http_response_get_data(response, &datalen);
+
+		written = 0;
+		while (written < datalen) {
+			ret = send(connection->socket_fd, data+written, datalen-written, 0);
+			if (ret == -1) {
+				/* FIXME: Error happened */
+				logger_log(httpd->logger, LOGGER_INFO, "Error in sending data");
+				break;
+			}
+			written += ret;
+		}
+
+		if (http_response_get_disconnect(response)) {
+			logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
+			httpd_remove_connection(httpd, connection);
+			http_response_destroy(response);
+			return -1;
+		}
+	} else {
+		logger_log(httpd->logger, LOGGER_INFO, "Didn't get response");
+	}
+	http_response_destroy(response);
+	return 0;
+}
+
+/* Stops or resumes reading a connection, with select the busy flag
+ * keeps it out of the fd set. Returns -1 if the connection was removed */
+static int
+httpd_set_reading(httpd_t *httpd, http_connection_t *connection, int reading)
+{
+#if USE_EPOLL
+	struct epoll_event event;
+
+	if (httpd->epfd == -1) {
+		return 0;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = HTTPD_EPOLL_CONNECTION + (connection - httpd->connections);
+	if (epoll_ctl(httpd->epfd, reading ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, connection->socket_fd, &event) == -1) {
+		logger_log(httpd->logger, LOGGER_ERR, "Error updating socket %d in epoll %d", connection->socket_fd, errno);
+		httpd_remove_connection(httpd, connection);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Hands a complete request to the workers, returns -1 if the
+ * connection was removed */
+static int
+httpd_queue_request(httpd_t *httpd, http_connection_t *connection)
+{
+	int index = connection - httpd->connections;
+
+	if (httpd_set_reading(httpd, connection, 0) < 0) {
+		return -1;
+	}
+	connection->busy = 1;
+	connection->work_next = -1;
+
+	MUTEX_LOCK(httpd->work_mutex);
+	if (httpd->work_tail == -1) {
+		httpd->work_head = index;
+	} else {
+		httpd->connections[httpd->work_tail].work_next = index;
+	}
+	httpd->work_tail = index;
+	MUTEX_UNLOCK(httpd->work_mutex);
+	COND_SIGNAL(httpd->work_cond);
+	return 0;
+}
+
+/* Sends the responses the workers have finished and resumes reading */
+static void
+httpd_complete_requests(httpd_t *httpd)
+{
+	int index;
+
+	MUTEX_LOCK(httpd->work_mutex);
+	index = httpd->done_head;
+	httpd->done_head = httpd->done_tail = -1;
+	MUTEX_UNLOCK(httpd->work_mutex);
+
+	while (index != -1) {
+		http_connection_t *connection = &httpd->connections[index];
+		http_response_t *response = connection->response;
+
+		index = connection->work_next;
+		connection->response = NULL;
+		connection->busy = 0;
+		if (httpd->idle_timeout) {
+			connection->last_active = httpd_get_time();
+		}
+		if (httpd_send_response(httpd, connection, response) < 0) {
+			continue;
+		}
+		httpd_set_reading(httpd, connection, 1);
+	}
 }
 
 static THREAD_RETVAL
-httpd_thread(void *arg)
+httpd_worker_thread(void *arg)
 {
 	httpd_t *httpd = arg;
+
+	assert(httpd);
+
+	while (1) {
+		http_connection_t *connection;
+		http_response_t *response = NULL;
+		int index, more;
+
+		MUTEX_LOCK(httpd->work_mutex);
+		while (httpd->work_head == -1 && !httpd->work_stopping) {
+			COND_WAIT(httpd->work_cond, httpd->work_mutex);
+		}
+		if (httpd->work_stopping) {
+			MUTEX_UNLOCK(httpd->work_mutex);
+			/* Pass the wakeup on to the next worker */
+			COND_SIGNAL(httpd->work_cond);
+			break;
+		}
+		index = httpd->work_head;
+		connection = &httpd->connections[index];
+		httpd->work_head = connection->work_next;
+		if (httpd->work_head == -1) {
+			httpd->work_tail = -1;
+		}
+		more = (httpd->work_head != -1);
+		MUTEX_UNLOCK(httpd->work_mutex);
+		if (more) {
+			COND_SIGNAL(httpd->work_cond);
+		}
+
+		/* Only this worker touches the connection until it is done */
+		httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+
+		MUTEX_LOCK(httpd->work_mutex);
+		connection->response = response;
+		connection->work_next = -1;
+		if (httpd->done_tail == -1) {
+			httpd->done_head = index;
+		} else {
+			httpd->connections[httpd->done_tail].work_next = index;
+		}
+		httpd->done_tail = index;
+		MUTEX_UNLOCK(httpd->work_mutex);
+		netutils_signal_wakeup(httpd->wakeup_wfd);
+	}
+	return 0;
+}
+
+static void
+httpd_start_workers(httpd_t *httpd)
+{
+	int i;
+
+	if (!httpd->workers) {
+		return;
+	}
+	httpd->worker_threads = calloc(httpd->workers, sizeof(thread_handle_t));
+	if (!httpd->worker_threads) {
+		logger_log(httpd->logger, LOGGER_WARNING, "Handling requests in the HTTP thread");
+		return;
+	}
+	httpd->work_stopping = 0;
+	for (i=0; i<httpd->workers; i++) {
+		THREAD_CREATE(httpd->worker_threads[i], httpd_worker_thread, httpd);
+		if (!httpd->worker_threads[i]) {
+			logger_log(httpd->logger, LOGGER_WARNING, "Started only %d of %d HTTP workers", i, httpd->workers);
+			break;
+		}
+	}
+	httpd->started_workers = i;
+}
+
+/* Joins the workers, requests still queued are dropped with their
+ * connections */
+static void
+httpd_stop_workers(httpd_t *httpd)
+{
+	int i;
+
+	if (!httpd->worker_threads) {
+		return;
+	}
+	MUTEX_LOCK(httpd->work_mutex);
+	httpd->work_stopping = 1;
+	MUTEX_UNLOCK(httpd->work_mutex);
+	COND_SIGNAL(httpd->work_cond);
+	for (i=0; i<httpd->started_workers; i++) {
+		THREAD_JOIN(httpd->worker_threads[i]);
+	}
+	free(httpd->worker_threads);
+	httpd->worker_threads = NULL;
+	httpd->started_workers = 0;
+	httpd->work_head = httpd->work_tail = -1;
+	httpd->done_head = httpd->done_tail = -1;
+}
+
+/* Reads from a connection that has data, handles the request once it
+ * is complete and returns -1 if the connection was removed */
+static int
+httpd_process_connection(httpd_t *httpd, http_connection_t *connection)
+{
 	char buffer[1024];
+	int ret;
+
+	/* If not in the middle of request, reuse or allocate one */
+	if (!connection->request) {
+		connection->request = connection->free_request ? connection->free_request : http_request_init();
+		connection->free_request = NULL;
+		assert(connection->request);
+	}
+
+	logger_log(httpd->logger, LOGGER_DEBUG, "Receiving on socket %d", connection->socket_fd);
+	ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
+	if (ret == 0) {
+		logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
+		httpd_remove_connection(httpd, connection);
+		return -1;
+	} else if (ret == -1) {
+		logger_log(httpd->logger, LOGGER_INFO, "Error in recv for socket %d", connection->socket_fd);
+		httpd_remove_connection(httpd, connection);
+		return -1;
+	}
+	if (httpd->idle_timeout) {
+		connection->last_active = httpd_get_time();
+	}
+
+	/* Parse HTTP request from data read from connection */
+	http_request_add_data(connection->request, buffer, ret);
+	if (http_request_has_error(connection->request)) {
+		logger_log(httpd->logger, LOGGER_INFO, "Error in parsing: %s", http_request_get_error_name(connection->request));
+		httpd_remove_connection(httpd, connection);
+		return -1;
+	}
+
+	/* If request is finished, process it here or hand it to the workers */
+	if (http_request_is_complete(connection->request)) {
+		http_response_t *response = NULL;
+
+		if (httpd->started_workers && (!httpd->callbacks.conn_offload ||
+		                               httpd->callbacks.conn_offload(connection->user_data, connection->request))) {
+			return httpd_queue_request(httpd, connection);
+		}
+		httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+		return httpd_send_response(httpd, connection, response);
+	} else {
+		logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+	}
+	return 0;
+}
+
+/* Closes the connections idle for longer than the timeout that are due
+ * on the wheel, returns the milliseconds until the next slot to check
+ * or -1 if no connection is tracked */
+static int
+httpd_check_idle(httpd_t *httpd)
+{
+	unsigned int now;
 	int i;
 
-	assert(httpd);
+	if (!httpd->idle_timeout) {
+		return -1;
+	}
+	now = httpd_get_time();
+
+	/* Visit every slot passed since the last check, a full round at most */
+	if ((int)(now - httpd->wheel_time) >= HTTPD_WHEEL_LEN) {
+		httpd->wheel_time = now - HTTPD_WHEEL_LEN + 1;
+	}
+	for (; (int)(now - httpd->wheel_time) >= 0; httpd->wheel_time++) {
+		int slot = httpd->wheel_time % HTTPD_WHEEL_LEN;
+		int index = httpd->wheel[slot];
+
+		/* Detach the slot, the connections not closed are inserted again */
+		httpd->wheel[slot] = -1;
+		while (index != -1) {
+			http_connection_t *connection = &httpd->connections[index];
+			unsigned int expiry = connection->last_active + httpd->idle_timeout;
+			int next = connection->next;
+
+			connection->wheel_slot = -1;
+			if ((int)(connection->expiry - now) > 0) {
+				/* Due on a later round of the wheel */
+				httpd_wheel_insert(httpd, index, connection->expiry);
+			} else if ((int)(expiry - now) > 0) {
+				/* Active since it was inserted */
+				httpd_wheel_insert(httpd, index, expiry);
+			} else if (connection->busy ||
+			           (httpd->callbacks.conn_idle && !httpd->callbacks.conn_idle(connection->user_data))) {
+				/* Owned by a worker or has a live session, check again after
+				 * another timeout. A request left half sent does not count */
+				httpd_wheel_insert(httpd, index, now + httpd->idle_timeout);
+			} else {
+				logger_log(httpd->logger, LOGGER_INFO, "Closing idle connection for socket %d",
+				           connection->socket_fd);
+				httpd_remove_connection(httpd, connection);
+			}
+			index = next;
+		}
+	}
+
+	/* Wake up at the first slot with connections in it */
+	for (i=0; i<HTTPD_WHEEL_LEN; i++) {
+		if (httpd->wheel[(httpd->wheel_time + i) % HTTPD_WHEEL_LEN] != -1) {
+			return (i+1) * 1000;
+		}
+	}
+	return -1;
+}
+
+static void
+httpd_remove_all_connections(httpd_t *httpd)
+{
+	int i;
+
+	/* Remove all connections that are still connected */
+	for (i=0; i<httpd->max_connections; i++) {
+		http_connection_t *connection = &httpd->connections[i];
+
+		if (!connection->connected) {
+			continue;
+		}
+		logger_log(httpd->logger, LOGGER_INFO, "Removing connection for socket %d", connection->socket_fd);
+		httpd_remove_connection(httpd, connection);
+	}
+}
+
+#if USE_EPOLL
+/* Returns -1 if epoll is not available and select should be used instead */
+static int
+httpd_loop_epoll(httpd_t *httpd)
+{
+	struct epoll_event event, events[64];
+	int i;
+
+	httpd->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (httpd->epfd == -1) {
+		return -1;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = HTTPD_EPOLL_WAKEUP;
+	if (epoll_ctl(httpd->epfd, EPOLL_CTL_ADD, httpd->wakeup_rfd, &event) == -1) {
+		close(httpd->epfd);
+		httpd->epfd = -1;
+		return -1;
+	}
+	event.data.u32 = HTTPD_EPOLL_SERVER4;
+	if (httpd->server_fd4 != -1 && epoll_ctl(httpd->epfd, EPOLL_CTL_ADD, httpd->server_fd4, &event) == -1) {
+		close(httpd->epfd);
+		httpd->epfd = -1;
+		return -1;
+	}
+	event.data.u32 = HTTPD_EPOLL_SERVER6;
+	if (httpd->server_fd6 != -1 && epoll_ctl(httpd->epfd, EPOLL_CTL_ADD, httpd->server_fd6, &event) == -1) {
+		close(httpd->epfd);
+		httpd->epfd = -1;
+		return -1;
+	}
+	httpd->accepting = 1;
+
+	logger_log(httpd->logger, LOGGER_DEBUG, "Using epoll for the HTTP thread");
+	while (1) {
+		int nevents, timeout;
+
+		MUTEX_LOCK(httpd->run_mutex);
+		if (!httpd->running) {
+			MUTEX_UNLOCK(httpd->run_mutex);
+			break;
+		}
+		MUTEX_UNLOCK(httpd->run_mutex);
+
+		/* Sleep until there is activity, an idle check is due or we are
+		 * woken up to stop, the cost does not depend on the slot count */
+		timeout = httpd_check_idle(httpd);
+		nevents = epoll_wait(httpd->epfd, events, sizeof(events)/sizeof(events[0]), timeout);
+		if (nevents == -1 && errno == EINTR) {
+			continue;
+		} else if (nevents == -1) {
+			/* FIXME: Error happened */
+			logger_log(httpd->logger, LOGGER_INFO, "Error in epoll_wait %d", errno);
+			break;
+		}
+
+		for (i=0; i<nevents; i++) {
+			unsigned int data = events[i].data.u32;
+			http_connection_t *connection;
+			int ret;
+
+			if (data == HTTPD_EPOLL_WAKEUP) {
+				netutils_clear_wakeup(httpd->wakeup_rfd);
+				httpd_complete_requests(httpd);
+				continue;
+			} else if (data == HTTPD_EPOLL_SERVER4 || data == HTTPD_EPOLL_SERVER6) {
+				if (httpd->free_connection == -1) {
+					continue;
+				}
+				ret = httpd_accept_connection(httpd, (data == HTTPD_EPOLL_SERVER4) ?
+				                              httpd->server_fd4 : httpd->server_fd6,
+				                              data == HTTPD_EPOLL_SERVER6);
+				if (ret == -1) {
+					break;
+				}
+				continue;
+			}
+
+			/* Skip events of connections removed or handed to the
+			 * workers earlier in this batch */
+			connection = &httpd->connections[data - HTTPD_EPOLL_CONNECTION];
+			if (!connection->connected || connection->busy) {
+				continue;
+			}
+			httpd_process_connection(httpd, connection);
+		}
+		if (i < nevents) {
+			break;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static void
+httpd_loop_select(httpd_t *httpd)
+{
+	int i;
 
 	while (1) {
 		fd_set rfds;
 		struct timeval tv;
 		int nfds=0;
+		int timeout;
 		int ret;
 
 		MUTEX_LOCK(httpd->run_mutex);
@@ -203,12 +864,13 @@ httpd_thread(void *arg)
 		}
 		MUTEX_UNLOCK(httpd->run_mutex);
 
-		/* Set timeout value to 5ms */
-		tv.tv_sec = 1;
-		tv.tv_usec = 5000;
+		/* Close idle connections before their fds are selected */
+		timeout = httpd_check_idle(httpd);
 
 		/* Get the correct nfds value and set rfds */
 		FD_ZERO(&rfds);
+		FD_SET(httpd->wakeup_rfd, &rfds);
+		nfds = httpd->wakeup_rfd+1;
 		if (httpd->open_connections < httpd->max_connections) {
 			if (httpd->server_fd4 != -1) {
 				FD_SET(httpd->server_fd4, &rfds);
@@ -225,7 +887,7 @@ httpd_thread(void *arg)
 		}
 		for (i=0; i<httpd->max_connections; i++) {
 			int socket_fd;
-			if (!httpd->connections[i].connected) {
+			if (!httpd->connections[i].connected || httpd->connections[i].busy) {
 				continue;
 			}
 			socket_fd = httpd->connections[i].socket_fd;
@@ -235,15 +897,23 @@ httpd_thread(void *arg)
 			}
 		}
 
-		ret = select(nfds, &rfds, NULL, NULL, &tv);
+		/* Sleep until there is activity, an idle check is due or we are
+		 * woken up to stop */
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		ret = select(nfds, &rfds, NULL, NULL, (timeout >= 0) ? &tv : NULL);
 		if (ret == 0) {
-			/* Timeout happened */
 			continue;
 		} else if (ret == -1) {
 			/* FIXME: Error happened */
 			logger_log(httpd->logger, LOGGER_INFO, "Error in select");
 			break;
 		}
+		if (FD_ISSET(httpd->wakeup_rfd, &rfds)) {
+			netutils_clear_wakeup(httpd->wakeup_rfd);
+			httpd_complete_requests(httpd);
+			continue;
+		}
 
 		if (httpd->open_connections < httpd->max_connections &&
 		    httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
@@ -266,87 +936,43 @@ httpd_thread(void *arg)
 		for (i=0; i<httpd->max_connections; i++) {
 			http_connection_t *connection = &httpd->connections[i];
 
-			if (!connection->connected) {
+			if (!connection->connected || connection->busy) {
 				continue;
 			}
 			if (!FD_ISSET(connection->socket_fd, &rfds)) {
 				continue;
 			}
-
-			/* If not in the middle of request, allocate one */
-			if (!connection->request) {
-				connection->request = http_request_init();
-				assert(connection->request);
-			}
-
-			logger_log(httpd->logger, LOGGER_DEBUG, "Receiving on socket %d", connection->socket_fd);
-			ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
-			if (ret == 0) {
-				logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
-				httpd_remove_connection(httpd, connection);
-				continue;
-			}
-
-			/* Parse HTTP request from data read from connection */
-			http_request_add_data(connection->request, buffer, ret);
-			if (http_request_has_error(connection->request)) {
-				logger_log(httpd->logger, LOGGER_INFO, "Error in parsing: %s", http_request_get_error_name(connection->request));
-				httpd_remove_connection(httpd, connection);
-				continue;
-			}
-
-			/* If request is finished, process and deallocate */
-			if (http_request_is_complete(connection->request)) {
-				http_response_t *response = NULL;
-
-				httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
-				http_request_destroy(connection->request);
-				connection->request = NULL;
-
-				if (response) {
-					const char *data;
-					int datalen;
-					int written;
-					int ret;
-
-					/* Get response data and datalen */
-					data = http_response_get_data(response, &datalen);
-
-					written = 0;
-					while (written < datalen) {
-						ret = send(connection->socket_fd, data+written, datalen-written, 0);
-						if (ret == -1) {
-							/* FIXME: Error happened */
-							logger_log(httpd->logger, LOGGER_INFO, "Error in sending data");
-							break;
-						}
-						written += ret;
-					}
-
-					if (http_response_get_disconnect(response)) {
-						logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
-						httpd_remove_connection(httpd, connection);
-					}
-				} else {
-					logger_log(httpd->logger, LOGGER_INFO, "Didn't get response");
-				}
-				http_response_destroy(response);
-			} else {
-				logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
-			}
+			httpd_process_connection(httpd, connection);
 		}
 	}
+}
 
-	/* Remove all connections that are still connected */
-	for (i=0; i<httpd->max_connections; i++) {
-		http_connection_t *connection = &httpd->connections[i];
+static THREAD_RETVAL
+httpd_thread(void *arg)
+{
+	httpd_t *httpd = arg;
 
-		if (!connection->connected) {
-			continue;
-		}
-		logger_log(httpd->logger, LOGGER_INFO, "Removing connection for socket %d", connection->socket_fd);
-		httpd_remove_connection(httpd, connection);
+	assert(httpd);
+
+	httpd->wheel_time = httpd_get_time();
+	httpd_start_workers(httpd);
+#if USE_EPOLL
+	if (httpd_loop_epoll(httpd) < 0) {
+		httpd_loop_select(httpd);
+	}
+#else
+	httpd_loop_select(httpd);
+#endif
+
+	/* Workers may still use the connections until they are joined */
+	httpd_stop_workers(httpd);
+	httpd_remove_all_connections(httpd);
+#if USE_EPOLL
+	if (httpd->epfd != -1) {
+		close(httpd->epfd);
+		httpd->epfd = -1;
 	}
+#endif
 
 	/* Close server sockets since they are not used any more */
 	if (httpd->server_fd4 != -1) {
@@ -374,6 +1000,11 @@ httpd_start(httpd_t *httpd, unsigned short *port)
 	assert(httpd);
 	assert(port);
 
+	/* Let bursts of clients queue up when many are allowed */
+	if (httpd->max_connections > backlog) {
+		backlog = (httpd->max_connections < SOMAXCONN) ? httpd->max_connections : SOMAXCONN;
+	}
+
 	MUTEX_LOCK(httpd->run_mutex);
 	if (httpd->running || !httpd->joined) {
 		MUTEX_UNLOCK(httpd->run_mutex);
@@ -443,6 +1074,7 @@ httpd_stop(httpd_t *httpd)
 	}
 	httpd->running = 0;
 	MUTEX_UNLOCK(httpd->run_mutex);
+	netutils_signal_wakeup(httpd->wakeup_wfd);
 
 	THREAD_JOIN(httpd->thread);
 
@@ -26,12 +26,26 @@ struct httpd_callbacks_s {
 	void* (*conn_init)(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen);
 	void  (*conn_request)(void *ptr, http_request_t *request, http_response_t **response);
 	void  (*conn_destroy)(void *ptr);
+
+	/* Optional, returns non-zero if an idle connection may be closed */
+	int   (*conn_idle)(void *ptr);
+
+	/* Optional, returns non-zero if the request is slow to handle and
+	 * should go to a worker thread, by default all of them do */
+	int   (*conn_offload)(void *ptr, http_request_t *request);
 };
 typedef struct httpd_callbacks_s httpd_callbacks_t;
 
 
 httpd_t *httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections);
 
+/* Closes connections without traffic for this long, 0 never does */
+void httpd_set_idle_timeout(httpd_t *httpd, int seconds);
+
+/* Handles complete requests in this many threads so that slow ones do
+ * not hold up other connections, 0 handles them in the HTTP thread */
+void httpd_set_workers(httpd_t *httpd, int workers);
+
 int httpd_is_running(httpd_t *httpd);
 
 int httpd_start(httpd_t *httpd, unsigned short *port);
@@ -18,35 +18,86 @@
 #include <assert.h>
 
 #include "logger.h"
+#include "netutils.h"
 #include "compat.h"
 
+/* Number of queued messages, a power of two, and the longest message */
+#define LOGGER_QUEUE_LEN 64
+#define LOGGER_MESSAGE_LEN 4096
+
+typedef struct {
+	/* Queue position this slot is ready for, see logger_log_message */
+	unsigned int sequence;
+	int level;
+	char message[LOGGER_MESSAGE_LEN];
+} logger_slot_t;
+
 struct logger_s {
-	mutex_handle_t lvl_mutex;
 	mutex_handle_t cb_mutex;
 
 	int level;
 	void *cls;
 	logger_callback_t callback;
+
+	/* Bounded queue with any thread as a producer and the delivery thread
+	 * as the only consumer. A slot whose sequence equals the head is free
+	 * to fill, one whose sequence is the tail plus one holds a message */
+	logger_slot_t slots[LOGGER_QUEUE_LEN];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+
+	/* Delivery thread, it sleeps on the wakeup fd while the queue is empty */
+	int async;
+	int running;
+	int sleeping;
+	int wakeup_rfd;
+	int wakeup_wfd;
+	thread_handle_t thread;
 };
 
+static THREAD_RETVAL logger_thread(void *arg);
+
 logger_t *
 logger_init()
 {
 	logger_t *logger = calloc(1, sizeof(logger_t));
+	unsigned int i;
 	assert(logger);
 
-	MUTEX_CREATE(logger->lvl_mutex);
 	MUTEX_CREATE(logger->cb_mutex);
 
 	logger->level = LOGGER_WARNING;
 	logger->callback = NULL;
+
+	for (i=0; i<LOGGER_QUEUE_LEN; i++) {
+		logger->slots[i].sequence = i;
+	}
+
+	/* Without a wakeup fd or a thread the messages are delivered by the caller */
+	if (netutils_init_wakeup(&logger->wakeup_rfd, &logger->wakeup_wfd) == 0) {
+		logger->running = 1;
+		THREAD_CREATE(logger->thread, logger_thread, logger);
+		if (logger->thread) {
+			logger->async = 1;
+		} else {
+			logger->running = 0;
+			netutils_close_wakeup(logger->wakeup_rfd, logger->wakeup_wfd);
+		}
+	}
 	return logger;
 }
 
 void
 logger_destroy(logger_t *logger)
 {
-	MUTEX_DESTROY(logger->lvl_mutex);
+	if (logger->async) {
+		/* The thread delivers everything queued before it exits */
+		ATOMIC_STORE(&logger->running, 0);
+		netutils_signal_wakeup(logger->wakeup_wfd);
+		THREAD_JOIN(logger->thread);
+		netutils_close_wakeup(logger->wakeup_rfd, logger->wakeup_wfd);
+	}
 	MUTEX_DESTROY(logger->cb_mutex);
 	free(logger);
 }
@@ -56,9 +107,7 @@ logger_set_level(logger_t *logger, int level)
 {
 	assert(logger);
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	logger->level = level;
-	MUTEX_UNLOCK(logger->lvl_mutex);
+	ATOMIC_STORE_RELAXED(&logger->level, level);
 }
 
 void
@@ -102,38 +151,138 @@ logger_utf8_to_local(const char *str)
 	return ret;
 }
 
-void
-logger_log(logger_t *logger, int level, const char *fmt, ...)
+static void
+logger_deliver(logger_t *logger, int level, const char *message)
 {
-	char buffer[4096];
-	va_list ap;
-
-	MUTEX_LOCK(logger->lvl_mutex);
-	if (level > logger->level) {
-		MUTEX_UNLOCK(logger->lvl_mutex);
-		return;
-	}
-	MUTEX_UNLOCK(logger->lvl_mutex);
-
-	buffer[sizeof(buffer)-1] = '\0';
-	va_start(ap, fmt);
-	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
-	va_end(ap);
-
 	MUTEX_LOCK(logger->cb_mutex);
 	if (logger->callback) {
-		logger->callback(logger->cls, level, buffer);
+		logger->callback(logger->cls, level, message);
 		MUTEX_UNLOCK(logger->cb_mutex);
 	} else {
 		char *local;
 		MUTEX_UNLOCK(logger->cb_mutex);
-		local = logger_utf8_to_local(buffer);
+		local = logger_utf8_to_local(message);
 		if (local) {
 			fprintf(stderr, "%s\n", local);
 			free(local);
 		} else {
-			fprintf(stderr, "%s\n", buffer);
+			fprintf(stderr, "%s\n", message);
 		}
 	}
 }
 
+/* Delivers all queued messages, returns 1 if the queue was not empty */
+static int
+logger_drain(logger_t *logger)
+{
+	int delivered = 0;
+
+	while (1) {
+		logger_slot_t *slot = &logger->slots[logger->tail & (LOGGER_QUEUE_LEN-1)];
+
+		if (ATOMIC_LOAD(&slot->sequence) != logger->tail+1) {
+			break;
+		}
+		logger_deliver(logger, slot->level, slot->message);
+
+		/* Hand the slot back to the producers for the next round */
+		ATOMIC_STORE(&slot->sequence, logger->tail+LOGGER_QUEUE_LEN);
+		logger->tail++;
+		delivered = 1;
+	}
+	return delivered;
+}
+
+static THREAD_RETVAL
+logger_thread(void *arg)
+{
+	logger_t *logger = arg;
+	unsigned int reported = 0;
+
+	while (1) {
+		int running = ATOMIC_LOAD(&logger->running);
+		unsigned int dropped;
+		fd_set rfds;
+
+		logger_drain(logger);
+		dropped = ATOMIC_LOAD(&logger->dropped);
+		if (dropped != reported && LOGGER_WARNING <= ATOMIC_LOAD_RELAXED(&logger->level)) {
+			char message[64];
+
+			snprintf(message, sizeof(message), "Dropped %u log messages, the queue was full",
+			         dropped - reported);
+			logger_deliver(logger, LOGGER_WARNING, message);
+		}
+		reported = dropped;
+		if (!running) {
+			break;
+		}
+
+		/* Announce that we sleep before checking the queue once more, a
+		 * producer either sees the flag or its message is seen here */
+		ATOMIC_STORE(&logger->sleeping, 1);
+		ATOMIC_FENCE();
+		if (logger_drain(logger) || !ATOMIC_LOAD(&logger->running)) {
+			ATOMIC_STORE(&logger->sleeping, 0);
+			continue;
+		}
+		FD_ZERO(&rfds);
+		FD_SET(logger->wakeup_rfd, &rfds);
+		select(logger->wakeup_rfd+1, &rfds, NULL, NULL, NULL);
+		netutils_clear_wakeup(logger->wakeup_rfd);
+		ATOMIC_STORE(&logger->sleeping, 0);
+	}
+	return 0;
+}
+
+void
+logger_log_message(logger_t *logger, int level, const char *fmt, ...)
+{
+	logger_slot_t *slot;
+	unsigned int pos;
+	va_list ap;
+
+	if (level > ATOMIC_LOAD_RELAXED(&logger->level)) {
+		return;
+	}
+
+	if (!logger->async) {
+		char buffer[LOGGER_MESSAGE_LEN];
+
+		va_start(ap, fmt);
+		vsnprintf(buffer, sizeof(buffer), fmt, ap);
+		va_end(ap);
+		logger_deliver(logger, level, buffer);
+		return;
+	}
+
+	/* Claim the slot at the head, or drop the message if the queue is full */
+	pos = ATOMIC_LOAD_RELAXED(&logger->head);
+	while (1) {
+		int diff;
+
+		slot = &logger->slots[pos & (LOGGER_QUEUE_LEN-1)];
+		diff = (int)(ATOMIC_LOAD(&slot->sequence) - pos);
+		if (diff == 0) {
+			if (ATOMIC_CAS(&logger->head, pos, pos+1)) {
+				break;
+			}
+		} else if (diff < 0) {
+			ATOMIC_ADD(&logger->dropped, 1);
+			return;
+		}
+		pos = ATOMIC_LOAD_RELAXED(&logger->head);
+	}
+
+	/* Format straight into the slot and publish it */
+	slot->level = level;
+	va_start(ap, fmt);
+	vsnprintf(slot->message, sizeof(slot->message), fmt, ap);
+	va_end(ap);
+	ATOMIC_STORE(&slot->sequence, pos+1);
+
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD_RELAXED(&logger->sleeping)) {
+		netutils_signal_wakeup(logger->wakeup_wfd);
+	}
+}
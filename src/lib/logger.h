@@ -35,6 +35,17 @@ void logger_destroy(logger_t *logger);
 void logger_set_level(logger_t *logger, int level);
 void logger_set_callback(logger_t *logger, logger_callback_t callback, void *cls);
 
-void logger_log(logger_t *logger, int level, const char *fmt, ...);
+/* Messages above this level are compiled out, set with --with-log-level */
+#ifndef LOGGER_MAX_LEVEL
+# define LOGGER_MAX_LEVEL LOGGER_DEBUG
+#endif
+
+/* Formats the message into a queue, it is delivered to the callback
+ * by a background thread. Messages are dropped if the queue is full */
+#define logger_log(logger, level, ...) do { \
+	if ((level) <= LOGGER_MAX_LEVEL) logger_log_message((logger), (level), __VA_ARGS__); \
+	} while (0)
+
+void logger_log_message(logger_t *logger, int level, const char *fmt, ...);
 
 #endif
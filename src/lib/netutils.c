@@ -12,10 +12,20 @@
  *  Lesser General Public License for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#if defined(HAVE_SYS_EVENTFD_H)
+# include <sys/eventfd.h>
+#elif !defined(WIN32)
+# include <fcntl.h>
+#endif
+
 #include "compat.h"
 
 int
@@ -200,3 +210,112 @@ netutils_parse_address(int family, const char *src, void *dst, int dstlen)
 	freeaddrinfo(result);
 	return length;
 }
+
+int
+netutils_init_wakeup(int *rfd, int *wfd)
+{
+#if defined(WIN32)
+	/* Only sockets can be selected, use a UDP socket connected to itself */
+	struct sockaddr_in saddr;
+	socklen_t socklen;
+	u_long nonblocking = 1;
+	int fd;
+
+	assert(rfd);
+	assert(wfd);
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd == -1) {
+		return -1;
+	}
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen = sizeof(saddr);
+	if (bind(fd, (struct sockaddr *)&saddr, sizeof(saddr)) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&saddr, &socklen) == -1 ||
+	    connect(fd, (struct sockaddr *)&saddr, socklen) == -1 ||
+	    ioctlsocket(fd, FIONBIO, &nonblocking) == -1) {
+		closesocket(fd);
+		return -1;
+	}
+	*rfd = *wfd = fd;
+	return 0;
+#elif defined(HAVE_SYS_EVENTFD_H)
+	int fd;
+
+	assert(rfd);
+	assert(wfd);
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	*rfd = *wfd = fd;
+	return 0;
+#else
+	int fds[2];
+	int i;
+
+	assert(rfd);
+	assert(wfd);
+
+	if (pipe(fds) == -1) {
+		return -1;
+	}
+	for (i=0; i<2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	*rfd = fds[0];
+	*wfd = fds[1];
+	return 0;
+#endif
+}
+
+void
+netutils_signal_wakeup(int wfd)
+{
+#if defined(WIN32)
+	char value = 1;
+	send(wfd, &value, sizeof(value), 0);
+#elif defined(HAVE_SYS_EVENTFD_H)
+	eventfd_t value = 1;
+	if (write(wfd, &value, sizeof(value)) == -1) {
+		/* Counter is already non-zero, nothing to do */
+	}
+#else
+	char value = 1;
+	if (write(wfd, &value, sizeof(value)) == -1) {
+		/* Pipe is already full, nothing to do */
+	}
+#endif
+}
+
+void
+netutils_clear_wakeup(int rfd)
+{
+#if defined(WIN32)
+	char buffer[16];
+	while (recv(rfd, buffer, sizeof(buffer), 0) > 0);
+#elif defined(HAVE_SYS_EVENTFD_H)
+	eventfd_t value;
+	if (read(rfd, &value, sizeof(value)) == -1) {
+		/* Nothing signaled */
+	}
+#else
+	char buffer[16];
+	while (read(rfd, buffer, sizeof(buffer)) > 0);
+#endif
+}
+
+void
+netutils_close_wakeup(int rfd, int wfd)
+{
+	if (rfd != -1) {
+		closesocket(rfd);
+	}
+	if (wfd != -1 && wfd != rfd) {
+		closesocket(wfd);
+	}
+}
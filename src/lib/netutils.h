@@ -22,4 +22,11 @@ int netutils_init_socket(unsigned short *port, int use_ipv6, int use_udp);
 unsigned char *netutils_get_address(void *sockaddr, int *length);
 int netutils_parse_address(int family, const char *src, void *dst, int dstlen);
 
+/* Descriptors for waking up a thread blocked in select or epoll, the
+ * read and write descriptors may be the same */
+int netutils_init_wakeup(int *rfd, int *wfd);
+void netutils_signal_wakeup(int wfd);
+void netutils_clear_wakeup(int rfd);
+void netutils_close_wakeup(int rfd, int wfd);
+
 #endif
@@ -12,6 +12,10 @@
  *  Lesser General Public License for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,6 +23,7 @@
 
 #include "raop.h"
 #include "raop_rtp.h"
+#include "raop_buffer.h"
 #include "pairing.h"
 #include "rsakey.h"
 #include "digest.h"
@@ -31,6 +36,8 @@
 #include "netutils.h"
 #include "logger.h"
 #include "compat.h"
+#include "threads.h"
+#include "trace.h"
 
 /* Actually 345 bytes for 2048-bit key */
 #define MAX_SIGNATURE_LEN 512
@@ -41,6 +48,12 @@
 /* MD5 as hex fits here */
 #define MAX_NONCE_LEN 32
 
+/* Connections without an audio session are closed after this idle time */
+#define RAOP_IDLE_TIMEOUT 60
+
+/* Threads for the handlers, signing and key exchange take milliseconds */
+#define RAOP_HANDLER_THREADS 4
+
 struct raop_s {
 	/* Callbacks for audio */
 	raop_callbacks_t callbacks;
@@ -59,6 +72,26 @@ struct raop_s {
 
 	/* Password information */
 	char password[MAX_PASSWORD_LEN+1];
+
+	/* Jitter buffer length limits in frames */
+	int buffer_min_length;
+	int buffer_max_length;
+
+	/* Resample the audio to follow the local clock */
+	int drift_compensation;
+
+	/* Synthesize lost frames instead of silence */
+	int loss_concealment;
+
+	/* Open connections for the session statistics, the first num_conns
+	 * entries are used and each connection knows its own index */
+	mutex_handle_t conns_mutex;
+	struct raop_conn_s **conns;
+	int num_conns;
+	int max_conns;
+
+	/* Latency histograms of the sessions already destroyed */
+	raop_histogram_t latency[RAOP_LATENCY_STAGES];
 };
 
 struct raop_conn_s {
@@ -73,10 +106,38 @@ struct raop_conn_s {
 	unsigned char *remote;
 	int remotelen;
 
+	/* Index in raop->conns, -1 if not listed */
+	int conns_index;
+
 	char nonce[MAX_NONCE_LEN+1];
 };
 typedef struct raop_conn_s raop_conn_t;
 
+/* Replaces the RTP session, statistics readers never see a destroyed one.
+ * The latency histograms of the old session are kept in the totals */
+static void
+conn_set_raop_rtp(raop_conn_t *conn, raop_rtp_t *raop_rtp)
+{
+	raop_t *raop = conn->raop;
+	raop_rtp_t *old_rtp = conn->raop_rtp;
+	int i;
+
+	if (old_rtp) {
+		raop_rtp_stop(old_rtp);
+	}
+	MUTEX_LOCK(raop->conns_mutex);
+	if (old_rtp) {
+		for (i=0; i<RAOP_LATENCY_STAGES; i++) {
+			raop_rtp_merge_latency(old_rtp, i, &raop->latency[i]);
+		}
+	}
+	conn->raop_rtp = raop_rtp;
+	MUTEX_UNLOCK(raop->conns_mutex);
+	if (old_rtp) {
+		raop_rtp_destroy(old_rtp);
+	}
+}
+
 #include "raop_handlers.h"
 
 static void *
@@ -138,6 +199,14 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
 	conn->remotelen = remotelen;
 
 	digest_generate_nonce(conn->nonce, sizeof(conn->nonce));
+
+	MUTEX_LOCK(raop->conns_mutex);
+	conn->conns_index = -1;
+	if (raop->num_conns < raop->max_conns) {
+		conn->conns_index = raop->num_conns;
+		raop->conns[raop->num_conns++] = conn;
+	}
+	MUTEX_UNLOCK(raop->conns_mutex);
 	return conn;
 }
 
@@ -219,6 +288,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "Got response: %s", signature);
 	}
 
+	TRACE3(rtsp_request, conn, method, url);
 	logger_log(conn->raop->logger, LOGGER_DEBUG, "Handling request %s with URL %s", method, url);
 	raop_handler_t handler = NULL;
 	if (require_auth) {
@@ -260,9 +330,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
 		http_response_add_header(*response, "Connection", "close");
 		if (conn->raop_rtp) {
 			/* Destroy our RTP session */
-			raop_rtp_stop(conn->raop_rtp);
-			raop_rtp_destroy(conn->raop_rtp);
-			conn->raop_rtp = NULL;
+			conn_set_raop_rtp(conn, NULL);
 		}
 	}
 	if (handler != NULL) {
@@ -280,11 +348,21 @@ static void
 conn_destroy(void *ptr)
 {
 	raop_conn_t *conn = ptr;
+	raop_t *raop = conn->raop;
 
-	if (conn->raop_rtp) {
-		/* This is done in case TEARDOWN was not called */
-		raop_rtp_destroy(conn->raop_rtp);
+	/* Move the last connection into the freed index */
+	MUTEX_LOCK(raop->conns_mutex);
+	if (conn->conns_index >= 0) {
+		raop_conn_t *last = raop->conns[--raop->num_conns];
+
+		raop->conns[conn->conns_index] = last;
+		last->conns_index = conn->conns_index;
+		raop->conns[raop->num_conns] = NULL;
 	}
+	MUTEX_UNLOCK(raop->conns_mutex);
+
+	/* This is done in case TEARDOWN was not called */
+	conn_set_raop_rtp(conn, NULL);
 	free(conn->local);
 	free(conn->remote);
 	pairing_session_destroy(conn->pairing);
@@ -292,6 +370,36 @@ conn_destroy(void *ptr)
 	free(conn);
 }
 
+static int
+conn_idle(void *ptr)
+{
+	raop_conn_t *conn = ptr;
+
+	/* Senders keep the connection quiet while streaming */
+	return conn->raop_rtp == NULL;
+}
+
+static int
+conn_offload(void *ptr, http_request_t *request)
+{
+	const char *method = http_request_get_method(request);
+	const char *url = http_request_get_url(request);
+
+	/* Decided by the request alone, not the connection */
+	(void)ptr;
+
+	/* Signing, RSA decryption and the key exchanges */
+	if (http_request_get_header(request, "Apple-Challenge")) {
+		return 1;
+	} else if (method && !strcmp(method, "ANNOUNCE")) {
+		return 1;
+	} else if (method && url && !strcmp(method, "POST") &&
+	           (!strcmp(url, "/pair-verify") || !strcmp(url, "/fp-setup"))) {
+		return 1;
+	}
+	return 0;
+}
+
 raop_t *
 raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int *error)
 {
@@ -303,7 +411,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 
 	assert(callbacks);
 	assert(max_clients > 0);
-	assert(max_clients < 100);
+	assert(max_clients <= 65536);
 	assert(pemkey);
 
 	/* Initialize the network */
@@ -313,7 +421,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 
 	/* Validate the callbacks structure */
 	if (!callbacks->audio_init ||
-	    !callbacks->audio_process ||
+	    (!callbacks->audio_process && !callbacks->audio_process_timed) ||
 	    !callbacks->audio_destroy) {
 		return NULL;
 	}
@@ -327,8 +435,20 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	/* Initialize the logger */
 	raop->logger = logger_init();
 
+	raop->conns = calloc(max_clients, sizeof(raop_conn_t *));
+	if (!raop->conns) {
+		logger_destroy(raop->logger);
+		free(raop);
+		return NULL;
+	}
+	raop->max_conns = max_clients;
+	MUTEX_CREATE(raop->conns_mutex);
+
 	pairing = pairing_init_generate();
 	if (!pairing) {
+		MUTEX_DESTROY(raop->conns_mutex);
+		free(raop->conns);
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
@@ -339,14 +459,21 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	httpd_cbs.conn_init = &conn_init;
 	httpd_cbs.conn_request = &conn_request;
 	httpd_cbs.conn_destroy = &conn_destroy;
+	httpd_cbs.conn_idle = &conn_idle;
+	httpd_cbs.conn_offload = &conn_offload;
 
 	/* Initialize the http daemon */
 	httpd = httpd_init(raop->logger, &httpd_cbs, max_clients);
 	if (!httpd) {
 		pairing_destroy(pairing);
+		MUTEX_DESTROY(raop->conns_mutex);
+		free(raop->conns);
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
+	httpd_set_idle_timeout(httpd, RAOP_IDLE_TIMEOUT);
+	httpd_set_workers(httpd, (max_clients < RAOP_HANDLER_THREADS) ? max_clients : RAOP_HANDLER_THREADS);
 
 	/* Copy callbacks structure */
 	memcpy(&raop->callbacks, callbacks, sizeof(raop_callbacks_t));
@@ -356,6 +483,9 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	if (!rsakey) {
 		pairing_destroy(pairing);
 		httpd_destroy(httpd);
+		MUTEX_DESTROY(raop->conns_mutex);
+		free(raop->conns);
+		logger_destroy(raop->logger);
 		free(raop);
 		return NULL;
 	}
@@ -363,6 +493,8 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char *pemkey, int
 	raop->pairing = pairing;
 	raop->httpd = httpd;
 	raop->rsakey = rsakey;
+	raop->buffer_min_length = RAOP_BUFFER_LENGTH;
+	raop->buffer_max_length = RAOP_BUFFER_LENGTH;
 
 	return raop;
 }
@@ -391,6 +523,8 @@ raop_destroy(raop_t *raop)
 		httpd_destroy(raop->httpd);
 		rsakey_destroy(raop->rsakey);
 		logger_destroy(raop->logger);
+		MUTEX_DESTROY(raop->conns_mutex);
+		free(raop->conns);
 		free(raop);
 
 		/* Cleanup the network */
@@ -422,6 +556,33 @@ raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls)
 	logger_set_callback(raop->logger, callback, cls);
 }
 
+void
+raop_set_buffer_length(raop_t *raop, int min_length, int max_length)
+{
+	assert(raop);
+	assert(min_length > 0);
+	assert(max_length >= min_length);
+
+	raop->buffer_min_length = min_length;
+	raop->buffer_max_length = max_length;
+}
+
+void
+raop_set_drift_compensation(raop_t *raop, int enabled)
+{
+	assert(raop);
+
+	raop->drift_compensation = !!enabled;
+}
+
+void
+raop_set_loss_concealment(raop_t *raop, int enabled)
+{
+	assert(raop);
+
+	raop->loss_concealment = !!enabled;
+}
+
 int
 raop_start(raop_t *raop, unsigned short *port, const char *hwaddr, int hwaddrlen, const char *password)
 {
@@ -460,3 +621,93 @@ raop_stop(raop_t *raop)
 	httpd_stop(raop->httpd);
 }
 
+
+int
+raop_get_session_stats(raop_t *raop, raop_session_stats_t *stats, int max_sessions)
+{
+	raop_stats_t snapshot;
+	raop_ntp_clock_t clock;
+	int i, count = 0;
+
+	assert(raop);
+	assert(stats || !max_sessions);
+
+	MUTEX_LOCK(raop->conns_mutex);
+	for (i=0; i<raop->num_conns && count<max_sessions; i++) {
+		raop_conn_t *conn = raop->conns[i];
+		raop_session_stats_t *session = &stats[count];
+		const unsigned char *remote;
+
+		if (!conn->raop_rtp) {
+			continue;
+		}
+		raop_rtp_get_stats(conn->raop_rtp, &snapshot);
+		raop_rtp_get_clock(conn->raop_rtp, &clock);
+
+		memset(session, 0, sizeof(raop_session_stats_t));
+		remote = conn->remote;
+		if (conn->remotelen == 4) {
+			snprintf(session->remote, sizeof(session->remote), "%d.%d.%d.%d",
+			         remote[0], remote[1], remote[2], remote[3]);
+		} else if (conn->remotelen == 16) {
+			snprintf(session->remote, sizeof(session->remote),
+			         "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x",
+			         remote[0], remote[1], remote[2], remote[3], remote[4], remote[5], remote[6], remote[7],
+			         remote[8], remote[9], remote[10], remote[11], remote[12], remote[13], remote[14], remote[15]);
+		}
+		session->packets_received = snapshot.packets_received;
+		session->packets_out_of_order = snapshot.packets_out_of_order;
+		session->packets_duplicate = snapshot.packets_duplicate;
+		session->packets_late = snapshot.packets_late;
+		session->resends_requested = snapshot.resends_requested;
+		session->resends_recovered = snapshot.resends_recovered;
+		session->resends_expired = snapshot.resends_expired;
+		session->frames_decoded = snapshot.frames_decoded;
+		session->frames_lost = snapshot.frames_lost;
+		session->frames_concealed = snapshot.frames_concealed;
+		session->buffer_depth = snapshot.buffer_depth;
+		session->buffer_length = snapshot.buffer_length;
+		session->jitter_usec = snapshot.jitter_usec;
+		session->decrypt_usec = snapshot.decrypt_usec;
+		session->decode_usec = snapshot.decode_usec;
+		session->clock_synchronized = clock.synchronized;
+		session->clock_offset_usec = (long long)((double)clock.offset * 1000000.0 / RAOP_NTP_SECOND);
+		session->clock_drift_ppm = clock.drift_ppm;
+		session->clock_delay_usec = RAOP_NTP_TO_USEC(clock.delay);
+		count++;
+	}
+	MUTEX_UNLOCK(raop->conns_mutex);
+	return count;
+}
+
+void
+raop_get_latency_histogram(raop_t *raop, int stage, raop_histogram_t *hist)
+{
+	int i;
+
+	assert(raop);
+	assert(hist);
+
+	memset(hist, 0, sizeof(raop_histogram_t));
+	if (stage < 0 || stage >= RAOP_LATENCY_STAGES) {
+		return;
+	}
+
+	MUTEX_LOCK(raop->conns_mutex);
+	raop_histogram_merge(hist, &raop->latency[stage]);
+	for (i=0; i<raop->num_conns; i++) {
+		raop_conn_t *conn = raop->conns[i];
+
+		if (conn->raop_rtp) {
+			raop_rtp_merge_latency(conn->raop_rtp, stage, hist);
+		}
+	}
+	MUTEX_UNLOCK(raop->conns_mutex);
+}
+
+unsigned long long
+raop_get_time(void)
+{
+	uint64_t now = raop_ntp_get_monotonic_time();
+	return RAOP_NTP_TO_USEC(now);
+}
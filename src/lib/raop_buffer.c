@@ -12,6 +12,10 @@
  *  Lesser General Public License for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -19,13 +23,29 @@
 
 #include "raop_buffer.h"
 #include "raop_rtp.h"
+#include "raop_conceal.h"
+#include "raop_ntp.h"
+#include "raop_stats.h"
+#include "raop_histogram.h"
 #include "utils.h"
+#include "trace.h"
 
 #include <stdint.h>
 #include "crypto/crypto.h"
 #include "alac/alac.h"
 
-#define RAOP_BUFFER_LENGTH 32
+/* Number of frames between adaptive length updates, about 1s of audio */
+#define RAOP_BUFFER_WINDOW 128
+
+/* Number of windows without losses before the buffer is shrunk */
+#define RAOP_BUFFER_SHRINK_WINDOWS 8
+
+/* Resend requests are retried after this interval, doubled each time */
+#define RAOP_BUFFER_RESEND_INTERVAL (RAOP_NTP_SECOND/40)
+#define RAOP_BUFFER_MAX_RESENDS 4
+
+/* Most ranges of lost packets asked for at once */
+#define RAOP_BUFFER_MAX_RESEND_RANGES 16
 
 typedef struct {
 	/* Packet available */
@@ -42,6 +62,19 @@ typedef struct {
 	int audio_buffer_size;
 	int audio_buffer_len;
 	void *audio_buffer;
+
+	/* Encrypted payload waiting for decoding */
+	int decoded;
+	int payload_size;
+	int payload_len;
+	void *payload;
+
+	/* Resend requests sent for a missing packet and when to retry */
+	int resend_requests;
+	uint64_t resend_time;
+
+	/* When the packet was stored, for the buffer wait histogram */
+	uint64_t queue_time;
 } raop_buffer_entry_t;
 
 struct raop_buffer_s {
@@ -49,21 +82,58 @@ struct raop_buffer_s {
 	unsigned char aeskey[RAOP_AESKEY_LEN];
 	unsigned char aesiv[RAOP_AESIV_LEN];
 
+	/* Decryption key schedule, only the IV changes per packet */
+	AES_CTX aes_ctx;
+
 	/* ALAC decoder */
 	ALACSpecificConfig alacConfig;
 	alac_file *alac;
 
+	/* Decode packets only when they are dequeued */
+	int lazy_decode;
+	unsigned int decodes_avoided;
+
+	/* Synthesizes lost frames when enabled, otherwise they are silent */
+	raop_conceal_t *conceal;
+
 	/* First and last seqnum */
 	int is_empty;
 	unsigned short first_seqnum;
 	unsigned short last_seqnum;
 
-	/* RTP buffer entries */
-	raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
+	/* RTP timestamp expected for the next dequeued frame */
+	unsigned int next_timestamp;
+
+	/* RTP buffer entries, capacity is a power of two */
+	int capacity;
+	raop_buffer_entry_t *entries;
+
+	/* Current length and the limits for adapting it */
+	int length;
+	int min_length;
+	int max_length;
+
+	/* Loss and reordering statistics for adapting the length */
+	unsigned int window_frames;
+	unsigned int window_losses;
+	unsigned int clean_windows;
+	int reorder_depth;
+
+	/* Statistics readable from other threads and the total decrypt
+	 * and decode times they are derived from */
+	raop_stats_t stats;
+	uint64_t decrypt_time;
+	uint64_t decode_time;
+
+	/* Latency histograms of the stages, filled by the RTP thread */
+	raop_histogram_t latency[RAOP_LATENCY_STAGES];
 
 	/* Buffer of all audio buffers */
 	int buffer_size;
 	void *buffer;
+
+	/* Buffer of all payload buffers */
+	void *payload_buffer;
 };
 
 
@@ -102,10 +172,11 @@ get_fmtp_info(ALACSpecificConfig *config, const char *fmtp)
 	config->sampleRate = intarr[11];
 
 	/* Validate supported audio types */
-	if (config->bitDepth != 16) {
+	if (config->bitDepth != 16 && config->bitDepth != 20 &&
+	    config->bitDepth != 24 && config->bitDepth != 32) {
 		return -2;
 	}
-	if (config->numChannels != 2) {
+	if (config->numChannels < 1 || config->numChannels > 8) {
 		return -3;
 	}
 
@@ -149,10 +220,14 @@ raop_buffer_t *
 raop_buffer_init(const char *rtpmap,
                  const char *fmtp,
                  const unsigned char *aeskey,
-                 const unsigned char *aesiv)
+                 const unsigned char *aesiv,
+                 int min_length,
+                 int max_length,
+                 int min_latency)
 {
 	raop_buffer_t *raop_buffer;
 	int audio_buffer_size;
+	int payload_size;
 	ALACSpecificConfig *alacConfig;
 	int i;
 
@@ -168,34 +243,84 @@ raop_buffer_init(const char *rtpmap,
 
 	/* Parse fmtp information */
 	alacConfig = &raop_buffer->alacConfig;
-	if (get_fmtp_info(alacConfig, fmtp) < 0) {
+	if (get_fmtp_info(alacConfig, fmtp) < 0 || !alacConfig->frameLength) {
+		free(raop_buffer);
+		return NULL;
+	}
+
+	/* Make sure the buffer covers the latency requested by the sender */
+	if (min_length < 1) {
+		min_length = 1;
+	}
+	if (min_latency > 0) {
+		int latency_frames = (min_latency+alacConfig->frameLength-1) / alacConfig->frameLength;
+		if (min_length < latency_frames) {
+			min_length = latency_frames;
+		}
+	}
+	if (min_length > RAOP_BUFFER_MAX_LENGTH) {
+		min_length = RAOP_BUFFER_MAX_LENGTH;
+	}
+	if (max_length < min_length) {
+		max_length = min_length;
+	} else if (max_length > RAOP_BUFFER_MAX_LENGTH) {
+		max_length = RAOP_BUFFER_MAX_LENGTH;
+	}
+	raop_buffer->min_length = min_length;
+	raop_buffer->max_length = max_length;
+	raop_buffer->length = min_length;
+	raop_buffer->stats.buffer_length = min_length;
+
+	/* Allocate all entries the buffer can grow to, seqnums wrap at 2^16 */
+	raop_buffer->capacity = 1;
+	while (raop_buffer->capacity < max_length) {
+		raop_buffer->capacity *= 2;
+	}
+	raop_buffer->entries = calloc(raop_buffer->capacity, sizeof(raop_buffer_entry_t));
+	if (!raop_buffer->entries) {
 		free(raop_buffer);
 		return NULL;
 	}
 
-	/* Allocate the output audio buffers */
+	/* Allocate the output audio buffers, 20-bit samples take 24 bits */
 	audio_buffer_size = alacConfig->frameLength *
 	                    alacConfig->numChannels *
-	                    alacConfig->bitDepth/8;
+	                    ((alacConfig->bitDepth+7)/8);
 	raop_buffer->buffer_size = audio_buffer_size *
-	                           RAOP_BUFFER_LENGTH;
+	                           raop_buffer->capacity;
 	raop_buffer->buffer = malloc(raop_buffer->buffer_size);
 	if (!raop_buffer->buffer) {
+		free(raop_buffer->entries);
+		free(raop_buffer);
+		return NULL;
+	}
+
+	/* Compressed frames never exceed the uncompressed size and header */
+	payload_size = audio_buffer_size + 16;
+	raop_buffer->payload_buffer = malloc(payload_size * raop_buffer->capacity);
+	if (!raop_buffer->payload_buffer) {
+		free(raop_buffer->buffer);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 		return NULL;
 	}
-	for (i=0; i<RAOP_BUFFER_LENGTH; i++) {
+	for (i=0; i<raop_buffer->capacity; i++) {
 		raop_buffer_entry_t *entry = &raop_buffer->entries[i];
 		entry->audio_buffer_size = audio_buffer_size;
 		entry->audio_buffer_len = 0;
 		entry->audio_buffer = (char *)raop_buffer->buffer+i*audio_buffer_size;
+		entry->payload_size = payload_size;
+		entry->payload_len = 0;
+		entry->payload = (char *)raop_buffer->payload_buffer+i*payload_size;
 	}
 
 	/* Initialize ALAC decoder */
 	raop_buffer->alac = alac_create(alacConfig->bitDepth,
 	                                alacConfig->numChannels);
 	if (!raop_buffer->alac) {
+		free(raop_buffer->payload_buffer);
 		free(raop_buffer->buffer);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 		return NULL;
 	}
@@ -205,6 +330,10 @@ raop_buffer_init(const char *rtpmap,
 	memcpy(raop_buffer->aeskey, aeskey, RAOP_AESKEY_LEN);
 	memcpy(raop_buffer->aesiv, aesiv, RAOP_AESIV_LEN);
 
+	/* Expand the decryption key schedule once for the session */
+	AES_set_key(&raop_buffer->aes_ctx, aeskey, aesiv, AES_MODE_128);
+	AES_convert_key(&raop_buffer->aes_ctx);
+
 	/* Mark buffer as empty */
 	raop_buffer->is_empty = 1;
 	return raop_buffer;
@@ -214,8 +343,11 @@ void
 raop_buffer_destroy(raop_buffer_t *raop_buffer)
 {
 	if (raop_buffer) {
+		raop_conceal_destroy(raop_buffer->conceal);
 		alac_free(raop_buffer->alac);
+		free(raop_buffer->payload_buffer);
 		free(raop_buffer->buffer);
+		free(raop_buffer->entries);
 		free(raop_buffer);
 	}
 }
@@ -228,28 +360,202 @@ raop_buffer_get_config(raop_buffer_t *raop_buffer)
 	return &raop_buffer->alacConfig;
 }
 
+int
+raop_buffer_get_output_bits(raop_buffer_t *raop_buffer)
+{
+	assert(raop_buffer);
+
+	return (raop_buffer->alacConfig.bitDepth+7)/8*8;
+}
+
+void
+raop_buffer_set_lazy_decode(raop_buffer_t *raop_buffer, int lazy_decode)
+{
+	assert(raop_buffer);
+
+	raop_buffer->lazy_decode = !!lazy_decode;
+}
+
+unsigned int
+raop_buffer_get_decodes_avoided(raop_buffer_t *raop_buffer)
+{
+	assert(raop_buffer);
+
+	return raop_buffer->decodes_avoided;
+}
+
+int
+raop_buffer_set_loss_concealment(raop_buffer_t *raop_buffer, int enabled)
+{
+	assert(raop_buffer);
+
+	if (enabled && !raop_buffer->conceal) {
+		raop_buffer->conceal = raop_conceal_init(raop_buffer->alacConfig.numChannels,
+		                                         raop_buffer_get_output_bits(raop_buffer),
+		                                         raop_buffer->alacConfig.frameLength);
+		if (!raop_buffer->conceal) {
+			return -1;
+		}
+	} else if (!enabled) {
+		raop_conceal_destroy(raop_buffer->conceal);
+		raop_buffer->conceal = NULL;
+	}
+	return 0;
+}
+
+raop_stats_t *
+raop_buffer_get_stats(raop_buffer_t *raop_buffer)
+{
+	assert(raop_buffer);
+
+	return &raop_buffer->stats;
+}
+
+/* Copies the statistics, safe to call from any thread */
+void
+raop_buffer_read_stats(raop_buffer_t *raop_buffer, raop_stats_t *snapshot)
+{
+	raop_stats_t *stats;
+
+	assert(raop_buffer);
+	assert(snapshot);
+
+	stats = &raop_buffer->stats;
+	snapshot->packets_received = RAOP_STATS_GET(stats, packets_received);
+	snapshot->packets_out_of_order = RAOP_STATS_GET(stats, packets_out_of_order);
+	snapshot->packets_duplicate = RAOP_STATS_GET(stats, packets_duplicate);
+	snapshot->packets_late = RAOP_STATS_GET(stats, packets_late);
+	snapshot->resends_requested = RAOP_STATS_GET(stats, resends_requested);
+	snapshot->resends_recovered = RAOP_STATS_GET(stats, resends_recovered);
+	snapshot->resends_expired = RAOP_STATS_GET(stats, resends_expired);
+	snapshot->frames_decoded = RAOP_STATS_GET(stats, frames_decoded);
+	snapshot->frames_lost = RAOP_STATS_GET(stats, frames_lost);
+	snapshot->frames_concealed = RAOP_STATS_GET(stats, frames_concealed);
+	snapshot->buffer_depth = RAOP_STATS_GET(stats, buffer_depth);
+	snapshot->buffer_length = RAOP_STATS_GET(stats, buffer_length);
+	snapshot->jitter_usec = RAOP_STATS_GET(stats, jitter_usec);
+	snapshot->decrypt_usec = RAOP_STATS_GET(stats, decrypt_usec);
+	snapshot->decode_usec = RAOP_STATS_GET(stats, decode_usec);
+}
+
+raop_histogram_t *
+raop_buffer_get_latency(raop_buffer_t *raop_buffer, int stage)
+{
+	assert(raop_buffer);
+	assert(stage >= 0 && stage < RAOP_LATENCY_STAGES);
+
+	return &raop_buffer->latency[stage];
+}
+
+int
+raop_buffer_get_length(raop_buffer_t *raop_buffer)
+{
+	assert(raop_buffer);
+
+	return raop_buffer->length;
+}
+
 static short
 seqnum_cmp(unsigned short s1, unsigned short s2)
 {
 	return (s1 - s2);
 }
 
-int
-raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum)
+static raop_buffer_entry_t *
+raop_buffer_get_entry(raop_buffer_t *raop_buffer, unsigned short seqnum)
+{
+	return &raop_buffer->entries[seqnum & (raop_buffer->capacity-1)];
+}
+
+/* Called once per window, grows the buffer after losses and shrinks it
+ * slowly back towards the minimum when the network has been clean */
+static void
+raop_buffer_adapt(raop_buffer_t *raop_buffer)
+{
+	int length = raop_buffer->length;
+	int used;
+
+	if (raop_buffer->window_losses) {
+		length += (length+3)/4;
+		raop_buffer->clean_windows = 0;
+	} else if (++raop_buffer->clean_windows >= RAOP_BUFFER_SHRINK_WINDOWS) {
+		length -= length/8;
+		if (length < 2*raop_buffer->reorder_depth) {
+			length = 2*raop_buffer->reorder_depth;
+		}
+		raop_buffer->clean_windows = 0;
+		raop_buffer->reorder_depth = 0;
+	}
+
+	/* Never shrink below the entries currently in use */
+	used = raop_buffer->is_empty ? 0 :
+	       seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1;
+	if (length < used) {
+		length = used;
+	}
+	if (length < raop_buffer->min_length) {
+		length = raop_buffer->min_length;
+	} else if (length > raop_buffer->max_length) {
+		length = raop_buffer->max_length;
+	}
+	raop_buffer->length = length;
+	RAOP_STATS_SET(&raop_buffer->stats, buffer_length, length);
+
+	raop_buffer->window_frames = 0;
+	raop_buffer->window_losses = 0;
+}
+
+/* Decrypts and decodes the payload into output, returns the output length */
+static int
+raop_buffer_decode(raop_buffer_t *raop_buffer, const unsigned char *payload, int payloadlen,
+                   void *output, int outputsize)
 {
 	unsigned char packetbuf[RAOP_PACKET_LEN];
-	unsigned short seqnum;
-	raop_buffer_entry_t *entry;
+	raop_stats_t *stats = &raop_buffer->stats;
+	uint64_t start, decrypted, decoded;
 	int encryptedlen;
-	AES_CTX aes_ctx;
 	int outputlen;
 
+	/* Decrypt audio data, every packet starts from the session IV */
+	TRACE2(decode_start, raop_buffer, payloadlen);
+	start = raop_ntp_get_monotonic_time();
+	encryptedlen = payloadlen/16*16;
+	memcpy(raop_buffer->aes_ctx.iv, raop_buffer->aesiv, RAOP_AESIV_LEN);
+	AES_cbc_decrypt(&raop_buffer->aes_ctx, payload, packetbuf, encryptedlen);
+	memcpy(packetbuf+encryptedlen, &payload[encryptedlen], payloadlen-encryptedlen);
+	decrypted = raop_ntp_get_monotonic_time();
+
+	/* Decode ALAC audio data */
+	outputlen = outputsize;
+	alac_decode_frame(raop_buffer->alac, packetbuf, payloadlen,
+	                  output, &outputlen);
+	decoded = raop_ntp_get_monotonic_time();
+	TRACE2(decode_end, raop_buffer, outputlen);
+
+	raop_buffer->decrypt_time += decrypted - start;
+	raop_buffer->decode_time += decoded - decrypted;
+	raop_histogram_add(&raop_buffer->latency[RAOP_LATENCY_DECRYPT], RAOP_NTP_TO_NSEC(decrypted - start));
+	raop_histogram_add(&raop_buffer->latency[RAOP_LATENCY_DECODE], RAOP_NTP_TO_NSEC(decoded - decrypted));
+	RAOP_STATS_ADD(stats, frames_decoded, 1);
+	RAOP_STATS_SET(stats, decrypt_usec, (unsigned int)RAOP_NTP_TO_USEC(raop_buffer->decrypt_time));
+	RAOP_STATS_SET(stats, decode_usec, (unsigned int)RAOP_NTP_TO_USEC(raop_buffer->decode_time));
+	return outputlen;
+}
+
+int
+raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum,
+                  uint64_t recv_time)
+{
+	unsigned short seqnum;
+	raop_buffer_entry_t *entry;
+
 	assert(raop_buffer);
 
 	/* Check packet data length is valid */
 	if (datalen < 12 || datalen > RAOP_PACKET_LEN) {
 		return -1;
 	}
+	RAOP_STATS_ADD(&raop_buffer->stats, packets_received, 1);
 
 	/* Get correct seqnum for the packet */
 	if (use_seqnum) {
@@ -260,18 +566,34 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 
 	/* If this packet is too late, just skip it */
 	if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->first_seqnum) < 0) {
+		RAOP_STATS_ADD(&raop_buffer->stats, packets_late, 1);
 		return 0;
 	}
 
-	/* Check that there is always space in the buffer, otherwise flush */
-	if (seqnum_cmp(seqnum, raop_buffer->first_seqnum+RAOP_BUFFER_LENGTH) >= 0) {
-		raop_buffer_flush(raop_buffer, seqnum);
+	/* Track how late reordered packets arrive */
+	if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0) {
+		int depth = seqnum_cmp(raop_buffer->last_seqnum, seqnum);
+		if (depth > raop_buffer->reorder_depth) {
+			raop_buffer->reorder_depth = depth;
+		}
+	}
+
+	/* Check that there is always space in the buffer, otherwise grow or flush */
+	if (seqnum_cmp(seqnum, raop_buffer->first_seqnum+raop_buffer->length) >= 0) {
+		int needed = seqnum_cmp(seqnum, raop_buffer->first_seqnum)+1;
+		if (!raop_buffer->is_empty && needed <= raop_buffer->max_length) {
+			raop_buffer->length = needed;
+			RAOP_STATS_SET(&raop_buffer->stats, buffer_length, needed);
+		} else {
+			raop_buffer_flush(raop_buffer, seqnum);
+		}
 	}
 
 	/* Get entry corresponding our seqnum */
-	entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
+	entry = raop_buffer_get_entry(raop_buffer, seqnum);
 	if (entry->available && seqnum_cmp(entry->seqnum, seqnum) == 0) {
 		/* Packet resend, we can safely ignore */
+		RAOP_STATS_ADD(&raop_buffer->stats, packets_duplicate, 1);
 		return 0;
 	}
 
@@ -284,19 +606,26 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 	entry->ssrc = (data[8] << 24) | (data[9] << 16) |
 	              (data[10] << 8) | data[11];
 	entry->available = 1;
-
-	/* Decrypt audio data */
-	encryptedlen = (datalen-12)/16*16;
-	AES_set_key(&aes_ctx, raop_buffer->aeskey, raop_buffer->aesiv, AES_MODE_128);
-	AES_convert_key(&aes_ctx);
-	AES_cbc_decrypt(&aes_ctx, &data[12], packetbuf, encryptedlen);
-	memcpy(packetbuf+encryptedlen, &data[12+encryptedlen], datalen-12-encryptedlen);
-
-	/* Decode ALAC audio data */
-	outputlen = entry->audio_buffer_size;
-	alac_decode_frame(raop_buffer->alac, packetbuf,
-	                  entry->audio_buffer, &outputlen);
-	entry->audio_buffer_len = outputlen;
+	if (entry->resend_requests) {
+		RAOP_STATS_ADD(&raop_buffer->stats, resends_recovered, 1);
+		entry->resend_requests = 0;
+	} else if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0) {
+		RAOP_STATS_ADD(&raop_buffer->stats, packets_out_of_order, 1);
+	}
+	entry->queue_time = raop_ntp_get_monotonic_time();
+	raop_histogram_add(&raop_buffer->latency[RAOP_LATENCY_RECEIVE],
+	                   RAOP_NTP_TO_NSEC(entry->queue_time - recv_time));
+
+	if (raop_buffer->lazy_decode && datalen-12 <= entry->payload_size) {
+		/* Store the encrypted payload, decoded when dequeued */
+		memcpy(entry->payload, &data[12], datalen-12);
+		entry->payload_len = datalen-12;
+		entry->decoded = 0;
+	} else {
+		entry->audio_buffer_len = raop_buffer_decode(raop_buffer, &data[12], datalen-12,
+		                                             entry->audio_buffer, entry->audio_buffer_size);
+		entry->decoded = 1;
+	}
 
 	/* Update the raop_buffer seqnums */
 	if (raop_buffer->is_empty) {
@@ -307,14 +636,19 @@ raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned shor
 	if (seqnum_cmp(seqnum, raop_buffer->last_seqnum) > 0) {
 		raop_buffer->last_seqnum = seqnum;
 	}
+	RAOP_STATS_SET(&raop_buffer->stats, buffer_depth,
+	               seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1);
+	TRACE3(queue, raop_buffer, seqnum, datalen);
 	return 1;
 }
 
 const void *
-raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, int no_resend)
+raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int *timestamp, int no_resend,
+                    raop_output_cb_t output_cb, void *opaque)
 {
 	short buflen;
 	raop_buffer_entry_t *entry;
+	void *output;
 
 	/* Calculate number of entries in the current buffer */
 	buflen = seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1;
@@ -325,57 +659,169 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, int no_resend)
 	}
 
 	/* Get the first buffer entry for inspection */
-	entry = &raop_buffer->entries[raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH];
+	entry = raop_buffer_get_entry(raop_buffer, raop_buffer->first_seqnum);
 	if (no_resend) {
 		/* If we do no resends, always return the first entry */
 	} else if (!entry->available) {
 		/* Check how much we have space left in the buffer */
-		if (buflen < RAOP_BUFFER_LENGTH) {
+		if (buflen < raop_buffer->length) {
 			/* Return nothing and hope resend gets on time */
 			return NULL;
 		}
 		/* Risk of buffer overrun, return empty buffer */
 	}
 
+	/* Update the statistics used for adapting the buffer length */
+	raop_buffer->window_frames++;
+	if (!entry->available) {
+		raop_buffer->window_losses++;
+		RAOP_STATS_ADD(&raop_buffer->stats, frames_lost, 1);
+		if (entry->resend_requests) {
+			RAOP_STATS_ADD(&raop_buffer->stats, resends_expired, 1);
+		}
+	}
+	entry->resend_requests = 0;
+	if (raop_buffer->window_frames >= RAOP_BUFFER_WINDOW &&
+	    raop_buffer->min_length < raop_buffer->max_length) {
+		raop_buffer_adapt(raop_buffer);
+	}
+
 	/* Update buffer and validate entry */
+	TRACE3(dequeue, raop_buffer, raop_buffer->first_seqnum, entry->available);
 	raop_buffer->first_seqnum += 1;
+	RAOP_STATS_SET(&raop_buffer->stats, buffer_depth, buflen-1);
+
+	/* Let the caller lend the output buffer, fall back to our own */
+	output = NULL;
+	if (output_cb) {
+		output = output_cb(opaque, entry->audio_buffer_size);
+	}
+	if (!output) {
+		output = entry->audio_buffer;
+	}
+
+	/* Lost frames continue from the previous timestamp */
+	if (entry->available) {
+		raop_buffer->next_timestamp = entry->timestamp;
+	}
+	*timestamp = raop_buffer->next_timestamp;
+	raop_buffer->next_timestamp += raop_buffer->alacConfig.frameLength;
+
 	if (!entry->available) {
-		/* Return an empty audio buffer to skip audio */
+		/* Replace the lost audio, or return an empty buffer to skip it */
 		*length = entry->audio_buffer_size;
-		memset(entry->audio_buffer, 0, *length);
-		return entry->audio_buffer;
+		if (raop_buffer->conceal) {
+			raop_conceal_lost(raop_buffer->conceal, output);
+			RAOP_STATS_ADD(&raop_buffer->stats, frames_concealed, 1);
+		} else {
+			memset(output, 0, *length);
+		}
+		return output;
 	}
 	entry->available = 0;
+	raop_histogram_add(&raop_buffer->latency[RAOP_LATENCY_BUFFER_WAIT],
+	                   RAOP_NTP_TO_NSEC(raop_ntp_get_monotonic_time() - entry->queue_time));
 
-	/* Return entry audio buffer */
-	*length = entry->audio_buffer_len;
+	if (!entry->decoded) {
+		/* Decode the lazily queued entry straight into the output */
+		*length = raop_buffer_decode(raop_buffer, entry->payload, entry->payload_len,
+		                             output, entry->audio_buffer_size);
+	} else {
+		/* Already decoded at queue time, copy if the buffer was lent */
+		*length = entry->audio_buffer_len;
+		if (output != entry->audio_buffer) {
+			memcpy(output, entry->audio_buffer, *length);
+		}
+	}
 	entry->audio_buffer_len = 0;
-	return entry->audio_buffer;
+
+	if (raop_buffer->conceal) {
+		raop_conceal_received(raop_buffer->conceal, output, *length);
+	}
+	return output;
 }
 
-void
-raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque)
+/* Asks for every missing packet that is due a request in one batch.
+ * Requests are retried with a doubling interval for as long as the
+ * packet could still arrive before it is played out, returns the
+ * milliseconds until the next retry or -1 if none is scheduled */
+int
+raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now,
+                           raop_resend_cb_t resend_cb, void *opaque)
 {
-	raop_buffer_entry_t *entry;
+	raop_resend_range_t ranges[RAOP_BUFFER_MAX_RESEND_RANGES];
+	uint64_t frame_time, next_time = 0;
+	int nranges = 0;
+	int buflen, i;
 
 	assert(raop_buffer);
 	assert(resend_cb);
 
-	if (seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) < 0) {
-		int seqnum, count;
-
-		for (seqnum=raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum)<0; seqnum++) {
-			entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-			if (entry->available) {
-				break;
+	if (raop_buffer->is_empty) {
+		return -1;
+	}
+	buflen = seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1;
+	frame_time = (uint64_t)raop_buffer->alacConfig.frameLength * RAOP_NTP_SECOND /
+	             raop_buffer->alacConfig.sampleRate;
+
+	/* The last packet is always available, only earlier ones can be lost */
+	for (i=0; i<buflen-1; i++) {
+		unsigned short seqnum = raop_buffer->first_seqnum + i;
+		raop_buffer_entry_t *entry = raop_buffer_get_entry(raop_buffer, seqnum);
+		uint64_t deadline;
+		int frames;
+
+		if (entry->available || entry->resend_requests >= RAOP_BUFFER_MAX_RESENDS) {
+			continue;
+		}
+		if (entry->resend_requests && (int64_t)(entry->resend_time - now) > 0) {
+			if (!next_time || (int64_t)(entry->resend_time - next_time) < 0) {
+				next_time = entry->resend_time;
 			}
+			continue;
+		}
+
+		/* Dequeue plays the packet out once the buffer is full */
+		frames = raop_buffer->length - buflen + i;
+		deadline = now + (frames > 0 ? frames : 0) * frame_time;
+		if (entry->resend_requests && (int64_t)(deadline - now) <= 0) {
+			continue;
+		}
+
+		if (nranges && (unsigned short)(ranges[nranges-1].seqnum + ranges[nranges-1].count) == seqnum) {
+			ranges[nranges-1].count++;
+		} else if (nranges < RAOP_BUFFER_MAX_RESEND_RANGES) {
+			ranges[nranges].seqnum = seqnum;
+			ranges[nranges].count = 1;
+			nranges++;
+		} else {
+			/* Batch is full, ask for the rest right after it */
+			next_time = now;
+			break;
+		}
+		if (!entry->resend_requests) {
+			RAOP_STATS_ADD(&raop_buffer->stats, resends_requested, 1);
 		}
-		if (seqnum_cmp(seqnum, raop_buffer->first_seqnum) == 0) {
-			return;
+		entry->resend_time = now + (RAOP_BUFFER_RESEND_INTERVAL << entry->resend_requests);
+		entry->resend_requests++;
+
+		/* Retry only if the answer could still arrive in time */
+		if ((int64_t)(entry->resend_time - deadline) < 0 &&
+		    entry->resend_requests < RAOP_BUFFER_MAX_RESENDS &&
+		    (!next_time || (int64_t)(entry->resend_time - next_time) < 0)) {
+			next_time = entry->resend_time;
 		}
-		count = seqnum_cmp(seqnum, raop_buffer->first_seqnum);
-		resend_cb(opaque, raop_buffer->first_seqnum, count);
 	}
+	if (nranges) {
+		resend_cb(opaque, ranges, nranges);
+	}
+	if (!next_time) {
+		return -1;
+	}
+	if ((int64_t)(next_time - now) <= 0) {
+		return 0;
+	}
+	return (int)(((next_time - now) * 1000) >> 32) + 1;
 }
 
 void
@@ -385,10 +831,20 @@ raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq)
 
 	assert(raop_buffer);
 
-	for (i=0; i<RAOP_BUFFER_LENGTH; i++) {
-		raop_buffer->entries[i].available = 0;
-		raop_buffer->entries[i].audio_buffer_len = 0;
+	for (i=0; i<raop_buffer->capacity; i++) {
+		raop_buffer_entry_t *entry = &raop_buffer->entries[i];
+		if (entry->available && !entry->decoded) {
+			/* Flushed before anyone needed the audio */
+			raop_buffer->decodes_avoided++;
+		}
+		entry->available = 0;
+		entry->audio_buffer_len = 0;
+		entry->resend_requests = 0;
+	}
+	if (raop_buffer->conceal) {
+		raop_conceal_reset(raop_buffer->conceal);
 	}
+	RAOP_STATS_SET(&raop_buffer->stats, buffer_depth, 0);
 	if (next_seq < 0 || next_seq > 0xffff) {
 		raop_buffer->is_empty = 1;
 	} else {
@@ -15,6 +15,15 @@
 #ifndef RAOP_BUFFER_H
 #define RAOP_BUFFER_H
 
+#include <stdint.h>
+
+#include "raop_stats.h"
+#include "raop_histogram.h"
+
+/* Default and maximum jitter buffer length in frames */
+#define RAOP_BUFFER_LENGTH 32
+#define RAOP_BUFFER_MAX_LENGTH 2048
+
 typedef struct raop_buffer_s raop_buffer_t;
 
 /* From ALACMagicCookieDescription.txt at http://http://alac.macosforge.org/ */
@@ -32,17 +41,40 @@ typedef struct {
 	unsigned int sampleRate;
 } ALACSpecificConfig;
 
-typedef int (*raop_resend_cb_t)(void *opaque, unsigned short seqno, unsigned short count);
+/* Range of lost packets asked from the sender */
+typedef struct {
+	unsigned short seqnum;
+	unsigned short count;
+} raop_resend_range_t;
+
+typedef int (*raop_resend_cb_t)(void *opaque, const raop_resend_range_t *ranges, int nranges);
+typedef void *(*raop_output_cb_t)(void *opaque, int buflen);
 
 raop_buffer_t *raop_buffer_init(const char *rtpmap,
                                 const char *fmtp,
                                 const unsigned char *aeskey,
-                                const unsigned char *aesiv);
+                                const unsigned char *aesiv,
+                                int min_length,
+                                int max_length,
+                                int min_latency);
 
 const ALACSpecificConfig *raop_buffer_get_config(raop_buffer_t *raop_buffer);
-int raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum);
-const void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, int no_resend);
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
+int raop_buffer_get_output_bits(raop_buffer_t *raop_buffer);
+void raop_buffer_set_lazy_decode(raop_buffer_t *raop_buffer, int lazy_decode);
+unsigned int raop_buffer_get_decodes_avoided(raop_buffer_t *raop_buffer);
+int raop_buffer_set_loss_concealment(raop_buffer_t *raop_buffer, int enabled);
+raop_stats_t *raop_buffer_get_stats(raop_buffer_t *raop_buffer);
+raop_histogram_t *raop_buffer_get_latency(raop_buffer_t *raop_buffer, int stage);
+void raop_buffer_read_stats(raop_buffer_t *raop_buffer, raop_stats_t *snapshot);
+int raop_buffer_get_length(raop_buffer_t *raop_buffer);
+
+/* Recv_time is the monotonic time when the receive call returned */
+int raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, int use_seqnum,
+                      uint64_t recv_time);
+const void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int *timestamp, int no_resend,
+                                raop_output_cb_t output_cb, void *opaque);
+int raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now,
+                               raop_resend_cb_t resend_cb, void *opaque);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 
 void raop_buffer_destroy(raop_buffer_t *raop_buffer);
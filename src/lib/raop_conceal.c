@@ -0,0 +1,286 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "raop_conceal.h"
+
+/* Samples at the end of the history matched against earlier audio */
+#define RAOP_CONCEAL_WINDOW 128
+
+/* Shortest pitch period searched and shortest segment repeated */
+#define RAOP_CONCEAL_MIN_PERIOD 32
+#define RAOP_CONCEAL_MIN_REPEAT 128
+
+/* Concealed audio fades out over this many lost frames */
+#define RAOP_CONCEAL_FADE_FRAMES 4
+
+/* Samples crossfaded from the concealment into the next decoded frame */
+#define RAOP_CONCEAL_OVERLAP 64
+
+struct raop_conceal_s {
+	int channels;
+	int bytes;
+	int frame_frames;
+
+	/* Last two decoded frames of each channel, planar */
+	int history_len;
+	int history_valid;
+	float *history;
+	float *frame;
+
+	/* Repeated segment at the end of the history and the read position */
+	int lost;
+	int repeat;
+	int phase;
+};
+
+raop_conceal_t *
+raop_conceal_init(int channels, int bits, int frame_frames)
+{
+	raop_conceal_t *raop_conceal;
+
+	assert(channels > 0);
+	assert(bits == 16 || bits == 24 || bits == 32);
+	assert(frame_frames > 0);
+
+	raop_conceal = calloc(1, sizeof(raop_conceal_t));
+	if (!raop_conceal) {
+		return NULL;
+	}
+	raop_conceal->channels = channels;
+	raop_conceal->bytes = bits/8;
+	raop_conceal->frame_frames = frame_frames;
+	raop_conceal->history_len = 2*frame_frames;
+	if (raop_conceal->history_len < RAOP_CONCEAL_WINDOW + 2*RAOP_CONCEAL_MIN_REPEAT) {
+		raop_conceal->history_len = RAOP_CONCEAL_WINDOW + 2*RAOP_CONCEAL_MIN_REPEAT;
+	}
+	raop_conceal->history = calloc(channels * raop_conceal->history_len, sizeof(float));
+	raop_conceal->frame = calloc(channels * frame_frames, sizeof(float));
+	if (!raop_conceal->history || !raop_conceal->frame) {
+		raop_conceal_destroy(raop_conceal);
+		return NULL;
+	}
+	return raop_conceal;
+}
+
+void
+raop_conceal_destroy(raop_conceal_t *raop_conceal)
+{
+	if (raop_conceal) {
+		free(raop_conceal->frame);
+		free(raop_conceal->history);
+		free(raop_conceal);
+	}
+}
+
+void
+raop_conceal_reset(raop_conceal_t *raop_conceal)
+{
+	assert(raop_conceal);
+
+	/* Audio before a flush must not leak into the next stream */
+	memset(raop_conceal->history, 0, raop_conceal->channels * raop_conceal->history_len * sizeof(float));
+	raop_conceal->history_valid = 0;
+	raop_conceal->lost = 0;
+}
+
+static float
+raop_conceal_read(const unsigned char *ptr, int bytes)
+{
+	if (bytes == 2) {
+		return *((const int16_t *)ptr);
+	} else if (bytes == 3) {
+		int32_t value = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+		return (value ^ 0x800000) - 0x800000;
+	}
+	return (int32_t)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+}
+
+static void
+raop_conceal_write(unsigned char *ptr, int bytes, float sample)
+{
+	double limit = (double)(((uint32_t)1 << (8*bytes-1)) - 1);
+	double value = sample;
+	int32_t result;
+
+	if (value > limit) {
+		value = limit;
+	} else if (value < -limit-1) {
+		value = -limit-1;
+	}
+	result = (int32_t)(value < 0 ? value-0.5 : value+0.5);
+	if (bytes == 2) {
+		*((int16_t *)ptr) = result;
+	} else {
+		ptr[0] = result & 0xff;
+		ptr[1] = (result >> 8) & 0xff;
+		ptr[2] = (result >> 16) & 0xff;
+		if (bytes == 4) {
+			ptr[3] = (result >> 24) & 0xff;
+		}
+	}
+}
+
+/* Finds the pitch period by normalized cross-correlation of the end of
+ * the history with earlier audio, summed over all channels */
+static int
+raop_conceal_find_period(raop_conceal_t *raop_conceal)
+{
+	int len = raop_conceal->history_len;
+	int max_period = len - RAOP_CONCEAL_WINDOW;
+	int best_period = 0;
+	double best_score = 0.0;
+	int period, c, i;
+
+	for (period=RAOP_CONCEAL_MIN_PERIOD; period<=max_period; period++) {
+		double corr = 0.0, energy = 0.0;
+
+		for (c=0; c<raop_conceal->channels; c++) {
+			const float *current = &raop_conceal->history[c*len + len - RAOP_CONCEAL_WINDOW];
+			const float *past = current - period;
+			float channel_corr = 0.0f, channel_energy = 0.0f;
+
+			for (i=0; i<RAOP_CONCEAL_WINDOW; i++) {
+				channel_corr += current[i] * past[i];
+				channel_energy += past[i] * past[i];
+			}
+			corr += channel_corr;
+			energy += channel_energy;
+		}
+		if (corr > 0.0 && energy > 0.0 && corr*corr/energy > best_score) {
+			best_score = corr*corr/energy;
+			best_period = period;
+		}
+	}
+	return best_period;
+}
+
+/* Writes count samples of the fading repetition into each plane */
+static void
+raop_conceal_extend(raop_conceal_t *raop_conceal, float *planes, int stride, int count)
+{
+	int len = raop_conceal->history_len;
+	float gain = 1.0f - (float)raop_conceal->lost / RAOP_CONCEAL_FADE_FRAMES;
+	float fade = 1.0f / (RAOP_CONCEAL_FADE_FRAMES * raop_conceal->frame_frames);
+	int c, i;
+
+	for (c=0; c<raop_conceal->channels; c++) {
+		const float *segment = &raop_conceal->history[c*len + len - raop_conceal->repeat];
+		float *output = &planes[c*stride];
+		int phase = raop_conceal->phase;
+
+		for (i=0; i<count; i++) {
+			float scale = gain - i*fade;
+			output[i] = (scale > 0.0f) ? scale * segment[phase] : 0.0f;
+			if (++phase == raop_conceal->repeat) {
+				phase = 0;
+			}
+		}
+	}
+}
+
+void
+raop_conceal_lost(raop_conceal_t *raop_conceal, void *output)
+{
+	int framelen = raop_conceal->channels * raop_conceal->bytes;
+	int frames = raop_conceal->frame_frames;
+	int c, i;
+
+	assert(raop_conceal);
+	assert(output);
+
+	if (!raop_conceal->history_valid || raop_conceal->lost >= RAOP_CONCEAL_FADE_FRAMES) {
+		/* Nothing to repeat or already faded out */
+		memset(output, 0, frames * framelen);
+		raop_conceal->lost++;
+		return;
+	}
+
+	if (raop_conceal->lost == 0) {
+		int period = raop_conceal_find_period(raop_conceal);
+
+		/* Repeat whole periods, unvoiced audio repeats a longer segment */
+		if (period == 0) {
+			period = RAOP_CONCEAL_MIN_REPEAT;
+		}
+		raop_conceal->repeat = period;
+		while (raop_conceal->repeat < RAOP_CONCEAL_MIN_REPEAT) {
+			raop_conceal->repeat += period;
+		}
+		raop_conceal->phase = 0;
+	}
+
+	raop_conceal_extend(raop_conceal, raop_conceal->frame, frames, frames);
+	raop_conceal->phase = (raop_conceal->phase + frames) % raop_conceal->repeat;
+	raop_conceal->lost++;
+
+	for (c=0; c<raop_conceal->channels; c++) {
+		const float *plane = &raop_conceal->frame[c*frames];
+		unsigned char *ptr = (unsigned char *)output + c*raop_conceal->bytes;
+
+		for (i=0; i<frames; i++, ptr += framelen) {
+			raop_conceal_write(ptr, raop_conceal->bytes, plane[i]);
+		}
+	}
+}
+
+void
+raop_conceal_received(raop_conceal_t *raop_conceal, void *audio, int audiolen)
+{
+	int len = raop_conceal->history_len;
+	int framelen = raop_conceal->channels * raop_conceal->bytes;
+	int frames = audiolen / framelen;
+	int overlap = 0;
+	int c, i;
+
+	assert(raop_conceal);
+	assert(audio);
+
+	if (frames > raop_conceal->frame_frames) {
+		frames = raop_conceal->frame_frames;
+	}
+
+	/* Continue the concealment a little and crossfade into the audio */
+	if (raop_conceal->lost && raop_conceal->history_valid) {
+		overlap = (frames < RAOP_CONCEAL_OVERLAP) ? frames : RAOP_CONCEAL_OVERLAP;
+		if (raop_conceal->lost < RAOP_CONCEAL_FADE_FRAMES) {
+			raop_conceal_extend(raop_conceal, raop_conceal->frame, frames, overlap);
+		} else {
+			memset(raop_conceal->frame, 0, raop_conceal->channels * frames * sizeof(float));
+		}
+	}
+	raop_conceal->lost = 0;
+
+	for (c=0; c<raop_conceal->channels; c++) {
+		float *plane = &raop_conceal->history[c*len];
+		const float *extension = &raop_conceal->frame[c*frames];
+		unsigned char *ptr = (unsigned char *)audio + c*raop_conceal->bytes;
+
+		memmove(plane, plane+frames, (len-frames)*sizeof(float));
+		plane += len-frames;
+		for (i=0; i<frames; i++, ptr += framelen) {
+			plane[i] = raop_conceal_read(ptr, raop_conceal->bytes);
+			if (i < overlap) {
+				float weight = (float)(i+1) / (overlap+1);
+				raop_conceal_write(ptr, raop_conceal->bytes,
+				                   weight*plane[i] + (1.0f-weight)*extension[i]);
+			}
+		}
+	}
+	raop_conceal->history_valid = 1;
+}
@@ -0,0 +1,32 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_CONCEAL_H
+#define RAOP_CONCEAL_H
+
+typedef struct raop_conceal_s raop_conceal_t;
+
+raop_conceal_t *raop_conceal_init(int channels, int bits, int frame_frames);
+
+/* Synthesizes a full frame in place of a lost one */
+void raop_conceal_lost(raop_conceal_t *raop_conceal, void *output);
+
+/* Remembers a decoded frame, blends it in if frames were concealed */
+void raop_conceal_received(raop_conceal_t *raop_conceal, void *audio, int audiolen);
+
+void raop_conceal_reset(raop_conceal_t *raop_conceal);
+
+void raop_conceal_destroy(raop_conceal_t *raop_conceal);
+
+#endif
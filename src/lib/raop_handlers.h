@@ -166,6 +166,7 @@ raop_handler_announce(raop_conn_t *conn,
 	if (data) {
 		sdp_t *sdp;
 		const char *remotestr, *rtpmapstr, *fmtpstr, *rsaaeskeystr, *fpaeskeystr, *aesivstr;
+		const char *minlatencystr;
 
 		sdp = sdp_init(data, datalen);
 		remotestr = sdp_get_connection(sdp);
@@ -174,6 +175,7 @@ raop_handler_announce(raop_conn_t *conn,
 		rsaaeskeystr = sdp_get_rsaaeskey(sdp);
 		fpaeskeystr = sdp_get_fpaeskey(sdp);
 		aesivstr = sdp_get_aesiv(sdp);
+		minlatencystr = sdp_get_min_latency(sdp);
 
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "connection: %s", remotestr);
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "rtpmap: %s", rtpmapstr);
@@ -185,6 +187,9 @@ raop_handler_announce(raop_conn_t *conn,
 			logger_log(conn->raop->logger, LOGGER_DEBUG, "fpaeskey: %s", fpaeskeystr);
 		}
 		logger_log(conn->raop->logger, LOGGER_DEBUG, "aesiv: %s", aesivstr);
+		if (minlatencystr) {
+			logger_log(conn->raop->logger, LOGGER_DEBUG, "min-latency: %s", minlatencystr);
+		}
 
 		if (rsaaeskeystr) {
 			aeskeylen = rsakey_decrypt(conn->raop->rsakey, aeskey, sizeof(aeskey), rsaaeskeystr);
@@ -204,12 +209,16 @@ raop_handler_announce(raop_conn_t *conn,
 
 		if (conn->raop_rtp) {
 			/* This should never happen */
-			raop_rtp_destroy(conn->raop_rtp);
-			conn->raop_rtp = NULL;
+			conn_set_raop_rtp(conn, NULL);
 		}
 		if (aeskeylen == sizeof(aeskey) && aesivlen == sizeof(aesiv)) {
-			conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks,
-						       remotestr, rtpmapstr, fmtpstr, aeskey, aesiv);
+			conn_set_raop_rtp(conn, raop_rtp_init(conn->raop->logger, &conn->raop->callbacks,
+			                                      remotestr, rtpmapstr, fmtpstr, aeskey, aesiv,
+			                                      conn->raop->buffer_min_length,
+			                                      conn->raop->buffer_max_length,
+			                                      minlatencystr ? atoi(minlatencystr) : 0,
+			                                      conn->raop->drift_compensation,
+			                                      conn->raop->loss_concealment));
 		}
 		if (!conn->raop_rtp) {
 			logger_log(conn->raop->logger, LOGGER_ERR, "Error initializing the audio decoder");
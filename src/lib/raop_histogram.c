@@ -0,0 +1,127 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <assert.h>
+
+#include "raop_histogram.h"
+#include "threads.h"
+
+/* Values below 2^SUB_BITS get a bucket each, every larger power of two
+ * is split in 2^SUB_BITS buckets of equal width */
+#define RAOP_HISTOGRAM_SUB_BITS 4
+#define RAOP_HISTOGRAM_SUB_COUNT (1 << RAOP_HISTOGRAM_SUB_BITS)
+
+static int
+raop_histogram_msb(uint32_t value)
+{
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(value);
+#else
+	int msb = 0;
+
+	while (value >>= 1) {
+		msb++;
+	}
+	return msb;
+#endif
+}
+
+static int
+raop_histogram_index(uint32_t value)
+{
+	int msb, shift;
+
+	if (value < RAOP_HISTOGRAM_SUB_COUNT) {
+		return value;
+	}
+	msb = raop_histogram_msb(value);
+	shift = msb - RAOP_HISTOGRAM_SUB_BITS;
+	return (shift + 1) * RAOP_HISTOGRAM_SUB_COUNT + ((value >> shift) & (RAOP_HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Largest value that falls in the bucket */
+static unsigned long long
+raop_histogram_bucket_max(int index)
+{
+	unsigned long long lower;
+	int shift;
+
+	if (index < RAOP_HISTOGRAM_SUB_COUNT) {
+		return index;
+	}
+	shift = index / RAOP_HISTOGRAM_SUB_COUNT - 1;
+	lower = (unsigned long long)(RAOP_HISTOGRAM_SUB_COUNT + index % RAOP_HISTOGRAM_SUB_COUNT) << shift;
+	return lower + (1ULL << shift) - 1;
+}
+
+void
+raop_histogram_add(raop_histogram_t *hist, uint64_t value)
+{
+	unsigned int *bucket;
+
+	assert(hist);
+
+	if (value > 0xffffffff) {
+		value = 0xffffffff;
+	}
+	bucket = &hist->buckets[raop_histogram_index((uint32_t)value)];
+	ATOMIC_STORE_RELAXED(bucket, ATOMIC_LOAD_RELAXED(bucket) + 1);
+	ATOMIC_STORE_RELAXED(&hist->count, ATOMIC_LOAD_RELAXED(&hist->count) + 1);
+}
+
+void
+raop_histogram_merge(raop_histogram_t *dst, const raop_histogram_t *src)
+{
+	int i;
+
+	assert(dst);
+	assert(src);
+
+	/* Count the buckets so the total matches a torn read */
+	for (i=0; i<RAOP_HISTOGRAM_BUCKETS; i++) {
+		unsigned int count = ATOMIC_LOAD_RELAXED(&src->buckets[i]);
+
+		dst->buckets[i] += count;
+		dst->count += count;
+	}
+}
+
+unsigned long long
+raop_histogram_get_percentile(const raop_histogram_t *hist, double percentile)
+{
+	unsigned long long rank, seen = 0;
+	int i;
+
+	assert(hist);
+
+	if (!hist->count) {
+		return 0;
+	}
+	if (percentile < 0.0) {
+		percentile = 0.0;
+	} else if (percentile > 100.0) {
+		percentile = 100.0;
+	}
+	rank = (unsigned long long)(percentile * hist->count / 100.0 + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (i=0; i<RAOP_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			return raop_histogram_bucket_max(i);
+		}
+	}
+	return raop_histogram_bucket_max(RAOP_HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,30 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_HISTOGRAM_H
+#define RAOP_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* For raop_histogram_t */
+#include "raop.h"
+
+/* Records a value in nanoseconds. Only one thread may add to a histogram,
+ * the counts are stored atomically so others can merge it at any time */
+void raop_histogram_add(raop_histogram_t *hist, uint64_t value);
+
+/* Adds the counts of src into dst, dst must not be shared */
+void raop_histogram_merge(raop_histogram_t *dst, const raop_histogram_t *src);
+
+#endif
@@ -0,0 +1,354 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "raop_ntp.h"
+#include "compat.h"
+
+/* Seconds between the NTP epoch 1900 and the Unix epoch 1970 */
+#define RAOP_NTP_UNIX_OFFSET 2208988800UL
+
+/* Number of requests that can wait for a response at the same time */
+#define RAOP_NTP_MAX_PENDING 4
+
+/* Number of latest samples of which the one with the smallest delay is used */
+#define RAOP_NTP_FILTER_LEN 8
+
+/* Number of filtered samples used for estimating the drift */
+#define RAOP_NTP_HISTORY_LEN 32
+
+/* Drift is only estimated from at least this many seconds of samples */
+#define RAOP_NTP_MIN_DRIFT_SPAN 10.0
+
+/* Larger drift than this means a broken sender clock */
+#define RAOP_NTP_MAX_DRIFT_PPM 500.0
+
+typedef struct {
+	/* Local time halfway between request and response */
+	uint64_t local;
+	int64_t offset;
+	uint64_t delay;
+} raop_ntp_sample_t;
+
+struct raop_ntp_s {
+	logger_t *logger;
+
+	/* Added to the monotonic clock to get the local NTP time */
+	uint64_t epoch;
+
+	/* Transmit times of requests waiting for a response */
+	uint64_t pending[RAOP_NTP_MAX_PENDING];
+	int pending_idx;
+
+	/* Latest raw samples, ring buffer */
+	raop_ntp_sample_t samples[RAOP_NTP_FILTER_LEN];
+	unsigned int sample_count;
+
+	/* Filtered samples for the drift estimate, ring buffer */
+	raop_ntp_sample_t history[RAOP_NTP_HISTORY_LEN];
+	unsigned int history_count;
+
+	/* Clock model read by other threads, mutex locked */
+	mutex_handle_t clock_mutex;
+	raop_ntp_clock_t clock;
+};
+
+uint64_t
+raop_ntp_get_monotonic_time(void)
+{
+#if defined(WIN32)
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return ((uint64_t)(counter.QuadPart / frequency.QuadPart) << 32) +
+	       (((uint64_t)(counter.QuadPart % frequency.QuadPart) << 32) / frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec << 32) + (((uint64_t)ts.tv_nsec << 32) / 1000000000);
+#endif
+}
+
+static uint64_t
+raop_ntp_read_time(const unsigned char *data)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i=0; i<8; i++) {
+		value = (value << 8) | data[i];
+	}
+	return value;
+}
+
+static void
+raop_ntp_write_time(unsigned char *data, uint64_t value)
+{
+	int i;
+
+	for (i=7; i>=0; i--) {
+		data[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+raop_ntp_t *
+raop_ntp_init(logger_t *logger)
+{
+	raop_ntp_t *raop_ntp;
+
+	assert(logger);
+
+	raop_ntp = calloc(1, sizeof(raop_ntp_t));
+	if (!raop_ntp) {
+		return NULL;
+	}
+	raop_ntp->logger = logger;
+
+	/* Monotonic time that starts from the current wall clock time, so
+	 * that the timestamps sent are sensible but never jump */
+	raop_ntp->epoch = ((uint64_t)(time(NULL) + RAOP_NTP_UNIX_OFFSET) << 32) -
+	                  raop_ntp_get_monotonic_time();
+
+	MUTEX_CREATE(raop_ntp->clock_mutex);
+	return raop_ntp;
+}
+
+void
+raop_ntp_destroy(raop_ntp_t *raop_ntp)
+{
+	if (raop_ntp) {
+		MUTEX_DESTROY(raop_ntp->clock_mutex);
+		free(raop_ntp);
+	}
+}
+
+uint64_t
+raop_ntp_get_local_time(raop_ntp_t *raop_ntp)
+{
+	assert(raop_ntp);
+
+	return raop_ntp->epoch + raop_ntp_get_monotonic_time();
+}
+
+uint64_t
+raop_ntp_local_to_monotonic(raop_ntp_t *raop_ntp, uint64_t local_time)
+{
+	assert(raop_ntp);
+
+	return local_time - raop_ntp->epoch;
+}
+
+int
+raop_ntp_create_request(raop_ntp_t *raop_ntp, uint64_t transmit_time, unsigned char *packet)
+{
+	assert(raop_ntp);
+	assert(packet);
+
+	memset(packet, 0, RAOP_NTP_PACKET_LEN);
+	packet[0] = 0x80;
+	packet[1] = 0x52|0x80;
+	packet[3] = 0x07;
+
+	/* Our transmit time is echoed back as the origin time */
+	raop_ntp_write_time(packet+24, transmit_time);
+
+	raop_ntp->pending[raop_ntp->pending_idx] = transmit_time;
+	raop_ntp->pending_idx = (raop_ntp->pending_idx+1) % RAOP_NTP_MAX_PENDING;
+	return RAOP_NTP_PACKET_LEN;
+}
+
+int
+raop_ntp_create_response(raop_ntp_t *raop_ntp, const unsigned char *request, int requestlen,
+                         uint64_t recv_time, unsigned char *packet)
+{
+	assert(raop_ntp);
+	assert(request);
+	assert(packet);
+
+	if (requestlen < RAOP_NTP_PACKET_LEN || (request[1] & ~0x80) != 0x52) {
+		return -1;
+	}
+
+	memset(packet, 0, RAOP_NTP_PACKET_LEN);
+	packet[0] = 0x80;
+	packet[1] = 0x53|0x80;
+	packet[3] = 0x07;
+	memcpy(packet+8, request+24, 8);
+	raop_ntp_write_time(packet+16, recv_time);
+	raop_ntp_write_time(packet+24, raop_ntp_get_local_time(raop_ntp));
+	return RAOP_NTP_PACKET_LEN;
+}
+
+/* Least squares slope of the filtered offsets against local time */
+static double
+raop_ntp_estimate_drift(raop_ntp_t *raop_ntp)
+{
+	unsigned int count, first, i;
+	double sumx = 0.0, sumy = 0.0, sumxx = 0.0, sumxy = 0.0;
+	double span, slope;
+	uint64_t base_local;
+	int64_t base_offset;
+
+	count = raop_ntp->history_count;
+	if (count > RAOP_NTP_HISTORY_LEN) {
+		count = RAOP_NTP_HISTORY_LEN;
+	}
+	if (count < 4) {
+		return 0.0;
+	}
+	first = raop_ntp->history_count - count;
+	base_local = raop_ntp->history[first % RAOP_NTP_HISTORY_LEN].local;
+	base_offset = raop_ntp->history[first % RAOP_NTP_HISTORY_LEN].offset;
+
+	span = 0.0;
+	for (i=first; i<raop_ntp->history_count; i++) {
+		raop_ntp_sample_t *sample = &raop_ntp->history[i % RAOP_NTP_HISTORY_LEN];
+		double x = (double)(int64_t)(sample->local - base_local) / RAOP_NTP_SECOND;
+		double y = (double)(sample->offset - base_offset) / RAOP_NTP_SECOND;
+
+		sumx += x;
+		sumy += y;
+		sumxx += x*x;
+		sumxy += x*y;
+		span = x;
+	}
+	if (span < RAOP_NTP_MIN_DRIFT_SPAN) {
+		return 0.0;
+	}
+	slope = (count*sumxy - sumx*sumy) / (count*sumxx - sumx*sumx);
+	slope *= 1000000.0;
+	if (slope > RAOP_NTP_MAX_DRIFT_PPM) {
+		slope = RAOP_NTP_MAX_DRIFT_PPM;
+	} else if (slope < -RAOP_NTP_MAX_DRIFT_PPM) {
+		slope = -RAOP_NTP_MAX_DRIFT_PPM;
+	}
+	return slope;
+}
+
+int
+raop_ntp_process_response(raop_ntp_t *raop_ntp, const unsigned char *packet, int packetlen,
+                          uint64_t recv_time)
+{
+	uint64_t origin_time, receive_time, transmit_time;
+	raop_ntp_sample_t *sample, *best;
+	unsigned int count, i;
+	int64_t elapsed, processing;
+
+	assert(raop_ntp);
+	assert(packet);
+
+	if (packetlen < RAOP_NTP_PACKET_LEN || (packet[1] & ~0x80) != 0x53) {
+		return -1;
+	}
+	origin_time = raop_ntp_read_time(packet+8);
+	receive_time = raop_ntp_read_time(packet+16);
+	transmit_time = raop_ntp_read_time(packet+24);
+
+	/* Only accept responses to our own requests, and each only once */
+	for (i=0; i<RAOP_NTP_MAX_PENDING; i++) {
+		if (raop_ntp->pending[i] && raop_ntp->pending[i] == origin_time) {
+			raop_ntp->pending[i] = 0;
+			break;
+		}
+	}
+	if (i == RAOP_NTP_MAX_PENDING) {
+		logger_log(raop_ntp->logger, LOGGER_DEBUG, "Ignoring unexpected timing response");
+		return -1;
+	}
+
+	/* Round trip minus the time spent in the sender */
+	elapsed = (int64_t)(recv_time - origin_time);
+	processing = (int64_t)(transmit_time - receive_time);
+	if (elapsed < 0 || processing < 0) {
+		return -1;
+	}
+
+	sample = &raop_ntp->samples[raop_ntp->sample_count % RAOP_NTP_FILTER_LEN];
+	sample->local = origin_time + elapsed/2;
+	sample->offset = ((int64_t)(receive_time - origin_time) + (int64_t)(transmit_time - recv_time)) / 2;
+	sample->delay = (elapsed > processing) ? elapsed - processing : 0;
+	raop_ntp->sample_count++;
+
+	/* Use the sample with the smallest delay, it has the least queueing error */
+	count = raop_ntp->sample_count;
+	if (count > RAOP_NTP_FILTER_LEN) {
+		count = RAOP_NTP_FILTER_LEN;
+	}
+	best = &raop_ntp->samples[0];
+	for (i=1; i<count; i++) {
+		if (raop_ntp->samples[i].delay < best->delay) {
+			best = &raop_ntp->samples[i];
+		}
+	}
+
+	/* Feed each filtered sample to the drift estimate only once */
+	if (!raop_ntp->history_count ||
+	    raop_ntp->history[(raop_ntp->history_count-1) % RAOP_NTP_HISTORY_LEN].local != best->local) {
+		raop_ntp->history[raop_ntp->history_count % RAOP_NTP_HISTORY_LEN] = *best;
+		raop_ntp->history_count++;
+	}
+
+	MUTEX_LOCK(raop_ntp->clock_mutex);
+	raop_ntp->clock.synchronized = 1;
+	raop_ntp->clock.offset = best->offset;
+	raop_ntp->clock.reference = best->local;
+	raop_ntp->clock.drift_ppm = raop_ntp_estimate_drift(raop_ntp);
+	raop_ntp->clock.delay = best->delay;
+	raop_ntp->clock.samples = raop_ntp->sample_count;
+	MUTEX_UNLOCK(raop_ntp->clock_mutex);
+
+	logger_log(raop_ntp->logger, LOGGER_DEBUG, "Timing sample offset %.6f s delay %.6f s, using offset %.6f s drift %.2f ppm",
+	           (double)sample->offset / RAOP_NTP_SECOND, (double)sample->delay / RAOP_NTP_SECOND,
+	           (double)best->offset / RAOP_NTP_SECOND, raop_ntp->clock.drift_ppm);
+	return 0;
+}
+
+void
+raop_ntp_get_clock(raop_ntp_t *raop_ntp, raop_ntp_clock_t *clock)
+{
+	assert(raop_ntp);
+	assert(clock);
+
+	MUTEX_LOCK(raop_ntp->clock_mutex);
+	memcpy(clock, &raop_ntp->clock, sizeof(raop_ntp_clock_t));
+	MUTEX_UNLOCK(raop_ntp->clock_mutex);
+}
+
+/* Offset of the sender clock at the given local time */
+static int64_t
+raop_ntp_get_offset(raop_ntp_clock_t *clock, uint64_t local_time)
+{
+	double elapsed = (double)(int64_t)(local_time - clock->reference);
+	return clock->offset + (int64_t)(elapsed * clock->drift_ppm / 1000000.0);
+}
+
+uint64_t
+raop_ntp_remote_to_local(raop_ntp_t *raop_ntp, uint64_t remote_time)
+{
+	raop_ntp_clock_t clock;
+	uint64_t local_time;
+
+	raop_ntp_get_clock(raop_ntp, &clock);
+
+	/* First order inverse is exact enough for any sensible drift */
+	local_time = remote_time - clock.offset;
+	return remote_time - raop_ntp_get_offset(&clock, local_time);
+}
@@ -0,0 +1,68 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_NTP_H
+#define RAOP_NTP_H
+
+#include <stdint.h>
+
+#include "logger.h"
+
+/* Length of the RAOP timing request and response packets */
+#define RAOP_NTP_PACKET_LEN 32
+
+/* Timestamps are 64-bit NTP values, 32.32 fixed point seconds since 1900 */
+#define RAOP_NTP_SECOND (((uint64_t)1) << 32)
+
+/* Converts a 32.32 fixed point time into microseconds without overflow */
+#define RAOP_NTP_TO_USEC(t) ((((t) >> 32) * 1000000) + ((((t) & 0xffffffff) * 1000000) >> 32))
+#define RAOP_NTP_TO_NSEC(t) ((((t) >> 32) * 1000000000) + ((((t) & 0xffffffff) * 1000000000) >> 32))
+
+typedef struct raop_ntp_s raop_ntp_t;
+
+/* Snapshot of the estimated sender clock */
+typedef struct {
+	int synchronized;
+
+	/* Offset of the sender clock at the reference local time */
+	int64_t offset;
+	uint64_t reference;
+
+	/* Sender clock rate relative to ours in parts per million */
+	double drift_ppm;
+
+	/* Round trip delay of the best sample used */
+	uint64_t delay;
+	unsigned int samples;
+} raop_ntp_clock_t;
+
+raop_ntp_t *raop_ntp_init(logger_t *logger);
+
+/* Monotonic clock shared by all sessions, local time is offset from it */
+uint64_t raop_ntp_get_monotonic_time(void);
+uint64_t raop_ntp_get_local_time(raop_ntp_t *raop_ntp);
+uint64_t raop_ntp_local_to_monotonic(raop_ntp_t *raop_ntp, uint64_t local_time);
+
+int raop_ntp_create_request(raop_ntp_t *raop_ntp, uint64_t transmit_time, unsigned char *packet);
+int raop_ntp_create_response(raop_ntp_t *raop_ntp, const unsigned char *request, int requestlen,
+                             uint64_t recv_time, unsigned char *packet);
+int raop_ntp_process_response(raop_ntp_t *raop_ntp, const unsigned char *packet, int packetlen,
+                              uint64_t recv_time);
+
+void raop_ntp_get_clock(raop_ntp_t *raop_ntp, raop_ntp_clock_t *clock);
+uint64_t raop_ntp_remote_to_local(raop_ntp_t *raop_ntp, uint64_t remote_time);
+
+void raop_ntp_destroy(raop_ntp_t *raop_ntp);
+
+#endif
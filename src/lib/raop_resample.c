@@ -0,0 +1,337 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "raop_resample.h"
+#include "raop_ntp.h"
+
+/* Interpolation needs one frame before and two after the read position */
+#define RAOP_RESAMPLE_HISTORY 3
+
+/* Seconds over which the measured fill level is smoothed */
+#define RAOP_RESAMPLE_SMOOTHING 2.0
+
+/* Controller gains, proportional in ppm per frame of fill error and
+ * integral in ppm per frame second, the loop settles in minutes so
+ * that network jitter is not heard as pitch changes */
+#define RAOP_RESAMPLE_KP 0.9
+#define RAOP_RESAMPLE_KI 0.009
+
+/* Fill errors larger than this many seconds mean the stream stalled */
+#define RAOP_RESAMPLE_MAX_ERROR 0.5
+
+struct raop_resample_s {
+	int channels;
+	int bytes;
+	int sample_rate;
+	int max_frames;
+
+	/* Planar samples of each channel, input has the history first */
+	int stride;
+	float *input;
+	float *output;
+
+	/* Read position in input frames, always at least one */
+	double position;
+
+	/* Output frames produced against the local clock since the anchor */
+	int anchored;
+	uint64_t anchor_time;
+	uint64_t last_time;
+	double produced;
+	double reference;
+
+	/* Controller state, smoothed fill error in frames */
+	double fill;
+	double integral;
+	double ratio_ppm;
+};
+
+raop_resample_t *
+raop_resample_init(int channels, int bits, int sample_rate, int max_frames)
+{
+	raop_resample_t *raop_resample;
+
+	assert(channels > 0);
+	assert(bits == 16 || bits == 24 || bits == 32);
+	assert(sample_rate > 0);
+	assert(max_frames > 0);
+
+	raop_resample = calloc(1, sizeof(raop_resample_t));
+	if (!raop_resample) {
+		return NULL;
+	}
+	raop_resample->channels = channels;
+	raop_resample->bytes = bits/8;
+	raop_resample->sample_rate = sample_rate;
+	raop_resample->max_frames = max_frames;
+
+	/* Less than two extra frames out of a maximum size input */
+	raop_resample->stride = RAOP_RESAMPLE_HISTORY + max_frames;
+	raop_resample->input = calloc(channels * raop_resample->stride, sizeof(float));
+	raop_resample->output = calloc(channels * (max_frames+2), sizeof(float));
+	if (!raop_resample->input || !raop_resample->output) {
+		raop_resample_destroy(raop_resample);
+		return NULL;
+	}
+	raop_resample_reset(raop_resample);
+	return raop_resample;
+}
+
+void
+raop_resample_destroy(raop_resample_t *raop_resample)
+{
+	if (raop_resample) {
+		free(raop_resample->output);
+		free(raop_resample->input);
+		free(raop_resample);
+	}
+}
+
+int
+raop_resample_get_max_output(raop_resample_t *raop_resample)
+{
+	assert(raop_resample);
+
+	return (raop_resample->max_frames+2) * raop_resample->channels * raop_resample->bytes;
+}
+
+double
+raop_resample_get_ratio_ppm(raop_resample_t *raop_resample)
+{
+	assert(raop_resample);
+
+	return raop_resample->ratio_ppm;
+}
+
+void
+raop_resample_reset(raop_resample_t *raop_resample)
+{
+	int c;
+
+	assert(raop_resample);
+
+	/* Start from silence, the drift estimate is still valid */
+	for (c=0; c<raop_resample->channels; c++) {
+		memset(&raop_resample->input[c*raop_resample->stride], 0,
+		       RAOP_RESAMPLE_HISTORY*sizeof(float));
+	}
+	raop_resample->position = RAOP_RESAMPLE_HISTORY-2;
+	raop_resample->anchored = 0;
+}
+
+static void
+raop_resample_deinterleave(raop_resample_t *raop_resample, const unsigned char *input, int frames)
+{
+	int channels = raop_resample->channels;
+	int bytes = raop_resample->bytes;
+	int c, i;
+
+	for (c=0; c<channels; c++) {
+		float *plane = &raop_resample->input[c*raop_resample->stride + RAOP_RESAMPLE_HISTORY];
+		const unsigned char *ptr = input + c*bytes;
+
+		for (i=0; i<frames; i++, ptr += channels*bytes) {
+			if (bytes == 2) {
+				plane[i] = *((const int16_t *)ptr);
+			} else if (bytes == 3) {
+				int32_t value = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+				plane[i] = (value ^ 0x800000) - 0x800000;
+			} else {
+				plane[i] = (int32_t)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+			}
+		}
+	}
+}
+
+static void
+raop_resample_interleave(raop_resample_t *raop_resample, unsigned char *output, int frames)
+{
+	int channels = raop_resample->channels;
+	int bytes = raop_resample->bytes;
+	double limit = (double)(((uint32_t)1 << (8*bytes-1)) - 1);
+	int c, i;
+
+	for (c=0; c<channels; c++) {
+		const float *plane = &raop_resample->output[c*(raop_resample->max_frames+2)];
+		unsigned char *ptr = output + c*bytes;
+
+		for (i=0; i<frames; i++, ptr += channels*bytes) {
+			double sample = plane[i];
+			int32_t value;
+
+			if (sample > limit) {
+				sample = limit;
+			} else if (sample < -limit-1) {
+				sample = -limit-1;
+			}
+			value = (int32_t)(sample < 0 ? sample-0.5 : sample+0.5);
+			if (bytes == 2) {
+				*((int16_t *)ptr) = value;
+			} else {
+				ptr[0] = value & 0xff;
+				ptr[1] = (value >> 8) & 0xff;
+				ptr[2] = (value >> 16) & 0xff;
+				if (bytes == 4) {
+					ptr[3] = (value >> 24) & 0xff;
+				}
+			}
+		}
+	}
+}
+
+/* Smallest integer not below the positive value */
+static int
+raop_resample_ceil(double value)
+{
+	int result = (int)value;
+
+	return (result < value) ? result+1 : result;
+}
+
+/* Cubic Hermite interpolation of count output frames that all read from
+ * consecutive input frames, so the fractional part grows linearly and
+ * the loop has no data dependent indexing for the compiler to vectorize */
+static void
+raop_resample_run(const float *input, float *output, int count, float frac, float step)
+{
+	int i;
+
+	for (i=0; i<count; i++) {
+		float t = frac + i*step;
+		float xm1 = input[i-1];
+		float x0 = input[i];
+		float x1 = input[i+1];
+		float x2 = input[i+2];
+
+		output[i] = x0 + 0.5f*t*(x1 - xm1 + t*(2.0f*xm1 - 5.0f*x0 + 4.0f*x1 - x2 +
+		                                      t*(3.0f*(x0 - x1) + x2 - xm1)));
+	}
+}
+
+/* Updates the ratio from the fill level of a buffer that the output
+ * goes into and the local clock drains at the nominal sample rate */
+static void
+raop_resample_update(raop_resample_t *raop_resample, int frames, uint64_t now)
+{
+	double elapsed, level, error, dt;
+
+	if (!raop_resample->anchored) {
+		raop_resample->anchored = 1;
+		raop_resample->anchor_time = now;
+		raop_resample->last_time = now;
+		raop_resample->produced = frames;
+		raop_resample->reference = frames;
+		raop_resample->fill = 0.0;
+		return;
+	}
+	raop_resample->produced += frames;
+
+	elapsed = (double)(now - raop_resample->anchor_time) / RAOP_NTP_SECOND;
+	level = raop_resample->produced - elapsed * raop_resample->sample_rate;
+	error = level - raop_resample->reference;
+	if (error > RAOP_RESAMPLE_MAX_ERROR * raop_resample->sample_rate ||
+	    error < -RAOP_RESAMPLE_MAX_ERROR * raop_resample->sample_rate) {
+		/* Sender paused without a flush, measure again from here */
+		raop_resample->anchored = 0;
+		return;
+	}
+
+	dt = (double)(now - raop_resample->last_time) / RAOP_NTP_SECOND;
+	raop_resample->last_time = now;
+	raop_resample->fill += dt / (RAOP_RESAMPLE_SMOOTHING + dt) * (error - raop_resample->fill);
+
+	raop_resample->integral += RAOP_RESAMPLE_KI * raop_resample->fill * dt;
+	if (raop_resample->integral > RAOP_RESAMPLE_MAX_PPM) {
+		raop_resample->integral = RAOP_RESAMPLE_MAX_PPM;
+	} else if (raop_resample->integral < -RAOP_RESAMPLE_MAX_PPM) {
+		raop_resample->integral = -RAOP_RESAMPLE_MAX_PPM;
+	}
+	raop_resample->ratio_ppm = RAOP_RESAMPLE_KP * raop_resample->fill + raop_resample->integral;
+	if (raop_resample->ratio_ppm > RAOP_RESAMPLE_MAX_PPM) {
+		raop_resample->ratio_ppm = RAOP_RESAMPLE_MAX_PPM;
+	} else if (raop_resample->ratio_ppm < -RAOP_RESAMPLE_MAX_PPM) {
+		raop_resample->ratio_ppm = -RAOP_RESAMPLE_MAX_PPM;
+	}
+}
+
+int
+raop_resample_process(raop_resample_t *raop_resample, const void *input, int inputlen,
+                      void *output, uint64_t now)
+{
+	int framelen, frames, count, c;
+	double step, end;
+
+	assert(raop_resample);
+	assert(input);
+	assert(output);
+
+	framelen = raop_resample->channels * raop_resample->bytes;
+	frames = inputlen / framelen;
+	if (frames > raop_resample->max_frames) {
+		frames = raop_resample->max_frames;
+	}
+	raop_resample_deinterleave(raop_resample, input, frames);
+
+	/* Positive ratio consumes the input faster and produces less output */
+	step = 1.0 + raop_resample->ratio_ppm / 1000000.0;
+	end = RAOP_RESAMPLE_HISTORY + frames - 2;
+
+	count = 0;
+	while (raop_resample->position < end) {
+		int offset = (int)raop_resample->position;
+		double frac = raop_resample->position - offset;
+		double run;
+		int length;
+
+		/* Output frames until the fraction wraps to another input frame */
+		length = raop_resample_ceil((end - raop_resample->position) / step);
+		if (step > 1.0) {
+			run = (1.0 - frac) / (step - 1.0);
+			if (run < length) {
+				length = raop_resample_ceil(run);
+			}
+		} else if (step < 1.0) {
+			run = frac / (1.0 - step);
+			if (run < length) {
+				length = (int)run + 1;
+			}
+		}
+		if (count + length > raop_resample->max_frames+2) {
+			break;
+		}
+
+		for (c=0; c<raop_resample->channels; c++) {
+			raop_resample_run(&raop_resample->input[c*raop_resample->stride + offset],
+			                  &raop_resample->output[c*(raop_resample->max_frames+2) + count],
+			                  length, (float)frac, (float)(step - 1.0));
+		}
+		count += length;
+		raop_resample->position += length * step;
+	}
+
+	/* Keep the last input frames as history for the next call */
+	raop_resample->position -= frames;
+	for (c=0; c<raop_resample->channels; c++) {
+		float *plane = &raop_resample->input[c*raop_resample->stride];
+		memmove(plane, plane+frames, RAOP_RESAMPLE_HISTORY*sizeof(float));
+	}
+
+	raop_resample_interleave(raop_resample, output, count);
+	raop_resample_update(raop_resample, count, now);
+	return count * framelen;
+}
@@ -0,0 +1,38 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_RESAMPLE_H
+#define RAOP_RESAMPLE_H
+
+#include <stdint.h>
+
+/* Largest rate correction ever applied, in parts per million */
+#define RAOP_RESAMPLE_MAX_PPM 500.0
+
+typedef struct raop_resample_s raop_resample_t;
+
+raop_resample_t *raop_resample_init(int channels, int bits, int sample_rate, int max_frames);
+
+/* Output length in bytes is at most this for an input of max_frames */
+int raop_resample_get_max_output(raop_resample_t *raop_resample);
+double raop_resample_get_ratio_ppm(raop_resample_t *raop_resample);
+
+/* Resamples one frame, now is the monotonic time the output is produced */
+int raop_resample_process(raop_resample_t *raop_resample, const void *input, int inputlen,
+                          void *output, uint64_t now);
+void raop_resample_reset(raop_resample_t *raop_resample);
+
+void raop_resample_destroy(raop_resample_t *raop_resample);
+
+#endif
@@ -12,21 +12,85 @@
  *  Lesser General Public License for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_RECVMMSG)
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#else
+# define USE_EPOLL 0
+#endif
+
 #include "raop_rtp.h"
 #include "raop.h"
 #include "raop_buffer.h"
+#include "raop_ntp.h"
+#include "raop_resample.h"
 #include "netutils.h"
 #include "utils.h"
 #include "compat.h"
 #include "logger.h"
-
-#define NO_FLUSH (-42)
+#include "trace.h"
+
+/* Maximum number of datagrams read with one recvmmsg call */
+#define RAOP_RTP_BATCH_LEN 8
+
+/* Timing requests are sent quickly until the clock filter is full */
+#define RAOP_RTP_TIMING_FAST_COUNT 8
+#define RAOP_RTP_TIMING_FAST_INTERVAL (RAOP_NTP_SECOND/5)
+#define RAOP_RTP_TIMING_INTERVAL (3*RAOP_NTP_SECOND)
+
+/* Most resend request packets sent in one batch */
+#define RAOP_RTP_MAX_RESEND_RANGES 16
+
+/* Capacity of the event queue, must be a power of two */
+#define RAOP_RTP_EVENT_QUEUE_LEN 64
+
+typedef enum {
+	RAOP_RTP_EVENT_VOLUME,
+	RAOP_RTP_EVENT_FLUSH,
+	RAOP_RTP_EVENT_METADATA,
+	RAOP_RTP_EVENT_COVERART,
+	RAOP_RTP_EVENT_REMOTE_CONTROL_ID,
+	RAOP_RTP_EVENT_PROGRESS
+} raop_rtp_event_type_t;
+
+/* Event passed from the RTSP handlers to the RTP thread with its payload */
+typedef struct {
+	raop_rtp_event_type_t type;
+	union {
+		float volume;
+		int next_seq;
+		struct {
+			unsigned char *data;
+			int datalen;
+		} buffer;
+		struct {
+			char *dacp_id;
+			char *active_remote_header;
+		} remote;
+		struct {
+			unsigned int start;
+			unsigned int curr;
+			unsigned int end;
+		} progress;
+	} u;
+} raop_rtp_event_t;
+
+/* Event that did not fit in the queue, the overflow list always starts
+ * with a node that has already been handled */
+typedef struct raop_rtp_overflow_s {
+	raop_rtp_event_t event;
+	struct raop_rtp_overflow_s *next;
+} raop_rtp_overflow_t;
 
 struct raop_rtp_s {
 	logger_t *logger;
@@ -35,33 +99,45 @@ struct raop_rtp_s {
 	/* Buffer to handle all resends */
 	raop_buffer_t *buffer;
 
+	/* Sender clock estimate from the timing channel */
+	raop_ntp_t *ntp;
+
+	/* Optional drift compensation between dequeue and output */
+	raop_resample_t *resample;
+	unsigned char *resample_buffer;
+
 	/* Remote address as sockaddr */
 	struct sockaddr_storage remote_saddr;
 	socklen_t remote_saddr_len;
 
 	/* MUTEX LOCKED VARIABLES START */
-	/* These variables only edited mutex locked */
+	/* These variables only edited mutex locked, running
+	 * is read without the mutex by the RTP thread */
 	int running;
 	int joined;
 
-	float volume;
-	int volume_changed;
-	unsigned char *metadata;
-	int metadata_len;
-	unsigned char *coverart;
-	int coverart_len;
-	char *dacp_id;
-	char *active_remote_header;
-	unsigned int progress_start;
-	unsigned int progress_curr;
-	unsigned int progress_end;
-	int progress_changed;
-
-	int flush;
 	thread_handle_t thread;
 	mutex_handle_t run_mutex;
 	/* MUTEX LOCKED VARIABLES END */
 
+	/* Single producer single consumer event queue, the RTSP handlers
+	 * only write event_head and the RTP thread only event_tail */
+	raop_rtp_event_t events[RAOP_RTP_EVENT_QUEUE_LEN];
+	unsigned int event_head;
+	unsigned int event_tail;
+
+	/* Events posted while the queue is full or the overflow list is not
+	 * empty, linked in posting order. The RTSP handlers append after
+	 * overflow_last and the RTP thread removes from overflow_first */
+	raop_rtp_overflow_t overflow_stub;
+	raop_rtp_overflow_t *overflow_first;
+	raop_rtp_overflow_t *overflow_last;
+	unsigned int overflow_posted;
+	unsigned int overflow_handled;
+
+	/* Wakes up the RTP thread when events are queued or it is stopped */
+	int wakeup_rfd, wakeup_wfd;
+
 	/* Remote control and timing ports */
 	unsigned short control_rport;
 	unsigned short timing_rport;
@@ -78,6 +154,24 @@ struct raop_rtp_s {
 	struct sockaddr_storage control_saddr;
 	socklen_t control_saddr_len;
 	unsigned short control_seqnum;
+
+	/* Latest sync packet, the frame with sync_timestamp is heard at
+	 * sync_ntp_time of the sender clock when the latency is included */
+	int sync_valid;
+	unsigned int sync_timestamp;
+	uint64_t sync_ntp_time;
+	unsigned int sync_latency;
+
+	/* Sender timing port address, length zero if unknown */
+	struct sockaddr_storage timing_saddr;
+	socklen_t timing_saddr_len;
+	uint64_t timing_next;
+	unsigned int timing_requests;
+
+	/* Interarrival jitter estimate in samples and the previous transit */
+	int jitter_valid;
+	double jitter;
+	int last_transit;
 };
 
 static int
@@ -125,10 +219,55 @@ raop_rtp_parse_remote(raop_rtp_t *raop_rtp, const char *remote)
 	return 0;
 }
 
+static void
+raop_rtp_event_free(raop_rtp_event_t *event)
+{
+	switch (event->type) {
+	case RAOP_RTP_EVENT_METADATA:
+	case RAOP_RTP_EVENT_COVERART:
+		free(event->u.buffer.data);
+		break;
+	case RAOP_RTP_EVENT_REMOTE_CONTROL_ID:
+		free(event->u.remote.dacp_id);
+		free(event->u.remote.active_remote_header);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Queues the event to the RTP thread, which takes ownership of any
+ * payload. Called by one RTSP handler at a time. Once an event goes to
+ * the overflow list the following ones do too, until the RTP thread has
+ * handled the list, so the order is kept without waiting or dropping */
+static void
+raop_rtp_event_push(raop_rtp_t *raop_rtp, raop_rtp_event_t *event)
+{
+	unsigned int head = raop_rtp->event_head;
+
+	if (raop_rtp->overflow_posted == ATOMIC_LOAD(&raop_rtp->overflow_handled) &&
+	    head - ATOMIC_LOAD(&raop_rtp->event_tail) < RAOP_RTP_EVENT_QUEUE_LEN) {
+		memcpy(&raop_rtp->events[head & (RAOP_RTP_EVENT_QUEUE_LEN-1)], event, sizeof(raop_rtp_event_t));
+		ATOMIC_STORE(&raop_rtp->event_head, head+1);
+	} else {
+		raop_rtp_overflow_t *overflow = malloc(sizeof(raop_rtp_overflow_t));
+
+		assert(overflow);
+		memcpy(&overflow->event, event, sizeof(raop_rtp_event_t));
+		overflow->next = NULL;
+		ATOMIC_STORE_PTR(&raop_rtp->overflow_last->next, overflow);
+		raop_rtp->overflow_last = overflow;
+		raop_rtp->overflow_posted++;
+	}
+	netutils_signal_wakeup(raop_rtp->wakeup_wfd);
+}
+
 raop_rtp_t *
 raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
               const char *rtpmap, const char *fmtp,
-              const unsigned char *aeskey, const unsigned char *aesiv)
+              const unsigned char *aeskey, const unsigned char *aesiv,
+              int min_length, int max_length, int min_latency,
+              int drift_compensation, int loss_concealment)
 {
 	raop_rtp_t *raop_rtp;
 
@@ -144,20 +283,55 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
 	}
 	raop_rtp->logger = logger;
 	memcpy(&raop_rtp->callbacks, callbacks, sizeof(raop_callbacks_t));
-	raop_rtp->buffer = raop_buffer_init(rtpmap, fmtp, aeskey, aesiv);
+	raop_rtp->buffer = raop_buffer_init(rtpmap, fmtp, aeskey, aesiv,
+	                                     min_length, max_length, min_latency);
 	if (!raop_rtp->buffer) {
 		free(raop_rtp);
 		return NULL;
 	}
-	if (raop_rtp_parse_remote(raop_rtp, remote) < 0) {
+	if (raop_buffer_set_loss_concealment(raop_rtp->buffer, loss_concealment) < 0 ||
+	    raop_rtp_parse_remote(raop_rtp, remote) < 0) {
+		raop_buffer_destroy(raop_rtp->buffer);
+		free(raop_rtp);
+		return NULL;
+	}
+	raop_rtp->ntp = raop_ntp_init(logger);
+	if (!raop_rtp->ntp) {
+		raop_buffer_destroy(raop_rtp->buffer);
+		free(raop_rtp);
+		return NULL;
+	}
+	if (drift_compensation) {
+		const ALACSpecificConfig *config = raop_buffer_get_config(raop_rtp->buffer);
+
+		raop_rtp->resample = raop_resample_init(config->numChannels,
+		                                        raop_buffer_get_output_bits(raop_rtp->buffer),
+		                                        config->sampleRate, config->frameLength);
+		if (raop_rtp->resample) {
+			raop_rtp->resample_buffer = malloc(raop_resample_get_max_output(raop_rtp->resample));
+		}
+		if (!raop_rtp->resample_buffer) {
+			raop_resample_destroy(raop_rtp->resample);
+			raop_ntp_destroy(raop_rtp->ntp);
+			raop_buffer_destroy(raop_rtp->buffer);
+			free(raop_rtp);
+			return NULL;
+		}
+	}
+	if (netutils_init_wakeup(&raop_rtp->wakeup_rfd, &raop_rtp->wakeup_wfd) < 0) {
+		free(raop_rtp->resample_buffer);
+		raop_resample_destroy(raop_rtp->resample);
+		raop_ntp_destroy(raop_rtp->ntp);
+		raop_buffer_destroy(raop_rtp->buffer);
 		free(raop_rtp);
 		return NULL;
 	}
 
 	raop_rtp->running = 0;
 	raop_rtp->joined = 1;
-	raop_rtp->flush = NO_FLUSH;
 	MUTEX_CREATE(raop_rtp->run_mutex);
+	raop_rtp->overflow_first = &raop_rtp->overflow_stub;
+	raop_rtp->overflow_last = &raop_rtp->overflow_stub;
 
 	return raop_rtp;
 }
@@ -168,12 +342,30 @@ raop_rtp_destroy(raop_rtp_t *raop_rtp)
 	if (raop_rtp) {
 		raop_rtp_stop(raop_rtp);
 
+		/* Free the payloads of events never processed */
+		while (raop_rtp->event_tail != raop_rtp->event_head) {
+			raop_rtp_event_free(&raop_rtp->events[raop_rtp->event_tail & (RAOP_RTP_EVENT_QUEUE_LEN-1)]);
+			raop_rtp->event_tail++;
+		}
+		while (raop_rtp->overflow_first->next) {
+			raop_rtp_overflow_t *overflow = raop_rtp->overflow_first;
+
+			raop_rtp->overflow_first = overflow->next;
+			raop_rtp_event_free(&raop_rtp->overflow_first->event);
+			if (overflow != &raop_rtp->overflow_stub) {
+				free(overflow);
+			}
+		}
+		if (raop_rtp->overflow_first != &raop_rtp->overflow_stub) {
+			free(raop_rtp->overflow_first);
+		}
+
+		netutils_close_wakeup(raop_rtp->wakeup_rfd, raop_rtp->wakeup_wfd);
 		MUTEX_DESTROY(raop_rtp->run_mutex);
+		free(raop_rtp->resample_buffer);
+		raop_resample_destroy(raop_rtp->resample);
+		raop_ntp_destroy(raop_rtp->ntp);
 		raop_buffer_destroy(raop_rtp->buffer);
-		free(raop_rtp->metadata);
-		free(raop_rtp->coverart);
-		free(raop_rtp->dacp_id);
-		free(raop_rtp->active_remote_header);
 		free(raop_rtp);
 	}
 }
@@ -223,181 +415,604 @@ sockets_cleanup:
 }
 
 static int
-raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short count)
+raop_rtp_resend_callback(void *opaque, const raop_resend_range_t *ranges, int nranges)
 {
 	raop_rtp_t *raop_rtp = opaque;
-	unsigned char packet[8];
-	unsigned short ourseqnum;
+	unsigned char packets[RAOP_RTP_MAX_RESEND_RANGES][8];
 	struct sockaddr *addr;
 	socklen_t addrlen;
-	int ret;
+	int i, ret;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[RAOP_RTP_MAX_RESEND_RANGES];
+	struct iovec iovs[RAOP_RTP_MAX_RESEND_RANGES];
+#endif
 
 	addr = (struct sockaddr *)&raop_rtp->control_saddr;
 	addrlen = raop_rtp->control_saddr_len;
+	if (nranges > RAOP_RTP_MAX_RESEND_RANGES) {
+		nranges = RAOP_RTP_MAX_RESEND_RANGES;
+	}
 
-	logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got resend request %d %d", seqnum, count);
-	ourseqnum = raop_rtp->control_seqnum++;
-
-	/* Fill the request buffer */
-	packet[0] = 0x80;
-	packet[1] = 0x55|0x80;
-	packet[2] = (ourseqnum >> 8);
-	packet[3] =  ourseqnum;
-	packet[4] = (seqnum >> 8);
-	packet[5] =  seqnum;
-	packet[6] = (count >> 8);
-	packet[7] =  count;
-
-	ret = sendto(raop_rtp->csock, (const char *)packet, sizeof(packet), 0, addr, addrlen);
-	if (ret == -1) {
+	/* Fill one request packet for each range */
+	for (i=0; i<nranges; i++) {
+		unsigned short ourseqnum = raop_rtp->control_seqnum++;
+		unsigned char *packet = packets[i];
+
+		TRACE3(resend_request, raop_rtp, ranges[i].seqnum, ranges[i].count);
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got resend request %d %d",
+		           ranges[i].seqnum, ranges[i].count);
+		packet[0] = 0x80;
+		packet[1] = 0x55|0x80;
+		packet[2] = (ourseqnum >> 8);
+		packet[3] =  ourseqnum;
+		packet[4] = (ranges[i].seqnum >> 8);
+		packet[5] =  ranges[i].seqnum;
+		packet[6] = (ranges[i].count >> 8);
+		packet[7] =  ranges[i].count;
+	}
+
+#ifdef HAVE_SENDMMSG
+	/* Send the whole batch with a single system call */
+	memset(msgs, 0, sizeof(msgs));
+	for (i=0; i<nranges; i++) {
+		iovs[i].iov_base = packets[i];
+		iovs[i].iov_len = sizeof(packets[i]);
+		msgs[i].msg_hdr.msg_name = addr;
+		msgs[i].msg_hdr.msg_namelen = addrlen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = sendmmsg(raop_rtp->csock, msgs, nranges, 0);
+	if (ret < nranges) {
 		logger_log(raop_rtp->logger, LOGGER_WARNING, "Resend failed: %d", SOCKET_GET_ERROR());
 	}
+#else
+	for (i=0; i<nranges; i++) {
+		ret = sendto(raop_rtp->csock, (const char *)packets[i], sizeof(packets[i]), 0, addr, addrlen);
+		if (ret == -1) {
+			logger_log(raop_rtp->logger, LOGGER_WARNING, "Resend failed: %d", SOCKET_GET_ERROR());
+		}
+	}
+#endif
 
 	return 0;
 }
 
+static void
+raop_rtp_handle_event(raop_rtp_t *raop_rtp, void *cb_data, raop_rtp_event_t *event)
+{
+	raop_callbacks_t *cbs = &raop_rtp->callbacks;
+
+	switch (event->type) {
+	case RAOP_RTP_EVENT_VOLUME:
+		if (cbs->audio_set_volume) {
+			cbs->audio_set_volume(cbs->cls, cb_data, event->u.volume);
+		}
+		break;
+	case RAOP_RTP_EVENT_FLUSH:
+		TRACE2(flush, raop_rtp, event->u.next_seq);
+		raop_buffer_flush(raop_rtp->buffer, event->u.next_seq);
+		if (raop_rtp->resample) {
+			raop_resample_reset(raop_rtp->resample);
+		}
+		/* Timestamps jump at a flush, restart the transit times */
+		raop_rtp->jitter_valid = 0;
+		if (cbs->audio_flush) {
+			cbs->audio_flush(cbs->cls, cb_data);
+		}
+		break;
+	case RAOP_RTP_EVENT_METADATA:
+		if (cbs->audio_set_metadata) {
+			cbs->audio_set_metadata(cbs->cls, cb_data, event->u.buffer.data, event->u.buffer.datalen);
+		}
+		break;
+	case RAOP_RTP_EVENT_COVERART:
+		if (cbs->audio_set_coverart) {
+			cbs->audio_set_coverart(cbs->cls, cb_data, event->u.buffer.data, event->u.buffer.datalen);
+		}
+		break;
+	case RAOP_RTP_EVENT_REMOTE_CONTROL_ID:
+		if (cbs->audio_remote_control_id) {
+			cbs->audio_remote_control_id(cbs->cls, event->u.remote.dacp_id, event->u.remote.active_remote_header);
+		}
+		break;
+	case RAOP_RTP_EVENT_PROGRESS:
+		if (cbs->audio_set_progress) {
+			cbs->audio_set_progress(cbs->cls, cb_data, event->u.progress.start,
+			                        event->u.progress.curr, event->u.progress.end);
+		}
+		break;
+	}
+	raop_rtp_event_free(event);
+}
+
 static int
 raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 {
-	int flush;
-	float volume;
-	int volume_changed;
-	unsigned char *metadata;
-	int metadata_len;
-	unsigned char *coverart;
-	int coverart_len;
-	char *dacp_id;
-	char *active_remote_header;
-	unsigned int progress_start;
-	unsigned int progress_curr;
-	unsigned int progress_end;
-	int progress_changed;
+	raop_rtp_overflow_t *overflow;
+	unsigned int head, tail;
 
 	assert(raop_rtp);
 
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	if (!raop_rtp->running) {
-		MUTEX_UNLOCK(raop_rtp->run_mutex);
+	if (!ATOMIC_LOAD(&raop_rtp->running)) {
 		return 1;
 	}
 
-	/* Read the volume level */
-	volume = raop_rtp->volume;
-	volume_changed = raop_rtp->volume_changed;
-	raop_rtp->volume_changed = 0;
-
-	/* Read the flush value */
-	flush = raop_rtp->flush;
-	raop_rtp->flush = NO_FLUSH;
-
-	/* Read the metadata */
-	metadata = raop_rtp->metadata;
-	metadata_len = raop_rtp->metadata_len;
-	raop_rtp->metadata = NULL;
-	raop_rtp->metadata_len = 0;
-
-	/* Read the coverart */
-	coverart = raop_rtp->coverart;
-	coverart_len = raop_rtp->coverart_len;
-	raop_rtp->coverart = NULL;
-	raop_rtp->coverart_len = 0;
-	
-	/* Read DACP remote control data */
-	dacp_id = raop_rtp->dacp_id;
-	active_remote_header = raop_rtp->active_remote_header;
-	raop_rtp->dacp_id = NULL;
-	raop_rtp->active_remote_header = NULL;
-
-	/* Read the progress values */
-	progress_start = raop_rtp->progress_start;
-	progress_curr = raop_rtp->progress_curr;
-	progress_end = raop_rtp->progress_end;
-	progress_changed = raop_rtp->progress_changed;
-	raop_rtp->progress_changed = 0;
+	/* Handle all queued events in order, nothing to do in the common case.
+	 * The queue is drained again before each overflow event, as events
+	 * queued before it may only become visible together with it */
+	tail = raop_rtp->event_tail;
+	do {
+		head = ATOMIC_LOAD(&raop_rtp->event_head);
+		while (tail != head) {
+			raop_rtp_handle_event(raop_rtp, cb_data, &raop_rtp->events[tail & (RAOP_RTP_EVENT_QUEUE_LEN-1)]);
+			tail++;
+			ATOMIC_STORE(&raop_rtp->event_tail, tail);
+		}
+
+		overflow = ATOMIC_LOAD_PTR(&raop_rtp->overflow_first->next);
+		if (overflow) {
+			if (raop_rtp->overflow_first != &raop_rtp->overflow_stub) {
+				free(raop_rtp->overflow_first);
+			}
+			raop_rtp->overflow_first = overflow;
+			raop_rtp_handle_event(raop_rtp, cb_data, &overflow->event);
+			ATOMIC_STORE(&raop_rtp->overflow_handled, raop_rtp->overflow_handled+1);
+		}
+	} while (overflow);
+	return 0;
+}
 
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+static unsigned int
+raop_rtp_read_u32(const unsigned char *data)
+{
+	return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void
+raop_rtp_process_sync(raop_rtp_t *raop_rtp, const unsigned char *packet)
+{
+	unsigned int timestamp_less_latency;
+	unsigned int latency;
+
+	/* The sender clock is at ntp_time when it plays the frame at the
+	 * second timestamp, the first one has the latency subtracted */
+	timestamp_less_latency = raop_rtp_read_u32(packet+4);
+	raop_rtp->sync_ntp_time = ((uint64_t)raop_rtp_read_u32(packet+8) << 32) |
+	                          raop_rtp_read_u32(packet+12);
+	raop_rtp->sync_timestamp = raop_rtp_read_u32(packet+16);
+	latency = raop_rtp->sync_timestamp - timestamp_less_latency;
+
+	if (!raop_rtp->sync_valid || latency != raop_rtp->sync_latency) {
+		logger_log(raop_rtp->logger, LOGGER_INFO, "Sender latency is %u samples", latency);
+	}
+	if (packet[0] & 0x10) {
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got first sync packet after flush");
+	}
+	raop_rtp->sync_latency = latency;
+	raop_rtp->sync_valid = 1;
+}
 
-	/* Call set_volume callback if changed */
-	if (volume_changed) {
-		if (raop_rtp->callbacks.audio_set_volume) {
-			raop_rtp->callbacks.audio_set_volume(raop_rtp->callbacks.cls, cb_data, volume);
+/* Returns 1 if a resent data packet was queued */
+static int
+raop_rtp_process_control(raop_rtp_t *raop_rtp, unsigned char *packet, int packetlen,
+                         struct sockaddr_storage *saddr, socklen_t saddrlen, uint64_t recv_time)
+{
+	/* Get the destination address here, because we need the sin6_scope_id */
+	memcpy(&raop_rtp->control_saddr, saddr, saddrlen);
+	raop_rtp->control_saddr_len = saddrlen;
+
+	if (packetlen >= 12) {
+		char type = packet[1] & ~0x80;
+
+		TRACE3(packet_receive, raop_rtp, type, packetlen);
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got control packet of type 0x%02x", type);
+		if (type == 0x56) {
+			/* Handle resent data packet */
+			int ret = raop_buffer_queue(raop_rtp->buffer, packet+4, packetlen-4, 1, recv_time);
+			assert(ret >= 0);
+			return ret;
+		} else if (type == 0x54 && packetlen >= 20) {
+			raop_rtp_process_sync(raop_rtp, packet);
 		}
 	}
+	return 0;
+}
 
-	/* Handle flush if requested */
-	if (flush != NO_FLUSH) {
-		raop_buffer_flush(raop_rtp->buffer, flush);
-		if (raop_rtp->callbacks.audio_flush) {
-			raop_rtp->callbacks.audio_flush(raop_rtp->callbacks.cls, cb_data);
+static void
+raop_rtp_process_timing(raop_rtp_t *raop_rtp, unsigned char *packet, int packetlen,
+                        struct sockaddr_storage *saddr, socklen_t saddrlen)
+{
+	uint64_t recv_time = raop_ntp_get_local_time(raop_rtp->ntp);
+	unsigned char response[RAOP_NTP_PACKET_LEN];
+	char type;
+
+	if (packetlen < RAOP_NTP_PACKET_LEN) {
+		return;
+	}
+	type = packet[1] & ~0x80;
+	TRACE3(packet_receive, raop_rtp, type, packetlen);
+	if (type == 0x53) {
+		/* Response to our timing request */
+		raop_ntp_process_response(raop_rtp->ntp, packet, packetlen, recv_time);
+	} else if (type == 0x52) {
+		/* Timing request from the sender, answer right away */
+		if (raop_ntp_create_response(raop_rtp->ntp, packet, packetlen, recv_time, response) > 0) {
+			sendto(raop_rtp->tsock, (const char *)response, sizeof(response), 0,
+			       (struct sockaddr *)saddr, saddrlen);
 		}
+	} else {
+		logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got timing packet of type 0x%02x", type);
+	}
+}
+
+/* Sends a timing request if one is due, returns the milliseconds
+ * until the next request or -1 if the sender timing port is unknown */
+static int
+raop_rtp_send_timing(raop_rtp_t *raop_rtp)
+{
+	uint64_t now;
+
+	if (!raop_rtp->timing_saddr_len) {
+		return -1;
 	}
 
-	if (metadata != NULL) {
-		if (raop_rtp->callbacks.audio_set_metadata) {
-			raop_rtp->callbacks.audio_set_metadata(raop_rtp->callbacks.cls, cb_data, metadata, metadata_len);
+	now = raop_ntp_get_local_time(raop_rtp->ntp);
+	if ((int64_t)(now - raop_rtp->timing_next) >= 0) {
+		unsigned char packet[RAOP_NTP_PACKET_LEN];
+		int ret;
+
+		raop_ntp_create_request(raop_rtp->ntp, now, packet);
+		ret = sendto(raop_rtp->tsock, (const char *)packet, sizeof(packet), 0,
+		             (struct sockaddr *)&raop_rtp->timing_saddr, raop_rtp->timing_saddr_len);
+		if (ret == -1) {
+			logger_log(raop_rtp->logger, LOGGER_WARNING, "Timing request failed: %d", SOCKET_GET_ERROR());
 		}
-		free(metadata);
-		metadata = NULL;
+		if (raop_rtp->timing_requests++ < RAOP_RTP_TIMING_FAST_COUNT) {
+			raop_rtp->timing_next = now + RAOP_RTP_TIMING_FAST_INTERVAL;
+		} else {
+			raop_rtp->timing_next = now + RAOP_RTP_TIMING_INTERVAL;
+		}
+	}
+	return (int)(((raop_rtp->timing_next - now) * 1000) >> 32) + 1;
+}
+
+/* Interarrival jitter as in RFC 3550, in units of the sample clock */
+static void
+raop_rtp_update_jitter(raop_rtp_t *raop_rtp, const unsigned char *packet, uint64_t recv_time)
+{
+	unsigned int sample_rate = raop_buffer_get_config(raop_rtp->buffer)->sampleRate;
+	uint64_t arrival;
+	unsigned int timestamp;
+	int transit, diff;
+
+	if (!sample_rate) {
+		return;
+	}
+	arrival = ((recv_time >> 16) * sample_rate) >> 16;
+	timestamp = (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+	transit = (int)((unsigned int)arrival - timestamp);
+	if (raop_rtp->jitter_valid) {
+		diff = transit - raop_rtp->last_transit;
+		if (diff < 0) diff = -diff;
+		raop_rtp->jitter += (diff - raop_rtp->jitter) / 16.0;
+		RAOP_STATS_SET(raop_buffer_get_stats(raop_rtp->buffer), jitter_usec,
+		               (unsigned int)(raop_rtp->jitter * 1000000.0 / sample_rate));
+	}
+	raop_rtp->last_transit = transit;
+	raop_rtp->jitter_valid = 1;
+}
+
+static int
+raop_rtp_process_data(raop_rtp_t *raop_rtp, unsigned char *packet, int packetlen, uint64_t recv_time)
+{
+	int ret;
+
+	if (packetlen < 12) {
+		return 0;
+	}
+	TRACE3(packet_receive, raop_rtp, packet[1] & 0x7f, packetlen);
+	raop_rtp_update_jitter(raop_rtp, packet, recv_time);
+	ret = raop_buffer_queue(raop_rtp->buffer, packet, packetlen, 1, recv_time);
+	assert(ret >= 0);
+	return 1;
+}
+
+typedef struct {
+	raop_rtp_t *raop_rtp;
+	void *cb_data;
+} raop_rtp_output_t;
+
+static void *
+raop_rtp_output_callback(void *opaque, int buflen)
+{
+	raop_rtp_output_t *output = opaque;
+	raop_rtp_t *raop_rtp = output->raop_rtp;
+
+	return raop_rtp->callbacks.audio_get_buffer(raop_rtp->callbacks.cls, output->cb_data, buflen);
+}
+
+static const void *
+raop_rtp_dequeue(raop_rtp_t *raop_rtp, void *cb_data, int *length, unsigned int *timestamp, int no_resend)
+{
+	raop_rtp_output_t output;
+
+	/* The resampler output is lent instead when compensating drift */
+	if (!raop_rtp->callbacks.audio_get_buffer || raop_rtp->resample) {
+		return raop_buffer_dequeue(raop_rtp->buffer, length, timestamp, no_resend, NULL, NULL);
+	}
+	output.raop_rtp = raop_rtp;
+	output.cb_data = cb_data;
+	return raop_buffer_dequeue(raop_rtp->buffer, length, timestamp, no_resend,
+	                           raop_rtp_output_callback, &output);
+}
+
+/* Local time in microseconds at which the frame should be heard, or 0 if
+ * the sender clock or the sync packets are not available yet */
+static unsigned long long
+raop_rtp_get_presentation_time(raop_rtp_t *raop_rtp, unsigned int timestamp)
+{
+	unsigned int sample_rate = raop_buffer_get_config(raop_rtp->buffer)->sampleRate;
+	raop_ntp_clock_t clock;
+	uint64_t remote_time, local_time;
+	int diff;
+
+	if (!raop_rtp->sync_valid || !sample_rate) {
+		return 0;
+	}
+	raop_ntp_get_clock(raop_rtp->ntp, &clock);
+	if (!clock.synchronized) {
+		return 0;
 	}
 
-	if (coverart != NULL) {
-		if (raop_rtp->callbacks.audio_set_coverart) {
-			raop_rtp->callbacks.audio_set_coverart(raop_rtp->callbacks.cls, cb_data, coverart, coverart_len);
+	/* Samples from the synced frame, the latency delays all frames */
+	diff = (int)(timestamp - raop_rtp->sync_timestamp) + (int)raop_rtp->sync_latency;
+	if (diff > 60*(int)sample_rate || diff < -60*(int)sample_rate) {
+		return 0;
+	}
+	remote_time = raop_rtp->sync_ntp_time + (int64_t)diff * (int64_t)RAOP_NTP_SECOND / sample_rate;
+	local_time = raop_ntp_remote_to_local(raop_rtp->ntp, remote_time);
+	local_time = raop_ntp_local_to_monotonic(raop_rtp->ntp, local_time);
+	return RAOP_NTP_TO_USEC(local_time);
+}
+
+static void
+raop_rtp_output_audio(raop_rtp_t *raop_rtp, void *cb_data, const void *audiobuf, int audiobuflen,
+                      unsigned int timestamp)
+{
+	raop_callbacks_t *cbs = &raop_rtp->callbacks;
+	uint64_t start;
+
+	if (raop_rtp->resample) {
+		void *output = NULL;
+
+		if (cbs->audio_get_buffer) {
+			output = cbs->audio_get_buffer(cbs->cls, cb_data,
+			                               raop_resample_get_max_output(raop_rtp->resample));
 		}
-		free(coverart);
-		coverart = NULL;
+		if (!output) {
+			output = raop_rtp->resample_buffer;
+		}
+		audiobuflen = raop_resample_process(raop_rtp->resample, audiobuf, audiobuflen,
+		                                    output, raop_ntp_get_monotonic_time());
+		audiobuf = output;
+	}
+	if (cbs->audio_process_timed) {
+		unsigned long long pts = raop_rtp_get_presentation_time(raop_rtp, timestamp);
+
+		start = raop_ntp_get_monotonic_time();
+		cbs->audio_process_timed(cbs->cls, cb_data, audiobuf, audiobuflen, pts);
+	} else {
+		start = raop_ntp_get_monotonic_time();
+		cbs->audio_process(cbs->cls, cb_data, audiobuf, audiobuflen);
 	}
-	if (dacp_id && active_remote_header) {
-		if (raop_rtp->callbacks.audio_remote_control_id) {
-			raop_rtp->callbacks.audio_remote_control_id(raop_rtp->callbacks.cls, dacp_id, active_remote_header);
+	raop_histogram_add(raop_buffer_get_latency(raop_rtp->buffer, RAOP_LATENCY_CALLBACK),
+	                   RAOP_NTP_TO_NSEC(raop_ntp_get_monotonic_time() - start));
+}
+
+static void
+raop_rtp_process_audio(raop_rtp_t *raop_rtp, void *cb_data)
+{
+	int no_resend = (raop_rtp->control_rport == 0);
+	const void *audiobuf;
+	int audiobuflen;
+	unsigned int timestamp;
+
+	/* Decode all frames in queue */
+	while ((audiobuf = raop_rtp_dequeue(raop_rtp, cb_data, &audiobuflen, &timestamp, no_resend))) {
+		raop_rtp_output_audio(raop_rtp, cb_data, audiobuf, audiobuflen, timestamp);
+	}
+
+	/* Handle possible resend requests */
+	if (!no_resend) {
+		raop_buffer_handle_resends(raop_rtp->buffer, raop_ntp_get_monotonic_time(),
+		                           raop_rtp_resend_callback, raop_rtp);
+	}
+}
+
+/* Sends the timing and resend requests that are due, returns the
+ * milliseconds until the next one or -1 if nothing is scheduled */
+static int
+raop_rtp_send_requests(raop_rtp_t *raop_rtp)
+{
+	int timeout, resend_timeout;
+
+	timeout = raop_rtp_send_timing(raop_rtp);
+	if (raop_rtp->control_rport == 0) {
+		return timeout;
+	}
+	resend_timeout = raop_buffer_handle_resends(raop_rtp->buffer, raop_ntp_get_monotonic_time(),
+	                                            raop_rtp_resend_callback, raop_rtp);
+	if (resend_timeout >= 0 && (timeout < 0 || resend_timeout < timeout)) {
+		timeout = resend_timeout;
+	}
+	return timeout;
+}
+
+#if USE_EPOLL
+/* Reads all pending datagrams from the socket using recvmmsg, returns the
+ * number of data packets queued or -1 in case of a fatal socket error */
+static int
+raop_rtp_drain_socket(raop_rtp_t *raop_rtp, int fd, unsigned char *packets,
+                      struct mmsghdr *msgs, struct iovec *iovs,
+                      struct sockaddr_storage *saddrs)
+{
+	uint64_t recv_time;
+	int queued = 0;
+	int i, ret;
+
+	do {
+		for (i=0; i<RAOP_RTP_BATCH_LEN; i++) {
+			iovs[i].iov_base = packets + i*RAOP_PACKET_LEN;
+			iovs[i].iov_len = RAOP_PACKET_LEN;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &saddrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(saddrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
 		}
-		free(dacp_id);
-		free(active_remote_header);
-		dacp_id = NULL;
-		active_remote_header = NULL;
+		ret = recvmmsg(fd, msgs, RAOP_RTP_BATCH_LEN, MSG_DONTWAIT, NULL);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			logger_log(raop_rtp->logger, LOGGER_ERR, "Error in recvmmsg %d", errno);
+			return -1;
+		}
+		recv_time = raop_ntp_get_monotonic_time();
+		for (i=0; i<ret; i++) {
+			unsigned char *packet = iovs[i].iov_base;
+			int packetlen = msgs[i].msg_len;
+
+			if (fd == raop_rtp->csock) {
+				queued += raop_rtp_process_control(raop_rtp, packet, packetlen,
+				                                   &saddrs[i], msgs[i].msg_hdr.msg_namelen, recv_time);
+			} else if (fd == raop_rtp->tsock) {
+				raop_rtp_process_timing(raop_rtp, packet, packetlen,
+				                        &saddrs[i], msgs[i].msg_hdr.msg_namelen);
+			} else {
+				queued += raop_rtp_process_data(raop_rtp, packet, packetlen, recv_time);
+			}
+		}
+	} while (ret == RAOP_RTP_BATCH_LEN);
+
+	return queued;
+}
+
+/* Returns -1 if epoll is not available and select should be used instead */
+static int
+raop_rtp_udp_loop_epoll(raop_rtp_t *raop_rtp, void *cb_data)
+{
+	struct epoll_event event, events[4];
+	unsigned char *packets;
+	struct mmsghdr msgs[RAOP_RTP_BATCH_LEN];
+	struct iovec iovs[RAOP_RTP_BATCH_LEN];
+	struct sockaddr_storage saddrs[RAOP_RTP_BATCH_LEN];
+	int epfd;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		return -1;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = raop_rtp->csock;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, raop_rtp->csock, &event) == -1) {
+		close(epfd);
+		return -1;
+	}
+	event.data.fd = raop_rtp->tsock;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, raop_rtp->tsock, &event) == -1) {
+		close(epfd);
+		return -1;
+	}
+	event.data.fd = raop_rtp->dsock;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, raop_rtp->dsock, &event) == -1) {
+		close(epfd);
+		return -1;
 	}
+	event.data.fd = raop_rtp->wakeup_rfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, raop_rtp->wakeup_rfd, &event) == -1) {
+		close(epfd);
+		return -1;
+	}
+	packets = malloc(RAOP_RTP_BATCH_LEN * RAOP_PACKET_LEN);
+	if (!packets) {
+		close(epfd);
+		return -1;
+	}
+
+	logger_log(raop_rtp->logger, LOGGER_DEBUG, "Using epoll for the UDP RAOP thread");
+	while (1) {
+		int nevents, timeout, queued = 0;
+
+		/* Check if we are still running and process callbacks */
+		if (raop_rtp_process_events(raop_rtp, cb_data)) {
+			break;
+		}
 
-	if (progress_changed) {
-		if (raop_rtp->callbacks.audio_set_progress) {
-			raop_rtp->callbacks.audio_set_progress(raop_rtp->callbacks.cls, cb_data, progress_start, progress_curr, progress_end);
+		/* Sleep until packets arrive, the next timing or resend request
+		 * is due or we are woken up for events */
+		timeout = raop_rtp_send_requests(raop_rtp);
+		nevents = epoll_wait(epfd, events, 4, timeout);
+		if (nevents == 0 || (nevents == -1 && errno == EINTR)) {
+			continue;
+		} else if (nevents == -1) {
+			logger_log(raop_rtp->logger, LOGGER_ERR, "Error in epoll_wait %d", errno);
+			break;
+		}
+
+		for (i=0; i<nevents; i++) {
+			int ret;
+
+			if (events[i].data.fd == raop_rtp->wakeup_rfd) {
+				netutils_clear_wakeup(raop_rtp->wakeup_rfd);
+				continue;
+			}
+			ret = raop_rtp_drain_socket(raop_rtp, events[i].data.fd,
+			                            packets, msgs, iovs, saddrs);
+			if (ret == -1) {
+				break;
+			}
+			queued += ret;
+		}
+		if (i < nevents) {
+			break;
+		}
+		if (queued) {
+			raop_rtp_process_audio(raop_rtp, cb_data);
 		}
 	}
+
+	free(packets);
+	close(epfd);
 	return 0;
 }
+#endif
 
-static THREAD_RETVAL
-raop_rtp_thread_udp(void *arg)
+static void
+raop_rtp_udp_loop_select(raop_rtp_t *raop_rtp, void *cb_data)
 {
-	raop_rtp_t *raop_rtp = arg;
 	unsigned char packet[RAOP_PACKET_LEN];
 	unsigned int packetlen;
 	struct sockaddr_storage saddr;
 	socklen_t saddrlen;
 
-	const ALACSpecificConfig *config;
-	void *cb_data = NULL;
-
-	assert(raop_rtp);
-
-	config = raop_buffer_get_config(raop_rtp->buffer);
-	cb_data = raop_rtp->callbacks.audio_init(raop_rtp->callbacks.cls,
-	                               config->bitDepth,
-	                               config->numChannels,
-	                               config->sampleRate);
-
 	while(1) {
 		fd_set rfds;
 		struct timeval tv;
-		int nfds, ret;
+		int nfds, timeout, ret;
 
 		/* Check if we are still running and process callbacks */
 		if (raop_rtp_process_events(raop_rtp, cb_data)) {
 			break;
 		}
 
-		/* Set timeout value to 5ms */
-		tv.tv_sec = 0;
-		tv.tv_usec = 5000;
+		/* Wait until the next timing or resend request at most */
+		timeout = raop_rtp_send_requests(raop_rtp);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
 
 		/* Get the correct nfds value */
 		nfds = raop_rtp->csock+1;
@@ -405,13 +1020,16 @@ raop_rtp_thread_udp(void *arg)
 			nfds = raop_rtp->tsock+1;
 		if (raop_rtp->dsock >= nfds)
 			nfds = raop_rtp->dsock+1;
+		if (raop_rtp->wakeup_rfd >= nfds)
+			nfds = raop_rtp->wakeup_rfd+1;
 
-		/* Set rfds and call select */
+		/* Set rfds and sleep until packets arrive or we are woken up */
 		FD_ZERO(&rfds);
 		FD_SET(raop_rtp->csock, &rfds);
 		FD_SET(raop_rtp->tsock, &rfds);
 		FD_SET(raop_rtp->dsock, &rfds);
-		ret = select(nfds, &rfds, NULL, NULL, &tv);
+		FD_SET(raop_rtp->wakeup_rfd, &rfds);
+		ret = select(nfds, &rfds, NULL, NULL, (timeout >= 0) ? &tv : NULL);
 		if (ret == 0) {
 			/* Timeout happened */
 			continue;
@@ -420,53 +1038,57 @@ raop_rtp_thread_udp(void *arg)
 			break;
 		}
 
+		if (FD_ISSET(raop_rtp->wakeup_rfd, &rfds)) {
+			netutils_clear_wakeup(raop_rtp->wakeup_rfd);
+		}
 		if (FD_ISSET(raop_rtp->csock, &rfds)) {
 			saddrlen = sizeof(saddr);
 			packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0,
 			                     (struct sockaddr *)&saddr, &saddrlen);
-
-			/* Get the destination address here, because we need the sin6_scope_id */
-			memcpy(&raop_rtp->control_saddr, &saddr, saddrlen);
-			raop_rtp->control_saddr_len = saddrlen;
-
-			if (packetlen >= 12) {
-				char type = packet[1] & ~0x80;
-
-				logger_log(raop_rtp->logger, LOGGER_DEBUG, "Got control packet of type 0x%02x", type);
-				if (type == 0x56) {
-					/* Handle resent data packet */
-					int ret = raop_buffer_queue(raop_rtp->buffer, packet+4, packetlen-4, 1);
-					assert(ret >= 0);
-				}
+			if (raop_rtp_process_control(raop_rtp, packet, packetlen, &saddr, saddrlen,
+			                             raop_ntp_get_monotonic_time())) {
+				raop_rtp_process_audio(raop_rtp, cb_data);
 			}
 		} else if (FD_ISSET(raop_rtp->tsock, &rfds)) {
-			logger_log(raop_rtp->logger, LOGGER_INFO, "Would have timing packet in queue");
+			saddrlen = sizeof(saddr);
+			packetlen = recvfrom(raop_rtp->tsock, (char *)packet, sizeof(packet), 0,
+			                     (struct sockaddr *)&saddr, &saddrlen);
+			raop_rtp_process_timing(raop_rtp, packet, packetlen, &saddr, saddrlen);
 		} else if (FD_ISSET(raop_rtp->dsock, &rfds)) {
 			saddrlen = sizeof(saddr);
 			packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0,
 			                     (struct sockaddr *)&saddr, &saddrlen);
-			if (packetlen >= 12) {
-				int no_resend = (raop_rtp->control_rport == 0);
-				int ret;
+			if (raop_rtp_process_data(raop_rtp, packet, packetlen, raop_ntp_get_monotonic_time())) {
+				raop_rtp_process_audio(raop_rtp, cb_data);
+			}
+		}
+	}
+}
 
-				const void *audiobuf;
-				int audiobuflen;
+static THREAD_RETVAL
+raop_rtp_thread_udp(void *arg)
+{
+	raop_rtp_t *raop_rtp = arg;
+
+	const ALACSpecificConfig *config;
+	void *cb_data = NULL;
 
-				ret = raop_buffer_queue(raop_rtp->buffer, packet, packetlen, 1);
-				assert(ret >= 0);
+	assert(raop_rtp);
 
-				/* Decode all frames in queue */
-				while ((audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, no_resend))) {
-					raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, cb_data, audiobuf, audiobuflen);
-				}
+	config = raop_buffer_get_config(raop_rtp->buffer);
+	cb_data = raop_rtp->callbacks.audio_init(raop_rtp->callbacks.cls,
+	                               raop_buffer_get_output_bits(raop_rtp->buffer),
+	                               config->numChannels,
+	                               config->sampleRate);
 
-				/* Handle possible resend requests */
-				if (!no_resend) {
-					raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
-				}
-			}
-		}
+#if USE_EPOLL
+	if (raop_rtp_udp_loop_epoll(raop_rtp, cb_data) < 0) {
+		logger_log(raop_rtp->logger, LOGGER_WARNING, "Could not initialize epoll, falling back to select");
+		raop_rtp_udp_loop_select(raop_rtp, cb_data);
 	}
+#else
+	raop_rtp_udp_loop_select(raop_rtp, cb_data);
+#endif
 	logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting UDP RAOP thread");
 	raop_rtp->callbacks.audio_destroy(raop_rtp->callbacks.cls, cb_data);
 
@@ -488,13 +1110,12 @@ raop_rtp_thread_tcp(void *arg)
 
 	config = raop_buffer_get_config(raop_rtp->buffer);
 	cb_data = raop_rtp->callbacks.audio_init(raop_rtp->callbacks.cls,
-	                               config->bitDepth,
+	                               raop_buffer_get_output_bits(raop_rtp->buffer),
 	                               config->numChannels,
 	                               config->sampleRate);
 
 	while (1) {
 		fd_set rfds;
-		struct timeval tv;
 		int nfds, ret;
 
 		/* Check if we are still running and process callbacks */
@@ -502,10 +1123,6 @@ raop_rtp_thread_tcp(void *arg)
 			break;
 		}
 
-		/* Set timeout value to 5ms */
-		tv.tv_sec = 0;
-		tv.tv_usec = 5000;
-
 		/* Get the correct nfds value and set rfds */
 		FD_ZERO(&rfds);
 		if (stream_fd == -1) {
@@ -515,15 +1132,21 @@ raop_rtp_thread_tcp(void *arg)
 			FD_SET(stream_fd, &rfds);
 			nfds = stream_fd+1;
 		}
-		ret = select(nfds, &rfds, NULL, NULL, &tv);
-		if (ret == 0) {
-			/* Timeout happened */
-			continue;
-		} else if (ret == -1) {
+		FD_SET(raop_rtp->wakeup_rfd, &rfds);
+		if (raop_rtp->wakeup_rfd >= nfds) {
+			nfds = raop_rtp->wakeup_rfd+1;
+		}
+
+		/* Sleep until data arrives or we are woken up for events */
+		ret = select(nfds, &rfds, NULL, NULL, NULL);
+		if (ret == -1) {
 			/* FIXME: Error happened */
 			logger_log(raop_rtp->logger, LOGGER_INFO, "Error in select");
 			break;
 		}
+		if (FD_ISSET(raop_rtp->wakeup_rfd, &rfds)) {
+			netutils_clear_wakeup(raop_rtp->wakeup_rfd);
+		}
 		if (stream_fd == -1 && FD_ISSET(raop_rtp->dsock, &rfds)) {
 			struct sockaddr_storage saddr;
 			socklen_t saddrlen;
@@ -539,11 +1162,14 @@ raop_rtp_thread_tcp(void *arg)
 		}
 		if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
 			unsigned int rtplen=0;
+			uint64_t recv_time;
 
 			const void *audiobuf;
 			int audiobuflen;
+			unsigned int timestamp;
 
 			ret = recv(stream_fd, (char *)(packet+packetlen), sizeof(packet)-packetlen, 0);
+			recv_time = raop_ntp_get_monotonic_time();
 			if (ret == 0) {
 				/* TCP socket closed */
 				logger_log(raop_rtp->logger, LOGGER_INFO, "TCP socket closed");
@@ -574,7 +1200,8 @@ raop_rtp_thread_tcp(void *arg)
 			}
 
 			/* Packet is valid, process it */
-			ret = raop_buffer_queue(raop_rtp->buffer, packet+4, rtplen, 0);
+			TRACE3(packet_receive, raop_rtp, packet[5] & 0x7f, rtplen);
+			ret = raop_buffer_queue(raop_rtp->buffer, packet+4, rtplen, 0, recv_time);
 			assert(ret >= 0);
 
 			/* Remove processed bytes from packet buffer */
@@ -582,8 +1209,8 @@ raop_rtp_thread_tcp(void *arg)
 			packetlen -= 4+rtplen;
 
 			/* Decode the received frame */
-			if ((audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, 1))) {
-				raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, cb_data, audiobuf, audiobuflen);
+			if ((audiobuf = raop_rtp_dequeue(raop_rtp, cb_data, &audiobuflen, &timestamp, 1))) {
+				raop_rtp_output_audio(raop_rtp, cb_data, audiobuf, audiobuflen, timestamp);
 			}
 		}
 	}
@@ -627,21 +1254,44 @@ raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport,
 	if (control_lport) *control_lport = raop_rtp->control_lport;
 	if (timing_lport) *timing_lport = raop_rtp->timing_lport;
 	if (data_lport) *data_lport = raop_rtp->data_lport;
-	
+
+	/* Wait for a new sync packet before timing the audio */
+	raop_rtp->sync_valid = 0;
+
+	/* Timing requests are sent to the sender timing port */
+	raop_rtp->timing_saddr_len = 0;
+	raop_rtp->timing_next = 0;
+	raop_rtp->timing_requests = 0;
+	if (use_udp && timing_rport) {
+		memcpy(&raop_rtp->timing_saddr, &raop_rtp->remote_saddr, raop_rtp->remote_saddr_len);
+		if (raop_rtp->timing_saddr.ss_family == AF_INET6) {
+			((struct sockaddr_in6 *)&raop_rtp->timing_saddr)->sin6_port = htons(timing_rport);
+		} else {
+			((struct sockaddr_in *)&raop_rtp->timing_saddr)->sin_port = htons(timing_rport);
+		}
+		raop_rtp->timing_saddr_len = raop_rtp->remote_saddr_len;
+	}
+
+	/* Resends and flushes only happen with UDP, decode those lazily */
+	raop_buffer_set_lazy_decode(raop_rtp->buffer, use_udp);
+
 	/* Create the thread and initialize running values */
-	raop_rtp->running = 1;
+	ATOMIC_STORE(&raop_rtp->running, 1);
 	raop_rtp->joined = 0;
 	if (use_udp) {
 		THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_udp, raop_rtp);
 	} else {
 		THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_tcp, raop_rtp);
 	}
+	TRACE4(session_start, raop_rtp, use_udp, raop_rtp->control_lport, raop_rtp->data_lport);
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
 }
 
 void
 raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 {
+	raop_rtp_event_t event;
+
 	assert(raop_rtp);
 
 	if (volume > 0.0f) {
@@ -651,15 +1301,15 @@ raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 	}
 
 	/* Set volume in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->volume = volume;
-	raop_rtp->volume_changed = 1;
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_VOLUME;
+	event.u.volume = volume;
+	raop_rtp_event_push(raop_rtp, &event);
 }
 
 void
 raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
 {
+	raop_rtp_event_t event;
 	unsigned char *metadata;
 
 	assert(raop_rtp);
@@ -672,15 +1322,16 @@ raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
 	memcpy(metadata, data, datalen);
 
 	/* Set metadata in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->metadata = metadata;
-	raop_rtp->metadata_len = datalen;
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_METADATA;
+	event.u.buffer.data = metadata;
+	event.u.buffer.datalen = datalen;
+	raop_rtp_event_push(raop_rtp, &event);
 }
 
 void
 raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
 {
+	raop_rtp_event_t event;
 	unsigned char *coverart;
 
 	assert(raop_rtp);
@@ -693,15 +1344,17 @@ raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
 	memcpy(coverart, data, datalen);
 
 	/* Set coverart in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->coverart = coverart;
-	raop_rtp->coverart_len = datalen;
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_COVERART;
+	event.u.buffer.data = coverart;
+	event.u.buffer.datalen = datalen;
+	raop_rtp_event_push(raop_rtp, &event);
 }
 
 void 
 raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char *active_remote_header)
 {
+	raop_rtp_event_t event;
+
 	assert(raop_rtp);
 
 	if (!dacp_id || !active_remote_header) {
@@ -709,40 +1362,72 @@ raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char
 	}
 
 	/* Set dacp stuff in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->dacp_id = strdup(dacp_id);
-	raop_rtp->active_remote_header = strdup(active_remote_header);
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_REMOTE_CONTROL_ID;
+	event.u.remote.dacp_id = strdup(dacp_id);
+	event.u.remote.active_remote_header = strdup(active_remote_header);
+	raop_rtp_event_push(raop_rtp, &event);
 }
 
 void
 raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int curr, unsigned int end)
 {
+	raop_rtp_event_t event;
+
 	assert(raop_rtp);
 
 	/* Set progress in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->progress_start = start;
-	raop_rtp->progress_curr = curr;
-	raop_rtp->progress_end = end;
-	raop_rtp->progress_changed = 1;
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_PROGRESS;
+	event.u.progress.start = start;
+	event.u.progress.curr = curr;
+	event.u.progress.end = end;
+	raop_rtp_event_push(raop_rtp, &event);
 }
 
 void
 raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq)
 {
+	raop_rtp_event_t event;
+
 	assert(raop_rtp);
 
 	/* Call flush in thread instead */
-	MUTEX_LOCK(raop_rtp->run_mutex);
-	raop_rtp->flush = next_seq;
-	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	event.type = RAOP_RTP_EVENT_FLUSH;
+	event.u.next_seq = next_seq;
+	raop_rtp_event_push(raop_rtp, &event);
+}
+
+void
+raop_rtp_get_clock(raop_rtp_t *raop_rtp, raop_ntp_clock_t *clock)
+{
+	assert(raop_rtp);
+
+	raop_ntp_get_clock(raop_rtp->ntp, clock);
+}
+
+void
+raop_rtp_get_stats(raop_rtp_t *raop_rtp, raop_stats_t *stats)
+{
+	assert(raop_rtp);
+	assert(stats);
+
+	raop_buffer_read_stats(raop_rtp->buffer, stats);
+}
+
+void
+raop_rtp_merge_latency(raop_rtp_t *raop_rtp, int stage, raop_histogram_t *hist)
+{
+	assert(raop_rtp);
+	assert(hist);
+
+	raop_histogram_merge(hist, raop_buffer_get_latency(raop_rtp->buffer, stage));
 }
 
 void
 raop_rtp_stop(raop_rtp_t *raop_rtp)
 {
+	raop_ntp_clock_t clock;
+	raop_stats_t stats;
+
 	assert(raop_rtp);
 
 	/* Check that we are running and thread is not
@@ -752,17 +1437,40 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
 		MUTEX_UNLOCK(raop_rtp->run_mutex);
 		return;
 	}
-	raop_rtp->running = 0;
+	ATOMIC_STORE(&raop_rtp->running, 0);
 	MUTEX_UNLOCK(raop_rtp->run_mutex);
+	netutils_signal_wakeup(raop_rtp->wakeup_wfd);
 
 	/* Join the thread */
 	THREAD_JOIN(raop_rtp->thread);
+	TRACE1(session_stop, raop_rtp);
 	if (raop_rtp->csock != -1) closesocket(raop_rtp->csock);
 	if (raop_rtp->tsock != -1) closesocket(raop_rtp->tsock);
 	if (raop_rtp->dsock != -1) closesocket(raop_rtp->dsock);
 
+	raop_ntp_get_clock(raop_rtp->ntp, &clock);
+	if (clock.synchronized) {
+		logger_log(raop_rtp->logger, LOGGER_INFO, "Sender clock offset %.6f s, drift %.2f ppm from %u samples",
+		           (double)clock.offset / RAOP_NTP_SECOND, clock.drift_ppm, clock.samples);
+	}
+	if (raop_rtp->resample) {
+		logger_log(raop_rtp->logger, LOGGER_INFO, "Drift compensation at stop %.2f ppm",
+		           raop_resample_get_ratio_ppm(raop_rtp->resample));
+	}
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Jitter buffer length at stop %d frames",
+	           raop_buffer_get_length(raop_rtp->buffer));
+
 	/* Flush buffer into initial state */
 	raop_buffer_flush(raop_rtp->buffer, -1);
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Avoided decoding %u flushed packets",
+	           raop_buffer_get_decodes_avoided(raop_rtp->buffer));
+	raop_buffer_read_stats(raop_rtp->buffer, &stats);
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Received %u packets, %u out of order, %u duplicate and %u late",
+	           stats.packets_received, stats.packets_out_of_order, stats.packets_duplicate, stats.packets_late);
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Concealed %u lost frames",
+	           stats.frames_concealed);
+	logger_log(raop_rtp->logger, LOGGER_INFO, "Requested %u lost packets, %u recovered and %u expired",
+	           stats.resends_requested, stats.resends_recovered, stats.resends_expired);
 
 	/* Mark thread as joined */
 	MUTEX_LOCK(raop_rtp->run_mutex);
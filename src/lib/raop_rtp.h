@@ -17,6 +17,9 @@
 
 /* For raop_callbacks_t */
 #include "raop.h"
+#include "raop_ntp.h"
+#include "raop_stats.h"
+#include "raop_histogram.h"
 #include "logger.h"
 
 #define RAOP_AESKEY_LEN 16
@@ -27,7 +30,9 @@ typedef struct raop_rtp_s raop_rtp_t;
 
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
                           const char *rtpmap, const char *fmtp,
-                          const unsigned char *aeskey, const unsigned char *aesiv);
+                          const unsigned char *aeskey, const unsigned char *aesiv,
+                          int min_length, int max_length, int min_latency,
+                          int drift_compensation, int loss_concealment);
 void raop_rtp_start(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport, unsigned short timing_rport,
                     unsigned short *control_lport, unsigned short *timing_lport, unsigned short *data_lport);
 void raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume);
@@ -36,6 +41,15 @@ void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char *active_remote_header);
 void raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int curr, unsigned int end);
 void raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq);
+
+/* Sender clock estimate, may be queried from any thread */
+void raop_rtp_get_clock(raop_rtp_t *raop_rtp, raop_ntp_clock_t *clock);
+
+/* Snapshot of the streaming counters, may be queried from any thread */
+void raop_rtp_get_stats(raop_rtp_t *raop_rtp, raop_stats_t *stats);
+/* Adds the latency histogram of a stage into hist */
+void raop_rtp_merge_latency(raop_rtp_t *raop_rtp, int stage, raop_histogram_t *hist);
+
 void raop_rtp_stop(raop_rtp_t *raop_rtp);
 void raop_rtp_destroy(raop_rtp_t *raop_rtp);
 
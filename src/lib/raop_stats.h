@@ -0,0 +1,55 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_STATS_H
+#define RAOP_STATS_H
+
+#include "threads.h"
+
+/* Counters of one session. Only the RTP thread writes them, with relaxed
+ * atomic stores, so any thread can read a snapshot without locking */
+typedef struct {
+	unsigned int packets_received;
+	unsigned int packets_out_of_order;
+	unsigned int packets_duplicate;
+	unsigned int packets_late;
+
+	unsigned int resends_requested;
+	unsigned int resends_recovered;
+	unsigned int resends_expired;
+
+	unsigned int frames_decoded;
+	unsigned int frames_lost;
+	unsigned int frames_concealed;
+
+	/* Packets in the jitter buffer and its current length */
+	unsigned int buffer_depth;
+	unsigned int buffer_length;
+
+	/* RFC 3550 interarrival jitter in microseconds */
+	unsigned int jitter_usec;
+
+	/* Time spent decrypting and decoding in total */
+	unsigned int decrypt_usec;
+	unsigned int decode_usec;
+} raop_stats_t;
+
+#define RAOP_STATS_ADD(stats, field, value) \
+	ATOMIC_STORE_RELAXED(&(stats)->field, ATOMIC_LOAD_RELAXED(&(stats)->field) + (value))
+#define RAOP_STATS_SET(stats, field, value) \
+	ATOMIC_STORE_RELAXED(&(stats)->field, (value))
+#define RAOP_STATS_GET(stats, field) \
+	ATOMIC_LOAD_RELAXED(&(stats)->field)
+
+#endif
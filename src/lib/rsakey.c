@@ -21,6 +21,7 @@
 #include "rsapem.h"
 #include "base64.h"
 #include "crypto/crypto.h"
+#include "threads.h"
 
 #define RSA_MIN_PADLEN 8
 #define MAX_KEYLEN 512
@@ -41,6 +42,9 @@ struct rsakey_s {
 	bigint *qInv;           /* q^-1 mod p */
 
 	base64_t *base64;
+
+	/* The bigint context is not thread safe */
+	mutex_handle_t bi_mutex;
 };
 
 rsakey_t *
@@ -75,6 +79,7 @@ rsakey_init(const unsigned char *modulus, int mod_len,
 	for (i=0; !modulus[i] && i<mod_len; i++);
 	rsakey->keylen = mod_len-i;
 	rsakey->bi_ctx = bi_initialize();
+	MUTEX_CREATE(rsakey->bi_mutex);
 
 	/* Import public and private keys */
 	rsakey->n = bi_import(rsakey->bi_ctx, modulus, mod_len);
@@ -175,23 +180,33 @@ rsakey_destroy(rsakey_t *rsakey)
 			bi_free(rsakey->bi_ctx, rsakey->qInv);
 		}
 		bi_terminate(rsakey->bi_ctx);
+		MUTEX_DESTROY(rsakey->bi_mutex);
 
 		base64_destroy(rsakey->base64);
 		free(rsakey);
 	}
 }
 
-static bigint *
-rsakey_modpow(rsakey_t *rsakey, bigint *msg)
+/* Raises the keylen bytes in buffer to the private exponent in place,
+ * handlers of different connections may call this concurrently */
+static void
+rsakey_modpow(rsakey_t *rsakey, unsigned char *buffer)
 {
+	bigint *bi_in;
+	bigint *bi_out;
+
+	MUTEX_LOCK(rsakey->bi_mutex);
+	bi_in = bi_import(rsakey->bi_ctx, buffer, rsakey->keylen);
 	if (rsakey->use_crt) {
-		return bi_crt(rsakey->bi_ctx, msg,
-		              rsakey->dP, rsakey->dQ,
-		              rsakey->p, rsakey->q, rsakey->qInv);
+		bi_out = bi_crt(rsakey->bi_ctx, bi_in,
+		                rsakey->dP, rsakey->dQ,
+		                rsakey->p, rsakey->q, rsakey->qInv);
 	} else {
 		rsakey->bi_ctx->mod_offset = BIGINT_M_OFFSET;
-		return bi_mod_power(rsakey->bi_ctx, msg, rsakey->d);
+		bi_out = bi_mod_power(rsakey->bi_ctx, bi_in, rsakey->d);
 	}
+	bi_export(rsakey->bi_ctx, bi_out, buffer, rsakey->keylen);
+	MUTEX_UNLOCK(rsakey->bi_mutex);
 }
 
 int
@@ -203,8 +218,6 @@ rsakey_sign(rsakey_t *rsakey, char *dst, int dstlen, const char *b64digest,
 	unsigned char *digest;
 	int digestlen;
 	int inputlen;
-	bigint *bi_in;
-	bigint *bi_out;
 	int idx;
 
 	assert(rsakey);
@@ -247,11 +260,9 @@ rsakey_sign(rsakey_t *rsakey, char *dst, int dstlen, const char *b64digest,
 	idx += hwaddrlen;
 
 	/* Calculate the signature s = m^d (mod n) */
-	bi_in = bi_import(rsakey->bi_ctx, buffer, rsakey->keylen);
-	bi_out = rsakey_modpow(rsakey, bi_in);
+	rsakey_modpow(rsakey, buffer);
 
 	/* Encode and save the signature into dst */
-	bi_export(rsakey->bi_ctx, bi_out, buffer, rsakey->keylen);
 	base64_encode(rsakey->base64, dst, buffer, rsakey->keylen);
 
 	free(digest);
@@ -299,8 +310,6 @@ rsakey_decrypt(rsakey_t *rsakey, unsigned char *dst, int dstlen, const char *b64
 	unsigned char maskbuf[MAX_KEYLEN];
 	unsigned char *input;
 	int inputlen;
-	bigint *bi_in;
-	bigint *bi_out;
 	int outlen;
 	int i, ret;
 
@@ -319,11 +328,7 @@ rsakey_decrypt(rsakey_t *rsakey, unsigned char *dst, int dstlen, const char *b64
 	input = NULL;
 
 	/* Decrypt the input data m = c^d (mod n) */
-	bi_in = bi_import(rsakey->bi_ctx, buffer, rsakey->keylen);
-	bi_out = rsakey_modpow(rsakey, bi_in);
-
-	memset(buffer, 0, sizeof(buffer));
-	bi_export(rsakey->bi_ctx, bi_out, buffer, rsakey->keylen);
+	rsakey_modpow(rsakey, buffer);
 
 	/* First unmask seed in the buffer */
 	ret = rsakey_mfg1(maskbuf, sizeof(maskbuf),
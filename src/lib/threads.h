@@ -34,6 +34,35 @@ typedef HANDLE mutex_handle_t;
 #define MUTEX_UNLOCK(handle) ReleaseMutex(handle)
 #define MUTEX_DESTROY(handle) CloseHandle(handle)
 
+/* Signals may coalesce into a single wakeup, waiters that find more
+ * work left should signal again */
+typedef HANDLE cond_handle_t;
+
+#define COND_CREATE(handle) handle = CreateEvent(NULL, FALSE, FALSE, NULL)
+#define COND_WAIT(handle, mutex) \
+	do { ReleaseMutex(mutex); WaitForSingleObject(handle, INFINITE); WaitForSingleObject(mutex, INFINITE); } while(0)
+#define COND_SIGNAL(handle) SetEvent(handle)
+#define COND_DESTROY(handle) CloseHandle(handle)
+
+/* Atomic accessors for 32-bit values shared without a mutex */
+#define ATOMIC_LOAD(ptr) InterlockedCompareExchange((LONG volatile *)(ptr), 0, 0)
+#define ATOMIC_STORE(ptr, val) InterlockedExchange((LONG volatile *)(ptr), (LONG)(val))
+
+/* Aligned 32-bit accesses are atomic, no ordering is implied */
+#define ATOMIC_LOAD_RELAXED(ptr) (*(LONG volatile *)(ptr))
+#define ATOMIC_STORE_RELAXED(ptr, val) (*(LONG volatile *)(ptr) = (LONG)(val))
+
+/* Atomic accessors for pointers, ordered like ATOMIC_LOAD and ATOMIC_STORE */
+#define ATOMIC_LOAD_PTR(ptr) InterlockedCompareExchangePointer((PVOID volatile *)(ptr), NULL, NULL)
+#define ATOMIC_STORE_PTR(ptr, val) InterlockedExchangePointer((PVOID volatile *)(ptr), (PVOID)(val))
+
+/* Read-modify-write operations with full ordering, CAS returns non-zero
+ * if the value was oldval and got replaced with newval */
+#define ATOMIC_CAS(ptr, oldval, newval) \
+	(InterlockedCompareExchange((LONG volatile *)(ptr), (LONG)(newval), (LONG)(oldval)) == (LONG)(oldval))
+#define ATOMIC_ADD(ptr, val) InterlockedExchangeAdd((LONG volatile *)(ptr), (LONG)(val))
+#define ATOMIC_FENCE() MemoryBarrier()
+
 #else /* Use pthread library */
 
 #include <pthread.h>
@@ -55,6 +84,32 @@ typedef pthread_mutex_t mutex_handle_t;
 #define MUTEX_UNLOCK(handle) pthread_mutex_unlock(&(handle))
 #define MUTEX_DESTROY(handle) pthread_mutex_destroy(&(handle))
 
+typedef pthread_cond_t cond_handle_t;
+
+#define COND_CREATE(handle) pthread_cond_init(&(handle), NULL)
+#define COND_WAIT(handle, mutex) pthread_cond_wait(&(handle), &(mutex))
+#define COND_SIGNAL(handle) pthread_cond_signal(&(handle))
+#define COND_DESTROY(handle) pthread_cond_destroy(&(handle))
+
+/* Atomic accessors for 32-bit values shared without a mutex, a load
+ * acquires and a store releases all memory accesses before it */
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/* Atomic accessors without ordering, as cheap as plain accesses */
+#define ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELAXED(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+
+/* Atomic accessors for pointers, ordered like ATOMIC_LOAD and ATOMIC_STORE */
+#define ATOMIC_LOAD_PTR(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_PTR(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/* Read-modify-write operations with full ordering, CAS returns non-zero
+ * if the value was oldval and got replaced with newval */
+#define ATOMIC_CAS(ptr, oldval, newval) __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#define ATOMIC_ADD(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 #endif
 
 #endif /* THREADS_H */
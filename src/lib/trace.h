@@ -0,0 +1,42 @@
+/**
+ *  Copyright (C) 2011-2012  Juho Vähä-Herttua
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Static tracepoints of the shairplay provider, built in with the
+ * configure option --enable-usdt. A probe is a single nop until a
+ * tracer such as bpftrace or perf attaches to it, for example:
+ *
+ *   bpftrace -e 'usdt:libshairplay.so:shairplay:packet_receive { @[arg1] = count(); }'
+ *
+ * Arguments must be cheap to evaluate, they are computed even when no
+ * tracer is attached. Without USDT support the probes compile to nothing. */
+
+#ifdef ENABLE_USDT
+# include <sys/sdt.h>
+# define TRACE0(name) DTRACE_PROBE(shairplay, name)
+# define TRACE1(name, a1) DTRACE_PROBE1(shairplay, name, a1)
+# define TRACE2(name, a1, a2) DTRACE_PROBE2(shairplay, name, a1, a2)
+# define TRACE3(name, a1, a2, a3) DTRACE_PROBE3(shairplay, name, a1, a2, a3)
+# define TRACE4(name, a1, a2, a3, a4) DTRACE_PROBE4(shairplay, name, a1, a2, a3, a4)
+#else
+# define TRACE0(name) do {} while (0)
+# define TRACE1(name, a1) do {} while (0)
+# define TRACE2(name, a1, a2) do {} while (0)
+# define TRACE3(name, a1, a2, a3) do {} while (0)
+# define TRACE4(name, a1, a2, a3, a4) do {} while (0)
+#endif
+
+#endif
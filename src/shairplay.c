@@ -30,6 +30,9 @@
 
 #ifdef WIN32
 # include <windows.h>
+#else
+# include <pthread.h>
+# include <time.h>
 #endif
 
 #include <shairplay/dnssd.h>
@@ -48,20 +51,62 @@ typedef struct {
 	char ao_driver[56];
 	char ao_devicename[56];
 	char ao_deviceid[16];
+
+	int buffer_min_length;
+	int buffer_max_length;
+	int drift_compensation;
+	int loss_concealment;
 } shairplay_options_t;
 
-typedef struct {
-	ao_device *device;
+/* Number of decoded frames queued for their presentation time, the
+ * queue has to cover the latency of the sender, usually about 2 s */
+#define AUDIO_QUEUE_LEN 512
+
+/* Frames are written this long before their presentation time and
+ * dropped when they are this late, about what the device buffers */
+#define AUDIO_LEAD_US 100000
 
-	int buffering;
+typedef struct {
+	unsigned long long pts;
 	int buflen;
-	char buffer[8192];
+} shairplay_frame_t;
+
+typedef struct {
+	ao_device *device;
+	int bits;
+	int framebytes;
+
+	/* Queued frames, each frame in a slot of slotsize bytes. The RTP
+	 * thread adds frames at head and the output thread plays them from
+	 * tail at their presentation time, both with the mutex locked */
+	shairplay_frame_t frames[AUDIO_QUEUE_LEN];
+	char *slots;
+	int slotsize;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+
+	/* Output thread, the frame being played is copied out of its slot */
+#ifdef WIN32
+	HANDLE thread;
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE cond;
+#else
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+	int started;
+	int stopping;
+	char *playbuf;
+	int playbufsize;
 
 	float volume;
 } shairplay_session_t;
 
 
 static int running;
+static volatile int dump_latency;
 
 #ifndef WIN32
 
@@ -74,6 +119,9 @@ signal_handler(int sig)
 	case SIGTERM:
 		running = 0;
 		break;
+	case SIGUSR1:
+		dump_latency = 1;
+		break;
 	}
 }
 static void
@@ -86,11 +134,34 @@ init_signals(void)
 	sigact.sa_flags = 0;
 	sigaction(SIGINT, &sigact, NULL);
 	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGUSR1, &sigact, NULL);
 }
 
 #endif
 
 
+static void
+print_latency(raop_t *raop)
+{
+	static const char *stages[RAOP_LATENCY_STAGES] = {
+		"receive", "buffer wait", "decrypt", "decode", "callback"
+	};
+	raop_histogram_t hist;
+	int i;
+
+	printf("Latency in microseconds:   count      p50      p90      p99    p99.9      max\n");
+	for (i=0; i<RAOP_LATENCY_STAGES; i++) {
+		raop_get_latency_histogram(raop, i, &hist);
+		printf("  %-20s %10u %8.1f %8.1f %8.1f %8.1f %8.1f\n", stages[i], hist.count,
+		       raop_histogram_get_percentile(&hist, 50.0) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 90.0) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 99.0) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 99.9) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 100.0) / 1000.0);
+	}
+	fflush(stdout);
+}
+
 static int
 parse_hwaddr(const char *str, char *hwaddr, int hwaddrlen)
 {
@@ -146,7 +217,8 @@ audio_open_device(shairplay_options_t *opt, int bits, int channels, int samplera
 	format.bits = bits;
 	format.channels = channels;
 	format.rate = samplerate;
-	format.byte_format = AO_FMT_NATIVE;
+	/* Samples wider than 16 bits come little endian from the library */
+	format.byte_format = (bits == 16) ? AO_FMT_NATIVE : AO_FMT_LITTLE;
 
 	/* Try opening the actual device */
 	device = ao_open_live(driver_id, &format, ao_options);
@@ -154,6 +226,210 @@ audio_open_device(shairplay_options_t *opt, int bits, int channels, int samplera
 	return device;
 }
 
+static void
+audio_lock(shairplay_session_t *session)
+{
+#ifdef WIN32
+	EnterCriticalSection(&session->mutex);
+#else
+	pthread_mutex_lock(&session->mutex);
+#endif
+}
+
+static void
+audio_unlock(shairplay_session_t *session)
+{
+#ifdef WIN32
+	LeaveCriticalSection(&session->mutex);
+#else
+	pthread_mutex_unlock(&session->mutex);
+#endif
+}
+
+/* Wakes up the other thread waiting for the queue */
+static void
+audio_signal(shairplay_session_t *session)
+{
+#ifdef WIN32
+	WakeConditionVariable(&session->cond);
+#else
+	pthread_cond_signal(&session->cond);
+#endif
+}
+
+/* Waits for a signal with the mutex locked, at most usec if not 0 */
+static void
+audio_wait(shairplay_session_t *session, unsigned long long usec)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(&session->cond, &session->mutex, usec ? (DWORD)((usec+999)/1000) : INFINITE);
+#else
+	if (usec) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += usec / 1000000;
+		ts.tv_nsec += (usec % 1000000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&session->cond, &session->mutex, &ts);
+	} else {
+		pthread_cond_wait(&session->cond, &session->mutex);
+	}
+#endif
+}
+
+static void
+audio_scale(shairplay_session_t *session, char *buffer, int buflen)
+{
+	short *shortbuf;
+	int i;
+
+	if (session->bits != 16) {
+		int bytes = session->bits/8;
+
+		/* Scale the little endian samples as 32-bit values */
+		for (i=0; i<buflen; i+=bytes) {
+			unsigned char *ptr = (unsigned char *)buffer+i;
+			unsigned int usample = 0;
+			int sample, b;
+
+			for (b=0; b<bytes; b++) {
+				usample |= (unsigned int)ptr[b] << (32-8*bytes+8*b);
+			}
+			sample = (int)((int)usample * (double)session->volume);
+			for (b=0; b<bytes; b++) {
+				ptr[b] = (unsigned int)sample >> (32-8*bytes+8*b);
+			}
+		}
+	} else {
+		if (ao_is_big_endian()) {
+			for (i=0; i<buflen/2; i++) {
+				char tmpch = buffer[i*2];
+				buffer[i*2] = buffer[i*2+1];
+				buffer[i*2+1] = tmpch;
+			}
+		}
+		shortbuf = (short *)buffer;
+		for (i=0; i<buflen/2; i++) {
+			shortbuf[i] = shortbuf[i] * session->volume;
+		}
+	}
+}
+
+static void
+audio_play(shairplay_session_t *session, char *buffer, int buflen)
+{
+	audio_scale(session, buffer, buflen);
+	if (session->device) {
+		ao_play(session->device, buffer, buflen);
+	}
+}
+
+static int
+audio_output(shairplay_session_t *session, const void *buffer, int buflen)
+{
+	char tmpbuf[4096];
+	int tmpbuflen;
+
+	tmpbuflen = (buflen > sizeof(tmpbuf)) ? sizeof(tmpbuf) : buflen;
+	tmpbuflen -= tmpbuflen % session->framebytes;
+	memcpy(tmpbuf, buffer, tmpbuflen);
+	audio_play(session, tmpbuf, tmpbuflen);
+	return tmpbuflen;
+}
+
+static char *
+audio_get_slot(shairplay_session_t *session, unsigned int index)
+{
+	return session->slots + (index % AUDIO_QUEUE_LEN) * session->slotsize;
+}
+
+/* Makes the slots at least buflen bytes, moving the queued frames. The
+ * library may ask for more than a frame, e.g. when resampling */
+static int
+audio_reserve_slots(shairplay_session_t *session, int buflen)
+{
+	char *slots;
+	unsigned int i;
+
+	if (session->slots && buflen <= session->slotsize) {
+		return 0;
+	}
+	slots = malloc(AUDIO_QUEUE_LEN * buflen);
+	if (!slots) {
+		return -1;
+	}
+	for (i=session->tail; i!=session->head; i++) {
+		memcpy(slots + (i % AUDIO_QUEUE_LEN) * buflen, audio_get_slot(session, i),
+		       session->frames[i % AUDIO_QUEUE_LEN].buflen);
+	}
+	free(session->slots);
+	session->slots = slots;
+	session->slotsize = buflen;
+	return 0;
+}
+
+/* Plays the queued frames when they are due and drops the ones too late,
+ * until the session is destroyed. A full queue plays the oldest early */
+#ifdef WIN32
+static DWORD WINAPI
+#else
+static void *
+#endif
+audio_thread(void *arg)
+{
+	shairplay_session_t *session = arg;
+
+	audio_lock(session);
+	while (!session->stopping) {
+		shairplay_frame_t *frame = &session->frames[session->tail % AUDIO_QUEUE_LEN];
+		unsigned long long now = raop_get_time();
+
+		if (session->tail == session->head) {
+			audio_wait(session, 0);
+			continue;
+		}
+
+		/* Frames without presentation time are played right away */
+		if (frame->pts && frame->pts > now + AUDIO_LEAD_US &&
+		    session->head - session->tail < AUDIO_QUEUE_LEN) {
+			audio_wait(session, frame->pts - AUDIO_LEAD_US - now);
+			continue;
+		}
+		if (frame->pts && frame->pts + AUDIO_LEAD_US < now) {
+			session->dropped++;
+			session->tail++;
+			audio_signal(session);
+			continue;
+		}
+		if (frame->buflen > session->playbufsize) {
+			char *playbuf = realloc(session->playbuf, frame->buflen);
+
+			if (!playbuf) {
+				session->dropped++;
+				session->tail++;
+				audio_signal(session);
+				continue;
+			}
+			session->playbuf = playbuf;
+			session->playbufsize = frame->buflen;
+		}
+		memcpy(session->playbuf, audio_get_slot(session, session->tail), frame->buflen);
+		session->tail++;
+		audio_signal(session);
+
+		/* The slots may be moved or refilled while playing */
+		audio_unlock(session);
+		audio_play(session, session->playbuf, frame->buflen);
+		audio_lock(session);
+	}
+	audio_unlock(session);
+	return 0;
+}
+
 static void *
 audio_init(void *cls, int bits, int channels, int samplerate)
 {
@@ -163,74 +439,100 @@ audio_init(void *cls, int bits, int channels, int samplerate)
 	session = calloc(1, sizeof(shairplay_session_t));
 	assert(session);
 
+	session->bits = bits;
+	session->framebytes = bits/8 * channels;
 	session->device = audio_open_device(options, bits, channels, samplerate);
 	if (session->device == NULL) {
 		printf("Error opening device %d\n", errno);
 		printf("The device might already be in use");
 	}
 
-	session->buffering = 1;
 	session->volume = 1.0f;
+
+	/* Frames are played from a thread so that the queue is drained
+	 * even when the sender stops sending */
+#ifdef WIN32
+	InitializeCriticalSection(&session->mutex);
+	InitializeConditionVariable(&session->cond);
+	session->thread = CreateThread(NULL, 0, audio_thread, session, 0, NULL);
+	session->started = (session->thread != NULL);
+#else
+	pthread_mutex_init(&session->mutex, NULL);
+	pthread_cond_init(&session->cond, NULL);
+	session->started = !pthread_create(&session->thread, NULL, audio_thread, session);
+#endif
+	if (!session->started) {
+		printf("Error starting the audio thread, playing frames as they arrive\n");
+	}
 	return session;
 }
 
-static int
-audio_output(shairplay_session_t *session, const void *buffer, int buflen)
+static void *
+audio_get_buffer(void *cls, void *opaque, int buflen)
 {
-	short *shortbuf;
-	char tmpbuf[4096];
-	int tmpbuflen, i;
+	shairplay_session_t *session = opaque;
+	char *slot = NULL;
 
-	tmpbuflen = (buflen > sizeof(tmpbuf)) ? sizeof(tmpbuf) : buflen;
-	memcpy(tmpbuf, buffer, tmpbuflen);
-	if (ao_is_big_endian()) {
-		for (i=0; i<tmpbuflen/2; i++) {
-			char tmpch = tmpbuf[i*2];
-			tmpbuf[i*2] = tmpbuf[i*2+1];
-			tmpbuf[i*2+1] = tmpch;
-		}
-	}
-	shortbuf = (short *)tmpbuf;
-	for (i=0; i<tmpbuflen/2; i++) {
-		shortbuf[i] = shortbuf[i] * session->volume;
-	}
-	if (session->device) {
-		ao_play(session->device, tmpbuf, tmpbuflen);
+	/* Decode straight into the next free slot of the queue, only the
+	 * RTP thread writes to it so it can be done without the mutex */
+	audio_lock(session);
+	if (session->head - session->tail < AUDIO_QUEUE_LEN && audio_reserve_slots(session, buflen) == 0) {
+		slot = audio_get_slot(session, session->head);
 	}
-	return tmpbuflen;
+	audio_unlock(session);
+	return slot;
 }
 
 static void
-audio_process(void *cls, void *opaque, const void *buffer, int buflen)
+audio_process_timed(void *cls, void *opaque, const void *buffer, int buflen, unsigned long long pts)
 {
 	shairplay_session_t *session = opaque;
+	char *slot;
 	int processed;
 
-	if (session->buffering) {
-		printf("Buffering...\n");
-		if (session->buflen+buflen < sizeof(session->buffer)) {
-			memcpy(session->buffer+session->buflen, buffer, buflen);
-			session->buflen += buflen;
-			return;
-		}
-		session->buffering = 0;
-		printf("Finished buffering...\n");
-
+	if (!session->started) {
 		processed = 0;
-		while (processed < session->buflen) {
+		while (processed < buflen) {
 			processed += audio_output(session,
-			                          session->buffer+processed,
-			                          session->buflen-processed);
+			                          buffer+processed,
+			                          buflen-processed);
 		}
-		session->buflen = 0;
+		return;
 	}
 
-	processed = 0;
-	while (processed < buflen) {
-		processed += audio_output(session,
-		                          buffer+processed,
-		                          buflen-processed);
+	audio_lock(session);
+	while (session->head - session->tail == AUDIO_QUEUE_LEN) {
+		/* Queue is full, wait for the oldest frame to be played early */
+		audio_signal(session);
+		audio_wait(session, 0);
+	}
+	if (audio_reserve_slots(session, buflen) < 0) {
+		/* Out of memory, the frame cannot be queued */
+		session->dropped++;
+		audio_unlock(session);
+		return;
 	}
+	slot = audio_get_slot(session, session->head);
+	if (buffer != slot) {
+		memcpy(slot, buffer, buflen);
+	}
+	session->frames[session->head % AUDIO_QUEUE_LEN].pts = pts;
+	session->frames[session->head % AUDIO_QUEUE_LEN].buflen = buflen;
+	session->head++;
+	audio_signal(session);
+	audio_unlock(session);
+}
+
+static void
+audio_flush(void *cls, void *opaque)
+{
+	shairplay_session_t *session = opaque;
+
+	/* Queued audio belongs to the position before the flush */
+	audio_lock(session);
+	session->tail = session->head;
+	audio_signal(session);
+	audio_unlock(session);
 }
 
 static void
@@ -238,9 +540,34 @@ audio_destroy(void *cls, void *opaque)
 {
 	shairplay_session_t *session = opaque;
 
+	/* The session has ended, queued audio is discarded */
+	if (session->started) {
+		audio_lock(session);
+		session->stopping = 1;
+		audio_signal(session);
+		audio_unlock(session);
+#ifdef WIN32
+		WaitForSingleObject(session->thread, INFINITE);
+		CloseHandle(session->thread);
+#else
+		pthread_join(session->thread, NULL);
+#endif
+	}
+#ifdef WIN32
+	DeleteCriticalSection(&session->mutex);
+#else
+	pthread_cond_destroy(&session->cond);
+	pthread_mutex_destroy(&session->mutex);
+#endif
+
+	if (session->dropped) {
+		printf("Dropped %u late frames\n", session->dropped);
+	}
 	if (session->device) {
 		ao_close(session->device);
 	}
+	free(session->playbuf);
+	free(session->slots);
 	free(session);
 }
 
@@ -263,6 +590,8 @@ parse_options(shairplay_options_t *opt, int argc, char *argv[])
 	strncpy(opt->apname, "Shairplay", sizeof(opt->apname)-1);
 	opt->port = 5000;
 	memcpy(opt->hwaddr, default_hwaddr, sizeof(opt->hwaddr));
+	opt->buffer_min_length = 32;
+	opt->buffer_max_length = 32;
 
 	while ((arg = *++argv)) {
 		if (!strcmp(arg, "-a")) {
@@ -289,6 +618,19 @@ parse_options(shairplay_options_t *opt, int argc, char *argv[])
 			strncpy(opt->ao_devicename, arg+16, sizeof(opt->ao_devicename)-1);
 		} else if (!strncmp(arg, "--ao_deviceid=", 14)) {
 			strncpy(opt->ao_deviceid, arg+14, sizeof(opt->ao_deviceid)-1);
+		} else if (!strncmp(arg, "--buffer_length=", 16)) {
+			char *max = strchr(arg+16, ':');
+			opt->buffer_min_length = atoi(arg+16);
+			opt->buffer_max_length = max ? atoi(max+1) : opt->buffer_min_length;
+			if (opt->buffer_min_length <= 0 || opt->buffer_max_length < opt->buffer_min_length) {
+				fprintf(stderr, "Invalid format given for buffer_length, aborting...\n");
+				fprintf(stderr, "Please use buffer_length format: min[:max]\n");
+				return 1;
+			}
+		} else if (!strcmp(arg, "--drift_compensation")) {
+			opt->drift_compensation = 1;
+		} else if (!strcmp(arg, "--loss_concealment")) {
+			opt->loss_concealment = 1;
 		} else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
 			fprintf(stderr, "Shairplay version %s\n", VERSION);
 			fprintf(stderr, "Usage: %s [OPTION...]\n", path);
@@ -300,6 +642,9 @@ parse_options(shairplay_options_t *opt, int argc, char *argv[])
 			fprintf(stderr, "      --ao_driver=driver          Sets the ao driver (optional)\n");
 			fprintf(stderr, "      --ao_devicename=devicename  Sets the ao device name (optional)\n");
 			fprintf(stderr, "      --ao_deviceid=id            Sets the ao device id (optional)\n");
+			fprintf(stderr, "      --buffer_length=32[:max]    Sets the jitter buffer length in frames, adaptive if max is given\n");
+			fprintf(stderr, "      --drift_compensation        Resamples the audio to follow the local clock\n");
+			fprintf(stderr, "      --loss_concealment          Replaces lost frames with audio instead of silence\n");
 			fprintf(stderr, "  -h, --help                      This help\n");
 			fprintf(stderr, "\n");
 			return 1;
@@ -346,9 +691,11 @@ main(int argc, char *argv[])
 	memset(&raop_cbs, 0, sizeof(raop_cbs));
 	raop_cbs.cls = &options;
 	raop_cbs.audio_init = audio_init;
-	raop_cbs.audio_process = audio_process;
+	raop_cbs.audio_process_timed = audio_process_timed;
 	raop_cbs.audio_destroy = audio_destroy;
+	raop_cbs.audio_flush = audio_flush;
 	raop_cbs.audio_set_volume = audio_set_volume;
+	raop_cbs.audio_get_buffer = audio_get_buffer;
 
 	raop = raop_init_from_keyfile(10, &raop_cbs, "airport.key", NULL);
 	if (raop == NULL) {
@@ -361,6 +708,9 @@ main(int argc, char *argv[])
 		password = options.password;
 	}
 	raop_set_log_level(raop, RAOP_LOG_DEBUG);
+	raop_set_buffer_length(raop, options.buffer_min_length, options.buffer_max_length);
+	raop_set_drift_compensation(raop, options.drift_compensation);
+	raop_set_loss_concealment(raop, options.loss_concealment);
 	raop_start(raop, &options.port, options.hwaddr, sizeof(options.hwaddr), password);
 
 	error = 0;
@@ -384,12 +734,17 @@ main(int argc, char *argv[])
 #else
 		Sleep(1000);
 #endif
+		if (dump_latency) {
+			dump_latency = 0;
+			print_latency(raop);
+		}
 	}
 
 	dnssd_unregister_raop(dnssd);
 	dnssd_destroy(dnssd);
 
 	raop_stop(raop);
+	print_latency(raop);
 	raop_destroy(raop);
 
 	ao_shutdown();
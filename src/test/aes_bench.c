@@ -0,0 +1,416 @@
+/*
+ * Verifies the AES backends and measures the per-packet cost of
+ * decrypting RAOP audio payloads.
+ *
+ * Every backend supported by the CPU is checked against the FIPS-197 and
+ * SP 800-38A test vectors, and against the small reference backend with
+ * random keys, IVs and lengths, including the IV left in the context.
+ *
+ * The batched CTR mode in aes_ctr.c is checked against the SP 800-38A
+ * vector and against the original one block at a time implementation,
+ * with the message split into random pieces.
+ *
+ * The benchmark compares expanding and converting the AES key schedule
+ * for every packet against reusing a schedule that is prepared once per
+ * session, and then the cached variant for each backend. Finally the
+ * CTR mode is timed against the original implementation.
+ *
+ * Compile with: gcc -O2 -o aes_bench -I../lib aes_bench.c ../lib/.libs/libshairplay.a -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "crypto/crypto.h"
+#include "aes_ctr.h"
+
+/* Uncompressed stereo 16-bit frame of 352 samples with ALAC header */
+#define MAX_PAYLOAD_LEN (352*4 + 3)
+
+typedef struct {
+	const char *name;
+	AES_MODE mode;
+	const char *key;
+	const char *iv;
+	const char *plain;
+	const char *cipher;
+} test_vector_t;
+
+static const test_vector_t test_vectors[] = {
+	{ "FIPS-197 C.1", AES_MODE_128,
+	  "000102030405060708090a0b0c0d0e0f",
+	  "00000000000000000000000000000000",
+	  "00112233445566778899aabbccddeeff",
+	  "69c4e0d86a7b0430d8cdb78070b4c55a" },
+	{ "FIPS-197 C.3", AES_MODE_256,
+	  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+	  "00000000000000000000000000000000",
+	  "00112233445566778899aabbccddeeff",
+	  "8ea2b7ca516745bfeafc49904b496089" },
+	{ "SP 800-38A F.2.1", AES_MODE_128,
+	  "2b7e151628aed2a6abf7158809cf4f3c",
+	  "000102030405060708090a0b0c0d0e0f",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+	  "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+	{ "SP 800-38A F.2.5", AES_MODE_256,
+	  "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+	  "000102030405060708090a0b0c0d0e0f",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+	  "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+};
+
+static const struct {
+	AES_BACKEND backend;
+	const char *name;
+} backends[] = {
+	{ AES_BACKEND_SMALL, "small" },
+	{ AES_BACKEND_TABLE, "table" },
+	{ AES_BACKEND_AESNI, "aesni" },
+	{ AES_BACKEND_ARMV8, "armv8" },
+};
+
+static const test_vector_t ctr_test_vector =
+	{ "SP 800-38A F.5.1", AES_MODE_128,
+	  "2b7e151628aed2a6abf7158809cf4f3c",
+	  "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+	  "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" };
+
+#define NUM_TEST_VECTORS (sizeof(test_vectors)/sizeof(test_vectors[0]))
+#define NUM_BACKENDS (sizeof(backends)/sizeof(backends[0]))
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+parse_hex(unsigned char *dst, const char *str)
+{
+	int len = strlen(str)/2;
+	int i;
+
+	for (i=0; i<len; i++) {
+		unsigned int value;
+		sscanf(str+i*2, "%2x", &value);
+		dst[i] = value;
+	}
+	return len;
+}
+
+static int
+run_test_vectors(const char *backend)
+{
+	unsigned char key[32], iv[16], plain[64], cipher[64], output[64];
+	int failed = 0;
+	int i, len;
+
+	for (i=0; i<NUM_TEST_VECTORS; i++) {
+		const test_vector_t *tv = &test_vectors[i];
+		AES_CTX aes_ctx;
+
+		parse_hex(key, tv->key);
+		parse_hex(iv, tv->iv);
+		parse_hex(plain, tv->plain);
+		len = parse_hex(cipher, tv->cipher);
+
+		AES_set_key(&aes_ctx, key, iv, tv->mode);
+		AES_cbc_encrypt(&aes_ctx, plain, output, len);
+		if (memcmp(output, cipher, len) || memcmp(aes_ctx.iv, cipher+len-16, 16)) {
+			fprintf(stderr, "%s: %s encryption failed\n", backend, tv->name);
+			failed = 1;
+		}
+
+		AES_set_key(&aes_ctx, key, iv, tv->mode);
+		AES_convert_key(&aes_ctx);
+		AES_cbc_decrypt(&aes_ctx, cipher, output, len);
+		if (memcmp(output, plain, len) || memcmp(aes_ctx.iv, cipher+len-16, 16)) {
+			fprintf(stderr, "%s: %s decryption failed\n", backend, tv->name);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* Compares a backend against the small reference with random inputs */
+static int
+run_random_tests(AES_BACKEND backend, const char *name)
+{
+	unsigned char key[32], iv[16], input[256];
+	unsigned char ref_output[256], output[256];
+	AES_CTX ref_ctx, aes_ctx;
+	int failed = 0;
+	int i, j, len;
+
+	srand(2);
+	for (i=0; i<2000; i++) {
+		AES_MODE mode = (i & 1) ? AES_MODE_256 : AES_MODE_128;
+		int decrypt = (i & 2);
+
+		for (j=0; j<sizeof(key); j++) key[j] = rand();
+		for (j=0; j<sizeof(iv); j++) iv[j] = rand();
+		for (j=0; j<sizeof(input); j++) input[j] = rand();
+		len = rand() % sizeof(input);
+
+		AES_set_key(&ref_ctx, key, iv, mode);
+		if (decrypt) {
+			AES_convert_key(&ref_ctx);
+		}
+		memcpy(&aes_ctx, &ref_ctx, sizeof(AES_CTX));
+		memset(ref_output, 0, sizeof(ref_output));
+		memset(output, 0, sizeof(output));
+
+		AES_set_backend(AES_BACKEND_SMALL);
+		if (decrypt) {
+			AES_cbc_decrypt(&ref_ctx, input, ref_output, len);
+		} else {
+			AES_cbc_encrypt(&ref_ctx, input, ref_output, len);
+		}
+		AES_set_backend(backend);
+		if (decrypt) {
+			AES_cbc_decrypt(&aes_ctx, input, output, len);
+		} else {
+			AES_cbc_encrypt(&aes_ctx, input, output, len);
+		}
+
+		if (memcmp(output, ref_output, sizeof(output)) ||
+		    memcmp(aes_ctx.iv, ref_ctx.iv, sizeof(aes_ctx.iv))) {
+			fprintf(stderr, "%s: random %s test %d differs from reference\n",
+			        name, decrypt ? "decryption" : "encryption", i);
+			failed = 1;
+			break;
+		}
+	}
+	return failed;
+}
+
+/* The original CTR implementation generating one keystream block at a time */
+static void
+ref_ctr_encrypt(AES_CTR_CTX *ctx, const uint8_t *msg, uint8_t *out, int length)
+{
+	int msgidx, i, n;
+
+	msgidx = 0;
+	while (msgidx < length) {
+		if (ctx->available == 0) {
+			memset(ctx->aes_ctx.iv, 0, AES_IV_SIZE);
+			AES_cbc_encrypt(&ctx->aes_ctx, ctx->counter, ctx->state, AES_BLOCKSIZE);
+			ctx->available = AES_BLOCKSIZE;
+			for (n=15, i=1; n>=0 && i; n--) {
+				i = (++ctx->counter[n] == 0);
+			}
+		}
+		for (i=0; i<ctx->available && msgidx<length; i++, msgidx++) {
+			out[msgidx] = msg[msgidx] ^ ctx->state[AES_BLOCKSIZE-ctx->available+i];
+		}
+		ctx->available -= i;
+	}
+}
+
+static int
+run_ctr_tests(const char *name)
+{
+	unsigned char key[16], nonce[16], plain[64], cipher[64];
+	unsigned char input[1024], ref_output[1024], output[1024];
+	AES_CTR_CTX ref_ctx, aes_ctx;
+	int i, j, len, pos;
+
+	parse_hex(key, ctr_test_vector.key);
+	parse_hex(nonce, ctr_test_vector.iv);
+	parse_hex(plain, ctr_test_vector.plain);
+	len = parse_hex(cipher, ctr_test_vector.cipher);
+	AES_ctr_set_key(&aes_ctx, key, nonce, AES_MODE_128);
+	AES_ctr_encrypt(&aes_ctx, plain, output, len);
+	if (memcmp(output, cipher, len)) {
+		fprintf(stderr, "%s: %s encryption failed\n", name, ctr_test_vector.name);
+		return 1;
+	}
+
+	srand(3);
+	for (i=0; i<500; i++) {
+		for (j=0; j<sizeof(key); j++) key[j] = rand();
+		for (j=0; j<sizeof(nonce); j++) nonce[j] = rand();
+		for (j=0; j<sizeof(input); j++) input[j] = rand();
+		len = rand() % sizeof(input);
+
+		/* Make some counters wrap inside the message */
+		if (i & 1) {
+			memset(nonce+8, 0xff, 8);
+		}
+
+		AES_ctr_set_key(&ref_ctx, key, nonce, AES_MODE_128);
+		AES_ctr_set_key(&aes_ctx, key, nonce, AES_MODE_128);
+		ref_ctr_encrypt(&ref_ctx, input, ref_output, len);
+		for (pos=0; pos<len; ) {
+			int chunk = 1 + rand() % (len-pos < 100 ? len-pos : 100);
+			AES_ctr_encrypt(&aes_ctx, input+pos, output+pos, chunk);
+			pos += chunk;
+		}
+		if (memcmp(output, ref_output, len) ||
+		    memcmp(aes_ctx.counter, ref_ctx.counter, AES_BLOCKSIZE) ||
+		    aes_ctx.available != ref_ctx.available) {
+			fprintf(stderr, "%s: random CTR test %d differs from reference\n", name, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double
+bench_per_packet_key(const unsigned char *aeskey, const unsigned char *aesiv,
+                     const unsigned char *payload, unsigned char *output,
+                     int payloadlen, int packets)
+{
+	int encryptedlen = payloadlen/16*16;
+	double start;
+	int i;
+
+	start = get_time();
+	for (i=0; i<packets; i++) {
+		AES_CTX aes_ctx;
+
+		AES_set_key(&aes_ctx, aeskey, aesiv, AES_MODE_128);
+		AES_convert_key(&aes_ctx);
+		AES_cbc_decrypt(&aes_ctx, payload, output, encryptedlen);
+	}
+	return get_time() - start;
+}
+
+static double
+bench_cached_key(const unsigned char *aeskey, const unsigned char *aesiv,
+                 const unsigned char *payload, unsigned char *output,
+                 int payloadlen, int packets)
+{
+	int encryptedlen = payloadlen/16*16;
+	AES_CTX aes_ctx;
+	double start;
+	int i;
+
+	start = get_time();
+	AES_set_key(&aes_ctx, aeskey, aesiv, AES_MODE_128);
+	AES_convert_key(&aes_ctx);
+	for (i=0; i<packets; i++) {
+		memcpy(aes_ctx.iv, aesiv, AES_IV_SIZE);
+		AES_cbc_decrypt(&aes_ctx, payload, output, encryptedlen);
+	}
+	return get_time() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned char aeskey[16];
+	unsigned char aesiv[16];
+	unsigned char payload[MAX_PAYLOAD_LEN];
+	unsigned char output1[MAX_PAYLOAD_LEN];
+	unsigned char output2[MAX_PAYLOAD_LEN];
+	int payloadlen = MAX_PAYLOAD_LEN;
+	int packets = 200000;
+	AES_CTR_CTX ctr_ctx;
+	const char *autoname;
+	int failed = 0, ret;
+	double t1, t2;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "l:n:")) != -1) {
+		switch (c) {
+		case 'l':
+			payloadlen = atoi(optarg);
+			break;
+		case 'n':
+			packets = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l payloadlen] [-n packets]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (payloadlen < 16 || payloadlen > MAX_PAYLOAD_LEN) {
+		fprintf(stderr, "Payload length must be between 16 and %d\n", MAX_PAYLOAD_LEN);
+		return 1;
+	}
+	if (packets <= 0) {
+		fprintf(stderr, "Invalid number of packets\n");
+		return 1;
+	}
+
+	autoname = AES_get_backend_name();
+	for (i=0; i<NUM_BACKENDS; i++) {
+		if (AES_set_backend(backends[i].backend) < 0) {
+			printf("backend %-6s not supported\n", backends[i].name);
+			continue;
+		}
+		ret = run_test_vectors(backends[i].name);
+		ret |= run_random_tests(backends[i].backend, backends[i].name);
+		ret |= run_ctr_tests(backends[i].name);
+		printf("backend %-6s %s\n", backends[i].name, ret ? "FAILED" : "ok");
+		failed |= ret;
+	}
+	if (failed) {
+		return 1;
+	}
+	AES_set_backend(AES_BACKEND_AUTO);
+	printf("default backend: %s\n\n", autoname);
+
+	srand(1);
+	for (i=0; i<sizeof(aeskey); i++) {
+		aeskey[i] = rand();
+		aesiv[i] = rand();
+	}
+	for (i=0; i<sizeof(payload); i++) {
+		payload[i] = rand();
+	}
+
+	printf("packets: %d, payload: %d bytes\n", packets, payloadlen);
+	AES_set_backend(AES_BACKEND_SMALL);
+	t1 = bench_per_packet_key(aeskey, aesiv, payload, output1, payloadlen, packets);
+	t2 = bench_cached_key(aeskey, aesiv, payload, output2, payloadlen, packets);
+	if (memcmp(output1, output2, payloadlen/16*16)) {
+		fprintf(stderr, "Decrypted output differs between variants\n");
+		return 1;
+	}
+	printf("small, per-packet key: %8.3f us/packet\n", t1*1e6/packets);
+	printf("small, cached key:     %8.3f us/packet\n", t2*1e6/packets);
+
+	for (i=1; i<NUM_BACKENDS; i++) {
+		if (AES_set_backend(backends[i].backend) < 0) {
+			continue;
+		}
+		t2 = bench_cached_key(aeskey, aesiv, payload, output2, payloadlen, packets);
+		printf("%-6s cached key:     %8.3f us/packet\n", backends[i].name, t2*1e6/packets);
+	}
+
+	AES_set_backend(AES_BACKEND_AUTO);
+	AES_ctr_set_key(&ctr_ctx, aeskey, aesiv, AES_MODE_128);
+	t1 = get_time();
+	for (i=0; i<packets; i++) {
+		ref_ctr_encrypt(&ctr_ctx, payload, output1, payloadlen);
+	}
+	t1 = get_time() - t1;
+	AES_ctr_set_key(&ctr_ctx, aeskey, aesiv, AES_MODE_128);
+	t2 = get_time();
+	for (i=0; i<packets; i++) {
+		AES_ctr_encrypt(&ctr_ctx, payload, output2, payloadlen);
+	}
+	t2 = get_time() - t2;
+	if (memcmp(output1, output2, payloadlen)) {
+		fprintf(stderr, "CTR output differs between variants\n");
+		return 1;
+	}
+	printf("%-6s CTR per block:  %8.3f us/packet\n", autoname, t1*1e6/packets);
+	printf("%-6s CTR batched:    %8.3f us/packet\n", autoname, t2*1e6/packets);
+	return 0;
+}
@@ -0,0 +1,668 @@
+/*
+ * Measures ALAC decoding speed on a corpus of RAOP sized frames.
+ *
+ * The corpus is built into the benchmark: a small encoder that mirrors
+ * the decoder in src/lib/alac compresses a deterministic mix of tones,
+ * noise and silence into 352 sample frames, the same way iTunes streams
+ * them (adaptive FIR prediction, rice coding with zero runs and
+ * weighted mid/side stereo). Frames captured from a real stream can be
+ * decoded instead with -f, as a file of 16-bit big endian lengths each
+ * followed by a decrypted frame.
+ *
+ * The built in corpora cover every sample size (16, 20, 24 and 32 bits),
+ * mono, stereo and multichannel frames, the second prediction mode and
+ * frames with data and fill elements, and each is checked to decode back
+ * to the encoded samples. For 16 and 24-bit stereo every deinterlacing
+ * kernel supported by the CPU is checked to give output identical to the
+ * C kernel and then timed, reporting decoded samples/s. Finally the
+ * 16-bit stereo corpus is encoded with different
+ * numbers of predictor taps and timed with the default kernel.
+ *
+ * Compile with: gcc -O2 -o alac_bench -I../lib alac_bench.c ../lib/.libs/libshairplay.a -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "alac/alac.h"
+
+#define FRAME_SAMPLES 352
+#define MAX_CHANNELS 8
+#define MAX_FRAME_BYTES (FRAME_SAMPLES * MAX_CHANNELS * 6 + 256)
+#define MAX_FRAMES 8192
+
+typedef struct {
+	int samplesize;
+	int numchannels;
+	int coef_num;
+	int quantization;
+	int interlacing_shift;
+	int interlacing_leftweight;
+	int uncompressed_bytes;
+	int prediction_type;
+	int extra_elements;
+} encoder_params_t;
+
+/* Rice parameters from the fmtp iTunes sends, "96 352 0 16 40 10 14 2 255 0 0 44100" */
+#define RICE_HISTORYMULT 40
+#define RICE_INITIALHISTORY 10
+#define RICE_KMODIFIER 14
+#define RICE_MODIFIER 4
+
+typedef struct {
+	int numframes;
+	int samplesize;
+	int numchannels;
+	unsigned char *frames[MAX_FRAMES];
+	int framelens[MAX_FRAMES];
+
+	/* Expected decoder output for the built in corpus */
+	unsigned char *expected;
+} corpus_t;
+
+static const char *kernels[] = { "c", "sse2", "avx2", "neon" };
+#define NUM_KERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes of each decoded sample */
+static int
+sample_bytes(int samplesize)
+{
+	return (samplesize + 7) / 8;
+}
+
+static void
+put_bits(unsigned char *buf, int *bitpos, uint32_t value, int bits)
+{
+	while (bits-- > 0) {
+		if ((value >> bits) & 1) {
+			buf[*bitpos/8] |= 0x80 >> (*bitpos%8);
+		}
+		(*bitpos)++;
+	}
+}
+
+static int32_t
+sign_extend(int32_t value, int bits)
+{
+	return (int32_t)((uint32_t)value << (32 - bits)) >> (32 - bits);
+}
+
+/* Writes a value the way entropy_decode_value reads it */
+static void
+encode_value(unsigned char *buf, int *bitpos, uint32_t value, int k, uint32_t multiplier, int rawbits)
+{
+	uint32_t q, r;
+
+	if (k == 1) {
+		q = value;
+		r = 0;
+	} else {
+		q = value / multiplier;
+		r = value % multiplier;
+	}
+	if (q > 8) {
+		put_bits(buf, bitpos, 0x1ff, 9);
+		put_bits(buf, bitpos, value, rawbits);
+		return;
+	}
+	put_bits(buf, bitpos, (1 << q) - 1, q);
+	put_bits(buf, bitpos, 0, 1);
+	if (k != 1) {
+		if (r == 0) {
+			put_bits(buf, bitpos, 0, k - 1);
+		} else {
+			put_bits(buf, bitpos, r + 1, k);
+		}
+	}
+}
+
+/* Mirrors entropy_rice_decode */
+static void
+encode_rice(unsigned char *buf, int *bitpos, const int32_t *errors, int count, int samplesize)
+{
+	int history = RICE_INITIALHISTORY;
+	int historymult = RICE_MODIFIER * RICE_HISTORYMULT / 4;
+	int signmodifier = 0;
+	int i;
+
+	for (i=0; i<count; i++) {
+		int32_t error = errors[i];
+		uint32_t value;
+		int k;
+
+		value = (error < 0) ? (uint32_t)(-2 * error - 1) : (uint32_t)(2 * error);
+		k = 31 - RICE_KMODIFIER - __builtin_clz((history >> 9) + 3);
+		k = (k < 0) ? k + RICE_KMODIFIER : RICE_KMODIFIER;
+		encode_value(buf, bitpos, value - signmodifier, k, (1 << k) - 1, samplesize);
+		signmodifier = 0;
+
+		history += (value * historymult) - ((history * historymult) >> 9);
+		if (value > 0xFFFF) {
+			history = 0xFFFF;
+		}
+
+		if (history < 128 && i + 1 < count) {
+			int zeros = 0;
+
+			while (i + 1 + zeros < count && zeros < 0xFFFF && errors[i + 1 + zeros] == 0) {
+				zeros++;
+			}
+			k = __builtin_clz(history) + ((history + 16) / 64) - 24;
+			encode_value(buf, bitpos, zeros, k,
+			             ((1 << k) - 1) & ((1 << RICE_KMODIFIER) - 1), 16);
+			i += zeros;
+			signmodifier = 1;
+			history = 0;
+		}
+	}
+}
+
+/* Mirrors predictor_decompress_fir_adapt, producing its error input */
+static void
+encode_fir(const int32_t *input, int32_t *errors, int count, int samplesize,
+           int16_t *coefs, int coef_num, int quantization)
+{
+	const int32_t *buffer = input;
+	int i, j;
+
+	errors[0] = input[0];
+	for (i=0; i<coef_num && i+1<count; i++) {
+		errors[i+1] = sign_extend(input[i+1] - input[i], samplesize);
+	}
+
+	for (i=coef_num+1; i<count; i++) {
+		int sum = 0;
+		int error_val;
+
+		for (j=0; j<coef_num; j++) {
+			sum += (buffer[coef_num-j] - buffer[0]) * coefs[j];
+		}
+		sum = ((1 << (quantization-1)) + sum) >> quantization;
+		error_val = sign_extend(input[i] - (sum + buffer[0]), samplesize);
+		errors[i] = error_val;
+
+		if (error_val > 0) {
+			int predictor_num = coef_num - 1;
+			while (predictor_num >= 0 && error_val > 0) {
+				int val = buffer[0] - buffer[coef_num - predictor_num];
+				int sign = (val < 0) ? -1 : (val > 0);
+				coefs[predictor_num] -= sign;
+				val *= sign;
+				error_val -= ((val >> quantization) * (coef_num - predictor_num));
+				predictor_num--;
+			}
+		} else if (error_val < 0) {
+			int predictor_num = coef_num - 1;
+			while (predictor_num >= 0 && error_val < 0) {
+				int val = buffer[0] - buffer[coef_num - predictor_num];
+				int sign = (val < 0) ? 1 : -(val > 0);
+				coefs[predictor_num] -= sign;
+				val *= sign;
+				error_val -= ((val >> quantization) * (coef_num - predictor_num));
+				predictor_num--;
+			}
+		}
+		buffer++;
+	}
+}
+
+/* Initial coefficients for a second order predictor, x[n] = 2x[n-1] - x[n-2] */
+static void
+init_coefs(int16_t *coefs, int coef_num, int quantization)
+{
+	memset(coefs, 0, coef_num * sizeof(int16_t));
+	if (coef_num > 0) {
+		coefs[0] = 2 << quantization;
+	}
+	if (coef_num > 1) {
+		coefs[1] = -(1 << quantization);
+	} else if (coef_num > 0) {
+		coefs[0] = 1 << quantization;
+	}
+}
+
+static void
+put_channel_header(unsigned char *buf, int *bitpos, const encoder_params_t *params, int16_t *coefs)
+{
+	int i;
+
+	put_bits(buf, bitpos, params->prediction_type, 4);
+	put_bits(buf, bitpos, params->quantization, 4);
+	put_bits(buf, bitpos, RICE_MODIFIER, 3);
+	put_bits(buf, bitpos, params->coef_num, 5);
+	for (i=0; i<params->coef_num; i++) {
+		put_bits(buf, bitpos, (uint16_t)coefs[i], 16);
+	}
+}
+
+/* Element layout for each channel count, the decoder outputs channels
+ * in element order: s is a single channel, p a channel pair, l an lfe */
+static const char *element_layouts[MAX_CHANNELS + 1] = {
+	"", "s", "p", "sp", "sps", "spp", "sppl", "sppsl", "spppl"
+};
+
+/* Encodes channel first, or channels first and first+1 for a pair */
+static void
+encode_element(unsigned char *buf, int *bitpos, const int32_t *samples, int count,
+               const encoder_params_t *params, int tag, int first, int elemchannels)
+{
+	int32_t channel[2][FRAME_SAMPLES];
+	int32_t low[2][FRAME_SAMPLES];
+	int32_t errors[FRAME_SAMPLES];
+	int16_t coefs[2][32];
+	int numchannels = params->numchannels;
+	int ubits = params->uncompressed_bytes * 8;
+	int readsamplesize = params->samplesize - ubits + (elemchannels - 1);
+	int i, ch;
+
+	/* Split off the uncompressed low bytes and mix the channels */
+	for (i=0; i<count; i++) {
+		for (ch=0; ch<elemchannels; ch++) {
+			int32_t sample = samples[i * numchannels + first + ch];
+			low[ch][i] = sample & ((1 << ubits) - 1);
+			channel[ch][i] = sample >> ubits;
+		}
+		if (elemchannels == 2 && params->interlacing_leftweight) {
+			int32_t left = channel[0][i];
+			int32_t right = channel[1][i];
+			int32_t difference = left - right;
+			channel[0][i] = right + ((difference * params->interlacing_leftweight) >> params->interlacing_shift);
+			channel[1][i] = difference;
+		}
+	}
+
+	put_bits(buf, bitpos, tag, 3);                  /* element type */
+	put_bits(buf, bitpos, 0, 4);                    /* element instance */
+	put_bits(buf, bitpos, 0, 12);
+	put_bits(buf, bitpos, count != FRAME_SAMPLES, 1);
+	put_bits(buf, bitpos, params->uncompressed_bytes, 2);
+	put_bits(buf, bitpos, 0, 1);                    /* compressed */
+	if (count != FRAME_SAMPLES) {
+		put_bits(buf, bitpos, count, 32);
+	}
+	if (elemchannels == 2) {
+		put_bits(buf, bitpos, params->interlacing_shift, 8);
+		put_bits(buf, bitpos, params->interlacing_leftweight, 8);
+	} else {
+		put_bits(buf, bitpos, 0, 16);
+	}
+	for (ch=0; ch<elemchannels; ch++) {
+		init_coefs(coefs[ch], params->coef_num, params->quantization);
+		put_channel_header(buf, bitpos, params, coefs[ch]);
+	}
+	if (ubits) {
+		for (i=0; i<count; i++) {
+			for (ch=0; ch<elemchannels; ch++) {
+				put_bits(buf, bitpos, low[ch][i], ubits);
+			}
+		}
+	}
+	for (ch=0; ch<elemchannels; ch++) {
+		encode_fir(channel[ch], errors, count, readsamplesize,
+		           coefs[ch], params->coef_num, params->quantization);
+		if (params->prediction_type) {
+			/* First order coding of the FIR error, undone by the decoder */
+			for (i=count-1; i>0; i--) {
+				errors[i] = sign_extend(errors[i] - errors[i-1], readsamplesize);
+			}
+		}
+		encode_rice(buf, bitpos, errors, count, readsamplesize);
+	}
+}
+
+/* Data stream and fill elements the decoder has to skip */
+static void
+encode_extra_elements(unsigned char *buf, int *bitpos)
+{
+	int i;
+
+	put_bits(buf, bitpos, 4, 3);                    /* data stream element */
+	put_bits(buf, bitpos, 0, 4);                    /* element instance */
+	put_bits(buf, bitpos, 1, 1);                    /* byte aligned */
+	put_bits(buf, bitpos, 5, 8);
+	*bitpos = (*bitpos + 7) & ~7;
+	for (i=0; i<5; i++) {
+		put_bits(buf, bitpos, 0xa5, 8);
+	}
+	put_bits(buf, bitpos, 6, 3);                    /* fill element */
+	put_bits(buf, bitpos, 3, 4);
+	for (i=0; i<3; i++) {
+		put_bits(buf, bitpos, 0xff, 8);
+	}
+}
+
+/* Encodes one frame of interleaved samples, returns the frame length */
+static int
+encode_frame(unsigned char *buf, const int32_t *samples, int count, const encoder_params_t *params)
+{
+	const char *layout = element_layouts[params->numchannels];
+	int bitpos = 0;
+	int first = 0;
+	int i;
+
+	memset(buf, 0, MAX_FRAME_BYTES);
+	for (i=0; layout[i]; i++) {
+		if (layout[i] == 'p') {
+			encode_element(buf, &bitpos, samples, count, params, 1, first, 2);
+			first += 2;
+		} else {
+			encode_element(buf, &bitpos, samples, count, params, layout[i] == 'l' ? 3 : 0, first, 1);
+			first += 1;
+		}
+		if (i == 0 && params->extra_elements) {
+			encode_extra_elements(buf, &bitpos);
+		}
+	}
+	put_bits(buf, &bitpos, 7, 3);                   /* end tag */
+	return (bitpos + 7) / 8;
+}
+
+/* Deterministic test signal: tones, a sweep, noise and some silence */
+static void
+generate_samples(int32_t *samples, int frame, int count, int numchannels, int samplesize)
+{
+	double scale = ldexp(0.5, samplesize - 1);
+	int silent = (frame % 64) >= 60;
+	int i, ch;
+
+	for (i=0; i<count; i++) {
+		double t = (double)(frame * FRAME_SAMPLES + i) / 44100.0;
+		double base = 0.5 * sin(2 * M_PI * 220.0 * t) +
+		              0.25 * sin(2 * M_PI * (440.0 + 200.0 * sin(t)) * t);
+		for (ch=0; ch<numchannels; ch++) {
+			double noise = ((rand() & 0xffff) / 65536.0 - 0.5) * 0.02;
+			double value = base * (1.0 - 0.3 * ch) + 0.2 * sin(2 * M_PI * 330.0 * t + ch) + noise;
+			samples[i * numchannels + ch] = silent ? 0 : (int32_t)(value * scale);
+		}
+	}
+}
+
+static int
+build_corpus(corpus_t *corpus, int numframes, const encoder_params_t *params)
+{
+	int32_t samples[FRAME_SAMPLES * MAX_CHANNELS];
+	unsigned char buf[MAX_FRAME_BYTES];
+	int bytes = sample_bytes(params->samplesize);
+	unsigned char *expected;
+	int i, j, b;
+
+	srand(1);
+	expected = corpus->expected = malloc((long)numframes * FRAME_SAMPLES * params->numchannels * bytes);
+	corpus->samplesize = params->samplesize;
+	corpus->numchannels = params->numchannels;
+	for (i=0; i<numframes; i++) {
+		int len;
+
+		generate_samples(samples, i, FRAME_SAMPLES, params->numchannels, params->samplesize);
+		len = encode_frame(buf, samples, FRAME_SAMPLES, params);
+		for (j=0; j<FRAME_SAMPLES * params->numchannels; j++) {
+			/* 20-bit samples are output left justified in 24 bits */
+			uint32_t sample = (uint32_t)samples[j] << (params->samplesize == 20 ? 4 : 0);
+			for (b=0; b<bytes; b++) {
+				*expected++ = sample >> (b * 8);
+			}
+		}
+		corpus->frames[i] = malloc(len);
+		memcpy(corpus->frames[i], buf, len);
+		corpus->framelens[i] = len;
+	}
+	corpus->numframes = numframes;
+	return 0;
+}
+
+static int
+load_corpus(corpus_t *corpus, const char *filename)
+{
+	unsigned char header[2];
+	FILE *file;
+
+	file = fopen(filename, "rb");
+	if (!file) {
+		return -1;
+	}
+	corpus->samplesize = 16;
+	corpus->numchannels = 2;
+	corpus->numframes = 0;
+	while (corpus->numframes < MAX_FRAMES && fread(header, 1, 2, file) == 2) {
+		int len = (header[0] << 8) | header[1];
+		unsigned char *frame = malloc(len);
+		if (fread(frame, 1, len, file) != len) {
+			free(frame);
+			break;
+		}
+		corpus->frames[corpus->numframes] = frame;
+		corpus->framelens[corpus->numframes] = len;
+		corpus->numframes++;
+	}
+	fclose(file);
+	return corpus->numframes > 0 ? 0 : -1;
+}
+
+static alac_file *
+create_decoder(int samplesize, int numchannels)
+{
+	unsigned char info[48];
+	alac_file *alac;
+
+	memset(info, 0, sizeof(info));
+	info[24] = FRAME_SAMPLES >> 24;
+	info[25] = FRAME_SAMPLES >> 16;
+	info[26] = FRAME_SAMPLES >> 8;
+	info[27] = FRAME_SAMPLES & 0xff;
+	info[29] = samplesize;
+	info[30] = RICE_HISTORYMULT;
+	info[31] = RICE_INITIALHISTORY;
+	info[32] = RICE_KMODIFIER;
+	info[33] = numchannels;
+	alac = alac_create(samplesize, numchannels);
+	alac_set_info(alac, (char *) info);
+	return alac;
+}
+
+/* Decodes the whole corpus into output, returns the number of samples */
+static long
+decode_corpus(alac_file *alac, const corpus_t *corpus, unsigned char *output, int framesize)
+{
+	long samples = 0;
+	int i;
+
+	for (i=0; i<corpus->numframes; i++) {
+		int outputsize = framesize;
+		alac_decode_frame(alac, corpus->frames[i], corpus->framelens[i], output + (long)i * framesize, &outputsize);
+		samples += outputsize / (sample_bytes(corpus->samplesize) * corpus->numchannels);
+	}
+	return samples;
+}
+
+static int
+run_corpus(const corpus_t *corpus, const char *name, double mintime)
+{
+	int framesize = FRAME_SAMPLES * corpus->numchannels * sample_bytes(corpus->samplesize);
+	unsigned char *reference, *output;
+	alac_file *alac;
+	long bytes = 0;
+	int numkernels;
+	int i;
+
+	for (i=0; i<corpus->numframes; i++) {
+		bytes += corpus->framelens[i];
+	}
+	printf("corpus: %s, %d frames, %d-bit, %d channels, %ld bytes/frame\n", name,
+	       corpus->numframes, corpus->samplesize, corpus->numchannels,
+	       bytes / corpus->numframes);
+
+	reference = calloc(corpus->numframes, framesize);
+	output = calloc(corpus->numframes, framesize);
+	alac = create_decoder(corpus->samplesize, corpus->numchannels);
+
+	alac_set_kernel("c");
+	decode_corpus(alac, corpus, reference, framesize);
+	if (corpus->expected && memcmp(reference, corpus->expected, (long)corpus->numframes * framesize)) {
+		printf("  decoded output differs from the encoded samples\n");
+		return 1;
+	}
+
+	/* The SIMD kernels only deinterlace 16 and 24-bit stereo */
+	numkernels = NUM_KERNELS;
+	if (corpus->numchannels != 2 || (corpus->samplesize != 16 && corpus->samplesize != 24)) {
+		numkernels = 1;
+	}
+	for (i=0; i<numkernels; i++) {
+		double start, elapsed;
+		long samples = 0;
+		int rounds = 0;
+
+		if (alac_set_kernel(kernels[i]) < 0) {
+			printf("  kernel %-5s not supported\n", kernels[i]);
+			continue;
+		}
+		memset(output, 0, (long)corpus->numframes * framesize);
+		decode_corpus(alac, corpus, output, framesize);
+		if (memcmp(output, reference, (long)corpus->numframes * framesize)) {
+			printf("  kernel %-5s output differs from the C kernel\n", kernels[i]);
+			return 1;
+		}
+
+		start = get_time();
+		do {
+			samples += decode_corpus(alac, corpus, output, framesize);
+			rounds++;
+			elapsed = get_time() - start;
+		} while (elapsed < mintime);
+		printf("  kernel %-5s %8.2f Msamples/s decode\n", kernels[i], samples / elapsed / 1e6);
+	}
+
+	alac_set_kernel(NULL);
+	alac_free(alac);
+	free(reference);
+	free(output);
+	return 0;
+}
+
+/* Times decoding of 16-bit stereo corpora that differ only in the number
+ * of predictor taps, with the default kernel */
+static int
+run_taps(int numframes, double mintime)
+{
+	static const int taps[] = { 1, 2, 4, 6, 8, 12, 16 };
+	static corpus_t corpus;
+	int framesize = FRAME_SAMPLES * 2 * 2;
+	unsigned char *output;
+	int failed = 0;
+	int i, j;
+
+	printf("predictor taps, 16-bit stereo, %d frames:\n", numframes);
+	output = calloc(numframes, framesize);
+	for (i=0; i<sizeof(taps)/sizeof(taps[0]); i++) {
+		encoder_params_t params = { 16, 2, 0, 9, 2, 3, 0 };
+		alac_file *alac;
+		double start, elapsed;
+		long samples = 0;
+
+		params.coef_num = taps[i];
+		build_corpus(&corpus, numframes, &params);
+		alac = create_decoder(16, 2);
+		decode_corpus(alac, &corpus, output, framesize);
+		if (memcmp(output, corpus.expected, (long)numframes * framesize)) {
+			printf("  taps %-2d decoded output differs from the encoded samples\n", taps[i]);
+			failed = 1;
+		} else {
+			start = get_time();
+			do {
+				samples += decode_corpus(alac, &corpus, output, framesize);
+				elapsed = get_time() - start;
+			} while (elapsed < mintime);
+			printf("  taps %-2d %8.2f Msamples/s decode\n", taps[i], samples / elapsed / 1e6);
+		}
+		alac_free(alac);
+		for (j=0; j<corpus.numframes; j++) {
+			free(corpus.frames[j]);
+		}
+		free(corpus.expected);
+	}
+	free(output);
+	return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static corpus_t corpus;
+	const char *filename = NULL;
+	double mintime = 1.0;
+	int numframes = 1000;
+	int failed = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "f:n:t:")) != -1) {
+		switch (c) {
+		case 'f':
+			filename = optarg;
+			break;
+		case 'n':
+			numframes = atoi(optarg);
+			break;
+		case 't':
+			mintime = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f frames.bin] [-n frames] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (numframes <= 0 || numframes > MAX_FRAMES) {
+		fprintf(stderr, "Number of frames must be between 1 and %d\n", MAX_FRAMES);
+		return 1;
+	}
+	printf("default kernel: %s\n", alac_get_kernel_name());
+
+	if (filename) {
+		if (load_corpus(&corpus, filename) < 0) {
+			fprintf(stderr, "Could not read frames from %s\n", filename);
+			return 1;
+		}
+		return run_corpus(&corpus, filename, mintime);
+	} else {
+		static const struct {
+			const char *name;
+			encoder_params_t params;
+		} corpora[] = {
+			{ "16-bit stereo", { 16, 2, 8, 9, 2, 3, 0 } },
+			{ "16-bit stereo, no mixing", { 16, 2, 4, 9, 0, 0, 0 } },
+			{ "24-bit stereo", { 24, 2, 8, 9, 2, 3, 1 } },
+			{ "16-bit mono", { 16, 1, 8, 9, 0, 0, 0 } },
+			{ "20-bit stereo", { 20, 2, 8, 9, 2, 3, 0 } },
+			{ "24-bit mono", { 24, 1, 8, 9, 0, 0, 1 } },
+			{ "32-bit stereo", { 32, 2, 8, 9, 2, 3, 2 } },
+			{ "16-bit stereo, prediction type 1", { 16, 2, 8, 9, 2, 3, 0, 1 } },
+			{ "16-bit 5.1", { 16, 6, 8, 9, 2, 3, 0 } },
+			{ "24-bit 7.1, data and fill elements", { 24, 8, 8, 9, 2, 3, 1, 0, 1 } },
+		};
+
+		for (i=0; i<sizeof(corpora)/sizeof(corpora[0]); i++) {
+			int j;
+
+			build_corpus(&corpus, numframes, &corpora[i].params);
+			failed |= run_corpus(&corpus, corpora[i].name, mintime);
+			for (j=0; j<corpus.numframes; j++) {
+				free(corpus.frames[j]);
+			}
+			free(corpus.expected);
+		}
+		failed |= run_taps(numframes, mintime);
+	}
+	return failed;
+}
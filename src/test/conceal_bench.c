@@ -0,0 +1,299 @@
+/*
+ * Measures the quality and the cost of concealing lost RAOP frames.
+ *
+ * A deterministic test signal of harmonic tones with vibrato and a
+ * little noise is cut into 352 sample frames, and frames are dropped
+ * at random with the given loss rate. For the concealment and for the
+ * silent frames used without it, the error of the lost frames and the
+ * frames after them is reported as the signal to error ratio, and the
+ * log spectral distance of the lost frames from the original in dB.
+ * The vibrato makes repeated audio drift out of phase, so the spectral
+ * distance tells more about how a concealed frame sounds.
+ *
+ * Timing covers the work done for every received frame and the work
+ * for a lost frame, which includes the pitch search at the start of a
+ * loss. Both are shown against the 7.98 ms that a frame of 44.1 kHz
+ * audio lasts, which is the budget for the whole receive path.
+ *
+ * Compile with: gcc -O2 -o conceal_bench -I../lib conceal_bench.c ../lib/.libs/libshairplay.a -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "raop_conceal.h"
+
+#define FRAME_LEN 352
+#define SAMPLE_RATE 44100
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Harmonic tone with slow vibrato, channels get slightly different mixes */
+static double
+signal_sample(long n, int channel)
+{
+	double t = (double)n / SAMPLE_RATE;
+	double f0 = 196.0 * (1.0 + 0.01 * sin(2*M_PI*5.0*t));
+	double value = 0.0;
+	int h;
+
+	for (h=1; h<=6; h++) {
+		value += sin(2*M_PI*f0*h*t + channel*0.3*h) / h;
+	}
+	value += 0.02 * ((rand() / (double)RAND_MAX) - 0.5);
+	return 0.4 * value;
+}
+
+static void
+write_sample(unsigned char *ptr, int bytes, double value)
+{
+	int32_t sample = (int32_t)(value * ((((uint32_t)1 << (8*bytes-1)) - 1)));
+
+	if (bytes == 2) {
+		*((int16_t *)ptr) = sample;
+	} else {
+		ptr[0] = sample & 0xff;
+		ptr[1] = (sample >> 8) & 0xff;
+		ptr[2] = (sample >> 16) & 0xff;
+		if (bytes == 4) {
+			ptr[3] = (sample >> 24) & 0xff;
+		}
+	}
+}
+
+static double
+read_sample(const unsigned char *ptr, int bytes)
+{
+	int32_t value;
+
+	if (bytes == 2) {
+		value = *((const int16_t *)ptr);
+	} else if (bytes == 3) {
+		value = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+		value = (value ^ 0x800000) - 0x800000;
+	} else {
+		value = (int32_t)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+	}
+	return value / (double)(((uint32_t)1 << (8*bytes-1)) - 1);
+}
+
+/* Hann windowed power spectrum of the first channel of a frame */
+static void
+power_spectrum(const unsigned char *frame, int channels, int bytes, double *power)
+{
+	int k, n;
+
+	for (k=1; k<FRAME_LEN/2; k++) {
+		double re = 0.0, im = 0.0;
+
+		for (n=0; n<FRAME_LEN; n++) {
+			double window = 0.5 - 0.5*cos(2*M_PI*n/FRAME_LEN);
+			double value = window * read_sample(frame + n*channels*bytes, bytes);
+
+			re += value * cos(2*M_PI*k*n/FRAME_LEN);
+			im -= value * sin(2*M_PI*k*n/FRAME_LEN);
+		}
+		power[k] = re*re + im*im;
+	}
+}
+
+/* Root mean square difference of the spectra in dB, floored at -100 dB */
+static double
+spectral_distance(const double *expected, const double *actual)
+{
+	double sum = 0.0;
+	int k;
+
+	for (k=1; k<FRAME_LEN/2; k++) {
+		double diff = 10*log10((expected[k] + 1e-10) / (actual[k] + 1e-10));
+		sum += diff*diff;
+	}
+	return sqrt(sum / (FRAME_LEN/2 - 1));
+}
+
+static unsigned char *
+build_signal(int numframes, int channels, int bytes)
+{
+	unsigned char *frames;
+	long n;
+	int c;
+
+	frames = malloc((size_t)numframes * FRAME_LEN * channels * bytes);
+	if (!frames) {
+		return NULL;
+	}
+	srand(1);
+	for (n=0; n<(long)numframes*FRAME_LEN; n++) {
+		for (c=0; c<channels; c++) {
+			write_sample(frames + (n*channels + c)*bytes, bytes, signal_sample(n, c));
+		}
+	}
+	return frames;
+}
+
+/* Compares concealment and silence against the original audio */
+static void
+run_quality(const unsigned char *frames, int numframes, int channels, int bytes, double loss)
+{
+	int framelen = FRAME_LEN * channels * bytes;
+	raop_conceal_t *conceal;
+	unsigned char *output;
+	double signal = 0.0, error = 0.0, silent = 0.0;
+	double expected_power[FRAME_LEN/2], actual_power[FRAME_LEN/2], silent_power[FRAME_LEN/2];
+	double distance = 0.0, silent_distance = 0.0;
+	int lost, prev_lost = 0, count = 0;
+	int i, j;
+
+	conceal = raop_conceal_init(channels, 8*bytes, FRAME_LEN);
+	output = malloc(framelen);
+	if (!conceal || !output) {
+		return;
+	}
+	memset(silent_power, 0, sizeof(silent_power));
+	srand(2);
+	for (i=0; i<numframes; i++) {
+		const unsigned char *frame = frames + (size_t)i*framelen;
+
+		lost = (i > 2) && (rand() / (double)RAND_MAX) < loss;
+		if (lost) {
+			raop_conceal_lost(conceal, output);
+			power_spectrum(frame, channels, bytes, expected_power);
+			power_spectrum(output, channels, bytes, actual_power);
+			distance += spectral_distance(expected_power, actual_power);
+			silent_distance += spectral_distance(expected_power, silent_power);
+			count++;
+		} else {
+			memcpy(output, frame, framelen);
+			raop_conceal_received(conceal, output, framelen);
+		}
+		if (lost || prev_lost) {
+			for (j=0; j<FRAME_LEN*channels; j++) {
+				double expected = read_sample(frame + j*bytes, bytes);
+				double actual = read_sample(output + j*bytes, bytes);
+
+				signal += expected*expected;
+				error += (expected-actual)*(expected-actual);
+				silent += lost ? expected*expected : 0.0;
+			}
+		}
+		prev_lost = lost;
+	}
+	printf("  %2.0f%% loss, %4d frames lost: SNR %6.2f dB (silence %5.2f dB), spectral distance %6.2f dB (silence %6.2f dB)\n",
+	       loss*100, count, 10*log10(signal/error), 10*log10(signal/silent),
+	       distance/count, silent_distance/count);
+	free(output);
+	raop_conceal_destroy(conceal);
+}
+
+static void
+run_timing(const unsigned char *frames, int numframes, int channels, int bytes, double mintime)
+{
+	int framelen = FRAME_LEN * channels * bytes;
+	double budget = 1e6 * FRAME_LEN / SAMPLE_RATE;
+	double start, elapsed, received_us, lost_us;
+	raop_conceal_t *conceal;
+	unsigned char *output;
+	long rounds;
+	int i;
+
+	conceal = raop_conceal_init(channels, 8*bytes, FRAME_LEN);
+	output = malloc(framelen);
+	if (!conceal || !output) {
+		return;
+	}
+
+	/* Every received frame is remembered */
+	rounds = 0;
+	start = get_time();
+	do {
+		for (i=0; i<numframes; i++, rounds++) {
+			memcpy(output, frames + (size_t)i*framelen, framelen);
+			raop_conceal_received(conceal, output, framelen);
+		}
+		elapsed = get_time() - start;
+	} while (elapsed < mintime);
+	received_us = elapsed * 1e6 / rounds;
+
+	/* Single losses, each starts with the pitch search */
+	rounds = 0;
+	start = get_time();
+	do {
+		for (i=0; i<numframes; i++, rounds++) {
+			raop_conceal_lost(conceal, output);
+			memcpy(output, frames + (size_t)i*framelen, framelen);
+			raop_conceal_received(conceal, output, framelen);
+		}
+		elapsed = get_time() - start;
+	} while (elapsed < mintime);
+	lost_us = elapsed * 1e6 / rounds - received_us;
+
+	printf("  received %8.2f us/frame (%5.2f%% of budget), lost %8.2f us/frame (%5.2f%% of budget)\n",
+	       received_us, 100*received_us/budget, lost_us, 100*lost_us/budget);
+	free(output);
+	raop_conceal_destroy(conceal);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		int channels;
+		int bits;
+	} formats[] = {
+		{ "16-bit stereo", 2, 16 },
+		{ "24-bit stereo", 2, 24 },
+		{ "32-bit stereo", 2, 32 },
+		{ "16-bit 5.1", 6, 16 },
+	};
+	static const double losses[] = { 0.01, 0.05, 0.20 };
+	double mintime = 1.0;
+	int numframes = 1000;
+	int c, i, j;
+
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			numframes = atoi(optarg);
+			break;
+		case 't':
+			mintime = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n frames] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (numframes <= 0) {
+		fprintf(stderr, "Number of frames must be positive\n");
+		return 1;
+	}
+
+	for (i=0; i<sizeof(formats)/sizeof(formats[0]); i++) {
+		int bytes = formats[i].bits/8;
+		unsigned char *frames;
+
+		frames = build_signal(numframes, formats[i].channels, bytes);
+		if (!frames) {
+			return 1;
+		}
+		printf("%s\n", formats[i].name);
+		for (j=0; j<sizeof(losses)/sizeof(losses[0]); j++) {
+			run_quality(frames, numframes, formats[i].channels, bytes, losses[j]);
+		}
+		run_timing(frames, numframes, formats[i].channels, bytes, mintime);
+		free(frames);
+	}
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Checks how well the timing channel estimates the sender clock.
+ *
+ * A simulated sender runs with a fixed offset and drift from our clock,
+ * and answers the timing requests after random queueing delays in both
+ * directions. The requests are sent on the same schedule as raop_rtp,
+ * and the responses are fed to raop_ntp as they would arrive from the
+ * socket. The estimated offset and drift are compared to the real ones
+ * as the simulated session goes on.
+ *
+ * Compile with: gcc -O2 -o ntp_bench -I../lib ntp_bench.c ../lib/.libs/libshairplay.a -lpthread -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "raop_ntp.h"
+#include "logger.h"
+
+/* Request schedule used by raop_rtp, in seconds */
+#define FAST_COUNT 8
+#define FAST_INTERVAL 0.2
+#define INTERVAL 3.0
+
+/* Shortest one way delay and the time the sender takes to answer */
+#define MIN_DELAY 0.0002
+#define PROCESSING 0.00005
+
+typedef struct {
+	uint64_t base;
+	int64_t offset;
+	double drift;
+} sender_t;
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t
+to_ntp(double seconds)
+{
+	return (int64_t)(seconds * RAOP_NTP_SECOND);
+}
+
+static double
+from_ntp(int64_t value)
+{
+	return (double)value / RAOP_NTP_SECOND;
+}
+
+/* Exponentially distributed queueing delay */
+static double
+get_delay(double mean)
+{
+	double u = rand() / (RAND_MAX + 1.0);
+	return MIN_DELAY - mean * log(1.0 - u);
+}
+
+/* Offset of the sender clock at the given local time */
+static int64_t
+sender_offset(sender_t *sender, uint64_t local_time)
+{
+	double elapsed = (double)(int64_t)(local_time - sender->base);
+	return sender->offset + (int64_t)(elapsed * sender->drift);
+}
+
+static void
+write_time(unsigned char *data, uint64_t value)
+{
+	int i;
+
+	for (i=7; i>=0; i--) {
+		data[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/* Answers the request like a sender receiving it at local time recv_time */
+static void
+sender_respond(sender_t *sender, const unsigned char *request, uint64_t recv_time, unsigned char *packet)
+{
+	uint64_t send_time = recv_time + to_ntp(PROCESSING);
+
+	memset(packet, 0, RAOP_NTP_PACKET_LEN);
+	packet[0] = 0x80;
+	packet[1] = 0x53|0x80;
+	packet[3] = 0x07;
+	memcpy(packet+8, request+24, 8);
+	write_time(packet+16, recv_time + sender_offset(sender, recv_time));
+	write_time(packet+24, send_time + sender_offset(sender, send_time));
+}
+
+int
+main(int argc, char *argv[])
+{
+	double duration = 600.0, drift_ppm = 37.0, jitter = 0.0001;
+	unsigned int seed = 1;
+	double elapsed, report, spent = 0.0;
+	int requests, c;
+	logger_t *logger;
+	raop_ntp_t *ntp;
+	raop_ntp_clock_t clock;
+	sender_t sender;
+
+	while ((c = getopt(argc, argv, "d:p:j:s:")) != -1) {
+		switch (c) {
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'p':
+			drift_ppm = atof(optarg);
+			break;
+		case 'j':
+			jitter = atof(optarg) / 1000.0;
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d seconds] [-p drift ppm] [-j mean queueing ms] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	srand(seed);
+
+	logger = logger_init();
+	ntp = raop_ntp_init(logger);
+	if (!ntp) {
+		fprintf(stderr, "Failed to initialize raop_ntp\n");
+		return 1;
+	}
+
+	sender.base = raop_ntp_get_local_time(ntp);
+	sender.offset = to_ntp(-1234.567891);
+	sender.drift = drift_ppm / 1000000.0;
+
+	printf("Sender drift %.3f ppm, mean queueing delay %.3f ms each way\n", drift_ppm, jitter * 1000.0);
+	printf("  %6s %8s %12s %14s %12s\n", "time", "samples", "drift ppm", "offset err us", "delay us");
+
+	elapsed = 0.0;
+	report = 10.0;
+	for (requests=0; elapsed<=duration; requests++) {
+		unsigned char request[RAOP_NTP_PACKET_LEN], response[RAOP_NTP_PACKET_LEN];
+		uint64_t transmit_time, sender_time, recv_time;
+		double start;
+
+		transmit_time = sender.base + to_ntp(elapsed);
+		sender_time = transmit_time + to_ntp(get_delay(jitter));
+		recv_time = sender_time + to_ntp(PROCESSING + get_delay(jitter));
+
+		raop_ntp_create_request(ntp, transmit_time, request);
+		sender_respond(&sender, request, sender_time, response);
+
+		start = get_time();
+		raop_ntp_process_response(ntp, response, sizeof(response), recv_time);
+		spent += get_time() - start;
+
+		if (elapsed >= report) {
+			raop_ntp_get_clock(ntp, &clock);
+			printf("  %5.0fs %8u %12.3f %14.1f %12.1f\n", elapsed, clock.samples, clock.drift_ppm,
+			       from_ntp(clock.offset - sender_offset(&sender, clock.reference)) * 1e6,
+			       from_ntp(clock.delay) * 1e6);
+			report = (report < 60.0) ? report + 10.0 : report + 60.0;
+		}
+		elapsed += (requests < FAST_COUNT) ? FAST_INTERVAL : INTERVAL;
+	}
+
+	raop_ntp_get_clock(ntp, &clock);
+	printf("Estimated drift %.3f ppm, offset error %.1f us, %.0f ns per response\n",
+	       clock.drift_ppm, from_ntp(clock.offset - sender_offset(&sender, clock.reference)) * 1e6,
+	       spent * 1e9 / requests);
+
+	raop_ntp_destroy(ntp);
+	logger_destroy(logger);
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Measures the cost of parsing RTSP requests and looking up their headers.
+ *
+ * Typical ANNOUNCE, SETUP and SET_PARAMETER requests of an iTunes sender
+ * are parsed whole and cut in 64 byte fragments, the way they may arrive
+ * from the socket. After each request the headers that the RAOP handlers
+ * ask for are looked up, some of them missing from the request.
+ *
+ * Each case is run with a new request allocated for every message and
+ * with a single request that is reset between messages, like httpd does
+ * for the requests of a connection.
+ *
+ * Compile with: gcc -O2 -o parse_bench -I../lib parse_bench.c ../lib/.libs/libshairplay.a -lpthread -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "http_request.h"
+
+static const char announce[] =
+	"ANNOUNCE rtsp://192.168.1.20/3413821438 RTSP/1.0\r\n"
+	"CSeq: 1\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 590\r\n"
+	"User-Agent: iTunes/10.6 (Macintosh; Intel Mac OS X 10.7.3) AppleWebKit/535.18.5\r\n"
+	"Client-Instance: 56B29BB6CB904862\r\n"
+	"DACP-ID: 56B29BB6CB904862\r\n"
+	"Active-Remote: 1986535575\r\n"
+	"Apple-Challenge: gQl7GlJBT5xRjjx2FZa+NQ\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"o=iTunes 3413821438 0 IN IP4 192.168.1.20\r\n"
+	"s=iTunes\r\n"
+	"c=IN IP4 192.168.1.21\r\n"
+	"t=0 0\r\n"
+	"m=audio 0 RTP/AVP 96\r\n"
+	"a=rtpmap:96 AppleLossless\r\n"
+	"a=fmtp:96 352 0 16 40 10 14 2 255 0 0 44100\r\n"
+	"a=rsaaeskey:VjVbxWcmYgbBbhwBNlCh3K0CMNtWoB844BuiHGUJT51zQS7SDpMnlbBIobsKbfEJ3SCgWHRXjYWf7VQWRYtEcfx7ejA8xDIk5PSBYTvXP5dU2QoGrSBv0leDS6uxlEWuxBq3lIxCxpWO2YswHYKJBt06Uz9P2Fq2hDUwl3qOQ8oXb0OateTKtfXEwHJMprkhsJsGDrIc5W5NJFMAo6zCiM9bGSDeH2nvTlhW6bfI4Lvq4Hl6TFsHH9KcQzG6eOE6xdd8Bm5kZtt23dvqabzUexcUC0Yy8F3Cd6cBHxmBWUZWPgBcTOOqyWf9xpQ2SRxhCuaRBxE2pBZUBtk+R2mEw\r\n"
+	"a=aesiv:zcZmAZtqh7uGcEwPXk0QeA\r\n"
+	"a=min-latency:11025\r\n";
+
+static const char setup[] =
+	"SETUP rtsp://192.168.1.20/3413821438 RTSP/1.0\r\n"
+	"Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;control_port=6001;timing_port=6002\r\n"
+	"CSeq: 2\r\n"
+	"DACP-ID: 56B29BB6CB904862\r\n"
+	"Active-Remote: 1986535575\r\n"
+	"User-Agent: iTunes/10.6 (Macintosh; Intel Mac OS X 10.7.3) AppleWebKit/535.18.5\r\n"
+	"Client-Instance: 56B29BB6CB904862\r\n"
+	"\r\n";
+
+static const char set_parameter[] =
+	"SET_PARAMETER rtsp://192.168.1.20/3413821438 RTSP/1.0\r\n"
+	"CSeq: 5\r\n"
+	"Content-Type: text/parameters\r\n"
+	"Content-Length: 20\r\n"
+	"User-Agent: iTunes/10.6 (Macintosh; Intel Mac OS X 10.7.3) AppleWebKit/535.18.5\r\n"
+	"Client-Instance: 56B29BB6CB904862\r\n"
+	"DACP-ID: 56B29BB6CB904862\r\n"
+	"Active-Remote: 1986535575\r\n"
+	"\r\n"
+	"volume: -11.123877\r\n";
+
+/* Headers asked for by conn_request and the handlers */
+static const char *lookups[] = {
+	"CSeq", "Authorization", "Apple-Challenge", "Content-Type",
+	"Transport", "DACP-ID", "Active-Remote", "RTP-Info"
+};
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses the message in fragments and looks up the headers, returns
+ * the number of headers found or -1 on errors */
+static int
+parse_message(http_request_t *request, const char *message, int length, int fragment)
+{
+	int found = 0, offset, i;
+
+	for (offset=0; offset<length; offset+=fragment) {
+		int len = (length-offset < fragment) ? length-offset : fragment;
+
+		http_request_add_data(request, message+offset, len);
+		if (http_request_has_error(request)) {
+			return -1;
+		}
+	}
+	if (!http_request_is_complete(request)) {
+		return -1;
+	}
+	for (i=0; i<sizeof(lookups)/sizeof(lookups[0]); i++) {
+		found += (http_request_get_header(request, lookups[i]) != NULL);
+	}
+	return found;
+}
+
+/* Checks that the fragments parse to the same request as the whole */
+static int
+check_message(const char *name, const char *message, int fragment)
+{
+	http_request_t *request = http_request_init();
+	const char *cseq, *data;
+	int datalen, ret;
+
+	ret = parse_message(request, message, strlen(message), fragment);
+	cseq = http_request_get_header(request, "cseq");
+	data = http_request_get_data(request, &datalen);
+	if (ret < 0 || !cseq || !http_request_get_url(request) ||
+	    (datalen && strncmp(data, strstr(message, "\r\n\r\n") + 4, datalen))) {
+		fprintf(stderr, "%s did not parse correctly in %d byte fragments\n", name, fragment);
+		http_request_destroy(request);
+		return -1;
+	}
+	http_request_destroy(request);
+	return 0;
+}
+
+static void
+run_case(const char *name, const char *message, int fragment, double mintime)
+{
+	int length = strlen(message);
+	http_request_t *request;
+	double start, elapsed, new_ns, reuse_ns;
+	long rounds;
+	int found = 0;
+
+	/* New request for every message */
+	rounds = 0;
+	start = get_time();
+	do {
+		int i;
+
+		for (i=0; i<1000; i++, rounds++) {
+			request = http_request_init();
+			found = parse_message(request, message, length, fragment);
+			http_request_destroy(request);
+		}
+		elapsed = get_time() - start;
+	} while (elapsed < mintime);
+	new_ns = elapsed * 1e9 / rounds;
+
+	/* Same request reset between messages */
+	request = http_request_init();
+	rounds = 0;
+	start = get_time();
+	do {
+		int i;
+
+		for (i=0; i<1000; i++, rounds++) {
+			http_request_reset(request);
+			found = parse_message(request, message, length, fragment);
+		}
+		elapsed = get_time() - start;
+	} while (elapsed < mintime);
+	reuse_ns = elapsed * 1e9 / rounds;
+	http_request_destroy(request);
+
+	printf("  %-14s %4d bytes %-10s %d headers found, new %7.0f ns, reused %7.0f ns\n",
+	       name, length, (fragment < length) ? "fragments" : "whole", found, new_ns, reuse_ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		const char *message;
+	} messages[] = {
+		{ "ANNOUNCE", announce },
+		{ "SETUP", setup },
+		{ "SET_PARAMETER", set_parameter },
+	};
+	double mintime = 1.0;
+	int fragment = 64;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "f:t:")) != -1) {
+		switch (c) {
+		case 'f':
+			fragment = atoi(optarg);
+			break;
+		case 't':
+			mintime = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f fragment bytes] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (fragment <= 0) {
+		fprintf(stderr, "Fragment length must be positive\n");
+		return 1;
+	}
+
+	for (i=0; i<sizeof(messages)/sizeof(messages[0]); i++) {
+		if (check_message(messages[i].name, messages[i].message, 1) < 0 ||
+		    check_message(messages[i].name, messages[i].message, fragment) < 0) {
+			return 1;
+		}
+	}
+	printf("Parse and header lookup time per request\n");
+	for (i=0; i<sizeof(messages)/sizeof(messages[0]); i++) {
+		run_case(messages[i].name, messages[i].message, strlen(messages[i].message), mintime);
+		run_case(messages[i].name, messages[i].message, fragment, mintime);
+	}
+	return 0;
+}
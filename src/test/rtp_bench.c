@@ -0,0 +1,609 @@
+/*
+ * Measures the throughput and CPU usage of the UDP RAOP receive path.
+ *
+ * Starts one or more RTP sessions on the loopback interface and replays
+ * audio packets to their data ports, either from a pcap capture file or
+ * from synthetic uncompressed ALAC frames. Reports packets/s and the CPU
+ * time used by each RTP receiver thread.
+ *
+ * Packets read from a capture are only decodable if the session key and
+ * IV used by the sender are given with -k and -i as hex strings.
+ *
+ * With -I seconds no packets are sent. The sessions and an HTTP server are
+ * left idle and the number of context switches of the process is reported
+ * as wakeups/s, to check that idle threads do not poll.
+ *
+ * With -l percent the packets are sent at the real time rate and that
+ * share of them is dropped at random, including resent packets. A
+ * simulated sender answers the resend requests on the control channel,
+ * and the number of request datagrams and the resend counters that the
+ * sessions log when they stop are reported.
+ *
+ * Latency percentiles of each stage of the receive path are printed at
+ * the end.
+ *
+ * Compile with: gcc -O2 -o rtp_bench -I../lib -I../../include/shairplay rtp_bench.c ../lib/.libs/libshairplay.a -lpthread -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "raop_rtp.h"
+#include "raop_buffer.h"
+#include "httpd.h"
+#include "logger.h"
+#include "crypto/crypto.h"
+
+#define MAX_STREAMS 64
+#define FRAME_SAMPLES 352
+#define FRAME_USEC (FRAME_SAMPLES * 1000000 / 44100)
+
+static const char rtpmap[] = "96 AppleLossless";
+static const char fmtp[] = "96 352 0 16 40 10 14 2 255 0 0 44100";
+
+typedef struct {
+	unsigned char *data;
+	int len;
+} bench_packet_t;
+
+typedef struct {
+	raop_rtp_t *raop_rtp;
+	unsigned short cport;
+	unsigned short dport;
+
+	clockid_t cpu_clock;
+	volatile int have_clock;
+	volatile unsigned int frames;
+} bench_stream_t;
+
+static void *
+audio_init(void *cls, int bits, int channels, int samplerate)
+{
+	bench_stream_t *stream = cls;
+
+	/* This callback runs in the RTP thread, so get its CPU clock here */
+	if (!pthread_getcpuclockid(pthread_self(), &stream->cpu_clock)) {
+		stream->have_clock = 1;
+	}
+	return stream;
+}
+
+static void
+audio_process(void *cls, void *session, const void *buffer, int buflen)
+{
+	bench_stream_t *stream = session;
+	stream->frames++;
+}
+
+static void
+audio_destroy(void *cls, void *session)
+{
+}
+
+static double
+get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen)
+{
+	return opaque;
+}
+
+static void
+conn_request(void *ptr, http_request_t *request, http_response_t **response)
+{
+}
+
+static void
+conn_destroy(void *ptr)
+{
+}
+
+static long
+get_context_switches(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return 0;
+	}
+	return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/* Leaves the sessions and an HTTP server idle and counts their wakeups */
+static void
+run_idle(logger_t *logger, int num_streams, int seconds)
+{
+	httpd_callbacks_t httpd_cbs;
+	httpd_t *httpd;
+	unsigned short port = 0;
+	long switches;
+
+	memset(&httpd_cbs, 0, sizeof(httpd_cbs));
+	httpd_cbs.conn_init = conn_init;
+	httpd_cbs.conn_request = conn_request;
+	httpd_cbs.conn_destroy = conn_destroy;
+	httpd = httpd_init(logger, &httpd_cbs, 10);
+	if (!httpd || httpd_start(httpd, &port) <= 0) {
+		fprintf(stderr, "Could not start HTTP server\n");
+		return;
+	}
+
+	/* Let the threads settle before measuring */
+	sleep(1);
+	switches = get_context_switches();
+	sleep(seconds);
+	switches = get_context_switches() - switches;
+
+	printf("idle: %d sessions and http server, %ld wakeups in %d s, %.1f wakeups/s\n",
+	       num_streams, switches, seconds, (double)switches / seconds);
+
+	httpd_stop(httpd);
+	httpd_destroy(httpd);
+}
+
+/* Simulated sender control channel answering resend requests */
+typedef struct {
+	int sock;
+	unsigned short cport;
+	volatile int running;
+	double loss;
+	bench_packet_t *packets;
+	int num_packets;
+	unsigned int requests;
+	unsigned int resent;
+} bench_sender_t;
+
+static int
+should_drop(double loss)
+{
+	return rand() < loss * RAND_MAX;
+}
+
+static void *
+sender_thread(void *arg)
+{
+	bench_sender_t *sender = arg;
+	unsigned char request[64], response[12 + 3 + FRAME_SAMPLES*4 + 4];
+
+	while (sender->running) {
+		struct sockaddr_storage saddr;
+		socklen_t saddrlen = sizeof(saddr);
+		int len, seqnum, count;
+
+		len = recvfrom(sender->sock, request, sizeof(request), 0,
+		               (struct sockaddr *)&saddr, &saddrlen);
+		if (len < 8 || (request[1] & ~0x80) != 0x55) {
+			continue;
+		}
+		sender->requests++;
+		seqnum = (request[4] << 8) | request[5];
+		count = (request[6] << 8) | request[7];
+		while (count-- > 0) {
+			bench_packet_t *packet;
+
+			if (seqnum >= sender->num_packets || should_drop(sender->loss)) {
+				seqnum++;
+				continue;
+			}
+			packet = &sender->packets[seqnum++];
+			response[0] = 0x80;
+			response[1] = 0xd6;
+			response[2] = 0;
+			response[3] = 0;
+			memcpy(response+4, packet->data, packet->len);
+			sendto(sender->sock, response, packet->len+4, 0,
+			       (struct sockaddr *)&saddr, saddrlen);
+			sender->resent++;
+		}
+	}
+	return NULL;
+}
+
+static void
+log_callback(void *cls, int level, const char *msg)
+{
+	if (!strncmp(msg, "Requested", 9) || !strncmp(msg, "Concealed", 9)) {
+		printf("%s\n", msg);
+	}
+}
+
+static double
+get_cpu_time(bench_stream_t *stream)
+{
+	struct timespec ts;
+	if (!stream->have_clock || clock_gettime(stream->cpu_clock, &ts)) {
+		return 0.0;
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+parse_hex(unsigned char *dst, int dstlen, const char *str)
+{
+	int i;
+
+	if (strlen(str) != dstlen*2) {
+		return -1;
+	}
+	for (i=0; i<dstlen; i++) {
+		unsigned int value;
+		if (sscanf(str+i*2, "%2x", &value) != 1) {
+			return -1;
+		}
+		dst[i] = value;
+	}
+	return 0;
+}
+
+static void
+put_bits(unsigned char *buf, int *bitpos, uint32_t value, int bits)
+{
+	while (bits-- > 0) {
+		if ((value >> bits) & 1) {
+			buf[*bitpos/8] |= 0x80 >> (*bitpos%8);
+		}
+		(*bitpos)++;
+	}
+}
+
+/* Creates an encrypted RTP packet containing an uncompressed stereo frame */
+static bench_packet_t
+create_packet(unsigned short seqnum, const unsigned char *aeskey, const unsigned char *aesiv)
+{
+	unsigned char payload[12 + 3 + FRAME_SAMPLES*4];
+	bench_packet_t packet;
+	unsigned int timestamp = seqnum * FRAME_SAMPLES;
+	int bitpos = 0, encryptedlen, i;
+	AES_CTX aes_ctx;
+
+	memset(payload, 0, sizeof(payload));
+	payload[0] = 0x80;
+	payload[1] = 0x60;
+	payload[2] = seqnum >> 8;
+	payload[3] = seqnum;
+	payload[4] = timestamp >> 24;
+	payload[5] = timestamp >> 16;
+	payload[6] = timestamp >> 8;
+	payload[7] = timestamp;
+	payload[8] = 0x12;
+
+	put_bits(payload+12, &bitpos, 1, 3);  /* stereo */
+	put_bits(payload+12, &bitpos, 0, 16); /* unused */
+	put_bits(payload+12, &bitpos, 0, 1);  /* hassize */
+	put_bits(payload+12, &bitpos, 0, 2);  /* uncompressed bytes */
+	put_bits(payload+12, &bitpos, 1, 1);  /* not compressed */
+	for (i=0; i<FRAME_SAMPLES; i++) {
+		int16_t sample = (int16_t)((timestamp + i) * 97);
+		put_bits(payload+12, &bitpos, (uint16_t)sample, 16);
+		put_bits(payload+12, &bitpos, (uint16_t)-sample, 16);
+	}
+
+	packet.len = 12 + (bitpos+7)/8;
+	packet.data = malloc(packet.len);
+	memcpy(packet.data, payload, packet.len);
+
+	encryptedlen = (packet.len-12)/16*16;
+	AES_set_key(&aes_ctx, aeskey, aesiv, AES_MODE_128);
+	AES_cbc_encrypt(&aes_ctx, payload+12, packet.data+12, encryptedlen);
+	return packet;
+}
+
+static uint32_t
+read_u32(const unsigned char *buf, int swap)
+{
+	if (swap) {
+		return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	}
+	return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+}
+
+/* Reads RAOP audio data packets from IPv4 UDP datagrams of a pcap file */
+static int
+read_capture(const char *filename, bench_packet_t *packets, int max_packets)
+{
+	unsigned char header[24], record[16];
+	unsigned char *frame;
+	uint32_t magic, linktype;
+	int swap, count = 0;
+	FILE *file;
+
+	file = fopen(filename, "rb");
+	if (!file) {
+		return -1;
+	}
+	if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+		fclose(file);
+		return -1;
+	}
+	magic = read_u32(header, 0);
+	if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+		swap = 0;
+	} else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+		swap = 1;
+	} else {
+		fclose(file);
+		return -1;
+	}
+	linktype = read_u32(header+20, swap);
+
+	frame = malloc(65536);
+	while (count < max_packets && fread(record, 1, sizeof(record), file) == sizeof(record)) {
+		uint32_t caplen = read_u32(record+8, swap);
+		const unsigned char *ip;
+		int offset, iplen, udplen;
+
+		if (caplen > 65536 || fread(frame, 1, caplen, file) != caplen) {
+			break;
+		}
+		switch (linktype) {
+		case 1:   offset = 14; break; /* Ethernet */
+		case 113: offset = 16; break; /* Linux cooked */
+		case 101: offset = 0;  break; /* Raw IP */
+		default:  offset = -1; break;
+		}
+		if (offset < 0 || caplen < offset+28) {
+			continue;
+		}
+		ip = frame+offset;
+		if ((ip[0] >> 4) != 4 || ip[9] != 17) {
+			continue;
+		}
+		iplen = (ip[0] & 0x0f) * 4;
+		if (caplen < offset+iplen+8) {
+			continue;
+		}
+		udplen = ((ip[iplen+4] << 8) | ip[iplen+5]) - 8;
+		if (udplen < 12 || caplen < offset+iplen+8+udplen) {
+			continue;
+		}
+		if ((ip[iplen+8+1] & ~0x80) != 0x60) {
+			continue;
+		}
+		packets[count].len = udplen;
+		packets[count].data = malloc(udplen);
+		memcpy(packets[count].data, ip+iplen+8, udplen);
+		count++;
+	}
+	free(frame);
+	fclose(file);
+	return count;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned char aeskey[RAOP_AESKEY_LEN];
+	unsigned char aesiv[RAOP_AESIV_LEN];
+	const char *capture = NULL;
+	int num_streams = 1;
+	int num_packets = 20000;
+	int burst = 16;
+	int idle = 0;
+	double loss = 0.0;
+	bench_sender_t sender;
+	pthread_t sender_tid;
+
+	bench_stream_t streams[MAX_STREAMS];
+	bench_packet_t *packets;
+	raop_callbacks_t callbacks;
+	struct sockaddr_in saddr;
+	logger_t *logger;
+	double start, elapsed, total_cpu = 0.0;
+	unsigned int received = 0;
+	int sock, opt, i, j;
+
+	memset(aeskey, 0x42, sizeof(aeskey));
+	memset(aesiv, 0x24, sizeof(aesiv));
+	while ((opt = getopt(argc, argv, "r:k:i:s:n:b:I:l:")) != -1) {
+		switch (opt) {
+		case 'r': capture = optarg; break;
+		case 'k': if (parse_hex(aeskey, sizeof(aeskey), optarg)) return 1; break;
+		case 'i': if (parse_hex(aesiv, sizeof(aesiv), optarg)) return 1; break;
+		case 's': num_streams = atoi(optarg); break;
+		case 'n': num_packets = atoi(optarg); break;
+		case 'b': burst = atoi(optarg); break;
+		case 'I': idle = atoi(optarg); break;
+		case 'l': loss = atof(optarg) / 100.0; break;
+		default:
+			fprintf(stderr, "Usage: %s [-r capture.pcap -k key -i iv] [-s streams] [-n packets] [-b burst] [-I seconds] [-l loss%%]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (num_streams < 1 || num_streams > MAX_STREAMS || num_packets < 1 || burst < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	packets = calloc(num_packets, sizeof(bench_packet_t));
+	if (capture) {
+		num_packets = read_capture(capture, packets, num_packets);
+		if (num_packets <= 0) {
+			fprintf(stderr, "Could not read audio packets from %s\n", capture);
+			return 1;
+		}
+	} else {
+		for (i=0; i<num_packets; i++) {
+			packets[i] = create_packet(i, aeskey, aesiv);
+		}
+	}
+
+	memset(&sender, 0, sizeof(sender));
+	sender.sock = -1;
+	if (loss > 0.0) {
+		struct timeval tv = { 0, 100000 };
+		struct sockaddr_in caddr;
+		socklen_t caddrlen = sizeof(caddr);
+
+		memset(&caddr, 0, sizeof(caddr));
+		caddr.sin_family = AF_INET;
+		caddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sender.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (sender.sock == -1 || bind(sender.sock, (struct sockaddr *)&caddr, sizeof(caddr)) ||
+		    getsockname(sender.sock, (struct sockaddr *)&caddr, &caddrlen)) {
+			fprintf(stderr, "Could not create the sender control socket\n");
+			return 1;
+		}
+		setsockopt(sender.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		sender.cport = ntohs(caddr.sin_port);
+		sender.loss = loss;
+		sender.packets = packets;
+		sender.num_packets = num_packets;
+		srand(1);
+	}
+
+	logger = logger_init();
+	if (loss > 0.0) {
+		logger_set_level(logger, LOGGER_INFO);
+		logger_set_callback(logger, log_callback, NULL);
+	}
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.audio_init = audio_init;
+	callbacks.audio_process = audio_process;
+	callbacks.audio_destroy = audio_destroy;
+
+	memset(streams, 0, sizeof(streams));
+	for (i=0; i<num_streams; i++) {
+		callbacks.cls = &streams[i];
+		streams[i].raop_rtp = raop_rtp_init(logger, &callbacks, "IN IP4 127.0.0.1",
+		                                    rtpmap, fmtp, aeskey, aesiv,
+		                                    RAOP_BUFFER_LENGTH, RAOP_BUFFER_LENGTH, 0, 0, 0);
+		if (!streams[i].raop_rtp) {
+			fprintf(stderr, "Could not initialize RTP session\n");
+			return 1;
+		}
+		raop_rtp_start(streams[i].raop_rtp, 1, sender.cport, 0, &streams[i].cport, NULL, &streams[i].dport);
+	}
+
+	if (idle > 0) {
+		run_idle(logger, num_streams, idle);
+		for (j=0; j<num_streams; j++) {
+			raop_rtp_destroy(streams[j].raop_rtp);
+		}
+		for (i=0; i<num_packets; i++) {
+			free(packets[i].data);
+		}
+		free(packets);
+		logger_destroy(logger);
+		return 0;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Give the receiver threads time to start */
+	usleep(100000);
+
+	if (loss > 0.0) {
+		unsigned char sync[20];
+
+		/* The receivers learn the control address from the first packet */
+		memset(sync, 0, sizeof(sync));
+		sync[0] = 0x90;
+		sync[1] = 0xd4;
+		for (j=0; j<num_streams; j++) {
+			saddr.sin_port = htons(streams[j].cport);
+			sendto(sender.sock, sync, sizeof(sync), 0,
+			       (struct sockaddr *)&saddr, sizeof(saddr));
+		}
+		sender.running = 1;
+		pthread_create(&sender_tid, NULL, sender_thread, &sender);
+		usleep(10000);
+	}
+
+	start = get_time();
+	for (i=0; i<num_packets; i++) {
+		if (loss > 0.0) {
+			/* Send at the real time rate, dropping some packets */
+			usleep(FRAME_USEC);
+			if (should_drop(loss)) {
+				continue;
+			}
+		}
+		for (j=0; j<num_streams; j++) {
+			saddr.sin_port = htons(streams[j].dport);
+			sendto(sock, packets[i].data, packets[i].len, 0,
+			       (struct sockaddr *)&saddr, sizeof(saddr));
+		}
+		if (loss == 0.0 && (i+1) % burst == 0) {
+			/* Avoid overflowing the socket receive buffers */
+			usleep(1000);
+		}
+	}
+
+	/* Wait until all streams stop making progress */
+	do {
+		unsigned int previous = received;
+		usleep(50000);
+		received = 0;
+		for (j=0; j<num_streams; j++) {
+			received += streams[j].frames;
+		}
+		if (received == previous) break;
+	} while (received < (unsigned int)num_packets*num_streams);
+	elapsed = get_time() - start;
+
+	printf("streams: %d, packets sent: %d, frames received: %u\n",
+	       num_streams, num_packets*num_streams, received);
+	for (j=0; j<num_streams; j++) {
+		double cpu = get_cpu_time(&streams[j]);
+		total_cpu += cpu;
+		printf("stream %2d: %8.0f packets/s, cpu %.3f s (%.2f us/packet)\n",
+		       j, streams[j].frames / elapsed, cpu,
+		       streams[j].frames ? cpu * 1e6 / streams[j].frames : 0.0);
+	}
+	printf("total: %.0f packets/s, cpu %.3f s over %.3f s\n",
+	       received / elapsed, total_cpu, elapsed);
+	if (loss > 0.0) {
+		sender.running = 0;
+		pthread_join(sender_tid, NULL);
+		close(sender.sock);
+		printf("loss %.1f%%: %u resend request datagrams, %u packets resent\n",
+		       loss*100, sender.requests, sender.resent);
+	}
+
+	/* Latency of each stage over all streams */
+	printf("latency us:        p50      p99    p99.9      max\n");
+	for (i=0; i<RAOP_LATENCY_STAGES; i++) {
+		static const char *stages[RAOP_LATENCY_STAGES] = {
+			"receive", "buffer wait", "decrypt", "decode", "callback"
+		};
+		raop_histogram_t hist;
+
+		memset(&hist, 0, sizeof(hist));
+		for (j=0; j<num_streams; j++) {
+			raop_rtp_merge_latency(streams[j].raop_rtp, i, &hist);
+		}
+		printf("%-12s %9.2f %8.2f %8.2f %8.2f\n", stages[i],
+		       raop_histogram_get_percentile(&hist, 50.0) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 99.0) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 99.9) / 1000.0,
+		       raop_histogram_get_percentile(&hist, 100.0) / 1000.0);
+	}
+
+	for (j=0; j<num_streams; j++) {
+		raop_rtp_destroy(streams[j].raop_rtp);
+	}
+	for (i=0; i<num_packets; i++) {
+		free(packets[i].data);
+	}
+	free(packets);
+	close(sock);
+	logger_destroy(logger);
+	return 0;
+}
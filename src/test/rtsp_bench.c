@@ -0,0 +1,370 @@
+/*
+ * Measures the RTSP request latency while other clients do handshakes.
+ *
+ * An HTTP server is started on the loopback interface with handlers that
+ * do the same expensive work as the RAOP ones: an Apple-Challenge is
+ * signed with the RSA key and a pair-verify request does the ECDH key
+ * exchange and the Ed25519 signature. Handshake clients send these back
+ * to back, while light clients send a plain OPTIONS request every
+ * millisecond like a streaming sender sending its volume and progress.
+ *
+ * The run is repeated with the requests handled in the HTTP thread and
+ * with the handshakes handed to the given number of worker threads. The
+ * p50, p99 and maximum latency of both kinds of request are reported,
+ * the light ones show how long a slow handshake of another connection
+ * holds them up.
+ *
+ * Compile with: gcc -O2 -o rtsp_bench -I../lib -I../../include/shairplay rtsp_bench.c ../lib/.libs/libshairplay.a -lpthread -lm
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "httpd.h"
+#include "rsakey.h"
+#include "pairing.h"
+#include "utils.h"
+#include "raop_histogram.h"
+
+#define MAX_CLIENTS 64
+
+static const char challenge[] = "QUJDREVGR0hJSktMTU5PUA==";
+static const unsigned char hwaddr[] = { 0x48, 0x5d, 0x60, 0x7c, 0xee, 0x22 };
+
+typedef struct {
+	rsakey_t *rsakey;
+	pairing_t *pairing;
+} bench_server_t;
+
+typedef struct {
+	bench_server_t *server;
+	pairing_session_t *session;
+	unsigned char local[16];
+	int locallen;
+} bench_conn_t;
+
+typedef struct {
+	unsigned short port;
+	int handshake;
+	int num_requests;
+	volatile int *running;
+	raop_histogram_t latency;
+	int errors;
+} bench_client_t;
+
+static uint64_t
+get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen)
+{
+	bench_conn_t *conn;
+
+	conn = calloc(1, sizeof(bench_conn_t));
+	if (!conn) {
+		return NULL;
+	}
+	conn->server = opaque;
+	conn->session = pairing_session_init(conn->server->pairing);
+	conn->locallen = (locallen <= sizeof(conn->local)) ? locallen : 0;
+	memcpy(conn->local, local, conn->locallen);
+	return conn;
+}
+
+/* Does the expensive parts of the RAOP handlers */
+static void
+conn_request(void *ptr, http_request_t *request, http_response_t **response)
+{
+	bench_conn_t *conn = ptr;
+	const char *method, *url, *cseq, *apple_challenge;
+	unsigned char reply[96];
+	int replylen = 0;
+
+	method = http_request_get_method(request);
+	url = http_request_get_url(request);
+	cseq = http_request_get_header(request, "CSeq");
+	if (!method || !cseq) {
+		return;
+	}
+	*response = http_response_init("RTSP/1.0", 200, "OK");
+	http_response_add_header(*response, "CSeq", cseq);
+
+	apple_challenge = http_request_get_header(request, "Apple-Challenge");
+	if (apple_challenge) {
+		char signature[512];
+
+		memset(signature, 0, sizeof(signature));
+		rsakey_sign(conn->server->rsakey, signature, sizeof(signature), apple_challenge,
+		            conn->local, conn->locallen, (unsigned char *)hwaddr, sizeof(hwaddr));
+		http_response_add_header(*response, "Apple-Response", signature);
+	}
+	if (!strcmp(method, "POST") && !strcmp(url, "/pair-verify")) {
+		const unsigned char *data;
+		int datalen;
+
+		data = (const unsigned char *)http_request_get_data(request, &datalen);
+		if (datalen == 4 + 32 + 32 && conn->session) {
+			pairing_session_handshake(conn->session, data + 4, data + 4 + 32);
+			pairing_session_get_public_key(conn->session, reply);
+			pairing_session_get_signature(conn->session, reply + 32);
+			replylen = 96;
+		}
+	}
+	http_response_finish(*response, replylen ? (const char *)reply : NULL, replylen);
+}
+
+/* Only the handshakes go to the workers, like with RAOP */
+static int
+conn_offload(void *ptr, http_request_t *request)
+{
+	return http_request_get_header(request, "Apple-Challenge") ||
+	       !strcmp(http_request_get_url(request), "/pair-verify");
+}
+
+static void
+conn_destroy(void *ptr)
+{
+	bench_conn_t *conn = ptr;
+
+	pairing_session_destroy(conn->session);
+	free(conn);
+}
+
+/* Reads one response with its content, returns -1 on errors */
+static int
+read_response(int sock, char *buffer, int buflen)
+{
+	int received = 0, content_length = 0;
+	char *end = NULL, *header;
+
+	while (!end || received < (end - buffer) + 4 + content_length) {
+		int ret = recv(sock, buffer + received, buflen - received - 1, 0);
+
+		if (ret <= 0) {
+			return -1;
+		}
+		received += ret;
+		buffer[received] = '\0';
+		if (!end && (end = strstr(buffer, "\r\n\r\n"))) {
+			for (header = strstr(buffer, "\r\n"); header && header < end; header = strstr(header + 2, "\r\n")) {
+				if (!strncasecmp(header + 2, "Content-Length:", 15)) {
+					content_length = atoi(header + 17);
+				}
+			}
+		}
+		if (received >= buflen - 1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *
+client_thread(void *arg)
+{
+	bench_client_t *client = arg;
+	struct sockaddr_in saddr;
+	char request[512], response[4096];
+	int sock, one = 1, i;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	saddr.sin_port = htons(client->port);
+	if (sock == -1 || connect(sock, (struct sockaddr *)&saddr, sizeof(saddr)) == -1) {
+		client->errors++;
+		if (sock != -1) {
+			close(sock);
+		}
+		return NULL;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	for (i=0; client->handshake ? i < client->num_requests : *client->running; i++) {
+		uint64_t start;
+		int len;
+
+		if (!client->handshake) {
+			len = snprintf(request, sizeof(request), "OPTIONS * RTSP/1.0\r\nCSeq: %d\r\n\r\n", i);
+		} else if (i % 2 == 0) {
+			len = snprintf(request, sizeof(request),
+			               "OPTIONS * RTSP/1.0\r\nCSeq: %d\r\nApple-Challenge: %s\r\n\r\n", i, challenge);
+		} else {
+			len = snprintf(request, sizeof(request),
+			               "POST /pair-verify RTSP/1.0\r\nCSeq: %d\r\n"
+			               "Content-Type: application/octet-stream\r\nContent-Length: 68\r\n\r\n", i);
+			memset(request + len, 0, 4);
+			request[len] = 1;
+			memset(request + len + 4, 0x40 + (i & 0x3f), 64);
+			len += 68;
+		}
+
+		start = get_time_ns();
+		if (send(sock, request, len, 0) != len || read_response(sock, response, sizeof(response)) < 0) {
+			client->errors++;
+			break;
+		}
+		raop_histogram_add(&client->latency, get_time_ns() - start);
+		if (!client->handshake) {
+			usleep(1000);
+		}
+	}
+	close(sock);
+	return NULL;
+}
+
+static void
+print_latency(const char *name, const raop_histogram_t *hist)
+{
+	printf("  %-10s %7u requests, p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n", name, hist->count,
+	       raop_histogram_get_percentile(hist, 50.0) / 1e6,
+	       raop_histogram_get_percentile(hist, 99.0) / 1e6,
+	       raop_histogram_get_percentile(hist, 100.0) / 1e6);
+}
+
+static int
+run_bench(logger_t *logger, bench_server_t *server, int workers,
+          int num_handshake, int num_light, int num_requests)
+{
+	static bench_client_t clients[MAX_CLIENTS];
+	static raop_histogram_t light, handshake;
+	pthread_t tids[MAX_CLIENTS];
+	httpd_callbacks_t httpd_cbs;
+	httpd_t *httpd;
+	unsigned short port = 0;
+	volatile int running = 1;
+	uint64_t start, elapsed;
+	int errors = 0, i;
+
+	memset(&httpd_cbs, 0, sizeof(httpd_cbs));
+	httpd_cbs.opaque = server;
+	httpd_cbs.conn_init = conn_init;
+	httpd_cbs.conn_request = conn_request;
+	httpd_cbs.conn_destroy = conn_destroy;
+	httpd_cbs.conn_offload = conn_offload;
+	httpd = httpd_init(logger, &httpd_cbs, num_handshake + num_light);
+	if (!httpd) {
+		return -1;
+	}
+	httpd_set_workers(httpd, workers);
+	if (httpd_start(httpd, &port) <= 0) {
+		fprintf(stderr, "Could not start HTTP server\n");
+		httpd_destroy(httpd);
+		return -1;
+	}
+
+	memset(clients, 0, sizeof(clients));
+	memset(&light, 0, sizeof(light));
+	memset(&handshake, 0, sizeof(handshake));
+	for (i=0; i<num_handshake+num_light; i++) {
+		clients[i].port = port;
+		clients[i].handshake = (i < num_handshake);
+		clients[i].num_requests = num_requests;
+		clients[i].running = &running;
+	}
+
+	/* Light clients run until the handshakes are done */
+	start = get_time_ns();
+	for (i=num_handshake+num_light-1; i>=0; i--) {
+		pthread_create(&tids[i], NULL, client_thread, &clients[i]);
+	}
+	for (i=0; i<num_handshake; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	elapsed = get_time_ns() - start;
+	running = 0;
+	for (i=num_handshake; i<num_handshake+num_light; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	for (i=0; i<num_handshake+num_light; i++) {
+		raop_histogram_merge(clients[i].handshake ? &handshake : &light, &clients[i].latency);
+		errors += clients[i].errors;
+	}
+	if (workers) {
+		printf("%d worker threads, %.1f handshake requests/s\n", workers, handshake.count / (elapsed / 1e9));
+	} else {
+		printf("HTTP thread only, %.1f handshake requests/s\n", handshake.count / (elapsed / 1e9));
+	}
+	print_latency("light", &light);
+	print_latency("handshake", &handshake);
+	if (errors) {
+		printf("  %d clients failed\n", errors);
+	}
+
+	httpd_stop(httpd);
+	httpd_destroy(httpd);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *keyfile = "../../airport.key";
+	int num_handshake = 8;
+	int num_light = 4;
+	int num_requests = 200;
+	int workers = 4;
+	bench_server_t server;
+	logger_t *logger;
+	char *pemstr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k:c:l:n:w:")) != -1) {
+		switch (opt) {
+		case 'k': keyfile = optarg; break;
+		case 'c': num_handshake = atoi(optarg); break;
+		case 'l': num_light = atoi(optarg); break;
+		case 'n': num_requests = atoi(optarg); break;
+		case 'w': workers = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-k keyfile] [-c handshake clients] [-l light clients] "
+			        "[-n requests] [-w workers]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (num_handshake < 0 || num_light < 0 || num_handshake + num_light < 1 ||
+	    num_handshake + num_light > MAX_CLIENTS || num_requests <= 0 || workers <= 0) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	if (utils_read_file(&pemstr, keyfile) < 0) {
+		fprintf(stderr, "Could not read the key file %s\n", keyfile);
+		return 1;
+	}
+	server.rsakey = rsakey_init_pem(pemstr);
+	free(pemstr);
+	server.pairing = pairing_init_generate();
+	if (!server.rsakey || !server.pairing) {
+		fprintf(stderr, "Could not initialize the keys\n");
+		return 1;
+	}
+
+	logger = logger_init();
+	printf("%d handshake clients with %d requests each, %d light clients\n",
+	       num_handshake, num_requests, num_light);
+	run_bench(logger, &server, 0, num_handshake, num_light, num_requests);
+	run_bench(logger, &server, workers, num_handshake, num_light, num_requests);
+
+	logger_destroy(logger);
+	pairing_destroy(server.pairing);
+	rsakey_destroy(server.rsakey);
+	return 0;
+}